@@ -0,0 +1,307 @@
+#include "batch.hpp"
+#include "device_extension.hpp"
+#include "file_context.hpp"
+#include "usb.hpp"
+#include "tunables.hpp"
+
+static ULONG batch_fill(batch_queue& Queue, PIRP Irp) {
+    // get the amount of results that fit in the output buffer. The
+    // caller checked there is room for the header
+    const ULONG length = IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.OutputBufferLength;
+    const ULONG max_count = (length - sizeof(usb_chief_batch_reap)) / sizeof(usb_chief_batch_result);
+
+    usb_chief_batch_reap* header = reinterpret_cast<usb_chief_batch_reap*>(Irp->AssociatedIrp.SystemBuffer);
+    usb_chief_batch_result* results = reinterpret_cast<usb_chief_batch_result*>(header + 1);
+
+    header->count = 0;
+
+    // move the results in the order the transfers completed. Should
+    // be called with the lock of the queue
+    while (header->count < max_count && Queue.count) {
+        results[header->count++] = Queue.results[Queue.head];
+
+        Queue.head = (Queue.head + 1) % chief_max_batch_inflight;
+        Queue.count--;
+        Queue.inflight--;
+    }
+
+    header->pending = Queue.inflight;
+
+    return sizeof(usb_chief_batch_reap) + (header->count * sizeof(usb_chief_batch_result));
+}
+
+static void batch_add_result(batch_queue* Queue, ULONGLONG Cookie, NTSTATUS Status, ULONG Length) {
+    KIRQL irql;
+    KeAcquireSpinLock(&Queue->lock, &irql);
+
+    // there is always room. A transfer keeps its place in the results
+    // until it is reaped
+    usb_chief_batch_result& result = Queue->results[(Queue->head + Queue->count) % chief_max_batch_inflight];
+
+    result.cookie = Cookie;
+    result.status = Status;
+    result.length = Length;
+
+    Queue->count++;
+
+    // give the result to a reap that is waiting
+    PIRP reaper = irp_queue_remove(Queue->reapers);
+
+    if (reaper) {
+        reaper->IoStatus.Status = STATUS_SUCCESS;
+        reaper->IoStatus.Information = batch_fill(*Queue, reaper);
+    }
+
+    // wake up the cleanup after the last transfer. This is the last
+    // time we use the queue, it can be freed after we release the lock
+    if (!--Queue->running) {
+        KeSetEvent(&Queue->idle, IO_NO_INCREMENT, false);
+    }
+
+    KeReleaseSpinLock(&Queue->lock, irql);
+
+    if (reaper) {
+        IofCompleteRequest(reaper, IO_NO_INCREMENT);
+    }
+}
+
+static NTSTATUS batch_transfer_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context) {
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    // get the cookie we stored in our own stack location. The lower
+    // drivers do not change it. The io manager already moved past our
+    // location when the completion routine is called
+    const PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(Irp);
+    const ULONGLONG cookie = (
+        static_cast<ULONGLONG>(reinterpret_cast<ULONG_PTR>(stack->Parameters.Others.Argument2)) << 32
+    ) | static_cast<ULONG>(reinterpret_cast<ULONG_PTR>(stack->Parameters.Others.Argument1));
+
+    const NTSTATUS status = Irp->IoStatus.Status;
+    const ULONG length = static_cast<ULONG>(Irp->IoStatus.Information);
+
+    // the irp is ours, nobody else completes it
+    IoFreeIrp(Irp);
+
+    batch_add_result(reinterpret_cast<batch_queue*>(Context), cookie, status, length);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static batch_queue* batch_get_queue(PDEVICE_OBJECT DeviceObject, chief_file_context* Context, PFILE_OBJECT File) {
+    // the queue is created with the first batch of the handle
+    if (Context->batch) {
+        return Context->batch;
+    }
+
+    batch_queue* queue = reinterpret_cast<batch_queue*>(ExAllocatePoolWithTag(
+        NonPagedPool,
+        sizeof(batch_queue),
+        0x206D6457u
+    ));
+
+    // check if we got memory
+    if (!queue) {
+        return nullptr;
+    }
+
+    memset(queue, 0x00, sizeof(batch_queue));
+
+    KeInitializeSpinLock(&queue->lock);
+    KeInitializeEvent(&queue->idle, NotificationEvent, true);
+    irp_queue_init(queue->reapers, DeviceObject);
+
+    queue->device_object = DeviceObject;
+    queue->file = File;
+
+    // another batch on the same handle could have been first
+    if (InterlockedCompareExchangePointer(reinterpret_cast<PVOID volatile*>(&Context->batch), queue, nullptr)) {
+        ExFreePool(queue);
+    }
+
+    return Context->batch;
+}
+
+static void batch_send(batch_queue* Queue, const usb_chief_batch_entry& Entry) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(Queue->device_object);
+
+    // the same limit as a normal read or write
+    if (Entry.length > get_tunables().max_transfer_size || (Entry.flags & ~static_cast<ULONG>(chief_batch_write))) {
+        batch_add_result(Queue, Entry.cookie, STATUS_INVALID_PARAMETER, 0);
+        return;
+    }
+
+    // allocate a irp with a stack location for us and the usb stack
+    PIRP irp = IoAllocateIrp(dev_ext->attachedDeviceObject->StackSize + 1, false);
+
+    if (!irp) {
+        batch_add_result(Queue, Entry.cookie, STATUS_INSUFFICIENT_RESOURCES, 0);
+        return;
+    }
+
+    // setup our own stack location the same way the io manager does
+    // for a request on the handle. The transfer gets the handle from
+    // the file object and the completion of the transfer gets the
+    // device object. The cookie is stored in the arguments
+    PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+    stack->DeviceObject = Queue->device_object;
+    stack->FileObject = Queue->file;
+    stack->Parameters.Others.Argument1 = reinterpret_cast<PVOID>(static_cast<ULONG_PTR>(Entry.cookie & 0xffffffff));
+    stack->Parameters.Others.Argument2 = reinterpret_cast<PVOID>(static_cast<ULONG_PTR>(Entry.cookie >> 32));
+    stack->CompletionRoutine = batch_transfer_complete;
+    stack->Context = Queue;
+    stack->Control = SL_INVOKE_ON_SUCCESS | SL_INVOKE_ON_ERROR | SL_INVOKE_ON_CANCEL;
+
+    IoSetNextIrpStackLocation(irp);
+
+    irp->IoStatus.Status = STATUS_SUCCESS;
+    irp->IoStatus.Information = 0;
+
+    const usb_chief_registered_transfer transfer = { Entry.slot, Entry.offset, Entry.length, 0 };
+
+    // send the transfer. The completion of the transfer completes
+    // our stack location, also when it fails right away
+    usb_send_registered_transfer(Queue->device_object, irp, !(Entry.flags & chief_batch_write), transfer);
+}
+
+NTSTATUS batch_submit(PDEVICE_OBJECT DeviceObject, chief_file_context* Context, PFILE_OBJECT File, const usb_chief_batch_submit& Request, ULONG Length) {
+    // check if we have a valid amount of entries
+    if (!Request.count || Request.count > chief_max_batch_entries || Request.reserved) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // check if all the entries are there
+    if (Length < sizeof(usb_chief_batch_submit) + (Request.count * sizeof(usb_chief_batch_entry))) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    batch_queue* queue = batch_get_queue(DeviceObject, Context, File);
+
+    if (!queue) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&queue->lock, &irql);
+
+    // every transfer needs room for its result
+    if (queue->inflight + Request.count > chief_max_batch_inflight) {
+        KeReleaseSpinLock(&queue->lock, irql);
+
+        return STATUS_DEVICE_BUSY;
+    }
+
+    queue->inflight += Request.count;
+
+    // the cleanup waits for these transfers
+    if (!queue->running) {
+        KeClearEvent(&queue->idle);
+    }
+
+    queue->running += Request.count;
+
+    KeReleaseSpinLock(&queue->lock, irql);
+
+    // the entries are in the system buffer after the header
+    const usb_chief_batch_entry* entries = reinterpret_cast<const usb_chief_batch_entry*>(&Request + 1);
+
+    // send all the transfers. Every entry adds a result
+    for (ULONG i = 0; i < Request.count; i++) {
+        batch_send(queue, entries[i]);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS batch_reap(chief_file_context* Context, PIRP Irp) {
+    batch_queue* queue = Context->batch;
+
+    // check if we have room for the header
+    if (IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.OutputBufferLength < sizeof(usb_chief_batch_reap)) {
+        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+        Irp->IoStatus.Information = 0;
+
+        IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    // nothing was ever submitted on the handle
+    if (!queue) {
+        usb_chief_batch_reap* header = reinterpret_cast<usb_chief_batch_reap*>(Irp->AssociatedIrp.SystemBuffer);
+        header->count = 0;
+        header->pending = 0;
+
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+        Irp->IoStatus.Information = sizeof(usb_chief_batch_reap);
+
+        IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return STATUS_SUCCESS;
+    }
+
+    KIRQL irql;
+    KeAcquireSpinLock(&queue->lock, &irql);
+
+    // wait for a result when transfers are still running
+    if (!queue->count && queue->inflight) {
+        irp_queue_insert(queue->reapers, Irp);
+
+        KeReleaseSpinLock(&queue->lock, irql);
+
+        return STATUS_PENDING;
+    }
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = batch_fill(*queue, Irp);
+
+    KeReleaseSpinLock(&queue->lock, irql);
+
+    IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return STATUS_SUCCESS;
+}
+
+void batch_stop(batch_queue* Queue) {
+    if (!Queue) {
+        return;
+    }
+
+    // the handle is closed, nobody is waiting for the results
+    PIRP irp;
+
+    while ((irp = irp_queue_remove(Queue->reapers)) != nullptr) {
+        irp->IoStatus.Status = STATUS_CANCELLED;
+        irp->IoStatus.Information = 0;
+
+        IofCompleteRequest(irp, IO_NO_INCREMENT);
+    }
+
+    // wait until every transfer added its result. The event can be
+    // set by a transfer that raced with a new batch, so the count
+    // is checked again under the lock
+    LARGE_INTEGER timeout;
+    timeout.QuadPart = -10 * 1000 * 10;
+
+    while (true) {
+        KIRQL irql;
+        KeAcquireSpinLock(&Queue->lock, &irql);
+
+        const bool running = Queue->running != 0;
+
+        KeReleaseSpinLock(&Queue->lock, irql);
+
+        if (!running) {
+            break;
+        }
+
+        KeWaitForSingleObject(&Queue->idle, Executive, KernelMode, false, &timeout);
+    }
+}
+
+void batch_free(batch_queue* Queue) {
+    if (Queue) {
+        ExFreePool(Queue);
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+#include "ioctl.hpp"
+#include "irp_queue.hpp"
+
+struct chief_file_context;
+
+/**
+ * @brief The batch transfers of a handle and the results that are
+ * not reaped yet
+ *
+ */
+struct batch_queue {
+    // spinlock to protect everything below
+    KSPIN_LOCK lock;
+
+    // the device and the handle the transfers are sent on
+    PDEVICE_OBJECT device_object;
+    PFILE_OBJECT file;
+
+    // the results in the order the transfers completed. There is
+    // room for every transfer that is not reaped
+    usb_chief_batch_result results[chief_max_batch_inflight];
+    ULONG head;
+    ULONG count;
+
+    // the amount of transfers that are submitted and not reaped
+    ULONG inflight;
+
+    // the amount of transfers that are not completed yet
+    ULONG running;
+
+    // signaled when running changes to 0
+    KEVENT idle;
+
+    // reaps that wait for a result
+    irp_queue reapers;
+};
+
+/**
+ * @brief Send the transfers of a batch. Should be called at passive
+ * level in the context of the process that registered the buffers
+ *
+ * @param DeviceObject
+ * @param Context the context of the handle
+ * @param File
+ * @param Request
+ * @param Length the size of the request with the entries
+ * @return NTSTATUS STATUS_DEVICE_BUSY when too many transfers are not reaped
+ */
+NTSTATUS batch_submit(PDEVICE_OBJECT DeviceObject, chief_file_context* Context, PFILE_OBJECT File, const usb_chief_batch_submit& Request, ULONG Length);
+
+/**
+ * @brief Get the results of the batch transfers. Completes the irp
+ * or queues it until a transfer is done
+ *
+ * @param Context the context of the handle
+ * @param Irp
+ * @return NTSTATUS
+ */
+NTSTATUS batch_reap(chief_file_context* Context, PIRP Irp);
+
+/**
+ * @brief Cancel the waiting reaps and wait until every batch transfer
+ * is completed. Called when the handle is cleaned up, should be
+ * called at passive level
+ *
+ * @param Queue can be a nullptr
+ */
+void batch_stop(batch_queue* Queue);
+
+/**
+ * @brief Free the batch queue of a handle
+ *
+ * @param Queue can be a nullptr
+ */
+void batch_free(batch_queue* Queue);
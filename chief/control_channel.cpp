@@ -0,0 +1,178 @@
+#include "control_channel.hpp"
+#include "device_extension.hpp"
+
+static control_channel& get_control_channel(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    return dev_ext->control;
+}
+
+static bool control_channel_bypassing(control_channel& Channel) {
+    return InterlockedCompareExchangePointer(&Channel.bypass_thread, nullptr, nullptr) == KeGetCurrentThread();
+}
+
+/**
+ * @brief Take the irp or the buffer of the channel. Waits in line when
+ * it is used, the request before us hands it over
+ *
+ * @param Channel
+ * @param Busy the busy flag of the irp or the buffer
+ * @param Waiters the line of the irp or the buffer
+ * @param Wait false to return right away when it is used
+ * @return false when it is used and we did not wait
+ */
+static bool control_channel_take(control_channel& Channel, volatile LONG& Busy, LIST_ENTRY& Waiters, bool Wait) {
+    KIRQL irql;
+    KeAcquireSpinLock(&Channel.lock, &irql);
+
+    if (!Busy) {
+        Busy = 1;
+        KeReleaseSpinLock(&Channel.lock, irql);
+
+        return true;
+    }
+
+    if (!Wait) {
+        KeReleaseSpinLock(&Channel.lock, irql);
+        return false;
+    }
+
+    // get in line behind the other requests
+    control_channel_waiter waiter;
+    KeInitializeEvent(&waiter.ready, NotificationEvent, false);
+
+    InsertTailList(&Waiters, &waiter.entry);
+    Channel.waiting++;
+
+    KeReleaseSpinLock(&Channel.lock, irql);
+
+    // it is ours when the event is set. The busy flag stays set
+    KeWaitForSingleObject(&waiter.ready, Executive, KernelMode, false, nullptr);
+
+    return true;
+}
+
+/**
+ * @brief Give the irp or the buffer to the first request in line, or
+ * mark it free when nobody waits
+ *
+ */
+static void control_channel_give(control_channel& Channel, volatile LONG& Busy, LIST_ENTRY& Waiters) {
+    KIRQL irql;
+    KeAcquireSpinLock(&Channel.lock, &irql);
+
+    if (IsListEmpty(&Waiters)) {
+        Busy = 0;
+        KeReleaseSpinLock(&Channel.lock, irql);
+
+        return;
+    }
+
+    control_channel_waiter* waiter = CONTAINING_RECORD(RemoveHeadList(&Waiters), control_channel_waiter, entry);
+    Channel.waiting--;
+
+    KeReleaseSpinLock(&Channel.lock, irql);
+
+    // the waiter is out of the line, nobody else touches it. It can
+    // return as soon as the event is set
+    KeSetEvent(&waiter->ready, IO_NO_INCREMENT, false);
+}
+
+void control_channel_init(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    control_channel& channel = dev_ext->control;
+
+    KeInitializeSpinLock(&channel.lock);
+    InitializeListHead(&channel.irp_waiters);
+    InitializeListHead(&channel.buffer_waiters);
+
+    channel.irp_busy = 0;
+    channel.buffer_busy = 0;
+    channel.waiting = 0;
+    channel.bypass_thread = nullptr;
+
+    // the requests allocate their own irp and buffer when these fail
+    channel.irp = IoAllocateIrp(dev_ext->attachedDeviceObject->StackSize, false);
+    channel.buffer = ExAllocatePoolWithTag(NonPagedPool, control_channel_buffer_size, 0x206D6457u);
+}
+
+PIRP control_channel_acquire_irp(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    control_channel& channel = dev_ext->control;
+
+    // use the irp of the channel. Wait for it when it is used, the
+    // watchdog only takes it when it is free
+    if (channel.irp && control_channel_take(channel, channel.irp_busy, channel.irp_waiters, !control_channel_bypassing(channel))) {
+        // clear what the last request left in the irp
+        IoReuseIrp(channel.irp, STATUS_SUCCESS);
+
+        return channel.irp;
+    }
+
+    return IoAllocateIrp(dev_ext->attachedDeviceObject->StackSize, false);
+}
+
+void control_channel_release_irp(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+    control_channel& channel = get_control_channel(DeviceObject);
+
+    if (Irp == channel.irp) {
+        control_channel_give(channel, channel.irp_busy, channel.irp_waiters);
+    }
+    else {
+        IoFreeIrp(Irp);
+    }
+}
+
+void* control_channel_acquire_buffer(PDEVICE_OBJECT DeviceObject, ULONG Length) {
+    control_channel& channel = get_control_channel(DeviceObject);
+
+    // use the buffer of the channel when it is large enough. Wait for
+    // it when it is used, the watchdog only takes it when it is free
+    if (channel.buffer && Length <= control_channel_buffer_size &&
+        control_channel_take(channel, channel.buffer_busy, channel.buffer_waiters, !control_channel_bypassing(channel)))
+    {
+        return channel.buffer;
+    }
+
+    return ExAllocatePoolWithTag(NonPagedPool, Length, 0x206D6457u);
+}
+
+void control_channel_release_buffer(PDEVICE_OBJECT DeviceObject, void* Buffer) {
+    control_channel& channel = get_control_channel(DeviceObject);
+
+    if (!Buffer) {
+        return;
+    }
+
+    if (Buffer == channel.buffer) {
+        control_channel_give(channel, channel.buffer_busy, channel.buffer_waiters);
+    }
+    else {
+        ExFreePool(Buffer);
+    }
+}
+
+void control_channel_begin_bypass(PDEVICE_OBJECT DeviceObject) {
+    InterlockedExchangePointer(&get_control_channel(DeviceObject).bypass_thread, KeGetCurrentThread());
+}
+
+void control_channel_end_bypass(PDEVICE_OBJECT DeviceObject) {
+    InterlockedExchangePointer(&get_control_channel(DeviceObject).bypass_thread, nullptr);
+}
+
+void control_channel_free(PDEVICE_OBJECT DeviceObject) {
+    control_channel& channel = get_control_channel(DeviceObject);
+
+    if (channel.irp) {
+        IoFreeIrp(channel.irp);
+        channel.irp = nullptr;
+    }
+
+    if (channel.buffer) {
+        ExFreePool(channel.buffer);
+        channel.buffer = nullptr;
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+// the size of the bounce buffer of the control channel. Large enough
+// for a chunk of a image download
+constexpr static ULONG control_channel_buffer_size = 4096;
+
+/**
+ * @brief A request that waits in line for the irp or the buffer of the
+ * channel. Lives on the stack of the waiting thread
+ *
+ */
+struct control_channel_waiter {
+    LIST_ENTRY entry;
+
+    // set when the request got the irp or the buffer
+    KEVENT ready;
+};
+
+/**
+ * @brief Irp and bounce buffer that are allocated once and reused for
+ * every synchronous request to the usb stack. A request that finds
+ * the irp or the buffer in use waits in line and gets it from the
+ * request before it, so a burst of requests does not allocate. Only
+ * the watchdog skips the line, it should not wait behind the request
+ * it tries to recover and allocates its own when the channel is used
+ *
+ */
+struct control_channel {
+    // spinlock to protect the busy flags and the lines
+    KSPIN_LOCK lock;
+
+    // the irp with a stack location for every driver below us. nullptr
+    // when it could not be allocated
+    PIRP irp;
+
+    // 1 when the irp is used and the requests that wait for it
+    volatile LONG irp_busy;
+    LIST_ENTRY irp_waiters;
+
+    // the bounce buffer of control_channel_buffer_size bytes. nullptr
+    // when it could not be allocated
+    void* buffer;
+
+    // 1 when the bounce buffer is used and the requests that wait for it
+    volatile LONG buffer_busy;
+    LIST_ENTRY buffer_waiters;
+
+    // the amount of requests that wait in both lines
+    volatile LONG waiting;
+
+    // the thread that skips the lines. nullptr when no thread does
+    PVOID volatile bypass_thread;
+};
+
+/**
+ * @brief Allocate the irp and the bounce buffer. Should be called after
+ * we are attached to the device stack. The channel is not used when
+ * this fails
+ *
+ * @param DeviceObject
+ */
+void control_channel_init(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Get a irp for a request to the usb stack. Returns the irp of
+ * the channel and waits for it when it is used. A thread that skips
+ * the line gets a new irp instead of waiting. Should be called at 
+ * passive level and given back with control_channel_release_irp
+ *
+ * @param DeviceObject
+ * @return PIRP nullptr when we are out of memory
+ */
+PIRP control_channel_acquire_irp(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Give back a irp from control_channel_acquire_irp. The irp
+ * should be completed. The irp of the channel goes to the first
+ * request in line
+ *
+ * @param DeviceObject
+ * @param Irp
+ */
+void control_channel_release_irp(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+
+/**
+ * @brief Get a nonpaged bounce buffer. Returns the buffer of the
+ * channel when it is large enough and waits for it when it is used.
+ * Larger buffers and a thread that skips the line allocate one. Should
+ * be called at passive level and given back with 
+ * control_channel_release_buffer
+ *
+ * @param DeviceObject
+ * @param Length
+ * @return void* nullptr when we are out of memory
+ */
+void* control_channel_acquire_buffer(PDEVICE_OBJECT DeviceObject, ULONG Length);
+
+/**
+ * @brief Give back a buffer from control_channel_acquire_buffer
+ *
+ * @param DeviceObject
+ * @param Buffer can be a nullptr
+ */
+void control_channel_release_buffer(PDEVICE_OBJECT DeviceObject, void* Buffer);
+
+/**
+ * @brief Let the requests of the current thread skip the lines until
+ * control_channel_end_bypass. Used by the watchdog
+ *
+ * @param DeviceObject
+ */
+void control_channel_begin_bypass(PDEVICE_OBJECT DeviceObject);
+void control_channel_end_bypass(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Free the irp and the bounce buffer. Should be called when the
+ * device is removed and no request uses the channel anymore
+ *
+ * @param DeviceObject
+ */
+void control_channel_free(PDEVICE_OBJECT DeviceObject);
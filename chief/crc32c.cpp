@@ -0,0 +1,83 @@
+#include "crc32c.hpp"
+
+#include <intrin.h>
+#include <nmmintrin.h>
+
+// the reversed castagnoli polynomial
+constexpr static ULONG crc32c_polynomial = 0x82F63B78u;
+
+// table for the processors without the crc32 instruction
+static ULONG crc32c_table[256];
+
+// true when the processor has the crc32 instruction
+static bool crc32c_hardware = false;
+
+void crc32c_init() {
+    // build the table for a byte at a time
+    for (ULONG i = 0; i < 256; i++) {
+        ULONG value = i;
+
+        for (ULONG bit = 0; bit < 8; bit++) {
+            value = (value >> 1) ^ ((value & 1) ? crc32c_polynomial : 0);
+        }
+
+        crc32c_table[i] = value;
+    }
+
+    // the crc32 instruction is part of SSE4.2 (cpuid 1, ecx bit 20)
+    int info[4];
+    __cpuid(info, 1);
+
+    crc32c_hardware = (info[2] & (1 << 20)) != 0;
+}
+
+bool crc32c_has_instruction() {
+    return crc32c_hardware;
+}
+
+ULONG crc32c_software(ULONG Crc, const UCHAR* Data, ULONG Length) {
+    for (ULONG i = 0; i < Length; i++) {
+        Crc = crc32c_table[(Crc ^ Data[i]) & 0xff] ^ (Crc >> 8);
+    }
+
+    return Crc;
+}
+
+ULONG crc32c_instruction(ULONG Crc, const UCHAR* Data, ULONG Length) {
+    // do the bytes before the first aligned word one at a time
+    while (Length && (reinterpret_cast<ULONG_PTR>(Data) & (sizeof(ULONG_PTR) - 1))) {
+        Crc = _mm_crc32_u8(Crc, *Data++);
+        Length--;
+    }
+
+#if defined(_M_X64)
+    // 8 bytes per instruction
+    ULONGLONG crc = Crc;
+
+    for (; Length >= sizeof(ULONGLONG); Length -= sizeof(ULONGLONG), Data += sizeof(ULONGLONG)) {
+        crc = _mm_crc32_u64(crc, *reinterpret_cast<const ULONGLONG*>(Data));
+    }
+
+    Crc = static_cast<ULONG>(crc);
+#else
+    // 4 bytes per instruction
+    for (; Length >= sizeof(ULONG); Length -= sizeof(ULONG), Data += sizeof(ULONG)) {
+        Crc = _mm_crc32_u32(Crc, *reinterpret_cast<const ULONG*>(Data));
+    }
+#endif
+
+    // do the bytes after the last word
+    while (Length--) {
+        Crc = _mm_crc32_u8(Crc, *Data++);
+    }
+
+    return Crc;
+}
+
+ULONG crc32c(const UCHAR* Data, ULONG Length) {
+    const ULONG crc = crc32c_hardware ? 
+        crc32c_instruction(0xffffffffu, Data, Length) : 
+        crc32c_software(0xffffffffu, Data, Length);
+
+    return ~crc;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+/**
+ * @brief Detect if the processor has the crc32 instruction (SSE4.2)
+ * and build the table for the fallback. Should be called once in
+ * DriverEntry before crc32c is used
+ *
+ */
+void crc32c_init();
+
+/**
+ * @brief Calculate the crc32c (castagnoli) of a buffer. Uses the 
+ * crc32 instruction when the processor has it. Can be called at any 
+ * irql as the instruction does not use the floating point state
+ *
+ * @param Data
+ * @param Length
+ * @return ULONG
+ */
+ULONG crc32c(const UCHAR* Data, ULONG Length);
+
+/**
+ * @brief Check if crc32c uses the crc32 instruction
+ *
+ * @return true when crc32c_init found SSE4.2
+ */
+bool crc32c_has_instruction();
+
+/**
+ * @brief The two ways crc32c calculates the crc. Continue the crc
+ * of the data before without the final inversion, crc32c starts with
+ * 0xffffffff and inverts the result. The instruction should only be
+ * used when crc32c_has_instruction returns true
+ *
+ * @param Crc
+ * @param Data
+ * @param Length
+ * @return ULONG
+ */
+ULONG crc32c_software(ULONG Crc, const UCHAR* Data, ULONG Length);
+ULONG crc32c_instruction(ULONG Crc, const UCHAR* Data, ULONG Length);
@@ -7,46 +7,126 @@ extern "C" {
 }
 
 #include "maybe.hpp"
+#include "ioctl.hpp"
+#include "device_state.hpp"
+#include "status_cache.hpp"
+#include "scheduler.hpp"
+#include "pipe.hpp"
+#include "tap.hpp"
+#include "trace.hpp"
+#include "fanout.hpp"
+#include "watchdog.hpp"
+#include "notify.hpp"
+#include "vendor_stats.hpp"
+#include "control_channel.hpp"
+
+// the size of a cache line on the platforms we support
+constexpr static size_t cache_line_size = 64;
 
 /**
- * @brief Payload we are receiving/sending from the 
- * application in a mj device control
+ * @brief Device extension structure. The fields are grouped in 
+ * cache line sized sections (relative to the start of the 
+ * extension). Fields that are read on every request are in the
+ * hot section, counters that are written on every request get 
+ * their own line so they do not invalidate the hot section and 
+ * everything that is only used during pnp/power is in the cold 
+ * section. Should be reached with get_device_extension so the
+ * sections are on real cache lines
  * 
  */
-struct usb_chief_vendor_request {
-    // usb request fields. Is sometimes used as input 
-    // and as output
-    unsigned short request;
-
-    // usb specific fields
-    unsigned short value;
-    unsigned short index;
-
-    // length of the data buffer
-    unsigned short length;
-
-    // pointer to the data buffer
-    void *data;
-};
-
-/**
- * @brief Device extension structure
- * 
- */
-struct chief_device_extension {
-    // the device objects we are connected to
-    PDEVICE_OBJECT attachedDeviceObject;
+struct alignas(cache_line_size) chief_device_extension {
+    // hot section. Read on every request but only written 
+    // during pnp or when changing the alternate setting
+    union {
+        struct {
+            // the current pnp state of the device. Stores a device_state
+            // and should only be modified using the transition functions
+            // in device_state.hpp
+            volatile LONG state;
+
+            // 1 when the urb tap is recording. Kept in the hot section
+            // so the disabled tap only costs this read
+            volatile LONG tap_enabled;
+
+            // 1 when the request recorder is recording
+            volatile LONG trace_enabled;
+
+            // the device object we are attached to
+            PDEVICE_OBJECT attachedDeviceObject;
+
+            // the current usb interface information
+            PUSBD_INTERFACE_INFORMATION usb_interface_info;
+
+            // the current usb configuration descriptor
+            PUSB_CONFIGURATION_DESCRIPTOR usb_config_desc;
+        };
+
+        UCHAR hot_section[cache_line_size];
+    };
+
+    // counter section. Written on every request
+    union {
+        struct {
+            // the owners of the pipes. The low 32 bits have a bit for
+            // every pipe that is opened, the high 32 bits the epoch of
+            // the owners. Should only be modified using the pipe 
+            // ownership functions in pipe.hpp
+            volatile LONGLONG pipe_owners;
+
+            // spinlock to protect the active_pipe_count
+            KSPIN_LOCK device_lock;
+
+            // count of opened pipes
+            LONG active_pipe_count;
+
+            // count of open pipe handles and 1 while the watchdog 
+            // selects the configuration again. Should only be modified 
+            // using the handle functions in pipe.hpp
+            volatile LONG open_pipe_handles;
+            volatile LONG pipe_reselecting;
+        };
+
+        UCHAR pipe_count_section[cache_line_size];
+    };
+
+    // power counter section. Updated independently from the
+    // pipe count
+    union {
+        // count of active power irps. Should only be modified 
+        // using Interlocked functions
+        LONG power_irp_count;
+
+        UCHAR power_count_section[cache_line_size];
+    };
+
+    // scheduler section. Written by every bulk and interrupt transfer
+    // so it is kept away from the hot section. Rounded up to whole
+    // cache lines
+    union {
+        transfer_scheduler scheduler;
+
+        UCHAR scheduler_section[(sizeof(transfer_scheduler) + cache_line_size - 1) & ~(cache_line_size - 1)];
+    };
+
+    // pipe section. The sizing and statistics of every pipe. Written
+    // by every completed transfer. Rounded up to whole cache lines
+    union {
+        pipe_state pipes[chief_max_pipes];
+
+        UCHAR pipe_section[(sizeof(pipe_state) * chief_max_pipes + cache_line_size - 1) & ~(cache_line_size - 1)];
+    };
+
+    // cold section. Only used during pnp and power requests
+
+    // the device object of this extension
+    PDEVICE_OBJECT device_object;
+
+    // the physical device object we are connected to
     PDEVICE_OBJECT physicalDeviceObject;
 
     // the current power state of the device
     POWER_STATE current_power_state;
 
-    // the current usb configuration descriptor
-    PUSB_CONFIGURATION_DESCRIPTOR usb_config_desc;
-
-    // the current usb interface information
-    PUSBD_INTERFACE_INFORMATION usb_interface_info;
-
     // the device capabilities structure. This is used
     // to know what power state we need to go to for each
     // system power state
@@ -57,38 +137,72 @@ struct chief_device_extension {
     // and IRP_MN_REMOVE_DEVICE is called
     KEVENT pipe_count_empty;
 
-    // spinlock to protect the active_pipe_count
-    KSPIN_LOCK device_lock;
+    // The BCD version of the connected USB device
+    maybe<unsigned short> bcdUSB;
+
+    // the alternate setting that was selected last
+    UCHAR alternate_setting;
 
-    // count of opened pipes
-    LONG active_pipe_count;
+    // cache with the results of the polled vendor status requests
+    status_cache status_poll;
 
-    // an array with flags for each pipe if it is opened 
-    // or not
-    bool *allocated_pipes;
+    // the ring and settings of the urb tap
+    urb_tap tap;
 
-    // flag if the device has been removed. This means
-    // that we cannot accept new ioctls/reads/writes.
-    // When this flag is set we cannot talk to the device 
-    // anymore
-    volatile bool device_removed;
+    // the ring of the request recorder
+    request_trace trace;
 
-    // flag if the device is remove pending. This means
-    // that we should not accept new ioctls/reads/writes
-    // and that the device should be considered as being 
-    // removed until it is deleted or canceled
-    volatile bool remove_pending;
+    // mutex for creating and freeing the fan-out of the pipes
+    FAST_MUTEX fanout_lock;
 
-    // flag if new requests should be held. This is used during
-    // stop device to prevent new ioctls/reads/writes from
-    // being processed until the device is started again
-    volatile bool hold_new_requests;
+    // the fan-out of every pipe. nullptr when the pipe has no 
+    // fan-out handles
+    fanout_hub* fanouts[chief_max_pipes];
 
-    // The BCD version of the connected USB device
-    maybe<unsigned short> bcdUSB;
+    // the hung device watchdog
+    device_watchdog watchdog;
+
+    // the channel for the device events
+    device_notify notify;
+
+    // the statistics of the vendor requests for every request code
+    vendor_stats vendor;
+
+    // the irp and bounce buffer of the synchronous requests
+    control_channel control;
 
-    // count of active power irps. Should only be modified 
-    // using Interlocked functions
-    LONG power_irp_count;
+    // entry in the list of devices that get the changed tunables
+    LIST_ENTRY tunables_entry;
 };
 
+// make sure every section is on its own cache line
+static_assert(offsetof(chief_device_extension, hot_section) == 0, "Hot section should be at the start of the device extension");
+static_assert(offsetof(chief_device_extension, usb_config_desc) + sizeof(PUSB_CONFIGURATION_DESCRIPTOR) <= cache_line_size, "Hot fields do not fit in one cache line");
+static_assert(offsetof(chief_device_extension, pipe_count_section) == cache_line_size, "Pipe count should start on its own cache line");
+static_assert(offsetof(chief_device_extension, pipe_reselecting) + sizeof(LONG) <= (2 * cache_line_size), "Pipe count fields do not fit in one cache line");
+static_assert((offsetof(chief_device_extension, pipe_owners) % sizeof(LONGLONG)) == 0, "Pipe owners should be aligned for the interlocked functions");
+static_assert(chief_max_pipes <= 32, "Every pipe should have a bit in the pipe owners");
+static_assert(offsetof(chief_device_extension, power_count_section) == (2 * cache_line_size), "Power irp count should start on its own cache line");
+static_assert(offsetof(chief_device_extension, scheduler_section) == (3 * cache_line_size), "Scheduler should start on its own cache line");
+static_assert(offsetof(chief_device_extension, pipe_section) == (3 * cache_line_size) + sizeof(chief_device_extension::scheduler_section), "Pipe section should start after the scheduler");
+static_assert(offsetof(chief_device_extension, device_object) == offsetof(chief_device_extension, pipe_section) + sizeof(chief_device_extension::pipe_section), "Cold section should start after the pipes");
+
+// the size to allocate for the device extension. IoCreateDevice only
+// aligns the extension to the pool alignment, the extra bytes let us
+// round it up to a cache line
+constexpr static ULONG chief_device_extension_size = sizeof(chief_device_extension) + cache_line_size - 1;
+
+/**
+ * @brief Get the cache line aligned device extension of a device
+ * object that is created with chief_device_extension_size
+ * 
+ * @param DeviceObject 
+ * @return chief_device_extension* 
+ */
+inline chief_device_extension* get_device_extension(PDEVICE_OBJECT DeviceObject) {
+    const ULONG_PTR address = reinterpret_cast<ULONG_PTR>(DeviceObject->DeviceExtension);
+
+    return reinterpret_cast<chief_device_extension*>(
+        (address + cache_line_size - 1) & ~static_cast<ULONG_PTR>(cache_line_size - 1)
+    );
+}
@@ -0,0 +1,45 @@
+#include "device_state.hpp"
+#include "device_extension.hpp"
+
+device_state get_device_state(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // read the state once
+    return static_cast<device_state>(dev_ext->state);
+}
+
+bool try_transition_device_state(PDEVICE_OBJECT DeviceObject, device_state from, device_state to) {
+    // check if we are allowed to do this transition
+    if (!is_valid_device_state_transition(from, to)) {
+        return false;
+    }
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // only change the state if nobody else changed it in the meantime
+    const LONG previous = InterlockedCompareExchange(
+        &dev_ext->state, static_cast<LONG>(to), static_cast<LONG>(from)
+    );
+
+    return previous == static_cast<LONG>(from);
+}
+
+bool transition_device_state(PDEVICE_OBJECT DeviceObject, device_state to) {
+    while (true) {
+        // get the current state
+        const device_state current = get_device_state(DeviceObject);
+
+        // check if we are allowed to go to the new state
+        if (!is_valid_device_state_transition(current, to)) {
+            return false;
+        }
+
+        // try to change the state. If someone changed it in
+        // the meantime we check the new state again
+        if (try_transition_device_state(DeviceObject, current, to)) {
+            return true;
+        }
+    }
+}
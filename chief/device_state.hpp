@@ -0,0 +1,151 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+/**
+ * @brief All the pnp states the device can be in. The state is
+ * stored as a single LONG in the device extension so the hot path
+ * only needs one load to know if it can accept new requests
+ *
+ */
+enum class device_state : LONG {
+    // the device object is created but we did not get a
+    // IRP_MN_START_DEVICE yet
+    not_started = 0,
+
+    // we are handling a IRP_MN_START_DEVICE
+    starting,
+
+    // the device is configured and accepts new ioctls/reads/writes
+    started,
+
+    // the lower driver accepted a IRP_MN_QUERY_STOP_DEVICE. New
+    // requests are held until the device is stopped or the stop
+    // is canceled
+    stop_pending,
+
+    // the device is stopped (or failed to start). The configuration
+    // is cleared and we cannot talk to the device
+    stopped,
+
+    // the lower driver accepted a IRP_MN_QUERY_REMOVE_DEVICE. New
+    // requests are rejected until the device is removed or the
+    // remove is canceled
+    remove_pending,
+
+    // the device is physically gone. We cannot talk to it anymore
+    surprise_removed,
+
+    // we got IRP_MN_REMOVE_DEVICE. This is the final state
+    removed,
+
+    // amount of states. Not a valid state
+    count
+};
+
+// the amount of states we have
+constexpr static LONG device_state_count = static_cast<LONG>(device_state::count);
+
+/**
+ * @brief Table with all the allowed transitions. The first index
+ * is the current state, the second index the new state
+ *
+ */
+constexpr static bool device_state_transitions[device_state_count][device_state_count] = {
+    //  not_started, starting, started, stop_pending, stopped, remove_pending, surprise_removed, removed
+    {   false,       true,     false,   false,        false,   false,          true,             true  }, // not_started
+    {   false,       false,    true,    false,        true,    false,          true,             true  }, // starting
+    {   false,       false,    false,   true,         true,    true,           true,             true  }, // started
+    {   false,       false,    true,    false,        true,    false,          true,             true  }, // stop_pending
+    {   false,       true,     false,   false,        false,   false,          true,             true  }, // stopped
+    {   false,       false,    true,    false,        false,   false,          true,             true  }, // remove_pending
+    {   false,       false,    false,   false,        false,   false,          false,            true  }, // surprise_removed
+    {   false,       false,    false,   false,        false,   false,          false,            false }, // removed
+};
+
+/**
+ * @brief Check if we are allowed to go from one state to another
+ *
+ * @param from
+ * @param to
+ * @return true
+ * @return false
+ */
+constexpr bool is_valid_device_state_transition(device_state from, device_state to) {
+    // check if both states are valid
+    if (from >= device_state::count || to >= device_state::count) {
+        return false;
+    }
+
+    return device_state_transitions[static_cast<LONG>(from)][static_cast<LONG>(to)];
+}
+
+/**
+ * @brief Check if every state (except removed) can always reach
+ * the removed state and if the removed state is final
+ *
+ * @return true
+ * @return false
+ */
+constexpr bool device_state_table_is_consistent() {
+    for (LONG from = 0; from < device_state_count; from++) {
+        for (LONG to = 0; to < device_state_count; to++) {
+            const device_state f = static_cast<device_state>(from);
+            const device_state t = static_cast<device_state>(to);
+
+            // we never transition to the same state
+            if (from == to && is_valid_device_state_transition(f, t)) {
+                return false;
+            }
+
+            // nothing can leave the removed state
+            if (f == device_state::removed && is_valid_device_state_transition(f, t)) {
+                return false;
+            }
+
+            // every other state should be able to go to removed
+            if (f != device_state::removed && t == device_state::removed && !is_valid_device_state_transition(f, t)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static_assert(device_state_table_is_consistent(), "Invalid device state transition table");
+static_assert(static_cast<LONG>(device_state::not_started) == 0, "A zeroed device extension should be in the not_started state");
+
+/**
+ * @brief Get the current device state using a single load
+ *
+ * @param DeviceObject
+ * @return device_state
+ */
+device_state get_device_state(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Try to change the state from a specific state to a new
+ * state. Fails when the current state is not the expected state
+ * or if the transition is not allowed
+ *
+ * @param DeviceObject
+ * @param from
+ * @param to
+ * @return true
+ * @return false
+ */
+bool try_transition_device_state(PDEVICE_OBJECT DeviceObject, device_state from, device_state to);
+
+/**
+ * @brief Change the state from whatever state we are in to a new
+ * state. Fails if the transition from the current state is not allowed
+ *
+ * @param DeviceObject
+ * @param to
+ * @return true
+ * @return false
+ */
+bool transition_device_state(PDEVICE_OBJECT DeviceObject, device_state to);
@@ -4,6 +4,12 @@
 #include "major_functions.hpp"
 #include "device_extension.hpp"
 #include "pipe.hpp"
+#include "status_cache.hpp"
+#include "scheduler.hpp"
+#include "crc32c.hpp"
+#include "fanout.hpp"
+#include "tunables.hpp"
+#include "watchdog.hpp"
 
 /**
  * @brief Unload routine for the driver.
@@ -30,7 +36,7 @@ NTSTATUS add_chief_device(PDRIVER_OBJECT driver_object, PDEVICE_OBJECT& device_o
     // create the device
     NTSTATUS status = IoCreateDevice(
         driver_object,
-        sizeof(chief_device_extension),
+        chief_device_extension_size,
         &device_name_unicode,
         FILE_DEVICE_USB,
         0,
@@ -59,19 +65,59 @@ NTSTATUS add_chief_device(PDRIVER_OBJECT driver_object, PDEVICE_OBJECT& device_o
     }
 
     // initialize the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(device_object->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(device_object);
     
     // reset the whole device extension memory to zero
     memset(dev_ext, 0, sizeof(chief_device_extension));
 
+    dev_ext->device_object = device_object;
+
     // initalize the events
     KeInitializeEvent(&dev_ext->pipe_count_empty, NotificationEvent, FALSE);
 
     // initialize spinlocks
     KeInitializeSpinLock(&dev_ext->device_lock);
 
-    // reset the allocated pipes and usb_interface_info
-    dev_ext->allocated_pipes = nullptr;
+    // initialize the transfer scheduler
+    scheduler_init(device_object);
+
+    // initialize the pipe statistics
+    pipe_state_init(device_object);
+
+    // no pipe has fan-out handles yet
+    fanout_init(device_object);
+    notify_init(device_object);
+
+    // initialize the watchdog and the status poller
+    status = watchdog_init(device_object);
+
+    if (NT_SUCCESS(status)) {
+        status = status_cache_init(device_object);
+
+        // free the work item of the watchdog when the poller failed
+        if (!NT_SUCCESS(status)) {
+            watchdog_free(device_object);
+        }
+    }
+
+    // check for errors
+    if (!NT_SUCCESS(status)) {
+        // delete the symbolic link and the device object
+        IoDeleteSymbolicLink(&symbolic_link_name_unicode);
+        IoDeleteDevice(device_object);
+
+        // reset the device object pointer back to a nullptr
+        device_object = nullptr;
+
+        // return the error status
+        return status;
+    }
+
+    // enable the tracing that is selected in the tunables
+    tunables_apply(device_object);
+
+    // reset the usb_interface_info. The pipe owners are cleared with 
+    // the rest of the device extension
     dev_ext->usb_interface_info = nullptr;
 
     // create a maybe<unsigned short> for bcdUSB
@@ -151,7 +197,7 @@ static NTSTATUS add_device(__in struct _DRIVER_OBJECT *DriverObject, __in struct
     device_object->Flags |= DO_DIRECT_IO | DO_POWER_PAGABLE;
 
     // initialize the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(device_object->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(device_object);
 
     // store the physical device object
     dev_ext->physicalDeviceObject = PhysicalDeviceObject;
@@ -161,6 +207,11 @@ static NTSTATUS add_device(__in struct _DRIVER_OBJECT *DriverObject, __in struct
     
     // check if we have a valid attached device object
     if (dev_ext->attachedDeviceObject == nullptr) {
+        // free the status poller and watchdog resources
+        status_cache_free(device_object);
+        watchdog_free(device_object);
+        tunables_remove(device_object);
+
         // delete the allocated object
         IoDeleteDevice(device_object);
 
@@ -168,6 +219,10 @@ static NTSTATUS add_device(__in struct _DRIVER_OBJECT *DriverObject, __in struct
         return STATUS_NO_SUCH_DEVICE;
     }
 
+    // allocate the irp for the synchronous requests now we know the 
+    // stack size of the drivers below us
+    control_channel_init(device_object);
+
     // clear the resource structure
     dev_ext->device_capabilities = {};
     dev_ext->device_capabilities.Size = sizeof(_DEVICE_CAPABILITIES);
@@ -191,7 +246,11 @@ static NTSTATUS add_device(__in struct _DRIVER_OBJECT *DriverObject, __in struct
 }
 
 NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath) {
-    UNREFERENCED_PARAMETER(RegistryPath);
+    // load the tunables before anything uses them
+    tunables_load(RegistryPath);
+
+    // pick the crc32c implementation for the crc read mode
+    crc32c_init();
 
     // setup the AddDevice and unload routines
     DriverObject->DriverUnload = driver_unload;
@@ -199,6 +258,7 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath)
 
     // setup all the major function pointers
     DriverObject->MajorFunction[IRP_MJ_CREATE] = mj_create;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = mj_cleanup;
     DriverObject->MajorFunction[IRP_MJ_CLOSE] = mj_close;
     DriverObject->MajorFunction[IRP_MJ_READ] = mj_read;
     DriverObject->MajorFunction[IRP_MJ_WRITE] = mj_write;
@@ -0,0 +1,785 @@
+#include "fanout.hpp"
+#include "device_extension.hpp"
+#include "device_state.hpp"
+#include "pipe.hpp"
+#include "tap.hpp"
+#include "usb.hpp"
+#include "urb.hpp"
+#include "watchdog.hpp"
+#include "tunables.hpp"
+#include "notify.hpp"
+
+// index in the driver context of a read where we store if the read
+// is framed. Index 0 is used by the irp queue and the last entry by
+// the cancel safe queue
+constexpr static ULONG fanout_framed_index = 1;
+
+static NTSTATUS fanout_transfer_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context);
+
+static void fanout_release(fanout_buffer* Buffer) {
+    // free the buffer when this was the last reference
+    if (!InterlockedDecrement(&Buffer->references)) {
+        ExFreeToNPagedLookasideList(&Buffer->hub->buffers, Buffer);
+    }
+}
+
+static bool fanout_is_held(fanout_hub& Hub) {
+    // check if a blocking handle has no room for new buffers. Should
+    // be called with the lock of the hub
+    for (PLIST_ENTRY entry = Hub.subscribers.Flink; entry != &Hub.subscribers; entry = entry->Flink) {
+        const fanout_subscriber* subscriber = CONTAINING_RECORD(entry, fanout_subscriber, entry);
+
+        if (subscriber->policy == chief_fanout_blocking && subscriber->count >= subscriber->depth) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void fanout_queue_buffer(fanout_subscriber& Subscriber, fanout_buffer* Buffer) {
+    const ULONG capacity = sizeof(Subscriber.buffers) / sizeof(Subscriber.buffers[0]);
+
+    // a lossy handle that fell behind loses the oldest buffer. A
+    // blocking handle can only go over the depth with the transfers
+    // that were already with the usb stack, these fit in the extra room
+    if (Subscriber.count >= ((Subscriber.policy == chief_fanout_lossy) ? Subscriber.depth : capacity)) {
+        fanout_release(Subscriber.buffers[Subscriber.head]);
+
+        Subscriber.head = (Subscriber.head + 1) % capacity;
+        Subscriber.count--;
+        Subscriber.dropped++;
+    }
+
+    // the handle shares the buffer with the other handles
+    InterlockedIncrement(&Buffer->references);
+
+    Subscriber.buffers[(Subscriber.head + Subscriber.count) % capacity] = Buffer;
+    Subscriber.count++;
+}
+
+static fanout_buffer* fanout_take_buffer(fanout_subscriber& Subscriber) {
+    const ULONG capacity = sizeof(Subscriber.buffers) / sizeof(Subscriber.buffers[0]);
+
+    fanout_buffer* buffer = Subscriber.buffers[Subscriber.head];
+
+    Subscriber.head = (Subscriber.head + 1) % capacity;
+    Subscriber.count--;
+    Subscriber.delivered++;
+
+    return buffer;
+}
+
+static void fanout_complete_read(PIRP Irp, fanout_buffer* Buffer) {
+    const bool framed = Irp->Tail.Overlay.DriverContext[fanout_framed_index] != nullptr;
+
+    // get the buffer of the read
+    UCHAR* output = reinterpret_cast<UCHAR*>(MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority));
+
+    if (!output) {
+        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+        Irp->IoStatus.Information = 0;
+
+        IofCompleteRequest(Irp, IO_NO_INCREMENT);
+        return;
+    }
+
+    const ULONG header_size = framed ? sizeof(chief_read_frame_header) : 0;
+    const ULONG room = MmGetMdlByteCount(Irp->MdlAddress) - header_size;
+
+    // the rest of a buffer that does not fit in the read is lost
+    const ULONG length = (Buffer->length < room) ? Buffer->length : room;
+
+    if (framed) {
+        chief_read_frame_header* header = reinterpret_cast<chief_read_frame_header*>(output);
+
+        header->timestamp = Buffer->timestamp;
+        header->length = length;
+        header->status = Buffer->status;
+        header->crc = 0;
+        header->flags = 0;
+    }
+
+    memcpy(output + header_size, Buffer->data, length);
+
+    Irp->IoStatus.Status = (length < Buffer->length) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+    Irp->IoStatus.Information = header_size + length;
+
+    IofCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+static void fanout_slot_stopped(fanout_slot* Slot, NTSTATUS Status, bool Held);
+
+static void fanout_submit(fanout_slot* Slot) {
+    fanout_hub* hub = Slot->hub;
+
+    // get a new buffer. The last one is owned by the handles now
+    fanout_buffer* buffer = reinterpret_cast<fanout_buffer*>(ExAllocateFromNPagedLookasideList(&hub->buffers));
+
+    if (!buffer) {
+        fanout_slot_stopped(Slot, STATUS_INSUFFICIENT_RESOURCES, false);
+        return;
+    }
+
+    // the transfer has the first reference
+    buffer->references = 1;
+    buffer->hub = hub;
+    buffer->length = 0;
+
+    Slot->buffer = buffer;
+
+    // initialize the urb. The builder sets every field so the urb 
+    // of the previous transfer does not need to be cleared
+    _URB_BULK_OR_INTERRUPT_TRANSFER* urb = &Slot->urb;
+
+    urb_build_bulk_or_interrupt(
+        *urb, hub->pipe_handle, USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
+        buffer->data, nullptr, hub->transfer_size
+    );
+
+    // reuse the irp of the slot
+    IoReuseIrp(Slot->irp, STATUS_SUCCESS);
+
+    PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(Slot->irp);
+
+    stack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    stack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+    stack->Parameters.Others.Argument1 = urb;
+    stack->CompletionRoutine = fanout_transfer_complete;
+    stack->Context = Slot;
+    stack->Control = SL_INVOKE_ON_SUCCESS | SL_INVOKE_ON_ERROR | SL_INVOKE_ON_CANCEL;
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(hub->device_object);
+
+    // record the urb when the tap is enabled
+    if (dev_ext->tap_enabled) {
+        tap_urb(hub->device_object, urb_cast(*urb), Slot->irp, false);
+    }
+
+    IofCallDriver(dev_ext->attachedDeviceObject, Slot->irp);
+}
+
+static void fanout_submit_dpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    fanout_submit(reinterpret_cast<fanout_slot*>(DeferredContext));
+}
+
+static void fanout_queue_submit(fanout_slot* Slot) {
+    // the slot is busy until it stops, so the dpc can not be queued
+    // twice
+    KeInsertQueueDpc(&Slot->dpc, nullptr, nullptr);
+}
+
+static void fanout_fail_reads(fanout_hub* Hub) {
+    // complete the reads of every handle with the error of the pump
+    while (true) {
+        PIRP irp = nullptr;
+
+        // acquire the spinlock
+        KIRQL irql;
+        KeAcquireSpinLock(&Hub->lock, &irql);
+
+        for (PLIST_ENTRY entry = Hub->subscribers.Flink; entry != &Hub->subscribers && !irp; entry = entry->Flink) {
+            irp = irp_queue_remove(CONTAINING_RECORD(entry, fanout_subscriber, entry)->reads);
+        }
+
+        const NTSTATUS status = Hub->error;
+
+        // release the spinlock
+        KeReleaseSpinLock(&Hub->lock, irql);
+
+        if (!irp) {
+            return;
+        }
+
+        irp->IoStatus.Status = status;
+        irp->IoStatus.Information = 0;
+
+        IofCompleteRequest(irp, IO_NO_INCREMENT);
+    }
+}
+
+static void fanout_slot_stopped(fanout_slot* Slot, NTSTATUS Status, bool Held) {
+    fanout_hub* hub = Slot->hub;
+    PDEVICE_OBJECT device_object = hub->device_object;
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&hub->lock, &irql);
+
+    Slot->busy = false;
+
+    // a held slot is started again when the blocking handle reads
+    if (Held) {
+        hub->held++;
+    }
+    else if (!hub->stopping && !NT_SUCCESS(Status) && NT_SUCCESS(hub->error)) {
+        hub->error = Status;
+    }
+
+    const bool last = !--hub->running;
+
+    // the pump is dead when the last slot stops on a error
+    const bool failed = last && !hub->held && !hub->stopping && !NT_SUCCESS(hub->error);
+
+    // release the spinlock
+    KeReleaseSpinLock(&hub->lock, irql);
+
+    if (failed) {
+        fanout_fail_reads(hub);
+    }
+
+    // the hub can be freed as soon as the event is set
+    if (last) {
+        KeSetEvent(&hub->idle, IO_NO_INCREMENT, false);
+    }
+
+    // the slot is not with the usb stack anymore
+    decrement_active_pipe_count_and_notify(device_object);
+}
+
+static void fanout_resume(fanout_hub* Hub) {
+    fanout_slot* start[fanout_pump_depth];
+    ULONG count = 0;
+
+    // the pump only runs while the device is started
+    const bool started = get_device_state(Hub->device_object) == device_state::started;
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&Hub->lock, &irql);
+
+    // start the held slots when no blocking handle is full
+    if (Hub->held && started && !Hub->stopping && !fanout_is_held(*Hub)) {
+        for (ULONG i = 0; i < fanout_pump_depth && Hub->held; i++) {
+            if (Hub->slots[i].busy) {
+                continue;
+            }
+
+            Hub->slots[i].busy = true;
+            Hub->held--;
+
+            start[count++] = &Hub->slots[i];
+        }
+
+        // the pump is not idle anymore
+        if (count && !Hub->running) {
+            KeClearEvent(&Hub->idle);
+        }
+
+        Hub->running += count;
+    }
+
+    // release the spinlock
+    KeReleaseSpinLock(&Hub->lock, irql);
+
+    for (ULONG i = 0; i < count; i++) {
+        // the slot is with the usb stack until it stops
+        increment_active_pipe_count(Hub->device_object);
+
+        fanout_queue_submit(start[i]);
+    }
+}
+
+static void fanout_dispatch(fanout_hub* Hub) {
+    // match the queued buffers with the waiting reads
+    while (true) {
+        PIRP irp = nullptr;
+        fanout_buffer* buffer = nullptr;
+
+        // acquire the spinlock
+        KIRQL irql;
+        KeAcquireSpinLock(&Hub->lock, &irql);
+
+        for (PLIST_ENTRY entry = Hub->subscribers.Flink; entry != &Hub->subscribers; entry = entry->Flink) {
+            fanout_subscriber* subscriber = CONTAINING_RECORD(entry, fanout_subscriber, entry);
+
+            if (!subscriber->count) {
+                continue;
+            }
+
+            // the read can be canceled while we look at the queue
+            irp = irp_queue_remove(subscriber->reads);
+
+            if (irp) {
+                buffer = fanout_take_buffer(*subscriber);
+                break;
+            }
+        }
+
+        // release the spinlock
+        KeReleaseSpinLock(&Hub->lock, irql);
+
+        if (!irp) {
+            break;
+        }
+
+        // copy the shared buffer to the read and drop our reference
+        fanout_complete_read(irp, buffer);
+        fanout_release(buffer);
+    }
+
+    // a blocking handle could have made room
+    fanout_resume(Hub);
+}
+
+static NTSTATUS fanout_transfer_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context) {
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    // stamp the transfer as early as possible
+    const LARGE_INTEGER timestamp = KeQueryPerformanceCounter(nullptr);
+
+    // the irp is ours so the device object is not set. Use the hub
+    fanout_slot* slot = reinterpret_cast<fanout_slot*>(Context);
+    fanout_hub* hub = slot->hub;
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(hub->device_object);
+
+    // the device is still responding
+    watchdog_progress(hub->device_object);
+
+    // record the result when the tap is enabled
+    if (dev_ext->tap_enabled) {
+        tap_urb(hub->device_object, urb_cast(slot->urb), Irp, true);
+    }
+
+    const NTSTATUS status = Irp->IoStatus.Status;
+    const ULONG length = slot->urb.TransferBufferLength;
+
+    // let the application know the pipe stalled
+    if (slot->urb.Hdr.Status == USBD_STATUS_STALL_PID) {
+        notify_event(hub->device_object, chief_event_stall, hub->pipe_index);
+    }
+
+    // the pump transfers show up in the statistics of the pipe
+    pipe_state_complete(get_pipe_state(hub->device_object, hub->pipe_index), hub->transfer_size, length, status, false);
+
+    fanout_buffer* buffer = slot->buffer;
+    slot->buffer = nullptr;
+
+    buffer->timestamp = timestamp.QuadPart;
+    buffer->status = slot->urb.Hdr.Status;
+    buffer->length = length;
+
+    const device_state state = get_device_state(hub->device_object);
+
+    // a query stop or remove can still be canceled. The slot waits 
+    // for that instead of stopping the pump without a error
+    const bool pending = (state == device_state::stop_pending || state == device_state::remove_pending);
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&hub->lock, &irql);
+
+    // give the buffer to every handle
+    if (NT_SUCCESS(status) && length) {
+        for (PLIST_ENTRY entry = hub->subscribers.Flink; entry != &hub->subscribers; entry = entry->Flink) {
+            fanout_queue_buffer(*CONTAINING_RECORD(entry, fanout_subscriber, entry), buffer);
+        }
+    }
+
+    // check if we can start the next transfer right away
+    const bool running = NT_SUCCESS(status) && state == device_state::started && !hub->stopping;
+    const bool held = (running && fanout_is_held(*hub)) || (NT_SUCCESS(status) && pending && !hub->stopping);
+
+    // the device is stopped or gone. The pipe handle is not valid 
+    // anymore so the pump stops with a error and fails the reads
+    const NTSTATUS stop_status = (NT_SUCCESS(status) && !running && !held && !hub->stopping) ? 
+        STATUS_DEVICE_NOT_CONNECTED : status;
+
+    // release the spinlock
+    KeReleaseSpinLock(&hub->lock, irql);
+
+    // drop the reference of the transfer
+    fanout_release(buffer);
+
+    // give the new buffer to the waiting reads
+    fanout_dispatch(hub);
+
+    if (running && !held) {
+        // the slot stays counted while we reuse it
+        fanout_queue_submit(slot);
+    }
+    else {
+        fanout_slot_stopped(slot, stop_status, held);
+    }
+
+    // the irp is reused or freed by us
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static void fanout_free_hub(fanout_hub* Hub) {
+    // free the irps of the slots
+    for (ULONG i = 0; i < fanout_pump_depth; i++) {
+        if (Hub->slots[i].irp) {
+            IoFreeIrp(Hub->slots[i].irp);
+        }
+    }
+
+    ExDeleteNPagedLookasideList(&Hub->buffers);
+    ExFreePool(Hub);
+}
+
+static fanout_hub* fanout_create_hub(PDEVICE_OBJECT DeviceObject, ULONG PipeIndex) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    fanout_hub* hub = reinterpret_cast<fanout_hub*>(ExAllocatePoolWithTag(
+        NonPagedPool,
+        sizeof(fanout_hub),
+        0x206D6457u
+    ));
+
+    // check if we got memory
+    if (!hub) {
+        return nullptr;
+    }
+
+    memset(hub, 0x00, sizeof(fanout_hub));
+
+    KeInitializeSpinLock(&hub->lock);
+    InitializeListHead(&hub->subscribers);
+
+    // no slot is running yet
+    KeInitializeEvent(&hub->idle, NotificationEvent, true);
+
+    hub->device_object = DeviceObject;
+    hub->pipe_index = PipeIndex;
+    hub->pipe_handle = dev_ext->usb_interface_info->Pipes[PipeIndex].PipeHandle;
+
+    // read with the largest size the pipe allows
+    pipe_state* pipe = get_pipe_state(DeviceObject, PipeIndex);
+    hub->transfer_size = pipe ? pipe->max_size : get_tunables().max_adaptive_size;
+
+    // the depth of the pool is a tunable. 0 lets the system decide
+    ExInitializeNPagedLookasideList(
+        &hub->buffers, nullptr, nullptr, 0,
+        offsetof(fanout_buffer, data) + hub->transfer_size, 0x206D6457u,
+        static_cast<USHORT>(get_tunables().fanout_pool_depth)
+    );
+
+    // allocate the irps we reuse for every transfer
+    for (ULONG i = 0; i < fanout_pump_depth; i++) {
+        hub->slots[i].hub = hub;
+        KeInitializeDpc(&hub->slots[i].dpc, fanout_submit_dpc, &hub->slots[i]);
+
+        hub->slots[i].irp = IoAllocateIrp(dev_ext->attachedDeviceObject->StackSize, false);
+
+        if (!hub->slots[i].irp) {
+            fanout_free_hub(hub);
+            return nullptr;
+        }
+    }
+
+    return hub;
+}
+
+void fanout_init(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    ExInitializeFastMutex(&dev_ext->fanout_lock);
+
+    for (ULONG i = 0; i < chief_max_pipes; i++) {
+        dev_ext->fanouts[i] = nullptr;
+    }
+}
+
+NTSTATUS fanout_subscribe(PDEVICE_OBJECT DeviceObject, ULONG PipeIndex, fanout_subscriber*& OutSubscriber) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // we only keep a fan-out for the first pipes
+    if (PipeIndex >= chief_max_pipes) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    fanout_subscriber* subscriber = reinterpret_cast<fanout_subscriber*>(ExAllocatePoolWithTag(
+        NonPagedPool,
+        sizeof(fanout_subscriber),
+        0x206D6457u
+    ));
+
+    // check if we got memory
+    if (!subscriber) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    memset(subscriber, 0x00, sizeof(fanout_subscriber));
+
+    irp_queue_init(subscriber->reads, DeviceObject);
+    subscriber->policy = chief_fanout_lossy;
+    subscriber->depth = get_tunables().fanout_depth;
+
+    ExAcquireFastMutex(&dev_ext->fanout_lock);
+
+    fanout_hub* hub = dev_ext->fanouts[PipeIndex];
+
+    if (!hub) {
+        // the hub owns the pipe the same way a normal handle does. The
+        // count is incremented first so a revoke never sees a claimed
+        // pipe that is not counted
+        ULONG epoch = 0;
+        increment_active_pipe_count(DeviceObject);
+
+        // the pipe can not be read by a normal handle at the same time
+        if (!pipe_claim(DeviceObject, PipeIndex, epoch)) {
+            decrement_active_pipe_count(DeviceObject);
+
+            ExReleaseFastMutex(&dev_ext->fanout_lock);
+            ExFreePool(subscriber);
+
+            return STATUS_SHARING_VIOLATION;
+        }
+
+        hub = fanout_create_hub(DeviceObject, PipeIndex);
+
+        if (!hub) {
+            if (pipe_release(DeviceObject, PipeIndex, epoch)) {
+                decrement_active_pipe_count(DeviceObject);
+            }
+
+            ExReleaseFastMutex(&dev_ext->fanout_lock);
+            ExFreePool(subscriber);
+
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        hub->pipe_epoch = epoch;
+        dev_ext->fanouts[PipeIndex] = hub;
+    }
+
+    subscriber->hub = hub;
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&hub->lock, &irql);
+
+    InsertTailList(&hub->subscribers, &subscriber->entry);
+    hub->subscriber_count++;
+
+    // start the pump for the first handle or again after a error
+    if (!hub->running && !hub->held) {
+        hub->held = fanout_pump_depth;
+        hub->error = STATUS_SUCCESS;
+    }
+
+    // release the spinlock
+    KeReleaseSpinLock(&hub->lock, irql);
+
+    ExReleaseFastMutex(&dev_ext->fanout_lock);
+
+    fanout_resume(hub);
+
+    OutSubscriber = subscriber;
+
+    return STATUS_SUCCESS;
+}
+
+void fanout_unsubscribe(PDEVICE_OBJECT DeviceObject, fanout_subscriber* Subscriber) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    ExAcquireFastMutex(&dev_ext->fanout_lock);
+
+    fanout_hub* hub = Subscriber->hub;
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&hub->lock, &irql);
+
+    RemoveEntryList(&Subscriber->entry);
+
+    // drop the buffers nobody is going to read
+    while (Subscriber->count) {
+        fanout_release(fanout_take_buffer(*Subscriber));
+    }
+
+    const bool last = !--hub->subscriber_count;
+
+    if (last) {
+        hub->stopping = true;
+    }
+
+    // release the spinlock
+    KeReleaseSpinLock(&hub->lock, irql);
+
+    // the reads are done before the handle is closed. Cancel any
+    // read that is still left
+    PIRP irp;
+
+    while ((irp = irp_queue_remove(Subscriber->reads)) != nullptr) {
+        irp->IoStatus.Status = STATUS_CANCELLED;
+        irp->IoStatus.Information = 0;
+
+        IofCompleteRequest(irp, IO_NO_INCREMENT);
+    }
+
+    if (!last) {
+        // the handle could have been the one that held the pump. The
+        // mutex keeps the last handle from freeing the hub meanwhile
+        fanout_resume(hub);
+        ExReleaseFastMutex(&dev_ext->fanout_lock);
+    }
+    else {
+        // abort the transfers until every slot is stopped. A slot that
+        // was restarted while we aborted is caught by the next abort
+        LARGE_INTEGER timeout;
+        timeout.QuadPart = -10 * 1000 * 100;
+
+        while (KeWaitForSingleObject(&hub->idle, Executive, KernelMode, false, &timeout) == STATUS_TIMEOUT) {
+            usb_abort_single_pipe(DeviceObject, hub->pipe_handle);
+        }
+
+        // release the pipe the same way a normal handle does
+        if (pipe_release(DeviceObject, hub->pipe_index, hub->pipe_epoch)) {
+            decrement_active_pipe_count(DeviceObject);
+        }
+
+        dev_ext->fanouts[hub->pipe_index] = nullptr;
+
+        ExReleaseFastMutex(&dev_ext->fanout_lock);
+
+        fanout_free_hub(hub);
+    }
+
+    ExFreePool(Subscriber);
+}
+
+static void fanout_drop_held(fanout_hub* Hub) {
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&Hub->lock, &irql);
+
+    // the held slots are never started again on this pipe handle
+    if (Hub->held && !Hub->stopping && NT_SUCCESS(Hub->error)) {
+        Hub->error = STATUS_DEVICE_NOT_CONNECTED;
+    }
+
+    Hub->held = 0;
+
+    const bool failed = !Hub->running && !Hub->stopping && !NT_SUCCESS(Hub->error);
+
+    // release the spinlock
+    KeReleaseSpinLock(&Hub->lock, irql);
+
+    if (failed) {
+        fanout_fail_reads(Hub);
+    }
+}
+
+void fanout_device_state_changed(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    const device_state state = get_device_state(DeviceObject);
+
+    // nothing changes while a query can still be canceled
+    if (state == device_state::stop_pending || state == device_state::remove_pending) {
+        return;
+    }
+
+    // the mutex keeps the last handle from freeing a hub meanwhile
+    ExAcquireFastMutex(&dev_ext->fanout_lock);
+
+    for (ULONG i = 0; i < chief_max_pipes; i++) {
+        if (!dev_ext->fanouts[i]) {
+            continue;
+        }
+
+        if (state == device_state::started) {
+            fanout_resume(dev_ext->fanouts[i]);
+        }
+        else {
+            fanout_drop_held(dev_ext->fanouts[i]);
+        }
+    }
+
+    ExReleaseFastMutex(&dev_ext->fanout_lock);
+}
+
+NTSTATUS fanout_read(fanout_subscriber* Subscriber, PIRP Irp, bool Framed) {
+    fanout_hub* hub = Subscriber->hub;
+
+    // a framed read needs space for the header and at least one byte of data
+    const ULONG length = Irp->MdlAddress ? MmGetMdlByteCount(Irp->MdlAddress) : 0;
+
+    if (length <= (Framed ? sizeof(chief_read_frame_header) : 0)) {
+        Irp->IoStatus.Status = STATUS_INVALID_BUFFER_SIZE;
+        Irp->IoStatus.Information = 0;
+
+        IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+
+    // store the read mode with the read
+    Irp->Tail.Overlay.DriverContext[fanout_framed_index] = reinterpret_cast<PVOID>(static_cast<ULONG_PTR>(Framed));
+
+    // queue the read. This marks the irp as pending
+    irp_queue_insert(Subscriber->reads, Irp);
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&hub->lock, &irql);
+
+    const bool failed = !hub->running && !hub->held && !NT_SUCCESS(hub->error);
+
+    // release the spinlock
+    KeReleaseSpinLock(&hub->lock, irql);
+
+    // complete the read with a buffer that is already queued
+    fanout_dispatch(hub);
+
+    // the pump stopped on a error. Nothing is going to come
+    if (failed) {
+        fanout_fail_reads(hub);
+    }
+
+    return STATUS_PENDING;
+}
+
+NTSTATUS fanout_configure(fanout_subscriber* Subscriber, const usb_chief_fanout_config& Config) {
+    // check if the policy and the depth are valid
+    if (Config.policy > chief_fanout_blocking || Config.depth > chief_max_fanout_depth) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    fanout_hub* hub = Subscriber->hub;
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&hub->lock, &irql);
+
+    Subscriber->policy = Config.policy;
+    Subscriber->depth = Config.depth ? Config.depth : get_tunables().fanout_depth;
+
+    // release the spinlock
+    KeReleaseSpinLock(&hub->lock, irql);
+
+    // a handle that is not blocking anymore can release the pump
+    fanout_resume(hub);
+
+    return STATUS_SUCCESS;
+}
+
+void fanout_get_stats(fanout_subscriber* Subscriber, usb_chief_fanout_stats& OutStats) {
+    fanout_hub* hub = Subscriber->hub;
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&hub->lock, &irql);
+
+    OutStats.delivered = Subscriber->delivered;
+    OutStats.dropped = Subscriber->dropped;
+    OutStats.queued = Subscriber->count;
+    OutStats.subscribers = hub->subscriber_count;
+
+    // release the spinlock
+    KeReleaseSpinLock(&hub->lock, irql);
+}
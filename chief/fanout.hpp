@@ -0,0 +1,211 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+    #include <usb.h>
+    #include <usbdi.h>
+}
+
+#include "ioctl.hpp"
+#include "irp_queue.hpp"
+
+// the amount of transfers the driver keeps in flight on a fan-out pipe
+constexpr static ULONG fanout_pump_depth = 4;
+
+// the default amount of buffers queued for a handle. Can be changed
+// with the tunables
+constexpr static ULONG fanout_default_depth = 16;
+
+struct fanout_hub;
+
+/**
+ * @brief Buffer with the data of a single transfer. Shared by all
+ * the handles on the pipe and freed when the last reference is
+ * released
+ *
+ */
+struct fanout_buffer {
+    // amount of references. One for every handle that has the
+    // buffer queued and one for the transfer
+    volatile LONG references;
+
+    // the hub the buffer is allocated from
+    fanout_hub* hub;
+
+    // performance counter value when the transfer completed
+    LONGLONG timestamp;
+
+    // the status of the transfer (USBD_STATUS)
+    LONG status;
+
+    // the amount of data in the buffer
+    ULONG length;
+
+    // the data. The size is the transfer size of the hub
+    UCHAR data[1];
+};
+
+/**
+ * @brief A handle opened on the fan-out of a pipe
+ *
+ */
+struct fanout_subscriber {
+    // entry in the subscriber list of the hub
+    LIST_ENTRY entry;
+
+    // the hub of the pipe
+    fanout_hub* hub;
+
+    // reads that wait for a buffer
+    irp_queue reads;
+
+    // the chief_fanout_policy and the amount of buffers we queue
+    ULONG policy;
+    ULONG depth;
+
+    // the queued buffers. Protected by the lock of the hub. Has room
+    // for the transfers that complete after a blocking handle is full
+    fanout_buffer* buffers[chief_max_fanout_depth + fanout_pump_depth];
+    ULONG head;
+    ULONG count;
+
+    // statistics. Protected by the lock of the hub
+    ULONGLONG delivered;
+    ULONGLONG dropped;
+};
+
+/**
+ * @brief A driver owned transfer of the pump
+ *
+ */
+struct fanout_slot {
+    // the hub of the slot
+    fanout_hub* hub;
+
+    // the irp and the urb we reuse for every transfer
+    PIRP irp;
+    _URB_BULK_OR_INTERRUPT_TRANSFER urb;
+
+    // the buffer the current transfer reads into
+    fanout_buffer* buffer;
+
+    // dpc that sends the next transfer. The completion routine and 
+    // the resume do not call the usb stack themselves so the 
+    // transfers can not nest when they complete right away
+    KDPC dpc;
+
+    // true while the transfer is with the usb stack
+    bool busy;
+};
+
+/**
+ * @brief Fan-out of a bulk in pipe. The driver reads the pipe and
+ * gives every completed buffer to all the handles
+ *
+ */
+struct fanout_hub {
+    // spinlock to protect the subscribers and the slots
+    KSPIN_LOCK lock;
+
+    // the device and the pipe we read
+    PDEVICE_OBJECT device_object;
+    ULONG pipe_index;
+    USBD_PIPE_HANDLE pipe_handle;
+
+    // the epoch of the claim on the pipe
+    ULONG pipe_epoch;
+
+    // the size of every transfer
+    ULONG transfer_size;
+
+    // the handles on the pipe
+    LIST_ENTRY subscribers;
+    ULONG subscriber_count;
+
+    // the buffers of the transfers
+    NPAGED_LOOKASIDE_LIST buffers;
+
+    // the transfers of the pump
+    fanout_slot slots[fanout_pump_depth];
+
+    // amount of slots with the usb stack and slots that wait for
+    // a blocking handle or for a canceled query stop or remove
+    ULONG running;
+    ULONG held;
+
+    // true when the last handle is closed
+    bool stopping;
+
+    // the error that stopped the pump
+    NTSTATUS error;
+
+    // signaled when no slot is with the usb stack
+    KEVENT idle;
+};
+
+/**
+ * @brief Initialize the fan-out of all the pipes
+ *
+ * @param DeviceObject
+ */
+void fanout_init(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Add a handle to the fan-out of a pipe. Starts reading the
+ * pipe for the first handle. Should be called at passive level
+ *
+ * @param DeviceObject
+ * @param PipeIndex should be a bulk in pipe
+ * @param OutSubscriber
+ * @return NTSTATUS
+ */
+NTSTATUS fanout_subscribe(PDEVICE_OBJECT DeviceObject, ULONG PipeIndex, fanout_subscriber*& OutSubscriber);
+
+/**
+ * @brief Remove a handle from the fan-out and free it. Stops reading
+ * the pipe after the last handle. Should be called at passive level
+ *
+ * @param DeviceObject
+ * @param Subscriber
+ */
+void fanout_unsubscribe(PDEVICE_OBJECT DeviceObject, fanout_subscriber* Subscriber);
+
+/**
+ * @brief Update the pumps after a pnp state change. The held transfers
+ * start again when the device is started, when it is stopped or gone
+ * the pumps stop with a error and the waiting reads fail. Should be
+ * called at passive level after a query is canceled and when the
+ * device is stopped or removed
+ *
+ * @param DeviceObject
+ */
+void fanout_device_state_changed(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Read the next buffer of a handle. Completes the irp or
+ * queues it until a buffer is available
+ *
+ * @param Subscriber
+ * @param Irp
+ * @param Framed true when a chief_read_frame_header is returned
+ * in front of the data
+ * @return NTSTATUS
+ */
+NTSTATUS fanout_read(fanout_subscriber* Subscriber, PIRP Irp, bool Framed);
+
+/**
+ * @brief Change the policy of a handle
+ *
+ * @param Subscriber
+ * @param Config
+ * @return NTSTATUS
+ */
+NTSTATUS fanout_configure(fanout_subscriber* Subscriber, const usb_chief_fanout_config& Config);
+
+/**
+ * @brief Get the statistics of a handle
+ *
+ * @param Subscriber
+ * @param OutStats
+ */
+void fanout_get_stats(fanout_subscriber* Subscriber, usb_chief_fanout_stats& OutStats);
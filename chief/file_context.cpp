@@ -0,0 +1,202 @@
+#include "file_context.hpp"
+#include "batch.hpp"
+
+chief_file_context* file_context_create() {
+    // allocate the context
+    chief_file_context* context = reinterpret_cast<chief_file_context*>(ExAllocatePoolWithTag(
+        NonPagedPool,
+        sizeof(chief_file_context),
+        0x206D6457u
+    ));
+
+    // check if we got memory
+    if (!context) {
+        return nullptr;
+    }
+
+    // clear the context. This sets the raw read mode
+    memset(context, 0x00, sizeof(chief_file_context));
+
+    // reads are not filtered until a trigger is set
+    trigger_init(context->trigger);
+
+    // no buffers are registered
+    KeInitializeSpinLock(&context->buffers_lock);
+    KeInitializeEvent(&context->buffers_idle, NotificationEvent, true);
+
+    return context;
+}
+
+static void file_context_free_buffers(registered_buffer* Buffers, ULONG Count) {
+    for (ULONG i = 0; i < Count; i++) {
+        // unlock the pages before the mdl is freed
+        MmUnlockPages(Buffers[i].mdl);
+        IoFreeMdl(Buffers[i].mdl);
+    }
+}
+
+void file_context_free(chief_file_context* Context) {
+    if (Context) {
+        // the handle is closed, no transfer can use the buffers anymore
+        file_context_free_buffers(Context->buffers, Context->buffer_count);
+
+        // the cleanup waited for the batch transfers
+        batch_free(Context->batch);
+
+        ExFreePool(Context);
+    }
+}
+
+chief_file_context* get_file_context(PFILE_OBJECT File) {
+    // check if we have a file
+    if (!File) {
+        return nullptr;
+    }
+
+    return reinterpret_cast<chief_file_context*>(File->FsContext2);
+}
+
+NTSTATUS file_context_register_buffers(chief_file_context* Context, const usb_chief_register_buffers& Request, KPROCESSOR_MODE RequestorMode) {
+    // check if we have a valid amount of buffers
+    if (!Request.count || Request.count > chief_max_registered_buffers || Request.reserved) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // validate all the buffers before we lock anything
+    for (ULONG i = 0; i < Request.count; i++) {
+        const usb_chief_registered_buffer& buffer = Request.buffers[i];
+
+        if (!buffer.data || !buffer.length || buffer.length > chief_max_registered_length || buffer.reserved) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    registered_buffer buffers[chief_max_registered_buffers] = {};
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG count = 0;
+
+    // lock every buffer in memory. This is the probe and lock the
+    // io manager does for every direct io transfer, we only do it
+    // once for all the transfers on the buffer
+    for (; count < Request.count; count++) {
+        const usb_chief_registered_buffer& buffer = Request.buffers[count];
+
+        buffers[count].length = buffer.length;
+        buffers[count].mdl = IoAllocateMdl(buffer.data, buffer.length, false, false, nullptr);
+
+        if (!buffers[count].mdl) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        // the buffer is used for reads and writes
+        __try {
+            MmProbeAndLockPages(buffers[count].mdl, RequestorMode, IoWriteAccess);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            status = GetExceptionCode();
+        }
+
+        if (!NT_SUCCESS(status)) {
+            IoFreeMdl(buffers[count].mdl);
+            break;
+        }
+    }
+
+    if (NT_SUCCESS(status)) {
+        KIRQL irql;
+        KeAcquireSpinLock(&Context->buffers_lock, &irql);
+
+        // only one set of buffers can be registered at a time
+        if (Context->buffer_count) {
+            status = STATUS_DEVICE_BUSY;
+        }
+        else {
+            memcpy(Context->buffers, buffers, sizeof(registered_buffer) * count);
+            Context->buffer_count = count;
+            Context->buffer_owner = PsGetCurrentProcess();
+        }
+
+        KeReleaseSpinLock(&Context->buffers_lock, irql);
+    }
+
+    // unlock what we locked when we failed
+    if (!NT_SUCCESS(status)) {
+        file_context_free_buffers(buffers, count);
+    }
+
+    return status;
+}
+
+NTSTATUS file_context_unregister_buffers(chief_file_context* Context) {
+    registered_buffer buffers[chief_max_registered_buffers];
+    ULONG count = 0;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&Context->buffers_lock, &irql);
+
+    // the buffers stay registered while a transfer uses them
+    if (Context->buffer_transfers) {
+        KeReleaseSpinLock(&Context->buffers_lock, irql);
+
+        return STATUS_DEVICE_BUSY;
+    }
+
+    // take the buffers so we can unlock them without the spinlock
+    count = Context->buffer_count;
+    memcpy(buffers, Context->buffers, sizeof(registered_buffer) * count);
+
+    Context->buffer_count = 0;
+    Context->buffer_owner = nullptr;
+
+    KeReleaseSpinLock(&Context->buffers_lock, irql);
+
+    file_context_free_buffers(buffers, count);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS file_context_acquire_buffer(chief_file_context* Context, const usb_chief_registered_transfer& Transfer, PMDL& OutMdl, PVOID& OutAddress) {
+    NTSTATUS status = STATUS_SUCCESS;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&Context->buffers_lock, &irql);
+
+    if (Transfer.slot >= Context->buffer_count || Context->buffer_owner != PsGetCurrentProcess()) {
+        // the slot is not registered by this process
+        status = STATUS_INVALID_HANDLE;
+    }
+    else if (!Transfer.length || Transfer.reserved || Transfer.offset >= Context->buffers[Transfer.slot].length ||
+        Transfer.length > (Context->buffers[Transfer.slot].length - Transfer.offset)) 
+    {
+        // the part should be inside the buffer
+        status = STATUS_INVALID_PARAMETER;
+    }
+    else {
+        const registered_buffer& buffer = Context->buffers[Transfer.slot];
+
+        OutMdl = buffer.mdl;
+        OutAddress = reinterpret_cast<UCHAR*>(MmGetMdlVirtualAddress(buffer.mdl)) + Transfer.offset;
+
+        // the first transfer keeps the buffers registered
+        if (!Context->buffer_transfers++) {
+            KeClearEvent(&Context->buffers_idle);
+        }
+    }
+
+    KeReleaseSpinLock(&Context->buffers_lock, irql);
+
+    return status;
+}
+
+void file_context_release_buffer(chief_file_context* Context) {
+    KIRQL irql;
+    KeAcquireSpinLock(&Context->buffers_lock, &irql);
+
+    // wake up the cleanup when this was the last transfer
+    if (!--Context->buffer_transfers) {
+        KeSetEvent(&Context->buffers_idle, IO_NO_INCREMENT, false);
+    }
+
+    KeReleaseSpinLock(&Context->buffers_lock, irql);
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+    #include <usb.h>
+}
+
+#include "ioctl.hpp"
+#include "trigger.hpp"
+
+struct fanout_subscriber;
+struct batch_queue;
+
+/**
+ * @brief A application buffer that is locked in memory for the
+ * transfers of a handle
+ *
+ */
+struct registered_buffer {
+    // the locked mdl of the buffer
+    PMDL mdl;
+
+    // the size of the buffer
+    ULONG length;
+};
+
+/**
+ * @brief Context for every handle that is opened on a pipe. Stored
+ * in the FsContext2 field of the file object
+ *
+ */
+struct chief_file_context {
+    // the chief_read_mode flags of this handle
+    ULONG read_mode;
+
+    // the index of the pipe the handle is opened on
+    ULONG pipe_index;
+
+    // true when the handle owns the pipe and the epoch of the claim. 
+    // Only a fan-out handle does not own it, the fan-out does
+    bool pipe_owner;
+    ULONG pipe_epoch;
+
+    // the trigger filter for the reads on this handle
+    trigger_filter trigger;
+
+    // the fan-out of the pipe when the handle is opened with the 
+    // \FANOUT suffix. nullptr for a normal handle
+    fanout_subscriber* subscriber;
+
+    // spinlock to protect the registered buffers
+    KSPIN_LOCK buffers_lock;
+
+    // the registered buffers and the process that registered them. 
+    // The buffers can only be used from the same process
+    registered_buffer buffers[chief_max_registered_buffers];
+    ULONG buffer_count;
+    PEPROCESS buffer_owner;
+
+    // the amount of transfers that use a registered buffer. The 
+    // buffers cannot be unregistered while this is not 0
+    ULONG buffer_transfers;
+
+    // signaled when no transfer uses a registered buffer
+    KEVENT buffers_idle;
+
+    // the batch transfers of the handle. Created with the first batch
+    batch_queue* batch;
+};
+
+/**
+ * @brief Allocate a new file context
+ *
+ * @return chief_file_context*
+ */
+chief_file_context* file_context_create();
+
+/**
+ * @brief Free a file context
+ *
+ * @param Context
+ */
+void file_context_free(chief_file_context* Context);
+
+/**
+ * @brief Get the file context of a file object. Returns a nullptr
+ * when the file is not opened on a pipe
+ *
+ * @param File
+ * @return chief_file_context*
+ */
+chief_file_context* get_file_context(PFILE_OBJECT File);
+
+/**
+ * @brief Lock the buffers of the application in memory and register
+ * them on the handle. Should be called at passive level in the 
+ * context of the process that owns the buffers
+ *
+ * @param Context
+ * @param Request
+ * @param RequestorMode
+ * @return NTSTATUS STATUS_DEVICE_BUSY when buffers are already registered
+ */
+NTSTATUS file_context_register_buffers(chief_file_context* Context, const usb_chief_register_buffers& Request, KPROCESSOR_MODE RequestorMode);
+
+/**
+ * @brief Unlock and unregister the buffers of the handle. Should be
+ * called at passive level
+ *
+ * @param Context
+ * @return NTSTATUS STATUS_DEVICE_BUSY when a transfer uses a buffer
+ */
+NTSTATUS file_context_unregister_buffers(chief_file_context* Context);
+
+/**
+ * @brief Get a part of a registered buffer for a transfer. The buffer
+ * cannot be unregistered until the transfer releases it with 
+ * file_context_release_buffer
+ *
+ * @param Context
+ * @param Transfer
+ * @param OutMdl the locked mdl of the whole buffer
+ * @param OutAddress the address of the part in the buffer
+ * @return NTSTATUS
+ */
+NTSTATUS file_context_acquire_buffer(chief_file_context* Context, const usb_chief_registered_transfer& Transfer, PMDL& OutMdl, PVOID& OutAddress);
+
+/**
+ * @brief Release a buffer that was acquired for a transfer. Can be
+ * called at dispatch level
+ *
+ * @param Context
+ */
+void file_context_release_buffer(chief_file_context* Context);
@@ -0,0 +1,1025 @@
+#pragma once
+
+/**
+ * @brief Ioctl codes and payloads shared with the application. This
+ * header does not depend on any kernel headers so it can also be
+ * used from user mode
+ *
+ */
+
+// the device type used for all the ioctls (FILE_DEVICE_USB)
+constexpr static unsigned long chief_ioctl_device_type = 0x22;
+
+/**
+ * @brief Create a ioctl code. Same as CTL_CODE with FILE_DEVICE_USB
+ * and FILE_ANY_ACCESS
+ *
+ * @param function
+ * @param method
+ * @return unsigned long
+ */
+constexpr unsigned long chief_ioctl_code(unsigned long function, unsigned long method = 0) {
+    return (chief_ioctl_device_type << 16) | (function << 2) | method;
+}
+
+// ioctls used by the original software
+constexpr static unsigned long ioctl_vendor_send = chief_ioctl_code(0); // 0x220000
+constexpr static unsigned long ioctl_vendor_receive = chief_ioctl_code(1); // 0x220004
+constexpr static unsigned long ioctl_set_alternate_setting = chief_ioctl_code(2); // 0x220008
+constexpr static unsigned long ioctl_get_bcd_usb = chief_ioctl_code(3); // 0x22000c
+
+// ioctls for the cached status poller
+constexpr static unsigned long ioctl_configure_status_poll = chief_ioctl_code(4); // 0x220010
+constexpr static unsigned long ioctl_get_cached_status = chief_ioctl_code(5); // 0x220014
+
+// ioctl to download a firmware/fpga image in chunks
+constexpr static unsigned long ioctl_download_image = chief_ioctl_code(6); // 0x220018
+
+// ioctls for the framed read mode and the timestamps. The
+// read mode is set on a pipe handle
+constexpr static unsigned long ioctl_set_read_mode = chief_ioctl_code(7); // 0x22001c
+constexpr static unsigned long ioctl_get_clock_info = chief_ioctl_code(8); // 0x220020
+
+// ioctl to get the statistics of the transfer scheduler
+constexpr static unsigned long ioctl_get_scheduler_stats = chief_ioctl_code(9); // 0x220024
+
+// ioctls for the per pipe transfer sizing and statistics
+constexpr static unsigned long ioctl_configure_pipe_sizing = chief_ioctl_code(10); // 0x220028
+constexpr static unsigned long ioctl_get_pipe_stats = chief_ioctl_code(11); // 0x22002c
+
+// ioctls for the urb tap
+constexpr static unsigned long ioctl_configure_tap = chief_ioctl_code(12); // 0x220030
+constexpr static unsigned long ioctl_drain_tap = chief_ioctl_code(13); // 0x220034
+
+// ioctls for the request recorder
+constexpr static unsigned long ioctl_configure_trace = chief_ioctl_code(14); // 0x220038
+constexpr static unsigned long ioctl_drain_trace = chief_ioctl_code(15); // 0x22003c
+
+// ioctl to set the trigger filter of a pipe handle
+constexpr static unsigned long ioctl_set_trigger = chief_ioctl_code(16); // 0x220040
+
+// ioctls for the fan-out handles (\PIPEnn\FANOUT)
+constexpr static unsigned long ioctl_configure_fanout = chief_ioctl_code(17); // 0x220044
+constexpr static unsigned long ioctl_get_fanout_stats = chief_ioctl_code(18); // 0x220048
+
+// ioctls to read and change the tunables of the driver
+constexpr static unsigned long ioctl_get_tunables = chief_ioctl_code(19); // 0x22004c
+constexpr static unsigned long ioctl_set_tunables = chief_ioctl_code(20); // 0x220050
+
+// ioctl to get the statistics of the hung device watchdog
+constexpr static unsigned long ioctl_get_watchdog_stats = chief_ioctl_code(21); // 0x220054
+
+// ioctls for the registered buffers of a pipe handle. The transfers
+// on a registered buffer return the amount of data in the bytes
+// returned and should not have a output buffer
+constexpr static unsigned long ioctl_register_buffers = chief_ioctl_code(22); // 0x220058
+constexpr static unsigned long ioctl_unregister_buffers = chief_ioctl_code(23); // 0x22005c
+constexpr static unsigned long ioctl_read_registered = chief_ioctl_code(24); // 0x220060
+constexpr static unsigned long ioctl_write_registered = chief_ioctl_code(25); // 0x220064
+
+// ioctls to submit many transfers on registered buffers at once and 
+// to get their results
+constexpr static unsigned long ioctl_submit_batch = chief_ioctl_code(26); // 0x220068
+constexpr static unsigned long ioctl_reap_batch = chief_ioctl_code(27); // 0x22006c
+
+// ioctl that waits for the next device event
+constexpr static unsigned long ioctl_wait_event = chief_ioctl_code(28); // 0x220070
+
+// ioctl to get the statistics of the vendor requests for every 
+// request code
+constexpr static unsigned long ioctl_get_vendor_stats = chief_ioctl_code(29); // 0x220074
+
+/**
+ * @brief Payload we are receiving/sending from the
+ * application in a mj device control
+ *
+ */
+struct usb_chief_vendor_request {
+    // usb request fields. Is sometimes used as input
+    // and as output
+    unsigned short request;
+
+    // usb specific fields
+    unsigned short value;
+    unsigned short index;
+
+    // length of the data buffer
+    unsigned short length;
+
+    // pointer to the data buffer
+    void *data;
+};
+
+// the maximum amount of vendor status reads the driver can poll
+constexpr static unsigned long chief_max_status_entries = 8;
+
+// the maximum length of a single vendor status read
+constexpr static unsigned long chief_max_status_length = 64;
+
+// the minimum and maximum poll interval in milliseconds
+constexpr static unsigned long chief_min_status_interval = 1;
+constexpr static unsigned long chief_max_status_interval = 60000;
+
+/**
+ * @brief A single vendor IN request the driver should poll
+ *
+ */
+struct usb_chief_status_entry {
+    // usb request fields
+    unsigned short request;
+    unsigned short value;
+    unsigned short index;
+
+    // amount of bytes to read. Should not be more than
+    // chief_max_status_length
+    unsigned short length;
+};
+
+/**
+ * @brief Input for ioctl_configure_status_poll
+ *
+ */
+struct usb_chief_status_poll_config {
+    // the poll interval in milliseconds. A interval of 0
+    // stops the poller and clears the cache
+    unsigned long interval;
+
+    // amount of valid entries
+    unsigned long count;
+
+    // the vendor requests to poll
+    usb_chief_status_entry entries[chief_max_status_entries];
+};
+
+/**
+ * @brief Output for ioctl_get_cached_status. The input is
+ * a usb_chief_status_entry with the request, value and index
+ * of a polled request
+ *
+ */
+struct usb_chief_cached_status {
+    // status of the last poll (NTSTATUS)
+    long status;
+
+    // non zero when the data is valid. The data is invalid
+    // until the first poll after a configuration change or
+    // after a vendor OUT request
+    unsigned short valid;
+
+    // amount of valid bytes in the data
+    unsigned short length;
+
+    // incremented on every successful poll of this entry
+    unsigned long sequence;
+
+    // the data we got from the device
+    unsigned char data[chief_max_status_length];
+};
+
+// the maximum amount of bytes in a single chunk of a image download
+constexpr static unsigned long chief_max_image_chunk_length = 4096;
+
+// flags for a image download
+enum chief_image_flags : unsigned short {
+    // use the value (low part) and index (high part) as a 32-bit
+    // byte address that is incremented with the chunk length
+    // after every chunk. The value and index step are ignored
+    chief_image_flag_address = (1 << 0),
+};
+
+/**
+ * @brief Input and output for ioctl_download_image. The image is
+ * sent as back to back vendor OUT requests of chunk_length bytes
+ * (the last chunk can be shorter)
+ *
+ */
+struct usb_chief_image_download {
+    // the vendor request code used for every chunk
+    unsigned short request;
+
+    // the value and index of the first chunk
+    unsigned short value;
+    unsigned short index;
+
+    // the amount of bytes per chunk. Should not be more than
+    // chief_max_image_chunk_length
+    unsigned short chunk_length;
+
+    // added to the value and index after every chunk
+    unsigned short value_step;
+    unsigned short index_step;
+
+    // chief_image_flags
+    unsigned short flags;
+
+    // reserved. Should be 0
+    unsigned short reserved;
+
+    // the length of the image
+    unsigned long length;
+
+    // pointer to the image
+    const void *data;
+
+    // output. The amount of bytes that are sent to the device. When
+    // the download failed this is the offset of the failing chunk
+    unsigned long transferred;
+
+    // output. The result of the download (NTSTATUS)
+    long status;
+};
+
+// read modes for a pipe handle
+enum chief_read_mode : unsigned long {
+    // the read returns the raw data of the transfer
+    chief_read_mode_raw = 0,
+
+    // the read returns a chief_read_frame_header followed by
+    // the data of the transfer
+    chief_read_mode_framed = (1 << 0),
+
+    // the frame header has the crc32c of the data. Only valid
+    // together with chief_read_mode_framed
+    chief_read_mode_crc = (1 << 1),
+};
+
+// flags in the frame header
+enum chief_frame_flags : unsigned long {
+    // the crc field has the crc32c of the data
+    chief_frame_crc = (1 << 0),
+};
+
+/**
+ * @brief Input for ioctl_set_read_mode
+ *
+ */
+struct usb_chief_read_mode {
+    // chief_read_mode flags
+    unsigned long mode;
+};
+
+/**
+ * @brief Header in front of every read in the framed read mode
+ *
+ */
+struct chief_read_frame_header {
+    // performance counter value when the transfer completed
+    unsigned long long timestamp;
+
+    // the amount of data bytes after this header
+    unsigned long length;
+
+    // the status of the transfer (USBD_STATUS)
+    long status;
+
+    // the crc32c of the data after this header. Only valid when
+    // flags has chief_frame_crc
+    unsigned long crc;
+
+    // chief_frame_flags
+    unsigned long flags;
+};
+
+/**
+ * @brief Output for ioctl_get_clock_info. All the values are
+ * sampled together so the application can convert the frame
+ * timestamps to system time
+ *
+ */
+struct usb_chief_clock_info {
+    // the performance counter frequency in counts per second
+    unsigned long long frequency;
+
+    // the performance counter value. Counts since boot
+    unsigned long long counter;
+
+    // the system time in 100ns units since January 1, 1601
+    unsigned long long system_time;
+
+    // the interrupt time in 100ns units since boot
+    unsigned long long interrupt_time;
+};
+
+// the classes of transfers the driver schedules separately
+enum chief_transfer_class : unsigned long {
+    // vendor and descriptor requests on the default pipe
+    chief_transfer_control = 0,
+
+    // transfers on a interrupt pipe
+    chief_transfer_interrupt,
+
+    // transfers on a bulk pipe
+    chief_transfer_bulk,
+
+    // amount of transfer classes. Not a valid class
+    chief_transfer_class_count
+};
+
+/**
+ * @brief Statistics of a single transfer class
+ *
+ */
+struct usb_chief_queue_stats {
+    // the amount of transfers the usb stack is processing
+    unsigned long outstanding;
+
+    // the maximum amount of outstanding transfers
+    unsigned long budget;
+
+    // the amount of transfers waiting in the driver
+    unsigned long depth;
+
+    // the highest depth since the device was added
+    unsigned long max_depth;
+
+    // the amount of transfers sent to the usb stack
+    unsigned long long submitted;
+
+    // the amount of transfers that had to wait in the driver
+    unsigned long long queued;
+
+    // the total and maximum time transfers waited in the
+    // driver in performance counter ticks
+    unsigned long long total_wait;
+    unsigned long long max_wait;
+};
+
+/**
+ * @brief Output for ioctl_get_scheduler_stats
+ *
+ */
+struct usb_chief_scheduler_stats {
+    // the statistics for every chief_transfer_class
+    usb_chief_queue_stats classes[chief_transfer_class_count];
+};
+
+// the maximum amount of pipes the driver keeps statistics for
+constexpr static unsigned long chief_max_pipes = 32;
+
+// the largest transfer size the adaptive sizing can pick
+constexpr static unsigned long chief_max_adaptive_size = 64 * 1024;
+
+// fixed point scale of the fill ratio. A ratio of 
+// chief_fill_ratio_scale means the transfers came back full
+constexpr static unsigned long chief_fill_ratio_scale = 256;
+
+// flags for the transfer sizing of a pipe
+enum chief_pipe_sizing_flags : unsigned long {
+    // size bulk in transfers based on how full the previous
+    // transfers came back instead of the size of the user buffer
+    chief_pipe_sizing_adaptive = 1 << 0,
+};
+
+/**
+ * @brief Input for ioctl_configure_pipe_sizing. The sizes are rounded
+ * to the maximum packet size of the pipe. A size of zero selects
+ * the default bound of the pipe
+ *
+ */
+struct usb_chief_pipe_sizing {
+    // the index of the pipe
+    unsigned long pipe;
+
+    // chief_pipe_sizing_flags
+    unsigned long flags;
+
+    // the bounds of the transfer size in bytes
+    unsigned long min_size;
+    unsigned long max_size;
+};
+
+/**
+ * @brief Input and output for ioctl_get_pipe_stats. Only the pipe
+ * field is used as input
+ *
+ */
+struct usb_chief_pipe_stats {
+    // the index of the pipe
+    unsigned long pipe;
+
+    // the current chief_pipe_sizing_flags and bounds
+    unsigned long flags;
+    unsigned long min_size;
+    unsigned long max_size;
+
+    // the transfer size the adaptive sizing picked
+    unsigned long transfer_size;
+
+    // average fill ratio of the recent in transfers. Scaled
+    // with chief_fill_ratio_scale
+    unsigned long fill_ratio;
+
+    // the amount of completed transfers and bytes
+    unsigned long long transfers;
+    unsigned long long bytes;
+
+    // the amount of in transfers that came back short
+    unsigned long long short_transfers;
+
+    // the amount of transfers that failed
+    unsigned long long errors;
+
+    // the amount of bytes checked with a crc and the performance
+    // counter ticks it took. Used to get the cost of the crc mode
+    unsigned long long crc_bytes;
+    unsigned long long crc_ticks;
+};
+
+// the maximum amount of payload bytes stored with a tap record
+constexpr static unsigned long chief_max_tap_snapshot = 256;
+
+/**
+ * @brief Input for ioctl_configure_tap
+ *
+ */
+struct usb_chief_tap_config {
+    // 1 to record the urbs, 0 to stop recording
+    unsigned long enable;
+
+    // the amount of payload bytes to store with every record. 
+    // Limited to chief_max_tap_snapshot
+    unsigned long snapshot_length;
+};
+
+// flags for the info field of a tap record. Same as USBPcap
+enum chief_tap_info : unsigned char {
+    // the record is the completion of the urb
+    chief_tap_info_completion = 1 << 0,
+};
+
+// the transfer types of a tap record. Same as USBPcap
+enum chief_tap_transfer : unsigned char {
+    chief_tap_transfer_isochronous = 0,
+    chief_tap_transfer_interrupt = 1,
+    chief_tap_transfer_control = 2,
+    chief_tap_transfer_bulk = 3,
+
+    // urbs without data (select configuration, pipe requests)
+    chief_tap_transfer_irp_info = 0xfe,
+};
+
+/**
+ * @brief A single urb that was sent to or returned by the usb stack
+ *
+ */
+struct usb_chief_tap_record {
+    // performance counter value when the urb was sent or completed
+    unsigned long long timestamp;
+
+    // id of the urb. The same for the submit and the completion
+    unsigned long long irp_id;
+
+    // the usbd status. Only valid for completions
+    long status;
+
+    // the length of the transfer. Requested length on submit
+    // and the transferred length on completion
+    unsigned long length;
+
+    // the urb function
+    unsigned short function;
+
+    // chief_tap_info flags
+    unsigned char info;
+
+    // the endpoint address with the direction bit
+    unsigned char endpoint;
+
+    // the chief_tap_transfer type
+    unsigned char transfer;
+
+    // 1 when setup contains the setup packet of a control transfer
+    unsigned char setup_valid;
+
+    // amount of payload bytes in data
+    unsigned short captured;
+
+    // the setup packet of a control transfer
+    unsigned char setup[8];
+
+    // the payload. Out data is captured on the submit and in data 
+    // on the completion
+    unsigned char data[chief_max_tap_snapshot];
+};
+
+/**
+ * @brief Output of ioctl_drain_tap. Followed by count records
+ *
+ */
+struct usb_chief_tap_drain {
+    // amount of records following this header
+    unsigned long count;
+
+    // amount of records dropped since the last drain
+    unsigned long dropped;
+};
+
+// the maximum amount of vendor send bytes stored with a trace record
+constexpr static unsigned long chief_max_trace_data = 16;
+
+/**
+ * @brief Input for ioctl_configure_trace
+ *
+ */
+struct usb_chief_trace_config {
+    // 1 to record the requests, 0 to stop recording
+    unsigned long enable;
+};
+
+// the kind of request in a trace record
+enum chief_trace_major : unsigned char {
+    chief_trace_read = 0,
+    chief_trace_write = 1,
+    chief_trace_device_control = 2,
+
+    // a recovery of the watchdog. The request field has the 
+    // chief_watchdog_action, the value field the chief_watchdog_reason 
+    // and the length field the resulting NTSTATUS
+    chief_trace_recovery = 3,
+};
+
+/**
+ * @brief A single request the driver received from the application
+ *
+ */
+struct usb_chief_trace_record {
+    // performance counter value when the request arrived
+    unsigned long long timestamp;
+
+    // the ioctl code. 0 for reads and writes
+    unsigned long code;
+
+    // the length of the read or write or the length of the 
+    // vendor request data
+    unsigned long length;
+
+    // the vendor request fields
+    unsigned short request;
+    unsigned short value;
+    unsigned short index;
+
+    // chief_trace_major
+    unsigned char major;
+
+    // the pipe index of a read or write
+    unsigned char pipe;
+
+    // amount of vendor send bytes in data
+    unsigned char captured;
+    unsigned char reserved[7];
+
+    // the start of the data of a vendor send
+    unsigned char data[chief_max_trace_data];
+};
+
+/**
+ * @brief Output of ioctl_drain_trace. Followed by count records
+ *
+ */
+struct usb_chief_trace_drain {
+    // amount of records following this header
+    unsigned long count;
+
+    // amount of records dropped since the last drain
+    unsigned long dropped;
+};
+
+// the maximum amount of trigger patterns and the maximum pattern length
+constexpr static unsigned long chief_max_trigger_patterns = 4;
+constexpr static unsigned long chief_max_trigger_length = 16;
+
+/**
+ * @brief A single trigger pattern. A byte matches when 
+ * (data & mask) == (pattern & mask)
+ *
+ */
+struct usb_chief_trigger_pattern {
+    // the amount of bytes in the pattern
+    unsigned long length;
+
+    unsigned char pattern[chief_max_trigger_length];
+    unsigned char mask[chief_max_trigger_length];
+};
+
+/**
+ * @brief Input for ioctl_set_trigger. When a trigger is set, reads on
+ * the handle only return the data around a match of one of the
+ * patterns. Buffers without a match are not returned
+ *
+ */
+struct usb_chief_trigger_config {
+    // the amount of patterns. 0 disables the trigger
+    unsigned long count;
+
+    // the amount of bytes to return before the match. Limited
+    // to the data in the same buffer as the match
+    unsigned long pre_window;
+
+    // the amount of bytes to return after the match. Continues
+    // in the next transfers of the same read until its buffer is
+    // full
+    unsigned long post_window;
+
+    usb_chief_trigger_pattern patterns[chief_max_trigger_patterns];
+};
+
+// policies of a fan-out handle when it falls behind
+enum chief_fanout_policy : unsigned long {
+    // the oldest buffer of the handle is dropped
+    chief_fanout_lossy = 0,
+
+    // the pipe is not read until the handle catches up. This
+    // also stops the data for all the other handles
+    chief_fanout_blocking = 1,
+};
+
+// the maximum amount of buffers queued for a fan-out handle
+constexpr static unsigned long chief_max_fanout_depth = 64;
+
+/**
+ * @brief Input for ioctl_configure_fanout
+ *
+ */
+struct usb_chief_fanout_config {
+    // the chief_fanout_policy of the handle
+    unsigned long policy;
+
+    // the amount of buffers queued before the policy is used. 0
+    // selects the fanout_depth of the tunables (16 by default)
+    unsigned long depth;
+};
+
+/**
+ * @brief Output for ioctl_get_fanout_stats
+ *
+ */
+struct usb_chief_fanout_stats {
+    // the amount of buffers returned and dropped for this handle
+    unsigned long long delivered;
+    unsigned long long dropped;
+
+    // the amount of buffers waiting for a read
+    unsigned long queued;
+
+    // the amount of handles on the pipe
+    unsigned long subscribers;
+};
+
+// the parts of the driver that are traced when the device is added
+enum chief_trace_mask : unsigned long {
+    // the urb tap (ioctl_configure_tap)
+    chief_trace_mask_tap = 1 << 0,
+
+    // the request recorder (ioctl_configure_trace)
+    chief_trace_mask_requests = 1 << 1,
+};
+
+/**
+ * @brief Tunables of the driver. Loaded from the Parameters key of 
+ * the service when the driver is loaded and changed at runtime with 
+ * ioctl_set_tunables. The registry value names are in tunables.cpp
+ *
+ */
+struct usb_chief_tunables {
+    // the largest read or write that is accepted (MaxTransferSize)
+    unsigned long max_transfer_size;
+
+    // the largest transfer size of the adaptive sizing of a pipe. Used
+    // when a pipe is configured (MaxAdaptiveSize)
+    unsigned long max_adaptive_size;
+
+    // the maximum amount of outstanding interrupt and bulk 
+    // transfers (InterruptBudget, BulkBudget)
+    unsigned long interrupt_budget;
+    unsigned long bulk_budget;
+
+    // the default amount of buffers queued for a fan-out handle 
+    // (FanoutDepth)
+    unsigned long fanout_depth;
+
+    // the amount of free fan-out buffers kept in the pool. 0 lets
+    // the system decide. Used when a fan-out is started (FanoutPoolDepth)
+    unsigned long fanout_pool_depth;
+
+    // the chief_trace_mask of the tracing that is enabled (TraceMask)
+    unsigned long trace_mask;
+
+    // the amount of payload bytes stored with every tap record when
+    // the tap is enabled by the trace mask (TapSnapshot)
+    unsigned long tap_snapshot;
+
+    // the interval of the hung device watchdog in milliseconds. 0 
+    // disables the watchdog (WatchdogInterval)
+    unsigned long watchdog_interval;
+
+    // the time in milliseconds a control transfer can take before the
+    // watchdog sees the device as hung (ControlDeadline)
+    unsigned long control_deadline;
+
+    // the time in milliseconds the driver waits for a synchronous
+    // request before it is cancelled and fails with STATUS_IO_TIMEOUT.
+    // 0 waits until the request completes. Used for the vendor and
+    // descriptor requests (ControlTimeout), the configuration and 
+    // pipe requests (ConfigurationTimeout) and the requests to the
+    // upstream port (PortTimeout)
+    unsigned long control_timeout;
+    unsigned long configuration_timeout;
+    unsigned long port_timeout;
+};
+
+// the reason the watchdog started a recovery
+enum chief_watchdog_reason : unsigned char {
+    // a control transfer did not complete before the deadline
+    chief_watchdog_control_timeout = 1,
+
+    // the port is connected but not enabled
+    chief_watchdog_port_disabled = 2,
+};
+
+// the recovery actions of the watchdog. Every check that still finds
+// the device hung tries the next action
+enum chief_watchdog_action : unsigned char {
+    // abort the transfers on all the pipes
+    chief_watchdog_abort_pipes = 1,
+
+    // abort and reset all the pipes
+    chief_watchdog_reset_pipes = 2,
+
+    // reset the upstream port
+    chief_watchdog_reset_port = 3,
+
+    // select the configuration again. Skipped while pipe handles are
+    // open as it replaces the pipes of the handles
+    chief_watchdog_select_configuration = 4,
+};
+
+constexpr static unsigned long chief_watchdog_action_count = 4;
+
+/**
+ * @brief Output for ioctl_get_watchdog_stats
+ *
+ */
+struct usb_chief_watchdog_stats {
+    // the amount of checks that were done
+    unsigned long long checks;
+
+    // the amount of checks that found the device hung for every 
+    // chief_watchdog_reason
+    unsigned long long control_timeouts;
+    unsigned long long port_disabled;
+
+    // the amount of times every chief_watchdog_action was done. The 
+    // first entry is chief_watchdog_abort_pipes
+    unsigned long long actions[chief_watchdog_action_count];
+
+    // the amount of actions that returned a error and the amount 
+    // of select configurations skipped for open handles
+    unsigned long long failed;
+    unsigned long long skipped;
+
+    // the amount of times all the actions were tried and the device
+    // was still hung. The watchdog waits for the device to recover
+    unsigned long long exhausted;
+
+    // the last chief_watchdog_action that was done. 0 when the 
+    // device is healthy
+    unsigned long level;
+    unsigned long reserved;
+};
+
+// the maximum amount of buffers that can be registered on a handle
+constexpr static unsigned long chief_max_registered_buffers = 16;
+
+// the maximum size of a single registered buffer
+constexpr static unsigned long chief_max_registered_length = 16 * 1024 * 1024;
+
+/**
+ * @brief A buffer of the application that is registered on a handle
+ *
+ */
+struct usb_chief_registered_buffer {
+    // the start and the size of the buffer
+    void *data;
+    unsigned long length;
+
+    // reserved. Should be 0
+    unsigned long reserved;
+};
+
+/**
+ * @brief Input for ioctl_register_buffers. The buffers are locked in
+ * memory once and stay locked until they are unregistered or the 
+ * handle is closed. Reads and writes with ioctl_read_registered and
+ * ioctl_write_registered then refer to a buffer by its slot, without
+ * locking the memory for every transfer. Only one set of buffers can
+ * be registered on a handle at a time
+ *
+ */
+struct usb_chief_register_buffers {
+    // the amount of buffers. Should not be more than 
+    // chief_max_registered_buffers
+    unsigned long count;
+
+    // reserved. Should be 0
+    unsigned long reserved;
+
+    // the buffers. The index is the slot of the buffer
+    usb_chief_registered_buffer buffers[chief_max_registered_buffers];
+};
+
+/**
+ * @brief Input for ioctl_read_registered and ioctl_write_registered.
+ * The read mode of the handle is used, a framed read returns the 
+ * header at the offset followed by the data
+ *
+ */
+struct usb_chief_registered_transfer {
+    // the slot of the registered buffer
+    unsigned long slot;
+
+    // the part of the buffer that is transferred
+    unsigned long offset;
+    unsigned long length;
+
+    // reserved. Should be 0
+    unsigned long reserved;
+};
+
+// the maximum amount of entries in a single ioctl_submit_batch
+constexpr static unsigned long chief_max_batch_entries = 64;
+
+// the maximum amount of batch transfers on a handle that are not 
+// reaped yet
+constexpr static unsigned long chief_max_batch_inflight = 256;
+
+// flags for a batch entry
+enum chief_batch_flags : unsigned long {
+    // write the buffer to the pipe. The entry reads when not set
+    chief_batch_write = (1 << 0),
+};
+
+/**
+ * @brief A single transfer in a batch
+ *
+ */
+struct usb_chief_batch_entry {
+    // returned with the result so the application can find the 
+    // transfer. Not used by the driver
+    unsigned long long cookie;
+
+    // the part of the registered buffer that is transferred
+    unsigned long slot;
+    unsigned long offset;
+    unsigned long length;
+
+    // chief_batch_flags
+    unsigned long flags;
+};
+
+/**
+ * @brief Input for ioctl_submit_batch. Followed by count entries. The
+ * entries use the registered buffers and the read mode of the handle.
+ * Every entry returns a single result with ioctl_reap_batch, also 
+ * when it fails
+ *
+ */
+struct usb_chief_batch_submit {
+    // amount of entries following this header
+    unsigned long count;
+
+    // reserved. Should be 0
+    unsigned long reserved;
+};
+
+/**
+ * @brief The result of a batch transfer
+ *
+ */
+struct usb_chief_batch_result {
+    // the cookie of the entry
+    unsigned long long cookie;
+
+    // the result of the transfer (NTSTATUS) and the amount of data
+    long status;
+    unsigned long length;
+};
+
+/**
+ * @brief Output of ioctl_reap_batch. Followed by count results. Waits
+ * until at least one transfer is done, or returns right away when 
+ * no transfer is left
+ *
+ */
+struct usb_chief_batch_reap {
+    // amount of results following this header
+    unsigned long count;
+
+    // the amount of transfers that are not reaped yet
+    unsigned long pending;
+};
+
+// device events returned by ioctl_wait_event
+enum chief_event : unsigned long {
+    // the device is started and accepts requests
+    chief_event_started = (1 << 0),
+
+    // the device is stopped to change its resources
+    chief_event_stopped = (1 << 1),
+
+    // the device is surprise removed or removed. No new events 
+    // follow after this
+    chief_event_removed = (1 << 2),
+
+    // the device power state changed
+    chief_event_power = (1 << 3),
+
+    // a transfer on a pipe stalled
+    chief_event_stall = (1 << 4),
+
+    // a new alternate setting was selected
+    chief_event_alternate_setting = (1 << 5),
+
+    // the watchdog started a recovery action
+    chief_event_recovery = (1 << 6),
+};
+
+/**
+ * @brief Output for ioctl_wait_event. The request waits in the driver
+ * until a event happens. Events that happen while no request waits 
+ * are combined in the record of the next request, which returns 
+ * right away. Every waiting request gets the same record
+ *
+ */
+struct usb_chief_event_record {
+    // the chief_event flags of all the events in the record
+    unsigned long events;
+
+    // the amount of events in the record. More than the amount of
+    // flags when events were combined
+    unsigned long count;
+
+    // incremented for every record, so a application with more than
+    // one waiting request can skip the records it already has
+    unsigned long sequence;
+
+    // a bit for every pipe index that stalled
+    unsigned long stalled_pipes;
+
+    // performance counter value of the first and last event
+    long long first_timestamp;
+    long long last_timestamp;
+
+    // the device power state (DEVICE_POWER_STATE) and the alternate
+    // setting after the last event
+    unsigned long power_state;
+    unsigned long alternate_setting;
+};
+
+// the amount of latency buckets of a vendor request code
+constexpr static unsigned long chief_vendor_latency_buckets = 16;
+
+// the upper bound of the first latency bucket in microseconds. Every 
+// next bucket doubles it and the last bucket has everything above
+constexpr static unsigned long chief_vendor_latency_base = 64;
+
+// flags for ioctl_get_vendor_stats
+enum chief_vendor_stats_flags : unsigned long {
+    // clear the statistics after they are read. Every counter is read
+    // and cleared at once so no request is lost
+    chief_vendor_stats_reset = (1 << 0),
+};
+
+/**
+ * @brief Statistics of a single vendor request code
+ *
+ */
+struct usb_chief_vendor_code_stats {
+    // the amount of requests and the data bytes they transferred
+    unsigned long long requests;
+    unsigned long long bytes;
+
+    // the amount of requests that failed
+    unsigned long long errors;
+
+    // the sum and maximum of the latency in microseconds. The latency 
+    // includes the wait for the control budget of the scheduler
+    unsigned long long total_latency;
+    unsigned long long max_latency;
+
+    // the amount of requests in every latency bucket
+    unsigned long latency[chief_vendor_latency_buckets];
+};
+
+/**
+ * @brief Input and output for ioctl_get_vendor_stats. The input is 
+ * optional, only the flags are used as input
+ *
+ */
+struct usb_chief_vendor_stats {
+    // chief_vendor_stats_flags
+    unsigned long flags;
+    unsigned long reserved;
+
+    // the statistics of every request code
+    usb_chief_vendor_code_stats codes[256];
+};
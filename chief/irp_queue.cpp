@@ -0,0 +1,113 @@
+#include "irp_queue.hpp"
+
+// index in the driver context of the irp where we store the insert time. The
+// last entry is used by the cancel safe queue
+constexpr static ULONG irp_queue_time_index = 0;
+
+static irp_queue& get_irp_queue(PIO_CSQ Csq) {
+    return *CONTAINING_RECORD(Csq, irp_queue, csq);
+}
+
+static void irp_queue_csq_insert(PIO_CSQ Csq, PIRP Irp) {
+    irp_queue& queue = get_irp_queue(Csq);
+
+    // add the irp at the back of the list
+    InsertTailList(&queue.list, &Irp->Tail.Overlay.ListEntry);
+    InterlockedIncrement(&queue.depth);
+}
+
+static void irp_queue_csq_remove(PIO_CSQ Csq, PIRP Irp) {
+    irp_queue& queue = get_irp_queue(Csq);
+
+    // remove the irp from the list
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    InterlockedDecrement(&queue.depth);
+}
+
+static PIRP irp_queue_csq_peek(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext) {
+    UNREFERENCED_PARAMETER(PeekContext);
+
+    irp_queue& queue = get_irp_queue(Csq);
+
+    // start at the front of the list or after the provided irp
+    PLIST_ENTRY next = (Irp ? Irp->Tail.Overlay.ListEntry.Flink : queue.list.Flink);
+
+    // check if we are at the end of the list
+    if (next == &queue.list) {
+        return nullptr;
+    }
+
+    return CONTAINING_RECORD(next, IRP, Tail.Overlay.ListEntry);
+}
+
+static void irp_queue_csq_acquire(PIO_CSQ Csq, PKIRQL Irql) {
+    KeAcquireSpinLock(&get_irp_queue(Csq).lock, Irql);
+}
+
+static void irp_queue_csq_release(PIO_CSQ Csq, KIRQL Irql) {
+    KeReleaseSpinLock(&get_irp_queue(Csq).lock, Irql);
+}
+
+static void irp_queue_csq_complete_canceled(PIO_CSQ Csq, PIRP Irp) {
+    irp_queue& queue = get_irp_queue(Csq);
+
+    // check if the owner wants to handle the cancel
+    if (queue.cancel) {
+        queue.cancel(queue.device_object, Irp);
+        return;
+    }
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+
+    IofCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+void irp_queue_init(irp_queue& Queue, PDEVICE_OBJECT DeviceObject, irp_queue_cancel_callback Cancel) {
+    InitializeListHead(&Queue.list);
+    KeInitializeSpinLock(&Queue.lock);
+
+    Queue.depth = 0;
+    Queue.device_object = DeviceObject;
+    Queue.cancel = Cancel;
+
+    IoCsqInitialize(
+        &Queue.csq,
+        irp_queue_csq_insert,
+        irp_queue_csq_remove,
+        irp_queue_csq_peek,
+        irp_queue_csq_acquire,
+        irp_queue_csq_release,
+        irp_queue_csq_complete_canceled
+    );
+}
+
+void irp_queue_insert(irp_queue& Queue, PIRP Irp) {
+    // store when the irp was added. Only the lower part of the
+    // counter fits in the driver context on 32-bit systems
+    Irp->Tail.Overlay.DriverContext[irp_queue_time_index] = reinterpret_cast<PVOID>(
+        static_cast<ULONG_PTR>(KeQueryPerformanceCounter(nullptr).LowPart)
+    );
+
+    // add the irp to the queue. This marks the irp as pending
+    IoCsqInsertIrp(&Queue.csq, Irp, nullptr);
+}
+
+PIRP irp_queue_remove(irp_queue& Queue) {
+    // check if we have anything in the queue before taking the lock
+    if (!Queue.depth) {
+        return nullptr;
+    }
+
+    return IoCsqRemoveNextIrp(&Queue.csq, nullptr);
+}
+
+ULONG irp_queue_wait_time(PIRP Irp) {
+    // get the time the irp was added to the queue
+    const ULONG inserted = static_cast<ULONG>(
+        reinterpret_cast<ULONG_PTR>(Irp->Tail.Overlay.DriverContext[irp_queue_time_index])
+    );
+
+    // the unsigned subtraction handles a wrap of the lower part
+    return KeQueryPerformanceCounter(nullptr).LowPart - inserted;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+/**
+ * @brief Callback for a irp that is canceled while it is in
+ * the queue. The callback should complete the irp
+ *
+ */
+using irp_queue_cancel_callback = void (*)(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+
+/**
+ * @brief Cancel safe queue of irps. Irps in the queue are
+ * pending and can be canceled at any time
+ *
+ */
+struct irp_queue {
+    // the cancel safe queue
+    IO_CSQ csq;
+
+    // list with all the irps in the queue. Protected by the lock
+    LIST_ENTRY list;
+
+    // spinlock to protect the list
+    KSPIN_LOCK lock;
+
+    // amount of irps in the queue
+    volatile LONG depth;
+
+    // the device object that owns the queue
+    PDEVICE_OBJECT device_object;
+
+    // callback for canceled irps
+    irp_queue_cancel_callback cancel;
+};
+
+/**
+ * @brief Initialize a irp queue. When no callback is provided canceled
+ * irps are completed with STATUS_CANCELLED
+ *
+ * @param Queue
+ * @param DeviceObject
+ * @param Cancel
+ */
+void irp_queue_init(irp_queue& Queue, PDEVICE_OBJECT DeviceObject, irp_queue_cancel_callback Cancel = nullptr);
+
+/**
+ * @brief Add a irp to the back of the queue. Marks the irp as pending.
+ * Stores the performance counter value of the insert in the irp so
+ * the time in the queue can be calculated
+ *
+ * @param Queue
+ * @param Irp
+ */
+void irp_queue_insert(irp_queue& Queue, PIRP Irp);
+
+/**
+ * @brief Remove the first irp from the queue. Returns a nullptr when
+ * the queue is empty
+ *
+ * @param Queue
+ * @return PIRP
+ */
+PIRP irp_queue_remove(irp_queue& Queue);
+
+/**
+ * @brief Get the amount of performance counter ticks a irp that
+ * was removed from the queue has been waiting. Only valid for waits
+ * shorter than 2^32 ticks
+ *
+ * @param Irp
+ * @return ULONG
+ */
+ULONG irp_queue_wait_time(PIRP Irp);
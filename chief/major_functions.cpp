@@ -4,6 +4,23 @@
 #include "pipe.hpp"
 #include "device_extension.hpp"
 #include "usb.hpp"
+#include "device_state.hpp"
+#include "status_cache.hpp"
+#include "file_context.hpp"
+#include "scheduler.hpp"
+#include "tap.hpp"
+#include "trace.hpp"
+#include "fanout.hpp"
+#include "tunables.hpp"
+#include "start_device.hpp"
+#include "watchdog.hpp"
+#include "batch.hpp"
+#include "notify.hpp"
+#include "vendor_stats.hpp"
+
+// make sure the shared ioctl codes match the codes the original software uses
+static_assert(ioctl_vendor_send == CTL_CODE(FILE_DEVICE_USB, 0, METHOD_BUFFERED, FILE_ANY_ACCESS), "Invalid ioctl code");
+static_assert(ioctl_get_bcd_usb == CTL_CODE(FILE_DEVICE_USB, 3, METHOD_BUFFERED, FILE_ANY_ACCESS), "Invalid ioctl code");
 
 NTSTATUS signal_event_complete(_DEVICE_OBJECT *DeviceObject, _IRP *Irp, void* Event) {
     KeSetEvent(reinterpret_cast<PRKEVENT>(Event), EVENT_INCREMENT, false);
@@ -12,28 +29,25 @@ NTSTATUS signal_event_complete(_DEVICE_OBJECT *DeviceObject, _IRP *Irp, void* Ev
 }
 
 static bool delete_is_not_pending(__in struct _DEVICE_OBJECT *DeviceObject) {
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
-    
-    // return if the device is not being removed or ejected and has a configuration descriptor
-    return !dev_ext->device_removed && (dev_ext->usb_config_desc != nullptr) && !dev_ext->remove_pending && !dev_ext->hold_new_requests;
+    // we only accept new requests when the device is started. This 
+    // means it is not being removed, stopped or ejected and has a 
+    // configuration descriptor
+    return get_device_state(DeviceObject) == device_state::started;
 }
 
 static NTSTATUS query_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context) {
-    // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
-
     // check if we have a pending return
     if (Irp->PendingReturned) {
         IoGetCurrentIrpStackLocation(Irp)->Control |= SL_PENDING_RETURNED;
     }
 
-    // check if we have a config descriptor
-    if (dev_ext->usb_config_desc) {
-        // mark we are stopped so we dont accept new
-        // ioctls/reads/writes if we gotten permission
-        // from the lower driver
-        volatile bool* value = reinterpret_cast<bool*>(Context);
-        *value = NT_SUCCESS(Irp->IoStatus.Status);
+    // check if we have gotten permission from the lower driver
+    if (NT_SUCCESS(Irp->IoStatus.Status)) {
+        // move to the pending state so we dont accept new 
+        // ioctls/reads/writes. This only works when we are 
+        // started (and have a config descriptor)
+        const device_state pending_state = static_cast<device_state>(reinterpret_cast<ULONG_PTR>(Context));
+        try_transition_device_state(DeviceObject, device_state::started, pending_state);
     }
 
     // release the spinlock
@@ -128,9 +142,39 @@ static ULONG get_pipe_from_unicode_str(_UNICODE_STRING* FileName) {
     return found_digit ? result : ULONG_MAX;
 }
 
+/**
+ * @brief Check if a file name ends with the fan-out suffix
+ * 
+ * @param FileName 
+ * @return true 
+ * @return false 
+ */
+static bool is_fanout_name(_UNICODE_STRING* FileName) {
+    // Example: "\PIPE00\FANOUT"
+    constexpr static wchar_t suffix[] = L"\\FANOUT";
+    constexpr static ULONG suffix_length = (sizeof(suffix) / sizeof(wchar_t)) - 1;
+
+    const ULONG length = FileName->Length / sizeof(wchar_t);
+
+    if (length < suffix_length) {
+        return false;
+    }
+
+    // compare without the case
+    for (ULONG i = 0; i < suffix_length; i++) {
+        const wchar_t ch = FileName->Buffer[length - suffix_length + i];
+
+        if (((ch >= L'a' && ch <= L'z') ? (ch - (L'a' - L'A')) : ch) != suffix[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static void power_request_complete(PDEVICE_OBJECT DeviceObject, UCHAR MinorFunction, POWER_STATE PowerState, PVOID Context, PIO_STATUS_BLOCK IoStatus) {
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
 
     // get the irp from the context
     PIRP Irp = reinterpret_cast<PIRP>(Context);
@@ -147,7 +191,7 @@ static void power_request_complete(PDEVICE_OBJECT DeviceObject, UCHAR MinorFunct
 
 static NTSTATUS power_state_systemworking_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context) {
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
 
     // check if we have a pending return
     if (Irp->PendingReturned) {
@@ -173,7 +217,7 @@ static DEVICE_POWER_STATE system_state_to_device_power_state(_DEVICE_OBJECT* Dev
     }
 
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
 
     // return the device power state for the given system power state
     return dev_ext->device_capabilities.DeviceState[state];
@@ -181,17 +225,11 @@ static DEVICE_POWER_STATE system_state_to_device_power_state(_DEVICE_OBJECT* Dev
 
 static NTSTATUS usb_cleanup_memory(_DEVICE_OBJECT* DeviceObject) {
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
     
     // clear the bcdUSB value
     dev_ext->bcdUSB.clear();
 
-    // free the allocated pipes
-    if (dev_ext->allocated_pipes) {
-        ExFreePool(dev_ext->allocated_pipes);
-        dev_ext->allocated_pipes = nullptr;
-    }
-
     // free the usb interface info
     if (dev_ext->usb_interface_info) {
         ExFreePool(dev_ext->usb_interface_info);
@@ -224,24 +262,129 @@ static NTSTATUS mj_read_write_impl(__in struct _DEVICE_OBJECT *DeviceObject, __i
     }
 
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // record the request when the recorder is enabled
+    if (dev_ext->trace_enabled) {
+        trace_request(DeviceObject, Irp);
+    }
+
+    // get the context of the handle
+    chief_file_context* context = get_file_context(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+    // a fan-out handle reads the shared buffers of the pipe
+    if (context && context->subscriber) {
+        if (read) {
+            return fanout_read(context->subscriber, Irp, (context->read_mode & chief_read_mode_framed) != 0);
+        }
+
+        Irp->IoStatus.Status = STATUS_INVALID_DEVICE_REQUEST;
+
+        // complete the irp
+        IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
 
     // get the amount of data to transfer
     const int length = (Irp->MdlAddress) ? MmGetMdlByteCount(Irp->MdlAddress) : 0;
 
     // check if the length is more than the maximum length
-    if (length <= 64000) {
+    if (static_cast<ULONG>(length) <= get_tunables().max_transfer_size) {
         // we can do it in one transfer
         return usb_send_bulk_or_interrupt_transfer(DeviceObject, Irp, read);
     }
 
-    // TODO: change to better error code
-    return STATUS_NOT_IMPLEMENTED;
+    // the same error as a registered transfer that is too long
+    Irp->IoStatus.Status = STATUS_INVALID_BUFFER_SIZE;
+
+    // complete the irp
+    IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return STATUS_INVALID_BUFFER_SIZE;
+}
+
+static NTSTATUS mj_reap_batch_impl(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp) {
+    // clear the information field
+    Irp->IoStatus.Information = 0;
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // get the context of the pipe handle
+    chief_file_context* context = get_file_context(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+    // check if we have a delete pending
+    if (!delete_is_not_pending(DeviceObject)) {
+        status = STATUS_DELETE_PENDING;
+    }
+    else if (!context || context->subscriber) {
+        status = STATUS_INVALID_HANDLE;
+    }
+    else {
+        // get the results. This completes the irp or queues it until
+        // a transfer is done
+        return batch_reap(context, Irp);
+    }
+
+    Irp->IoStatus.Status = status;
+
+    // complete the irp
+    IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+static NTSTATUS mj_registered_transfer_impl(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp, bool read) {
+    // clear the information field
+    Irp->IoStatus.Information = 0;
+
+    NTSTATUS status = STATUS_SUCCESS;
+
+    // get the current irp stack location
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+    // check if we have a delete pending
+    if (!delete_is_not_pending(DeviceObject)) {
+        status = STATUS_DELETE_PENDING;
+    }
+    else if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(usb_chief_registered_transfer)) {
+        status = STATUS_BUFFER_TOO_SMALL;
+    }
+    else {
+        // get the device extension
+        chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+        // record the request when the recorder is enabled
+        if (dev_ext->trace_enabled) {
+            trace_request(DeviceObject, Irp);
+        }
+
+        // copy the transfer. The system buffer is freed with the irp
+        const usb_chief_registered_transfer transfer = *reinterpret_cast<usb_chief_registered_transfer*>(
+            Irp->AssociatedIrp.SystemBuffer
+        );
+
+        // the same limit as a normal read or write
+        if (transfer.length > get_tunables().max_transfer_size) {
+            status = STATUS_INVALID_BUFFER_SIZE;
+        }
+        else {
+            // send the transfer. This completes the irp
+            return usb_send_registered_transfer(DeviceObject, Irp, read, transfer);
+        }
+    }
+
+    Irp->IoStatus.Status = status;
+
+    // complete the irp
+    IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
 }
 
 NTSTATUS mj_create(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp) {
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
 
     // aquire the spinlock
     increment_active_pipe_count(DeviceObject);
@@ -256,25 +399,81 @@ NTSTATUS mj_create(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP
         // we are not being deleted. Get the current file object in the irp
         PFILE_OBJECT file = IoGetCurrentIrpStackLocation(Irp)->FileObject;
         file->FsContext = nullptr;
+        file->FsContext2 = nullptr;
     
         // check if we have a file name
-        if (file->FileName.Length) {
+        if (file->FileName.Length && !pipe_handle_open(DeviceObject)) {
+            // the pipes are being replaced by a new setting
+            status = STATUS_DEVICE_BUSY;
+        }
+        else if (file->FileName.Length) {
             // get the pipe index from the file name
             ULONG pipe_index = get_pipe_from_unicode_str(&file->FileName);
 
+            // a fan-out handle shares the data of a bulk in pipe
+            const bool fanout = is_fanout_name(&file->FileName);
+
             // check if we got a valid pipe index
             if (pipe_index >= dev_ext->usb_interface_info->NumberOfPipes) {
                 status = STATUS_INVALID_PARAMETER;
             }
+            else if (fanout && (dev_ext->usb_interface_info->Pipes[pipe_index].PipeType != UsbdPipeTypeBulk ||
+                !USBD_PIPE_DIRECTION_IN(&dev_ext->usb_interface_info->Pipes[pipe_index]))) 
+            {
+                status = STATUS_INVALID_PARAMETER;
+            }
             else {
-                // store the pipe information in the fs context
-                file->FsContext = static_cast<void*>(&dev_ext->usb_interface_info->Pipes[pipe_index]);
+                // allocate the context for this handle
+                chief_file_context* context = file_context_create();
+
+                // check if we got memory
+                if (!context) {
+                    status = STATUS_INSUFFICIENT_RESOURCES;
+                }
+                else if (fanout) {
+                    // add the handle to the fan-out of the pipe
+                    status = fanout_subscribe(DeviceObject, pipe_index, context->subscriber);
+
+                    if (NT_SUCCESS(status)) {
+                        file->FsContext = static_cast<void*>(&dev_ext->usb_interface_info->Pipes[pipe_index]);
+                        file->FsContext2 = context;
+                        context->pipe_index = pipe_index;
+                    }
+                    else {
+                        file_context_free(context);
+                    }
+                }
+                else {
+                    // store the pipe information in the fs context and
+                    // the handle context in the second fs context
+                    file->FsContext = static_cast<void*>(&dev_ext->usb_interface_info->Pipes[pipe_index]);
+                    file->FsContext2 = context;
+                    context->pipe_index = pipe_index;
+
+                    // increment the interlocked value before we claim 
+                    // the pipe so a revoke never sees a claimed pipe 
+                    // that is not counted
+                    increment_active_pipe_count(DeviceObject);
 
-                // mark the pipe as allocated
-                dev_ext->allocated_pipes[pipe_index] = true;
+                    // claim the pipe. It can not be shared with a second
+                    // handle or a fan-out, these own the pipe already
+                    context->pipe_owner = pipe_claim(DeviceObject, pipe_index, context->pipe_epoch);
 
-                // increment the interlocked value
-                increment_active_pipe_count(DeviceObject);
+                    if (!context->pipe_owner) {
+                        decrement_active_pipe_count(DeviceObject);
+
+                        file->FsContext = nullptr;
+                        file->FsContext2 = nullptr;
+                        file_context_free(context);
+
+                        status = STATUS_SHARING_VIOLATION;
+                    }
+                }
+            }
+
+            // the handle is not opened
+            if (!NT_SUCCESS(status)) {
+                pipe_handle_close(DeviceObject);
             }
         }
     }
@@ -290,34 +489,80 @@ NTSTATUS mj_create(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP
     return status;
 }
 
+NTSTATUS mj_cleanup(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp) {
+    // get the current file object in the irp
+    PFILE_OBJECT file = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+
+    // get the context of the handle
+    chief_file_context* context = get_file_context(file);
+
+    // the registered buffers are locked in the memory of the process.
+    // They should be unlocked before the process exits, the close can
+    // come later when the file is still referenced
+    if (context && !context->subscriber) {
+        LARGE_INTEGER timeout;
+        timeout.QuadPart = -10 * 1000 * 100;
+
+        // wait for the transfers on the buffers. Abort the pipe while 
+        // we wait so a read on a idle pipe does not keep them locked
+        while (KeWaitForSingleObject(&context->buffers_idle, Executive, KernelMode, false, &timeout) == STATUS_TIMEOUT) {
+            if (delete_is_not_pending(DeviceObject)) {
+                usb_abort_single_pipe(
+                    DeviceObject, reinterpret_cast<USBD_PIPE_INFORMATION*>(file->FsContext)->PipeHandle
+                );
+            }
+        }
+
+        // the batch transfers release the buffers before they add
+        // their result. Wait until the last one is done with the handle
+        batch_stop(context->batch);
+
+        file_context_unregister_buffers(context);
+    }
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+
+    // complete the irp
+    IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS mj_close(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp) {
     // acquire the spinlock
     increment_active_pipe_count(DeviceObject);
 
-    // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
-
     // get the current file object in the irp
     PFILE_OBJECT file = IoGetCurrentIrpStackLocation(Irp)->FileObject;
 
-    // check if we have a valid fs context
-    if (file->FsContext) {
-        // get the pipe from the filename
-        const ULONG pipe_index = get_pipe_from_unicode_str(&file->FileName);
-
-        // check if the pipe index is valid
-        if (pipe_index < dev_ext->usb_interface_info->NumberOfPipes) {
-            // check if the pipe is allocated
-            if (dev_ext->allocated_pipes[pipe_index]) {
-                // mark the pipe as free
-                dev_ext->allocated_pipes[pipe_index] = false;
+    // get the context of the handle
+    chief_file_context* context = get_file_context(file);
 
-                // decrement the pipe count
-                decrement_active_pipe_count(DeviceObject);
-            }
+    // check if we have a fan-out handle. The fan-out owns the pipe
+    if (context && context->subscriber) {
+        fanout_unsubscribe(DeviceObject, context->subscriber);
+        context->subscriber = nullptr;
+    }
+    else if (context && context->pipe_owner) {
+        // release the pipe. This fails when the owners were revoked by
+        // a new setting or a abort, these already decremented the count
+        if (pipe_release(DeviceObject, context->pipe_index, context->pipe_epoch)) {
+            // decrement the pipe count
+            decrement_active_pipe_count(DeviceObject);
         }
     }
 
+    // every pipe handle has a context. The pipes can be replaced
+    // again when this was the last one
+    if (context) {
+        pipe_handle_close(DeviceObject);
+    }
+
+    // free the context of the handle
+    file_context_free(context);
+    file->FsContext2 = nullptr;
+
     // release the spinlock
     decrement_active_pipe_count_and_notify(DeviceObject);
 
@@ -339,11 +584,28 @@ NTSTATUS mj_write(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP
 }
 
 NTSTATUS mj_device_control(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp) {
+    // check for the requests that can wait in the driver. These 
+    // complete on their own, like a read or write
+    switch (IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.IoControlCode) {
+        case ioctl_read_registered: // 0x220060
+            return mj_registered_transfer_impl(DeviceObject, Irp, true);
+        case ioctl_write_registered: // 0x220064
+            return mj_registered_transfer_impl(DeviceObject, Irp, false);
+        case ioctl_reap_batch: // 0x22006c
+            // a reap waits for the batch transfers
+            return mj_reap_batch_impl(DeviceObject, Irp);
+        case ioctl_wait_event: // 0x220070
+            // the wait is failed by the channel when the device is removed
+            return notify_wait(DeviceObject, Irp);
+        default:
+            break;
+    }
+
     // acquire the spinlock
     increment_active_pipe_count(DeviceObject);
 
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
 
     // return status
     NTSTATUS status = STATUS_SUCCESS;
@@ -360,15 +622,25 @@ NTSTATUS mj_device_control(__in struct _DEVICE_OBJECT *DeviceObject, __inout str
 
         // get the values from the stack
         ULONG_PTR buffer_length = stack->Parameters.DeviceIoControl.OutputBufferLength;
+        const ULONG input_length = stack->Parameters.DeviceIoControl.InputBufferLength;
         const ULONG io_control_code = stack->Parameters.DeviceIoControl.IoControlCode;
         usb_chief_vendor_request* vendor_request = reinterpret_cast<usb_chief_vendor_request*>(Irp->AssociatedIrp.SystemBuffer);
 
+        // record the request when the recorder is enabled
+        if (dev_ext->trace_enabled) {
+            trace_request(DeviceObject, Irp);
+        }
+
         // check the io control code
         switch (io_control_code) {
-            case CTL_CODE(FILE_DEVICE_USB, 0, METHOD_BUFFERED, FILE_ANY_ACCESS): // 0x220000
+            case ioctl_vendor_send: // 0x220000
                 status = usb_send_receive_vendor_request(DeviceObject, vendor_request, false);
+
+                // the request could have changed the status of the 
+                // device. Refresh the cached status reads
+                status_cache_invalidate(DeviceObject);
                 break;
-            case CTL_CODE(FILE_DEVICE_USB, 1, METHOD_BUFFERED, FILE_ANY_ACCESS): // 0x220004
+            case ioctl_vendor_receive: // 0x220004
                 status = usb_send_receive_vendor_request(DeviceObject, vendor_request, true);
 
                 // check the status for a success
@@ -381,10 +653,28 @@ NTSTATUS mj_device_control(__in struct _DEVICE_OBJECT *DeviceObject, __inout str
                     Irp->IoStatus.Information = buffer_length;
                 }
                 break;
-            case CTL_CODE(FILE_DEVICE_USB, 2, METHOD_BUFFERED, FILE_ANY_ACCESS): // 0x220008
+            case ioctl_set_alternate_setting: // 0x220008
+                // the pipe handles point to the pipes of the current
+                // interface. These are freed by the new setting, so it
+                // can only be selected when no pipe handle is open
+                if (!pipe_begin_reselect(DeviceObject)) {
+                    status = STATUS_DEVICE_BUSY;
+                    break;
+                }
+
                 status = usb_set_alternate_setting(DeviceObject, dev_ext->usb_config_desc, vendor_request->request & 0xff);
+
+                pipe_end_reselect(DeviceObject);
+
+                // refresh the cached status reads for the new setting
+                status_cache_invalidate(DeviceObject);
+
+                // let the application know the pipes changed
+                if (NT_SUCCESS(status)) {
+                    notify_event(DeviceObject, chief_event_alternate_setting, vendor_request->request & 0xff);
+                }
                 break;
-            case CTL_CODE(FILE_DEVICE_USB, 3, METHOD_BUFFERED, FILE_ANY_ACCESS): // 0x22000c
+            case ioctl_get_bcd_usb: // 0x22000c
                 if (dev_ext->bcdUSB.has_value()) {
                     // copy the bcdUSB value to the vendor request
                     vendor_request->request = dev_ext->bcdUSB.has_value();
@@ -400,6 +690,396 @@ NTSTATUS mj_device_control(__in struct _DEVICE_OBJECT *DeviceObject, __inout str
                     status = STATUS_DEVICE_DATA_ERROR;
                 }
                 break;
+            case ioctl_configure_status_poll: // 0x220010
+                // check if we have the full configuration
+                if (input_length < sizeof(usb_chief_status_poll_config)) {
+                    status = STATUS_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                status = status_cache_configure(
+                    DeviceObject, *reinterpret_cast<usb_chief_status_poll_config*>(Irp->AssociatedIrp.SystemBuffer)
+                );
+                break;
+            case ioctl_get_cached_status: // 0x220014
+                {
+                    // check if the input and output buffers are big enough
+                    if (input_length < sizeof(usb_chief_status_entry) || buffer_length < sizeof(usb_chief_cached_status)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    // copy the request. The input and output share the same buffer
+                    const usb_chief_status_entry request = *reinterpret_cast<usb_chief_status_entry*>(Irp->AssociatedIrp.SystemBuffer);
+
+                    // get the cached result
+                    status = status_cache_get(
+                        DeviceObject, request, *reinterpret_cast<usb_chief_cached_status*>(Irp->AssociatedIrp.SystemBuffer)
+                    );
+
+                    // set the information to the result size
+                    Irp->IoStatus.Information = (NT_SUCCESS(status) ? sizeof(usb_chief_cached_status) : 0);
+                }
+                break;
+            case ioctl_download_image: // 0x220018
+                // check if the input and output buffers are big enough
+                if (input_length < sizeof(usb_chief_image_download) || buffer_length < sizeof(usb_chief_image_download)) {
+                    status = STATUS_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                // download the image. The result of the download is
+                // stored in the request so the application knows
+                // where it failed
+                status = usb_download_image(
+                    DeviceObject, *reinterpret_cast<usb_chief_image_download*>(Irp->AssociatedIrp.SystemBuffer), 
+                    Irp->RequestorMode
+                );
+
+                // the image could have changed the status of the device
+                status_cache_invalidate(DeviceObject);
+
+                // return the result when the request was valid
+                Irp->IoStatus.Information = (NT_SUCCESS(status) ? sizeof(usb_chief_image_download) : 0);
+                break;
+            case ioctl_set_read_mode: // 0x22001c
+                {
+                    // get the context of the pipe handle
+                    chief_file_context* context = get_file_context(stack->FileObject);
+
+                    // check if we have a pipe handle
+                    if (!context) {
+                        status = STATUS_INVALID_HANDLE;
+                        break;
+                    }
+
+                    // check if we have the mode
+                    if (input_length < sizeof(usb_chief_read_mode)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    const ULONG mode = reinterpret_cast<usb_chief_read_mode*>(Irp->AssociatedIrp.SystemBuffer)->mode;
+
+                    // check if we support all the flags
+                    if (mode & ~static_cast<ULONG>(chief_read_mode_framed | chief_read_mode_crc)) {
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    // the crc is returned in the frame header
+                    if ((mode & chief_read_mode_crc) && !(mode & chief_read_mode_framed)) {
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    // change the mode for all new reads
+                    context->read_mode = mode;
+                }
+                break;
+            case ioctl_get_clock_info: // 0x220020
+                {
+                    // check if the output buffer is big enough
+                    if (buffer_length < sizeof(usb_chief_clock_info)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    usb_chief_clock_info* info = reinterpret_cast<usb_chief_clock_info*>(Irp->AssociatedIrp.SystemBuffer);
+
+                    // sample all the clocks as close together as possible
+                    LARGE_INTEGER frequency;
+                    LARGE_INTEGER system_time;
+
+                    const LARGE_INTEGER counter = KeQueryPerformanceCounter(&frequency);
+                    KeQuerySystemTime(&system_time);
+                    const ULONGLONG interrupt_time = KeQueryInterruptTime();
+
+                    info->frequency = frequency.QuadPart;
+                    info->counter = counter.QuadPart;
+                    info->system_time = system_time.QuadPart;
+                    info->interrupt_time = interrupt_time;
+
+                    Irp->IoStatus.Information = sizeof(usb_chief_clock_info);
+                }
+                break;
+            case ioctl_get_scheduler_stats: // 0x220024
+                // check if the output buffer is big enough
+                if (buffer_length < sizeof(usb_chief_scheduler_stats)) {
+                    status = STATUS_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                // copy the statistics of every transfer class
+                scheduler_get_stats(DeviceObject, *reinterpret_cast<usb_chief_scheduler_stats*>(Irp->AssociatedIrp.SystemBuffer));
+
+                Irp->IoStatus.Information = sizeof(usb_chief_scheduler_stats);
+                break;
+            case ioctl_configure_pipe_sizing: // 0x220028
+                // check if we have the full configuration
+                if (input_length < sizeof(usb_chief_pipe_sizing)) {
+                    status = STATUS_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                status = pipe_state_configure(
+                    DeviceObject, *reinterpret_cast<usb_chief_pipe_sizing*>(Irp->AssociatedIrp.SystemBuffer)
+                );
+                break;
+            case ioctl_get_pipe_stats: // 0x22002c
+                // check if the input and output buffers are big enough
+                if (input_length < sizeof(unsigned long) || buffer_length < sizeof(usb_chief_pipe_stats)) {
+                    status = STATUS_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                // get the statistics. The pipe field selects the pipe
+                status = pipe_state_get_stats(
+                    DeviceObject, *reinterpret_cast<usb_chief_pipe_stats*>(Irp->AssociatedIrp.SystemBuffer)
+                );
+
+                // set the information to the result size
+                Irp->IoStatus.Information = (NT_SUCCESS(status) ? sizeof(usb_chief_pipe_stats) : 0);
+                break;
+            case ioctl_configure_tap: // 0x220030
+                // check if we have the full configuration
+                if (input_length < sizeof(usb_chief_tap_config)) {
+                    status = STATUS_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                status = tap_configure(
+                    DeviceObject, *reinterpret_cast<usb_chief_tap_config*>(Irp->AssociatedIrp.SystemBuffer)
+                );
+                break;
+            case ioctl_drain_tap: // 0x220034
+                {
+                    ULONG length = 0;
+
+                    // move the records to the output buffer
+                    status = tap_drain(DeviceObject, Irp->AssociatedIrp.SystemBuffer, static_cast<ULONG>(buffer_length), length);
+
+                    Irp->IoStatus.Information = length;
+                }
+                break;
+            case ioctl_configure_trace: // 0x220038
+                // check if we have the full configuration
+                if (input_length < sizeof(usb_chief_trace_config)) {
+                    status = STATUS_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                status = trace_configure(
+                    DeviceObject, *reinterpret_cast<usb_chief_trace_config*>(Irp->AssociatedIrp.SystemBuffer)
+                );
+                break;
+            case ioctl_drain_trace: // 0x22003c
+                {
+                    ULONG length = 0;
+
+                    // move the records to the output buffer
+                    status = trace_drain(DeviceObject, Irp->AssociatedIrp.SystemBuffer, static_cast<ULONG>(buffer_length), length);
+
+                    Irp->IoStatus.Information = length;
+                }
+                break;
+            case ioctl_set_trigger: // 0x220040
+                {
+                    // get the context of the pipe handle
+                    chief_file_context* context = get_file_context(stack->FileObject);
+
+                    // check if we have a pipe handle
+                    if (!context) {
+                        status = STATUS_INVALID_HANDLE;
+                        break;
+                    }
+
+                    // check if we have the full configuration
+                    if (input_length < sizeof(usb_chief_trigger_config)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    // change the trigger for all new reads
+                    status = trigger_configure(
+                        context->trigger, *reinterpret_cast<usb_chief_trigger_config*>(Irp->AssociatedIrp.SystemBuffer)
+                    );
+                }
+                break;
+            case ioctl_configure_fanout: // 0x220044
+                {
+                    // get the context of the pipe handle
+                    chief_file_context* context = get_file_context(stack->FileObject);
+
+                    // check if we have a fan-out handle
+                    if (!context || !context->subscriber) {
+                        status = STATUS_INVALID_HANDLE;
+                        break;
+                    }
+
+                    // check if we have the full configuration
+                    if (input_length < sizeof(usb_chief_fanout_config)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    status = fanout_configure(
+                        context->subscriber, *reinterpret_cast<usb_chief_fanout_config*>(Irp->AssociatedIrp.SystemBuffer)
+                    );
+                }
+                break;
+            case ioctl_get_fanout_stats: // 0x220048
+                {
+                    // get the context of the pipe handle
+                    chief_file_context* context = get_file_context(stack->FileObject);
+
+                    // check if we have a fan-out handle
+                    if (!context || !context->subscriber) {
+                        status = STATUS_INVALID_HANDLE;
+                        break;
+                    }
+
+                    // check if the output buffer is big enough
+                    if (buffer_length < sizeof(usb_chief_fanout_stats)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    fanout_get_stats(
+                        context->subscriber, *reinterpret_cast<usb_chief_fanout_stats*>(Irp->AssociatedIrp.SystemBuffer)
+                    );
+
+                    // set the information to the result size
+                    Irp->IoStatus.Information = sizeof(usb_chief_fanout_stats);
+                }
+                break;
+            case ioctl_get_tunables: // 0x22004c
+                // check if the output buffer is big enough
+                if (buffer_length < sizeof(usb_chief_tunables)) {
+                    status = STATUS_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                // copy the current tunables
+                *reinterpret_cast<usb_chief_tunables*>(Irp->AssociatedIrp.SystemBuffer) = get_tunables();
+
+                // set the information to the result size
+                Irp->IoStatus.Information = sizeof(usb_chief_tunables);
+                break;
+            case ioctl_set_tunables: // 0x220050
+                // check if we have all the tunables
+                if (input_length < sizeof(usb_chief_tunables)) {
+                    status = STATUS_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                // validate and apply the new values
+                status = tunables_set(
+                    *reinterpret_cast<usb_chief_tunables*>(Irp->AssociatedIrp.SystemBuffer)
+                );
+                break;
+            case ioctl_get_watchdog_stats: // 0x220054
+                // check if the output buffer is big enough
+                if (buffer_length < sizeof(usb_chief_watchdog_stats)) {
+                    status = STATUS_BUFFER_TOO_SMALL;
+                    break;
+                }
+
+                watchdog_get_stats(DeviceObject, *reinterpret_cast<usb_chief_watchdog_stats*>(Irp->AssociatedIrp.SystemBuffer));
+
+                // set the information to the result size
+                Irp->IoStatus.Information = sizeof(usb_chief_watchdog_stats);
+                break;
+            case ioctl_register_buffers: // 0x220058
+                {
+                    // get the context of the pipe handle
+                    chief_file_context* context = get_file_context(stack->FileObject);
+
+                    // the buffers are used by the transfers of a normal pipe handle
+                    if (!context || context->subscriber) {
+                        status = STATUS_INVALID_HANDLE;
+                        break;
+                    }
+
+                    // check if we have all the buffers
+                    if (input_length < sizeof(usb_chief_register_buffers)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    // lock the buffers in the context of the process
+                    status = file_context_register_buffers(
+                        context, *reinterpret_cast<usb_chief_register_buffers*>(Irp->AssociatedIrp.SystemBuffer),
+                        Irp->RequestorMode
+                    );
+                }
+                break;
+            case ioctl_unregister_buffers: // 0x22005c
+                {
+                    // get the context of the pipe handle
+                    chief_file_context* context = get_file_context(stack->FileObject);
+
+                    if (!context || context->subscriber) {
+                        status = STATUS_INVALID_HANDLE;
+                        break;
+                    }
+
+                    // fails when a transfer still uses a buffer
+                    status = file_context_unregister_buffers(context);
+                }
+                break;
+            case ioctl_submit_batch: // 0x220068
+                {
+                    // get the context of the pipe handle
+                    chief_file_context* context = get_file_context(stack->FileObject);
+
+                    if (!context || context->subscriber) {
+                        status = STATUS_INVALID_HANDLE;
+                        break;
+                    }
+
+                    // check if we have the header
+                    if (input_length < sizeof(usb_chief_batch_submit)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    // send all the transfers. The results are returned
+                    // with ioctl_reap_batch
+                    status = batch_submit(
+                        DeviceObject, context, stack->FileObject, 
+                        *reinterpret_cast<usb_chief_batch_submit*>(Irp->AssociatedIrp.SystemBuffer), input_length
+                    );
+                }
+                break;
+            case ioctl_get_vendor_stats: // 0x220074
+                {
+                    // check if the output buffer is big enough
+                    if (buffer_length < sizeof(usb_chief_vendor_stats)) {
+                        status = STATUS_BUFFER_TOO_SMALL;
+                        break;
+                    }
+
+                    usb_chief_vendor_stats* stats = reinterpret_cast<usb_chief_vendor_stats*>(Irp->AssociatedIrp.SystemBuffer);
+
+                    // the flags are optional. The output overwrites the 
+                    // input in the system buffer
+                    const unsigned long flags = (input_length >= sizeof(unsigned long)) ? stats->flags : 0;
+
+                    if (flags & ~static_cast<unsigned long>(chief_vendor_stats_reset)) {
+                        status = STATUS_INVALID_PARAMETER;
+                        break;
+                    }
+
+                    stats->flags = flags;
+                    stats->reserved = 0;
+
+                    vendor_stats_get(DeviceObject, *stats);
+
+                    // set the information to the result size
+                    Irp->IoStatus.Information = sizeof(usb_chief_vendor_stats);
+                }
+                break;
             default:
                 // all other requests are invalid
                 status = STATUS_INVALID_PARAMETER;
@@ -421,7 +1101,7 @@ NTSTATUS mj_device_control(__in struct _DEVICE_OBJECT *DeviceObject, __inout str
 
 NTSTATUS mj_power(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp) {
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);   
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);   
 
     // get the current stack location
     PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
@@ -491,6 +1171,9 @@ NTSTATUS mj_power(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP
                         if (new_state > PowerDeviceUnspecified && new_state < PowerDeviceMaximum) {
                             // update the current power state
                             dev_ext->current_power_state.DeviceState = new_state;
+
+                            // let the application know about the new state
+                            notify_event(DeviceObject, chief_event_power, new_state);
                         }
 
                         // forward the request to the next power driver. Add
@@ -545,7 +1228,7 @@ NTSTATUS mj_system_control(__in struct _DEVICE_OBJECT *DeviceObject, __inout str
     increment_active_pipe_count(DeviceObject);
 
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
 
     // call the next driver
     const NTSTATUS status = forward_to_next_driver(dev_ext->attachedDeviceObject, Irp);
@@ -564,8 +1247,7 @@ NTSTATUS mj_pnp(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *I
     PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
 
     // get the device extension
-    chief_device_extension* dev_ext = (chief_device_extension*)DeviceObject->DeviceExtension;   
-
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
     // acquire the spinlock
     increment_active_pipe_count(DeviceObject);
 
@@ -574,66 +1256,11 @@ NTSTATUS mj_pnp(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *I
     // check the minor function
     switch (stack->MinorFunction) {
         case IRP_MN_START_DEVICE:
-            {
-                // create an event
-                KEVENT event;
-                KeInitializeEvent(&event, NotificationEvent, false);
-
-                // call the next driver
-                status = forward_to_next_driver(
-                    dev_ext->attachedDeviceObject, Irp,
-                    false, signal_event_complete,
-                    &event
-                );
-
-                if (status == STATUS_PENDING) {
-                    // wait for the event to be signaled
-                    KeWaitForSingleObject(
-                        &event,
-                        Suspended,
-                        KernelMode,
-                        false,
-                        nullptr
-                    );
-
-                    status = Irp->IoStatus.Status;
-                }
-
-                // check if the start device was successful on the lower driver
-                if (NT_SUCCESS(status)) {
-                    // get the device descriptor
-                    USB_DEVICE_DESCRIPTOR device_desc;
-
-                    // get the device descriptor
-                    status = usb_get_device_desc(DeviceObject, device_desc);
-
-                    // check if we got the device descriptor
-                    if (NT_SUCCESS(status)) {
-                        // store the bcdUSB value
-                        dev_ext->bcdUSB.set(device_desc.bcdUSB);
-
-                        // try to get the configuration descriptor
-                        status = usb_get_configuration_desc(DeviceObject, dev_ext->usb_config_desc);
-
-                        // check if we can change to the first alternate setting
-                        if (NT_SUCCESS(status)) {
-                            // set the alternate setting to 0
-                            status = usb_set_alternate_setting(DeviceObject, dev_ext->usb_config_desc, 0);
-                        }
-                    }
-                    else {
-                        // if we failed to get the device descriptor 
-                        // clear the bcdUSB value
-                        dev_ext->bcdUSB.clear();
-                    }
-
-                    Irp->IoStatus.Status = status;
-                }
-
-                IofCompleteRequest(Irp, IO_NO_INCREMENT);
-                decrement_active_pipe_count_and_notify(DeviceObject);
-                break;
-            }
+            // the start is done from completion routines so the pnp 
+            // thread is not blocked. This completes the irp and 
+            // releases the spinlock when it is done
+            status = start_device(DeviceObject, Irp);
+            break;
 
         case IRP_MN_REMOVE_DEVICE:
             // decrement the pipe_count we incremented at the
@@ -641,7 +1268,11 @@ NTSTATUS mj_pnp(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *I
             decrement_active_pipe_count_and_notify(DeviceObject);
             
             // stop everything that is running
-            dev_ext->device_removed = true;
+            transition_device_state(DeviceObject, device_state::removed);
+            notify_event(DeviceObject, chief_event_removed);
+            status_cache_stop(DeviceObject);
+            watchdog_stop(DeviceObject);
+            fanout_device_state_changed(DeviceObject);
             usb_pipe_abort(DeviceObject);
 
             // copy the current irp stack location to the next
@@ -659,6 +1290,16 @@ NTSTATUS mj_pnp(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *I
             );
 
             usb_cleanup_memory(DeviceObject);
+            status_cache_free(DeviceObject);
+            watchdog_free(DeviceObject);
+            tap_free(DeviceObject);
+            trace_free(DeviceObject);
+            vendor_stats_free(DeviceObject);
+            control_channel_free(DeviceObject);
+            tunables_remove(DeviceObject);
+
+            // fail the event requests that came in after the removal
+            notify_flush(DeviceObject);
 
             // create unicode strings for the names
             UNICODE_STRING symbolic_link_name_unicode;
@@ -675,11 +1316,16 @@ NTSTATUS mj_pnp(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *I
             break;
 
         case IRP_MN_STOP_DEVICE:
+            // mark we are stopped. This makes sure we dont accept
+            // new requests while we clear the configuration
+            transition_device_state(DeviceObject, device_state::stopped);
+            notify_event(DeviceObject, chief_event_stopped);
+            status_cache_stop(DeviceObject);
+            watchdog_stop(DeviceObject);
+            fanout_device_state_changed(DeviceObject);
+
             // select the config descriptor
             status = usb_clear_config_desc(DeviceObject);
-
-            // clear the hold_new_requests flag
-            dev_ext->hold_new_requests = false;
             
             if (NT_SUCCESS(status)) {
                 // Forward the IRP to the next driver
@@ -696,40 +1342,45 @@ NTSTATUS mj_pnp(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *I
         case IRP_MN_QUERY_STOP_DEVICE:
         case IRP_MN_QUERY_REMOVE_DEVICE:
             // forward the irp to the next driver. In the 
-            // callback complete routine we will set the 
-            // hold_new_requests/remove_pending flag based on 
-            // the result and release the spinlock
+            // callback complete routine we will move to the
+            // stop_pending/remove_pending state based on the 
+            // result and release the spinlock
             status = forward_to_next_driver(
                 dev_ext->attachedDeviceObject, Irp,
-                false, query_complete, (
+                false, query_complete, reinterpret_cast<void*>(static_cast<ULONG_PTR>(
                     (stack->MinorFunction == IRP_MN_QUERY_STOP_DEVICE) ? 
-                    reinterpret_cast<void*>(const_cast<bool*>(&dev_ext->hold_new_requests)) : 
-                    reinterpret_cast<void*>(const_cast<bool*>(&dev_ext->remove_pending))
-                )
+                    device_state::stop_pending : device_state::remove_pending
+                ))
             );
             break;
 
         case IRP_MN_CANCEL_STOP_DEVICE:
         case IRP_MN_CANCEL_REMOVE_DEVICE:
-            // check if we have a config descriptor
-            if (!dev_ext->usb_config_desc) {
+            // go back to the started state if the query moved 
+            // us to a pending state
+            try_transition_device_state(
+                DeviceObject, (
+                    (stack->MinorFunction == IRP_MN_CANCEL_STOP_DEVICE) ? 
+                    device_state::stop_pending : device_state::remove_pending
+                ), device_state::started
+            );
+
+            // check if we are started (and have a config descriptor)
+            if (get_device_state(DeviceObject) != device_state::started) {
                 // skip the irp
                 status = forward_to_next_driver(
                     dev_ext->attachedDeviceObject, Irp, true
                 );
             }
             else {
-                if (stack->MinorFunction == IRP_MN_CANCEL_STOP_DEVICE) {
-                    dev_ext->hold_new_requests = false;
-                }
-                else if (stack->MinorFunction == IRP_MN_CANCEL_REMOVE_DEVICE) {
-                    dev_ext->remove_pending = false;
-                }
-
                 Irp->IoStatus.Status = STATUS_SUCCESS;
 
                 // forward the IRP to the next driver
                 status = forward_to_next_driver(dev_ext->attachedDeviceObject, Irp);
+
+                // the fan-out transfers that completed during the 
+                // query wait for this
+                fanout_device_state_changed(DeviceObject);
             }
 
             // release the spinlock
@@ -741,7 +1392,11 @@ NTSTATUS mj_pnp(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *I
             decrement_active_pipe_count_and_notify(DeviceObject);
 
             // mark we are ejecting
-            dev_ext->device_removed = true;
+            transition_device_state(DeviceObject, device_state::surprise_removed);
+            notify_event(DeviceObject, chief_event_removed);
+            status_cache_stop(DeviceObject);
+            watchdog_stop(DeviceObject);
+            fanout_device_state_changed(DeviceObject);
 
             // stop the device
             usb_pipe_abort(DeviceObject);
@@ -13,6 +13,16 @@ extern "C" {
  */
 NTSTATUS mj_create(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp);
 
+/**
+ * @brief Major function for IRP_MJ_CLEANUP. Called when the last 
+ * handle of a file is closed, while the process still exists
+ * 
+ * @param DeviceObject 
+ * @param Irp 
+ * @return NTSTATUS 
+ */
+NTSTATUS mj_cleanup(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp);
+
 /**
  * @brief Major function for IRP_MJ_CLOSE
  * 
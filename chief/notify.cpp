@@ -0,0 +1,179 @@
+#include "notify.hpp"
+#include "device_extension.hpp"
+
+static device_notify& get_notify(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    return dev_ext->notify;
+}
+
+static void notify_take_record(device_notify& Notify, PIRP Irp) {
+    // give the pending record to the request and start a new one.
+    // Should be called with the lock
+    usb_chief_event_record* record = reinterpret_cast<usb_chief_event_record*>(Irp->AssociatedIrp.SystemBuffer);
+
+    *record = Notify.pending;
+    record->sequence = ++Notify.sequence;
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = sizeof(usb_chief_event_record);
+
+    memset(&Notify.pending, 0x00, sizeof(Notify.pending));
+}
+
+void notify_init(PDEVICE_OBJECT DeviceObject) {
+    device_notify& notify = get_notify(DeviceObject);
+
+    KeInitializeSpinLock(&notify.lock);
+    irp_queue_init(notify.waiters, DeviceObject);
+
+    memset(&notify.pending, 0x00, sizeof(notify.pending));
+
+    notify.sequence = 0;
+    notify.power_state = PowerDeviceD0;
+    notify.alternate_setting = 0;
+    notify.closed = false;
+}
+
+void notify_event(PDEVICE_OBJECT DeviceObject, chief_event Event, ULONG Value) {
+    device_notify& notify = get_notify(DeviceObject);
+
+    // stamp the event before we wait for the lock
+    const LONGLONG timestamp = KeQueryPerformanceCounter(nullptr).QuadPart;
+
+    // the waiting requests we complete after the lock is released
+    LIST_ENTRY completed;
+    InitializeListHead(&completed);
+
+    KIRQL irql;
+    KeAcquireSpinLock(&notify.lock, &irql);
+
+    if (!notify.closed) {
+        // keep the state the application can not ask for anymore
+        // after the device is gone
+        if (Event == chief_event_power) {
+            notify.power_state = Value;
+        }
+        else if (Event == chief_event_alternate_setting) {
+            notify.alternate_setting = Value;
+        }
+
+        // add the event to the pending record
+        usb_chief_event_record& record = notify.pending;
+
+        if (!record.count) {
+            record.first_timestamp = timestamp;
+        }
+
+        record.events |= Event;
+        record.count++;
+        record.last_timestamp = timestamp;
+        record.power_state = notify.power_state;
+        record.alternate_setting = notify.alternate_setting;
+
+        if (Event == chief_event_stall && Value < (sizeof(record.stalled_pipes) * 8)) {
+            record.stalled_pipes |= (1ul << Value);
+        }
+
+        // every waiting request gets the record
+        PIRP irp;
+
+        while ((irp = irp_queue_remove(notify.waiters)) != nullptr) {
+            // the requests share the sequence of the record
+            if (IsListEmpty(&completed)) {
+                record.sequence = ++notify.sequence;
+            }
+
+            *reinterpret_cast<usb_chief_event_record*>(irp->AssociatedIrp.SystemBuffer) = record;
+
+            irp->IoStatus.Status = STATUS_SUCCESS;
+            irp->IoStatus.Information = sizeof(usb_chief_event_record);
+
+            // the irp is not in the queue anymore so we can use its
+            // list entry
+            InsertTailList(&completed, &irp->Tail.Overlay.ListEntry);
+        }
+
+        // start a new record when this one is returned
+        if (!IsListEmpty(&completed)) {
+            memset(&notify.pending, 0x00, sizeof(notify.pending));
+        }
+
+        // no new events after the device is removed
+        notify.closed = (Event == chief_event_removed);
+    }
+
+    KeReleaseSpinLock(&notify.lock, irql);
+
+    // complete the requests without the lock
+    while (!IsListEmpty(&completed)) {
+        PIRP irp = CONTAINING_RECORD(RemoveHeadList(&completed), IRP, Tail.Overlay.ListEntry);
+
+        IofCompleteRequest(irp, IO_NO_INCREMENT);
+    }
+}
+
+NTSTATUS notify_wait(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+    device_notify& notify = get_notify(DeviceObject);
+
+    NTSTATUS status = STATUS_PENDING;
+
+    // check if the output buffer is big enough
+    if (IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.OutputBufferLength < sizeof(usb_chief_event_record)) {
+        status = STATUS_BUFFER_TOO_SMALL;
+    }
+    else {
+        KIRQL irql;
+        KeAcquireSpinLock(&notify.lock, &irql);
+
+        if (notify.pending.count) {
+            // return the events that happened since the last record
+            notify_take_record(notify, Irp);
+
+            status = STATUS_SUCCESS;
+        }
+        else if (notify.closed) {
+            status = STATUS_DELETE_PENDING;
+        }
+        else {
+            // wait for the next event. This marks the irp as pending
+            irp_queue_insert(notify.waiters, Irp);
+        }
+
+        KeReleaseSpinLock(&notify.lock, irql);
+    }
+
+    if (status != STATUS_PENDING) {
+        if (!NT_SUCCESS(status)) {
+            Irp->IoStatus.Status = status;
+            Irp->IoStatus.Information = 0;
+        }
+
+        IofCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+
+    return status;
+}
+
+void notify_flush(PDEVICE_OBJECT DeviceObject) {
+    device_notify& notify = get_notify(DeviceObject);
+
+    KIRQL irql;
+    KeAcquireSpinLock(&notify.lock, &irql);
+
+    // fail all the new requests
+    notify.closed = true;
+
+    KeReleaseSpinLock(&notify.lock, irql);
+
+    // cancel the requests that are still waiting
+    PIRP irp;
+
+    while ((irp = irp_queue_remove(notify.waiters)) != nullptr) {
+        irp->IoStatus.Status = STATUS_CANCELLED;
+        irp->IoStatus.Information = 0;
+
+        IofCompleteRequest(irp, IO_NO_INCREMENT);
+    }
+}
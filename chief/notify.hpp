@@ -0,0 +1,73 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+#include "ioctl.hpp"
+#include "irp_queue.hpp"
+
+/**
+ * @brief Channel that returns the device events to the application.
+ * The application keeps a ioctl_wait_event waiting in the queue and
+ * the driver completes it when something happens
+ *
+ */
+struct device_notify {
+    // spinlock to protect everything below
+    KSPIN_LOCK lock;
+
+    // the requests that wait for a event
+    irp_queue waiters;
+
+    // the events that happened while no request was waiting. The
+    // count is 0 when there is nothing to return
+    usb_chief_event_record pending;
+
+    // the sequence of the last record
+    ULONG sequence;
+
+    // the last power state and alternate setting we know of
+    ULONG power_state;
+    ULONG alternate_setting;
+
+    // true when the device is removed. New requests fail
+    bool closed;
+};
+
+/**
+ * @brief Initialize the notification channel
+ *
+ * @param DeviceObject
+ */
+void notify_init(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Report a event. Completes all the waiting requests or adds
+ * the event to the record of the next request. Can be called at
+ * dispatch level
+ *
+ * @param DeviceObject
+ * @param Event a single chief_event
+ * @param Value the pipe index of a stall, the device power state or
+ * the alternate setting. Not used for the other events
+ */
+void notify_event(PDEVICE_OBJECT DeviceObject, chief_event Event, ULONG Value = 0);
+
+/**
+ * @brief Wait for the next event. Completes the irp right away when
+ * events happened since the last record, otherwise queues it
+ *
+ * @param DeviceObject
+ * @param Irp
+ * @return NTSTATUS
+ */
+NTSTATUS notify_wait(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+
+/**
+ * @brief Close the channel and cancel the waiting requests. Should
+ * be called before the device is deleted
+ *
+ * @param DeviceObject
+ */
+void notify_flush(PDEVICE_OBJECT DeviceObject);
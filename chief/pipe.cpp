@@ -1,9 +1,10 @@
 #include "pipe.hpp"
 #include "device_extension.hpp"
+#include "tunables.hpp"
 
 void increment_active_pipe_count(PDEVICE_OBJECT DeviceObject) {
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
     
     // acquire the spinlock
     KIRQL irql;
@@ -18,7 +19,7 @@ void increment_active_pipe_count(PDEVICE_OBJECT DeviceObject) {
 
 LONG decrement_active_pipe_count_and_notify(PDEVICE_OBJECT DeviceObject) {
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
 
     // acquire the spinlock
     KIRQL irql;
@@ -46,7 +47,7 @@ LONG decrement_active_pipe_count_and_notify(PDEVICE_OBJECT DeviceObject) {
 
 LONG decrement_active_pipe_count(PDEVICE_OBJECT DeviceObject) {
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
 
     // acquire the spinlock
     KIRQL irql;
@@ -61,3 +62,424 @@ LONG decrement_active_pipe_count(PDEVICE_OBJECT DeviceObject) {
     // return the new count
     return new_count;
 }
+
+static LONGLONG pipe_owners_make(ULONG Epoch, ULONG Mask) {
+    return static_cast<LONGLONG>((static_cast<ULONGLONG>(Epoch) << 32) | Mask);
+}
+
+static ULONG pipe_owners_epoch(LONGLONG Owners) {
+    return static_cast<ULONG>(static_cast<ULONGLONG>(Owners) >> 32);
+}
+
+static ULONG pipe_owners_mask(LONGLONG Owners) {
+    return static_cast<ULONG>(static_cast<ULONGLONG>(Owners) & 0xffffffff);
+}
+
+static LONGLONG pipe_owners_read(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // a 64 bit read is not atomic on x86. The exchange does not change
+    // the value, it only returns it
+    return InterlockedCompareExchange64(&dev_ext->pipe_owners, 0, 0);
+}
+
+bool pipe_claim(PDEVICE_OBJECT DeviceObject, ULONG Index, ULONG& OutEpoch) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    if (Index >= chief_max_pipes) {
+        return false;
+    }
+
+    LONGLONG owners = pipe_owners_read(DeviceObject);
+
+    while (true) {
+        // check if the pipe already has a owner
+        if (pipe_owners_mask(owners) & (1ul << Index)) {
+            return false;
+        }
+
+        const LONGLONG claimed = pipe_owners_make(pipe_owners_epoch(owners), pipe_owners_mask(owners) | (1ul << Index));
+
+        // try to set the bit. Retry with the new value when another 
+        // pipe was claimed or released meanwhile
+        const LONGLONG previous = InterlockedCompareExchange64(&dev_ext->pipe_owners, claimed, owners);
+
+        if (previous == owners) {
+            OutEpoch = pipe_owners_epoch(owners);
+            return true;
+        }
+
+        owners = previous;
+    }
+}
+
+bool pipe_release(PDEVICE_OBJECT DeviceObject, ULONG Index, ULONG Epoch) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    if (Index >= chief_max_pipes) {
+        return false;
+    }
+
+    LONGLONG owners = pipe_owners_read(DeviceObject);
+
+    while (true) {
+        // the pipe is not ours anymore when the owners were revoked. 
+        // It could have a new owner in the new epoch
+        if (pipe_owners_epoch(owners) != Epoch || !(pipe_owners_mask(owners) & (1ul << Index))) {
+            return false;
+        }
+
+        const LONGLONG released = pipe_owners_make(Epoch, pipe_owners_mask(owners) & ~(1ul << Index));
+
+        const LONGLONG previous = InterlockedCompareExchange64(&dev_ext->pipe_owners, released, owners);
+
+        if (previous == owners) {
+            return true;
+        }
+
+        owners = previous;
+    }
+}
+
+ULONG pipe_claimed_mask(PDEVICE_OBJECT DeviceObject) {
+    return pipe_owners_mask(pipe_owners_read(DeviceObject));
+}
+
+ULONG pipe_revoke_all(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    LONGLONG owners = pipe_owners_read(DeviceObject);
+
+    // clear all the bits and move to the next epoch in one exchange
+    while (true) {
+        const LONGLONG previous = InterlockedCompareExchange64(
+            &dev_ext->pipe_owners, pipe_owners_make(pipe_owners_epoch(owners) + 1, 0), owners
+        );
+
+        if (previous == owners) {
+            break;
+        }
+
+        owners = previous;
+    }
+
+    const ULONG mask = pipe_owners_mask(owners);
+
+    // the released pipes do not count as active anymore
+    for (ULONG i = 0; i < chief_max_pipes; i++) {
+        if (mask & (1ul << i)) {
+            decrement_active_pipe_count(DeviceObject);
+        }
+    }
+
+    return mask;
+}
+
+// the fill ratio where we grow and shrink the adaptive transfer size
+constexpr static LONG pipe_grow_ratio = (chief_fill_ratio_scale * 7) / 8;
+constexpr static LONG pipe_shrink_ratio = chief_fill_ratio_scale / 4;
+
+// weight of a new transfer in the average fill ratio (1 / 2^shift)
+constexpr static LONG pipe_fill_ratio_shift = 2;
+
+static ULONG pipe_round_size(ULONG Size, ULONG PacketSize) {
+    // round down to a multiple of the packet size but keep at least one packet
+    const ULONG rounded = Size - (Size % PacketSize);
+
+    return (rounded < PacketSize) ? PacketSize : rounded;
+}
+
+static ULONGLONG pipe_read(volatile LONGLONG& Value) {
+    // read the full value at once. Needed on 32-bit systems
+    return static_cast<ULONGLONG>(InterlockedCompareExchange64(&Value, 0, 0));
+}
+
+static void pipe_state_defaults(pipe_state& State, const USBD_PIPE_INFORMATION& Pipe) {
+    // get the packet size. Prevent a division by zero on a bad descriptor
+    State.packet_size = (Pipe.MaximumPacketSize & 0x7ff) ? (Pipe.MaximumPacketSize & 0x7ff) : 1;
+
+    // the largest size we pick is limited by the tunables and the usb stack
+    const ULONG max_adaptive_size = get_tunables().max_adaptive_size;
+
+    const ULONG max_size = (Pipe.MaximumTransferSize && Pipe.MaximumTransferSize < max_adaptive_size) ?
+        Pipe.MaximumTransferSize : max_adaptive_size;
+
+    State.flags = 0;
+    State.min_size = State.packet_size;
+    State.max_size = pipe_round_size(max_size, State.packet_size);
+    State.transfer_size = static_cast<LONG>(State.max_size);
+    State.fill_ratio = chief_fill_ratio_scale / 2;
+
+    // clear the statistics
+    State.transfers = 0;
+    State.bytes = 0;
+    State.short_transfers = 0;
+    State.errors = 0;
+    State.crc_bytes = 0;
+    State.crc_ticks = 0;
+}
+
+bool pipe_handle_open(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // count the handle before we look at the flag. The reselect sets 
+    // the flag before it looks at the count, so one of the two always
+    // sees the other
+    InterlockedIncrement(&dev_ext->open_pipe_handles);
+
+    if (InterlockedCompareExchange(&dev_ext->pipe_reselecting, 0, 0)) {
+        InterlockedDecrement(&dev_ext->open_pipe_handles);
+        return false;
+    }
+
+    return true;
+}
+
+void pipe_handle_close(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    InterlockedDecrement(&dev_ext->open_pipe_handles);
+}
+
+bool pipe_begin_reselect(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // block new handles first, then check for the open ones. Only one
+    // reselect at a time, the watchdog and the application could both
+    // replace the pipes
+    if (InterlockedCompareExchange(&dev_ext->pipe_reselecting, 1, 0)) {
+        return false;
+    }
+
+    if (InterlockedCompareExchange(&dev_ext->open_pipe_handles, 0, 0)) {
+        InterlockedExchange(&dev_ext->pipe_reselecting, 0);
+        return false;
+    }
+
+    return true;
+}
+
+void pipe_end_reselect(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    InterlockedExchange(&dev_ext->pipe_reselecting, 0);
+}
+
+void pipe_state_init(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    for (ULONG i = 0; i < chief_max_pipes; i++) {
+        KeInitializeSpinLock(&dev_ext->pipes[i].lock);
+    }
+}
+
+void pipe_state_reset(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    PUSBD_INTERFACE_INFORMATION interface_info = dev_ext->usb_interface_info;
+
+    // check if we have a interface
+    if (!interface_info) {
+        return;
+    }
+
+    for (ULONG i = 0; i < interface_info->NumberOfPipes && i < chief_max_pipes; i++) {
+        pipe_state& state = dev_ext->pipes[i];
+
+        // acquire the spinlock
+        KIRQL irql;
+        KeAcquireSpinLock(&state.lock, &irql);
+
+        pipe_state_defaults(state, interface_info->Pipes[i]);
+
+        // release the spinlock
+        KeReleaseSpinLock(&state.lock, irql);
+    }
+}
+
+pipe_state* get_pipe_state(PDEVICE_OBJECT DeviceObject, ULONG Index) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // check if the pipe exists and we keep a state for it
+    if (!dev_ext->usb_interface_info || Index >= dev_ext->usb_interface_info->NumberOfPipes || Index >= chief_max_pipes) {
+        return nullptr;
+    }
+
+    return &dev_ext->pipes[Index];
+}
+
+ULONG pipe_state_transfer_size(pipe_state* State, ULONG Length, bool& OutAdaptive) {
+    OutAdaptive = false;
+
+    // check if we need to limit the transfer
+    if (!State || !(State->flags & chief_pipe_sizing_adaptive)) {
+        return Length;
+    }
+
+    const ULONG size = static_cast<ULONG>(State->transfer_size);
+
+    // a smaller user buffer does not tell us anything about 
+    // the adaptive size
+    if (Length < size) {
+        return Length;
+    }
+
+    OutAdaptive = true;
+
+    return size;
+}
+
+void pipe_state_complete(pipe_state* State, ULONG Requested, ULONG Transferred, NTSTATUS Status, bool Adaptive) {
+    if (!State) {
+        return;
+    }
+
+    // update the statistics
+    InterlockedIncrement64(&State->transfers);
+
+    if (!NT_SUCCESS(Status)) {
+        // a failed transfer does not say anything about the traffic
+        InterlockedIncrement64(&State->errors);
+        return;
+    }
+
+    InterlockedExchangeAdd64(&State->bytes, Transferred);
+
+    if (Transferred < Requested) {
+        InterlockedIncrement64(&State->short_transfers);
+    }
+
+    // only transfers with the adaptive size are used to pick the next size
+    if (!Adaptive || !Requested) {
+        return;
+    }
+
+    // get how full the transfer came back
+    const LONG ratio = static_cast<LONG>((static_cast<ULONGLONG>(Transferred) * chief_fill_ratio_scale) / Requested);
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&State->lock, &irql);
+
+    // update the average fill ratio
+    State->fill_ratio += (ratio - State->fill_ratio) / (1 << pipe_fill_ratio_shift);
+
+    const ULONG size = static_cast<ULONG>(State->transfer_size);
+
+    if (State->fill_ratio >= pipe_grow_ratio && size < State->max_size) {
+        // the transfers come back full. Use bigger transfers so 
+        // we need less completions for the same data
+        State->transfer_size = static_cast<LONG>(((size * 2) < State->max_size) ? (size * 2) : State->max_size);
+        State->fill_ratio = chief_fill_ratio_scale / 2;
+    }
+    else if (State->fill_ratio <= pipe_shrink_ratio && size > State->min_size) {
+        // the traffic is sparse. Use smaller transfers so the 
+        // data is returned with less latency
+        const ULONG smaller = pipe_round_size(size / 2, State->packet_size);
+
+        State->transfer_size = static_cast<LONG>((smaller > State->min_size) ? smaller : State->min_size);
+        State->fill_ratio = chief_fill_ratio_scale / 2;
+    }
+
+    // release the spinlock
+    KeReleaseSpinLock(&State->lock, irql);
+}
+
+void pipe_state_add_crc(pipe_state* State, ULONG Bytes, LONGLONG Ticks) {
+    if (!State) {
+        return;
+    }
+
+    InterlockedExchangeAdd64(&State->crc_bytes, Bytes);
+    InterlockedExchangeAdd64(&State->crc_ticks, Ticks);
+}
+
+NTSTATUS pipe_state_configure(PDEVICE_OBJECT DeviceObject, const usb_chief_pipe_sizing& Config) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // get the state of the pipe
+    pipe_state* state = get_pipe_state(DeviceObject, Config.pipe);
+
+    if (!state) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // check for unknown flags
+    if (Config.flags & ~static_cast<ULONG>(chief_pipe_sizing_adaptive)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // get the default bounds of the pipe
+    pipe_state defaults = {};
+    pipe_state_defaults(defaults, dev_ext->usb_interface_info->Pipes[Config.pipe]);
+
+    // zero selects the default bound
+    const ULONG min_size = Config.min_size ? pipe_round_size(Config.min_size, defaults.packet_size) : defaults.min_size;
+    const ULONG max_size = Config.max_size ? pipe_round_size(Config.max_size, defaults.packet_size) : defaults.max_size;
+
+    // check if the bounds are valid
+    if (min_size > max_size || max_size > defaults.max_size) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&state->lock, &irql);
+
+    state->flags = Config.flags;
+    state->min_size = min_size;
+    state->max_size = max_size;
+
+    // keep the current size when it is still in the bounds
+    const ULONG size = static_cast<ULONG>(state->transfer_size);
+
+    state->transfer_size = static_cast<LONG>((size < min_size) ? min_size : ((size > max_size) ? max_size : size));
+    state->fill_ratio = chief_fill_ratio_scale / 2;
+
+    // release the spinlock
+    KeReleaseSpinLock(&state->lock, irql);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS pipe_state_get_stats(PDEVICE_OBJECT DeviceObject, usb_chief_pipe_stats& OutStats) {
+    // get the state of the pipe
+    pipe_state* state = get_pipe_state(DeviceObject, OutStats.pipe);
+
+    if (!state) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&state->lock, &irql);
+
+    OutStats.flags = state->flags;
+    OutStats.min_size = state->min_size;
+    OutStats.max_size = state->max_size;
+    OutStats.transfer_size = static_cast<ULONG>(state->transfer_size);
+    OutStats.fill_ratio = static_cast<ULONG>(state->fill_ratio);
+
+    // release the spinlock
+    KeReleaseSpinLock(&state->lock, irql);
+
+    OutStats.transfers = pipe_read(state->transfers);
+    OutStats.bytes = pipe_read(state->bytes);
+    OutStats.short_transfers = pipe_read(state->short_transfers);
+    OutStats.errors = pipe_read(state->errors);
+    OutStats.crc_bytes = pipe_read(state->crc_bytes);
+    OutStats.crc_ticks = pipe_read(state->crc_ticks);
+
+    return STATUS_SUCCESS;
+}
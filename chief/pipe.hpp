@@ -4,6 +4,8 @@ extern "C" {
     #include <wdm.h>
 }
 
+#include "ioctl.hpp"
+
 /**
  * @brief Increment the pipe_count with spinlock protection
  * 
@@ -25,3 +27,196 @@ LONG decrement_active_pipe_count_and_notify(PDEVICE_OBJECT DeviceObject);
  * @return LONG 
  */
 LONG decrement_active_pipe_count(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Claim a pipe for a handle. Fails when the pipe already has 
+ * a owner. Can be called at dispatch level
+ *
+ * @param DeviceObject
+ * @param Index
+ * @param OutEpoch the epoch of the claim. Needed to release the pipe
+ * @return true when the handle owns the pipe
+ */
+bool pipe_claim(PDEVICE_OBJECT DeviceObject, ULONG Index, ULONG& OutEpoch);
+
+/**
+ * @brief Release a pipe that was claimed. Does nothing when the owners 
+ * were revoked after the claim
+ *
+ * @param DeviceObject
+ * @param Index
+ * @param Epoch the epoch of the claim
+ * @return true when the pipe was released. The caller should decrement
+ * the active pipe count
+ */
+bool pipe_release(PDEVICE_OBJECT DeviceObject, ULONG Index, ULONG Epoch);
+
+/**
+ * @brief Get a mask with a bit for every pipe that has a owner
+ *
+ * @param DeviceObject
+ * @return ULONG
+ */
+ULONG pipe_claimed_mask(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Release all the pipes and start a new epoch. The handles 
+ * that claimed a pipe before cannot release it anymore. Decrements 
+ * the active pipe count for every pipe that was released
+ *
+ * @param DeviceObject
+ * @return ULONG the mask of the pipes that were released
+ */
+ULONG pipe_revoke_all(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Count a new pipe handle. Fails while the configuration is 
+ * selected again, the handle would point to a pipe that is replaced
+ *
+ * @param DeviceObject
+ * @return true when the handle can be opened. Should be matched with
+ * pipe_handle_close
+ */
+bool pipe_handle_open(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Stop counting a pipe handle from pipe_handle_open
+ *
+ * @param DeviceObject
+ */
+void pipe_handle_close(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Block new pipe handles for a reselect of the configuration.
+ * Fails when a pipe handle is open or a other reselect is running
+ *
+ * @param DeviceObject
+ * @return true when no handle is open. Should be matched with 
+ * pipe_end_reselect
+ */
+bool pipe_begin_reselect(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Allow new pipe handles again after pipe_begin_reselect
+ *
+ * @param DeviceObject
+ */
+void pipe_end_reselect(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Transfer sizing and statistics of a single pipe
+ *
+ */
+struct pipe_state {
+    // spinlock to protect the sizing fields
+    KSPIN_LOCK lock;
+
+    // the chief_pipe_sizing_flags of the pipe
+    ULONG flags;
+
+    // the bounds of the adaptive transfer size. Multiples 
+    // of the packet size
+    ULONG min_size;
+    ULONG max_size;
+
+    // the maximum packet size of the pipe
+    ULONG packet_size;
+
+    // the transfer size picked by the adaptive sizing. Can 
+    // be read without the lock
+    volatile LONG transfer_size;
+
+    // average fill ratio of the recent transfers. Scaled 
+    // with chief_fill_ratio_scale
+    LONG fill_ratio;
+
+    // statistics. Should only be modified using Interlocked functions
+    volatile LONGLONG transfers;
+    volatile LONGLONG bytes;
+    volatile LONGLONG short_transfers;
+    volatile LONGLONG errors;
+
+    // cost of the crc read mode. Should only be modified using 
+    // Interlocked functions
+    volatile LONGLONG crc_bytes;
+    volatile LONGLONG crc_ticks;
+};
+
+/**
+ * @brief Initialize the state of all the pipes
+ *
+ * @param DeviceObject
+ */
+void pipe_state_init(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Reset the sizing and statistics of all the pipes to the 
+ * defaults of the current usb interface. Should be called after 
+ * the interface changed
+ *
+ * @param DeviceObject
+ */
+void pipe_state_reset(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Get the state of a pipe. Returns a nullptr when we do not 
+ * keep a state for the pipe
+ *
+ * @param DeviceObject
+ * @param Index
+ * @return pipe_state*
+ */
+pipe_state* get_pipe_state(PDEVICE_OBJECT DeviceObject, ULONG Index);
+
+/**
+ * @brief Get the size of the next in transfer on a pipe. Returns 
+ * the length when the adaptive sizing is disabled or the length 
+ * is smaller than the adaptive size
+ *
+ * @param State
+ * @param Length the length of the user buffer
+ * @param OutAdaptive set to true when the adaptive size is used
+ * @return ULONG
+ */
+ULONG pipe_state_transfer_size(pipe_state* State, ULONG Length, bool& OutAdaptive);
+
+/**
+ * @brief Update the statistics and the adaptive size of a pipe with 
+ * a completed transfer. Called at dispatch level
+ *
+ * @param State
+ * @param Requested the length of the transfer
+ * @param Transferred the length the usb stack returned
+ * @param Status the status of the transfer
+ * @param Adaptive true when the length was picked by the adaptive sizing
+ */
+void pipe_state_complete(pipe_state* State, ULONG Requested, ULONG Transferred, NTSTATUS Status, bool Adaptive);
+
+/**
+ * @brief Add the cost of a crc over a completed transfer to the 
+ * statistics of a pipe. Called at dispatch level
+ *
+ * @param State
+ * @param Bytes the amount of bytes in the crc
+ * @param Ticks the performance counter ticks the crc took
+ */
+void pipe_state_add_crc(pipe_state* State, ULONG Bytes, LONGLONG Ticks);
+
+/**
+ * @brief Configure the transfer sizing of a pipe
+ *
+ * @param DeviceObject
+ * @param Config
+ * @return NTSTATUS
+ */
+NTSTATUS pipe_state_configure(PDEVICE_OBJECT DeviceObject, const usb_chief_pipe_sizing& Config);
+
+/**
+ * @brief Get the sizing and statistics of a pipe. The pipe field of 
+ * the stats selects the pipe
+ *
+ * @param DeviceObject
+ * @param OutStats
+ * @return NTSTATUS
+ */
+NTSTATUS pipe_state_get_stats(PDEVICE_OBJECT DeviceObject, usb_chief_pipe_stats& OutStats);
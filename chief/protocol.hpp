@@ -0,0 +1,327 @@
+#pragma once
+
+#include "ioctl.hpp"
+
+/**
+ * @brief The part of the Chief protocol that does not depend on the
+ * platform. The driver and the user mode backends only provide a
+ * transport for it. This header does not depend on any kernel
+ * headers so it can also be used from user mode
+ *
+ * A transport is a class with these members. A negative status is a
+ * error (a NTSTATUS in the driver, a -errno on linux):
+ *
+ *  // copy a part of the image to the bounce buffer
+ *  long read_image(const void* Image, unsigned long Offset, void* Buffer, unsigned long Length);
+ *
+ *  // send a control request to the device and wait for it. The
+ *  // length is the amount of bytes that are transferred
+ *  long control(const chief_setup_packet& Setup, void* Buffer, unsigned long& OutLength);
+ *
+ *  // select a alternate setting of the interface. Interface points
+ *  // at the interface descriptor of the setting in the configuration
+ *  long select_setting(const void* Interface, const chief_interface_setting& Setting);
+ *
+ * A template only needs the members it uses
+ *
+ */
+
+// the interface of the device. The device only has one
+constexpr static unsigned char chief_interface_number = 0;
+
+// the amount of alternate settings we support
+constexpr static unsigned long chief_max_alternate_settings = 2;
+
+// the most endpoints a alternate setting can have
+constexpr static unsigned long chief_max_setting_endpoints = 16;
+
+// the descriptor types of the usb specification we parse
+constexpr static unsigned char chief_descriptor_configuration = 2;
+constexpr static unsigned char chief_descriptor_interface = 4;
+constexpr static unsigned char chief_descriptor_endpoint = 5;
+
+// bmAttributes of a endpoint descriptor
+constexpr static unsigned char chief_endpoint_type_mask = 0x03;
+constexpr static unsigned char chief_endpoint_type_bulk = 0x02;
+constexpr static unsigned char chief_endpoint_direction_in = 0x80;
+
+// bmRequestType of a vendor request to the device
+constexpr static unsigned char chief_request_type_vendor_out = 0x40;
+constexpr static unsigned char chief_request_type_vendor_in = 0xc0;
+
+/**
+ * @brief The setup packet of a control request
+ *
+ */
+struct chief_setup_packet {
+    unsigned char request_type;
+    unsigned char request;
+    unsigned short value;
+    unsigned short index;
+    unsigned short length;
+};
+
+/**
+ * @brief Get the setup packet of a vendor request to the device
+ *
+ * @param In true when the device returns data
+ * @param Request
+ * @param Value
+ * @param Index
+ * @param Length
+ * @return chief_setup_packet
+ */
+constexpr chief_setup_packet protocol_vendor_setup(bool In, unsigned char Request, unsigned short Value, unsigned short Index, unsigned short Length) {
+    return {
+        In ? chief_request_type_vendor_in : chief_request_type_vendor_out,
+        Request, Value, Index, Length
+    };
+}
+
+/**
+ * @brief Check if the setup packet reads data from the device
+ *
+ * @param Setup
+ * @return bool
+ */
+constexpr bool protocol_setup_is_in(const chief_setup_packet& Setup) {
+    return (Setup.request_type & 0x80) != 0;
+}
+
+/**
+ * @brief Check the fields of a image download
+ *
+ * @param Request
+ * @return bool
+ */
+inline bool protocol_image_download_valid(const usb_chief_image_download& Request) {
+    // check if we have a valid chunk length and a image
+    if (!Request.chunk_length || Request.chunk_length > chief_max_image_chunk_length || Request.reserved) {
+        return false;
+    }
+
+    return !Request.length || Request.data;
+}
+
+/**
+ * @brief Move the value and index of a image download to the next
+ * chunk
+ *
+ * @param Request
+ * @param Length the length of the chunk that was sent
+ * @param Value
+ * @param Index
+ */
+inline void protocol_next_image_chunk(const usb_chief_image_download& Request, unsigned long Length, unsigned short& Value, unsigned short& Index) {
+    if (Request.flags & chief_image_flag_address) {
+        // use the value and index as a 32-bit address
+        const unsigned long address = ((static_cast<unsigned long>(Index) << 16) | Value) + Length;
+
+        Value = static_cast<unsigned short>(address & 0xffff);
+        Index = static_cast<unsigned short>((address >> 16) & 0xffff);
+    }
+    else {
+        Value = static_cast<unsigned short>(Value + Request.value_step);
+        Index = static_cast<unsigned short>(Index + Request.index_step);
+    }
+}
+
+/**
+ * @brief Send a image to the device as back to back vendor OUT
+ * requests. The request should be checked with
+ * protocol_image_download_valid first
+ *
+ * @tparam Transport
+ * @param Link
+ * @param Request
+ * @param Buffer bounce buffer of at least chunk_length bytes
+ * @param OutTransferred the amount of bytes that are sent. When the
+ * download failed this is the offset of the failing chunk
+ * @return long the status of the first chunk that failed
+ */
+template <typename Transport>
+long protocol_download_image(Transport& Link, const usb_chief_image_download& Request, void* Buffer, unsigned long& OutTransferred) {
+    OutTransferred = 0;
+
+    // the address/value and index of the current chunk
+    unsigned short value = Request.value;
+    unsigned short index = Request.index;
+
+    // send all the chunks
+    for (unsigned long offset = 0; offset < Request.length; offset += Request.chunk_length) {
+        // get the length of this chunk
+        const unsigned long length = ((Request.length - offset) < Request.chunk_length) ?
+            (Request.length - offset) : Request.chunk_length;
+
+        // copy the chunk to the bounce buffer
+        long status = Link.read_image(Request.data, offset, Buffer, length);
+
+        if (status < 0) {
+            return status;
+        }
+
+        // send the chunk. Stop on the first error
+        unsigned long transferred = 0;
+        status = Link.control(
+            protocol_vendor_setup(false, Request.request & 0xff, value, index, static_cast<unsigned short>(length)),
+            Buffer, transferred
+        );
+
+        if (status < 0) {
+            return status;
+        }
+
+        // mark the chunk as transferred
+        OutTransferred = offset + length;
+
+        protocol_next_image_chunk(Request, length, value, index);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief A endpoint of a alternate setting
+ *
+ */
+struct chief_endpoint_info {
+    // bEndpointAddress, the direction is in the top bit
+    unsigned char address;
+
+    // bmAttributes, the transfer type is in the low bits
+    unsigned char attributes;
+
+    // wMaxPacketSize without the high bandwidth bits
+    unsigned short max_packet_size;
+
+    unsigned char interval;
+};
+
+/**
+ * @brief A alternate setting of the interface in the configuration
+ * descriptor
+ *
+ */
+struct chief_interface_setting {
+    // offset of the interface descriptor in the configuration
+    unsigned long offset;
+
+    unsigned char interface_number;
+    unsigned char alternate_setting;
+
+    // the endpoints in the order of the descriptor. The pipes of the
+    // driver are in the same order
+    unsigned long endpoint_count;
+    chief_endpoint_info endpoints[chief_max_setting_endpoints];
+};
+
+/**
+ * @brief Check if a endpoint is a bulk in endpoint
+ *
+ * @param Endpoint
+ * @return bool
+ */
+constexpr bool protocol_endpoint_is_bulk_in(const chief_endpoint_info& Endpoint) {
+    return (Endpoint.address & chief_endpoint_direction_in) &&
+        (Endpoint.attributes & chief_endpoint_type_mask) == chief_endpoint_type_bulk;
+}
+
+/**
+ * @brief Find a alternate setting of the interface in a configuration
+ * descriptor with its interface, endpoint and class descriptors. Every
+ * descriptor is checked to be inside the length, so the descriptor
+ * can come from the device
+ *
+ * @param Configuration
+ * @param Length the amount of bytes we have of the configuration
+ * @param AlternateSetting should be below chief_max_alternate_settings
+ * @param OutSetting
+ * @return bool false when the setting is not supported or not in the
+ * descriptor, or when the descriptor is broken
+ */
+inline bool protocol_find_setting(const void* Configuration, unsigned long Length, unsigned long AlternateSetting, chief_interface_setting& OutSetting) {
+    const unsigned char* data = static_cast<const unsigned char*>(Configuration);
+
+    if (AlternateSetting >= chief_max_alternate_settings || !data || Length < 9) {
+        return false;
+    }
+
+    // the header of the configuration has the length of the whole set
+    if (data[0] < 9 || data[1] != chief_descriptor_configuration) {
+        return false;
+    }
+
+    const unsigned long total = static_cast<unsigned long>(data[2]) | (static_cast<unsigned long>(data[3]) << 8);
+    const unsigned long end = (total < Length) ? total : Length;
+
+    bool found = false;
+
+    for (unsigned long offset = data[0]; offset + 2 <= end; offset += data[offset]) {
+        const unsigned char length = data[offset];
+        const unsigned char type = data[offset + 1];
+
+        // a descriptor that does not fit ends the set. A empty one
+        // would loop forever
+        if (length < 2 || offset + length > end) {
+            return false;
+        }
+
+        if (type == chief_descriptor_interface) {
+            if (length < 9) {
+                return false;
+            }
+
+            // the endpoints of the setting end at the next interface
+            if (found) {
+                break;
+            }
+
+            if (data[offset + 2] != chief_interface_number || data[offset + 3] != AlternateSetting) {
+                continue;
+            }
+
+            found = true;
+
+            OutSetting.offset = offset;
+            OutSetting.interface_number = data[offset + 2];
+            OutSetting.alternate_setting = data[offset + 3];
+            OutSetting.endpoint_count = 0;
+
+            // the endpoints we expect after the interface
+            if (data[offset + 4] > chief_max_setting_endpoints) {
+                return false;
+            }
+        }
+        else if (type == chief_descriptor_endpoint && found) {
+            if (length < 7 || OutSetting.endpoint_count >= chief_max_setting_endpoints) {
+                return false;
+            }
+
+            chief_endpoint_info& endpoint = OutSetting.endpoints[OutSetting.endpoint_count++];
+
+            endpoint.address = data[offset + 2];
+            endpoint.attributes = data[offset + 3];
+            endpoint.max_packet_size = static_cast<unsigned short>((data[offset + 4] | (data[offset + 5] << 8)) & 0x7ff);
+            endpoint.interval = data[offset + 6];
+        }
+    }
+
+    // the setting should have all the endpoints its interface has
+    return found && OutSetting.endpoint_count == data[OutSetting.offset + 4];
+}
+
+/**
+ * @brief Select a alternate setting of the interface. The setting
+ * should be found with protocol_find_setting in the same configuration
+ * first
+ *
+ * @tparam Transport
+ * @param Link
+ * @param Configuration
+ * @param Setting
+ * @return long the status of the transport
+ */
+template <typename Transport>
+long protocol_select_setting(Transport& Link, const void* Configuration, const chief_interface_setting& Setting) {
+    return Link.select_setting(static_cast<const unsigned char*>(Configuration) + Setting.offset, Setting);
+}
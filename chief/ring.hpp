@@ -0,0 +1,285 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+/**
+ * @brief Bounded lock-free ring with fixed size records. Any amount
+ * of producers and consumers can use the ring at the same time, at
+ * any irql up to dispatch level. A record is reserved with begin_push,
+ * filled in place and published with end_push so large records are
+ * only copied once. When the ring is full new records are dropped
+ *
+ * @tparam T type of the records
+ * @tparam Capacity amount of records. Should be a power of 2
+ */
+template <typename T, ULONG Capacity>
+class mpmc_ring {
+    static_assert(Capacity >= 2 && !(Capacity & (Capacity - 1)), "Capacity should be a power of 2");
+
+protected:
+    // a single record with the sequence that tells if the
+    // cell is free (position) or published (position + 1)
+    struct cell {
+        volatile LONG sequence;
+        T value;
+    };
+
+    // position of the next record to write and to read. Kept on
+    // separate cache lines so producers and consumers do not share
+    volatile LONG write_position;
+    UCHAR write_padding[64 - sizeof(LONG)];
+
+    volatile LONG read_position;
+    UCHAR read_padding[64 - sizeof(LONG)];
+
+    // amount of records dropped because the ring was full
+    volatile LONG dropped_records;
+
+    // the records
+    cell cells[Capacity];
+
+public:
+    /**
+     * @brief Initialize the ring. Should be called before the
+     * ring is used
+     *
+     */
+    void init() {
+        write_position = 0;
+        read_position = 0;
+        dropped_records = 0;
+
+        // every cell is free for the first lap
+        for (ULONG i = 0; i < Capacity; i++) {
+            cells[i].sequence = static_cast<LONG>(i);
+        }
+    }
+
+    /**
+     * @brief Reserve a record. Returns a nullptr when the ring is
+     * full. The record should be published with end_push
+     *
+     * @param Position the position of the record. Used in end_push
+     * @return T*
+     */
+    T* begin_push(ULONG& Position) {
+        ULONG position = static_cast<ULONG>(write_position);
+
+        while (true) {
+            cell& current = cells[position & (Capacity - 1)];
+
+            // the difference wraps with the positions
+            const LONG difference = static_cast<LONG>(static_cast<ULONG>(current.sequence) - position);
+
+            if (!difference) {
+                // the cell is free. Try to claim it
+                const ULONG previous = static_cast<ULONG>(InterlockedCompareExchange(
+                    &write_position, static_cast<LONG>(position + 1), static_cast<LONG>(position)
+                ));
+
+                if (previous == position) {
+                    Position = position;
+                    return &current.value;
+                }
+
+                position = previous;
+            }
+            else if (difference < 0) {
+                // the reader did not free the cell yet. The ring is full
+                InterlockedIncrement(&dropped_records);
+                return nullptr;
+            }
+            else {
+                // another producer claimed the cell. Try again
+                position = static_cast<ULONG>(write_position);
+            }
+        }
+    }
+
+    /**
+     * @brief Publish a record reserved with begin_push
+     *
+     * @param Position
+     */
+    void end_push(ULONG Position) {
+        // the interlocked exchange is a full barrier. The record is
+        // visible before the sequence is
+        InterlockedExchange(&cells[Position & (Capacity - 1)].sequence, static_cast<LONG>(Position + 1));
+    }
+
+    /**
+     * @brief Copy the oldest record out of the ring. Returns false
+     * when the ring is empty
+     *
+     * @param Out
+     * @return true
+     * @return false
+     */
+    bool pop(T& Out) {
+        ULONG position = static_cast<ULONG>(read_position);
+
+        while (true) {
+            cell& current = cells[position & (Capacity - 1)];
+
+            // the difference wraps with the positions
+            const LONG difference = static_cast<LONG>(static_cast<ULONG>(current.sequence) - (position + 1));
+
+            if (!difference) {
+                // the cell is published. Try to claim it
+                const ULONG previous = static_cast<ULONG>(InterlockedCompareExchange(
+                    &read_position, static_cast<LONG>(position + 1), static_cast<LONG>(position)
+                ));
+
+                if (previous == position) {
+                    // copy the record and free the cell for the next lap
+                    Out = current.value;
+                    InterlockedExchange(&current.sequence, static_cast<LONG>(position + Capacity));
+
+                    return true;
+                }
+
+                position = previous;
+            }
+            else if (difference < 0) {
+                // nothing published at this position. The ring is empty
+                return false;
+            }
+            else {
+                // another consumer claimed the cell. Try again
+                position = static_cast<ULONG>(read_position);
+            }
+        }
+    }
+
+    /**
+     * @brief Get and reset the amount of dropped records
+     *
+     * @return ULONG
+     */
+    ULONG take_dropped() {
+        return static_cast<ULONG>(InterlockedExchange(&dropped_records, 0));
+    }
+};
+
+/**
+ * @brief Owner of a mpmc_ring that is allocated the first time it is
+ * enabled, drained from a ioctl and freed when the device is removed.
+ * Lives in the device extension so it starts zeroed
+ *
+ * @tparam T type of the records
+ * @tparam Capacity amount of records. Should be a power of 2
+ */
+template <typename T, ULONG Capacity>
+class ring_owner {
+public:
+    using ring_type = mpmc_ring<T, Capacity>;
+
+private:
+    // the ring. nullptr until install succeeds and after free
+    ring_type* volatile ring;
+
+public:
+    /**
+     * @brief Get the ring. Returns a nullptr when the ring was never
+     * installed or is freed
+     *
+     * @return ring_type*
+     */
+    ring_type* get() const {
+        return ring;
+    }
+
+    /**
+     * @brief Allocate and install the ring when there is none yet. Can
+     * be called by multiple threads at the same time
+     *
+     * @return NTSTATUS
+     */
+    NTSTATUS install() {
+        if (ring) {
+            return STATUS_SUCCESS;
+        }
+
+        ring_type* allocated = reinterpret_cast<ring_type*>(ExAllocatePoolWithTag(
+            NonPagedPool,
+            sizeof(ring_type),
+            0x206D6457u
+        ));
+
+        // check if we got memory
+        if (!allocated) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        allocated->init();
+
+        // install the ring. Free ours when someone else was first
+        if (InterlockedCompareExchangePointer(reinterpret_cast<PVOID volatile*>(&ring), allocated, nullptr)) {
+            ExFreePool(allocated);
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    /**
+     * @brief Move the records to a drain header and the records that
+     * fit after it. The header should have a count and a dropped field
+     *
+     * @tparam Drain type of the header
+     * @param Buffer
+     * @param Length
+     * @param OutLength the amount of bytes written to the buffer
+     * @return NTSTATUS
+     */
+    template <typename Drain>
+    NTSTATUS drain(void* Buffer, ULONG Length, ULONG& OutLength) {
+        OutLength = 0;
+
+        // check if we have room for the header
+        if (Length < sizeof(Drain)) {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        Drain* header = reinterpret_cast<Drain*>(Buffer);
+        T* records = reinterpret_cast<T*>(header + 1);
+
+        header->count = 0;
+        header->dropped = 0;
+
+        ring_type* current = ring;
+
+        // check if the ring was ever installed
+        if (current) {
+            // get the amount of records that fit in the buffer
+            const ULONG max_count = (Length - sizeof(Drain)) / sizeof(T);
+
+            // move the records to the buffer
+            while (header->count < max_count && current->pop(records[header->count])) {
+                header->count++;
+            }
+
+            header->dropped = current->take_dropped();
+        }
+
+        OutLength = sizeof(Drain) + (header->count * sizeof(T));
+
+        return STATUS_SUCCESS;
+    }
+
+    /**
+     * @brief Free the ring. Should only be called when no records are
+     * pushed anymore
+     *
+     */
+    void free() {
+        ring_type* current = reinterpret_cast<ring_type*>(
+            InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(&ring), nullptr)
+        );
+
+        if (current) {
+            ExFreePool(current);
+        }
+    }
+};
@@ -0,0 +1,296 @@
+#include "scheduler.hpp"
+#include "device_extension.hpp"
+#include "usb.hpp"
+#include "tunables.hpp"
+
+static transfer_scheduler& get_scheduler(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    return dev_ext->scheduler;
+}
+
+static void scheduler_update_max(volatile LONG& Max, LONG Value) {
+    LONG current = Max;
+
+    // only update when the value is higher than the current maximum
+    while (Value > current) {
+        const LONG previous = InterlockedCompareExchange(&Max, Value, current);
+
+        if (previous == current) {
+            break;
+        }
+
+        current = previous;
+    }
+}
+
+static void scheduler_update_max(volatile LONGLONG& Max, LONGLONG Value) {
+    LONGLONG current = Max;
+
+    // only update when the value is higher than the current maximum
+    while (Value > current) {
+        const LONGLONG previous = InterlockedCompareExchange64(&Max, Value, current);
+
+        if (previous == current) {
+            break;
+        }
+
+        current = previous;
+    }
+}
+
+static ULONGLONG scheduler_read(volatile LONGLONG& Value) {
+    // read the full value at once. Needed on 32-bit systems
+    return static_cast<ULONGLONG>(InterlockedCompareExchange64(&Value, 0, 0));
+}
+
+static bool scheduler_reserve(transfer_scheduler& Scheduler, transfer_class_state& State) {
+    const transfer_class_state& control = Scheduler.classes[chief_transfer_control];
+
+    // while control transfers are active or waiting we only keep one
+    // transfer in flight so the control transfers are serviced first
+    const LONG limit = (control.outstanding || control.waiting) ? 1 : State.budget;
+
+    LONG current = State.outstanding;
+
+    // try to get a slot in the budget
+    while (current < limit) {
+        const LONG previous = InterlockedCompareExchange(&State.outstanding, current + 1, current);
+
+        if (previous == current) {
+            return true;
+        }
+
+        current = previous;
+    }
+
+    return false;
+}
+
+static bool scheduler_start_next(PDEVICE_OBJECT DeviceObject, chief_transfer_class Class) {
+    transfer_scheduler& scheduler = get_scheduler(DeviceObject);
+    transfer_class_state& state = scheduler.classes[Class];
+
+    // check if we have anything waiting
+    if (!state.queue.depth) {
+        return false;
+    }
+
+    // check if we have room in the budget
+    if (!scheduler_reserve(scheduler, state)) {
+        return false;
+    }
+
+    // get the next transfer
+    PIRP irp = irp_queue_remove(state.queue);
+
+    if (!irp) {
+        // the transfer was canceled in the meantime. Release the slot
+        InterlockedDecrement(&state.outstanding);
+        return false;
+    }
+
+    // update the statistics
+    const ULONG wait = irp_queue_wait_time(irp);
+
+    InterlockedExchangeAdd64(&state.total_wait, wait);
+    scheduler_update_max(state.max_wait, wait);
+    InterlockedIncrement64(&state.submitted);
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // send the transfer to the usb stack
+    IofCallDriver(dev_ext->attachedDeviceObject, irp);
+
+    return true;
+}
+
+static void scheduler_dispatch(PDEVICE_OBJECT DeviceObject) {
+    transfer_scheduler& scheduler = get_scheduler(DeviceObject);
+
+    // check if someone else is already starting transfers. That
+    // caller will do another pass for our request. This also makes
+    // sure we do not recurse when a transfer completes right away
+    if (InterlockedIncrement(&scheduler.dispatch_requests) != 1) {
+        return;
+    }
+
+    LONG requests;
+
+    do {
+        // get the amount of requests we are handling in this pass
+        requests = scheduler.dispatch_requests;
+
+        bool started = true;
+
+        // keep going as long as we can start transfers
+        while (started) {
+            started = false;
+
+            // alternate the class that gets the first chance so both
+            // the interrupt and the bulk transfers get fair service
+            const LONG first = InterlockedIncrement(&scheduler.next_class);
+
+            for (LONG i = 0; i < 2; i++) {
+                const chief_transfer_class transfer_class = ((first + i) & 1) ?
+                    chief_transfer_bulk : chief_transfer_interrupt;
+
+                if (scheduler_start_next(DeviceObject, transfer_class)) {
+                    started = true;
+                }
+            }
+        }
+    } while (InterlockedExchangeAdd(&scheduler.dispatch_requests, -requests) != requests);
+}
+
+void scheduler_init(PDEVICE_OBJECT DeviceObject) {
+    transfer_scheduler& scheduler = get_scheduler(DeviceObject);
+
+    // get the tunables with the interrupt and bulk budgets
+    const usb_chief_tunables& tunables = get_tunables();
+
+    // the budget of every class
+    const LONG budgets[chief_transfer_class_count] = {
+        scheduler_control_budget,
+        static_cast<LONG>(tunables.interrupt_budget),
+        static_cast<LONG>(tunables.bulk_budget)
+    };
+
+    for (ULONG i = 0; i < chief_transfer_class_count; i++) {
+        transfer_class_state& state = scheduler.classes[i];
+
+        // canceled transfers are cleaned up by the usb code
+        irp_queue_init(state.queue, DeviceObject, usb_cancel_bulk_or_interrupt_transfer);
+
+        state.budget = budgets[i];
+    }
+
+    // control transfers wait on the semaphore for a slot
+    KeInitializeSemaphore(&scheduler.control_slots, scheduler_control_budget, scheduler_control_budget);
+}
+
+void scheduler_set_budgets(PDEVICE_OBJECT DeviceObject, ULONG InterruptBudget, ULONG BulkBudget) {
+    transfer_scheduler& scheduler = get_scheduler(DeviceObject);
+
+    InterlockedExchange(&scheduler.classes[chief_transfer_interrupt].budget, static_cast<LONG>(InterruptBudget));
+    InterlockedExchange(&scheduler.classes[chief_transfer_bulk].budget, static_cast<LONG>(BulkBudget));
+
+    // start the transfers that fit in a bigger budget
+    scheduler_dispatch(DeviceObject);
+}
+
+NTSTATUS scheduler_submit(PDEVICE_OBJECT DeviceObject, PIRP Irp, chief_transfer_class Class) {
+    transfer_scheduler& scheduler = get_scheduler(DeviceObject);
+    transfer_class_state& state = scheduler.classes[Class];
+
+    // start the transfer right away when nothing is waiting
+    // and we have room in the budget
+    if (!state.queue.depth && scheduler_reserve(scheduler, state)) {
+        InterlockedIncrement64(&state.submitted);
+
+        // get the device extension
+        chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+        return IofCallDriver(dev_ext->attachedDeviceObject, Irp);
+    }
+
+    // wait in the queue. This marks the irp as pending
+    irp_queue_insert(state.queue, Irp);
+
+    // update the statistics
+    InterlockedIncrement64(&state.queued);
+    scheduler_update_max(state.max_depth, state.queue.depth);
+
+    // a transfer could have completed before we were in the
+    // queue. Make sure we are not waiting for nothing
+    scheduler_dispatch(DeviceObject);
+
+    return STATUS_PENDING;
+}
+
+void scheduler_complete(PDEVICE_OBJECT DeviceObject, chief_transfer_class Class) {
+    transfer_scheduler& scheduler = get_scheduler(DeviceObject);
+
+    // release the slot in the budget
+    InterlockedDecrement(&scheduler.classes[Class].outstanding);
+
+    // start the next transfers
+    scheduler_dispatch(DeviceObject);
+}
+
+void scheduler_control_begin(PDEVICE_OBJECT DeviceObject) {
+    transfer_scheduler& scheduler = get_scheduler(DeviceObject);
+    transfer_class_state& state = scheduler.classes[chief_transfer_control];
+
+    // mark we are waiting. This already limits the other
+    // classes so the control transfer gets a slot first
+    scheduler_update_max(state.max_depth, InterlockedIncrement(&state.waiting));
+
+    const LONGLONG start = KeQueryPerformanceCounter(nullptr).QuadPart;
+
+    // check if we can get a slot without waiting
+    LARGE_INTEGER timeout;
+    timeout.QuadPart = 0;
+
+    if (KeWaitForSingleObject(&scheduler.control_slots, Executive, KernelMode, false, &timeout) == STATUS_TIMEOUT) {
+        // we need to wait for a slot
+        InterlockedIncrement64(&state.queued);
+
+        KeWaitForSingleObject(&scheduler.control_slots, Executive, KernelMode, false, nullptr);
+    }
+
+    // we have a slot
+    InterlockedIncrement(&state.outstanding);
+    InterlockedDecrement(&state.waiting);
+
+    // update the statistics
+    const LONGLONG wait = KeQueryPerformanceCounter(nullptr).QuadPart - start;
+
+    InterlockedExchangeAdd64(&state.total_wait, wait);
+    scheduler_update_max(state.max_wait, wait);
+    InterlockedIncrement64(&state.submitted);
+}
+
+void scheduler_control_end(PDEVICE_OBJECT DeviceObject) {
+    transfer_scheduler& scheduler = get_scheduler(DeviceObject);
+
+    // release the slot
+    InterlockedDecrement(&scheduler.classes[chief_transfer_control].outstanding);
+    KeReleaseSemaphore(&scheduler.control_slots, IO_NO_INCREMENT, 1, false);
+
+    // start the transfers that were waiting for the control transfer
+    scheduler_dispatch(DeviceObject);
+}
+
+void scheduler_flush(PDEVICE_OBJECT DeviceObject) {
+    transfer_scheduler& scheduler = get_scheduler(DeviceObject);
+
+    for (ULONG i = 0; i < chief_transfer_class_count; i++) {
+        PIRP irp;
+
+        // cancel everything that is waiting
+        while ((irp = irp_queue_remove(scheduler.classes[i].queue)) != nullptr) {
+            usb_cancel_bulk_or_interrupt_transfer(DeviceObject, irp);
+        }
+    }
+}
+
+void scheduler_get_stats(PDEVICE_OBJECT DeviceObject, usb_chief_scheduler_stats& OutStats) {
+    transfer_scheduler& scheduler = get_scheduler(DeviceObject);
+
+    for (ULONG i = 0; i < chief_transfer_class_count; i++) {
+        transfer_class_state& state = scheduler.classes[i];
+        usb_chief_queue_stats& stats = OutStats.classes[i];
+
+        stats.outstanding = state.outstanding;
+        stats.budget = state.budget;
+        stats.depth = (i == chief_transfer_control) ? state.waiting : state.queue.depth;
+        stats.max_depth = state.max_depth;
+        stats.submitted = scheduler_read(state.submitted);
+        stats.queued = scheduler_read(state.queued);
+        stats.total_wait = scheduler_read(state.total_wait);
+        stats.max_wait = scheduler_read(state.max_wait);
+    }
+}
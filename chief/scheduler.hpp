@@ -0,0 +1,135 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+#include "ioctl.hpp"
+#include "irp_queue.hpp"
+
+// the maximum amount of outstanding transfers for every class. The
+// interrupt and bulk budgets are the defaults of the tunables
+constexpr static LONG scheduler_control_budget = 1;
+constexpr static LONG scheduler_interrupt_budget = 8;
+constexpr static LONG scheduler_bulk_budget = 32;
+
+/**
+ * @brief State and statistics of a single transfer class
+ *
+ */
+struct transfer_class_state {
+    // queue with the transfers that are waiting for a slot in the
+    // budget. Not used for control transfers, those wait on the
+    // control semaphore
+    irp_queue queue;
+
+    // the amount of transfers the usb stack is processing. Should
+    // only be modified using Interlocked functions
+    volatile LONG outstanding;
+
+    // the maximum amount of outstanding transfers. Can be changed
+    // at runtime by the tunables
+    volatile LONG budget;
+
+    // the amount of control transfers waiting for the semaphore
+    volatile LONG waiting;
+
+    // statistics. Should only be modified using Interlocked functions
+    volatile LONG max_depth;
+    volatile LONGLONG submitted;
+    volatile LONGLONG queued;
+    volatile LONGLONG total_wait;
+    volatile LONGLONG max_wait;
+};
+
+/**
+ * @brief Scheduler that keeps control, interrupt and bulk transfers
+ * apart. Control transfers are serviced first. While control transfers
+ * are active interrupt and bulk transfers only keep one transfer in
+ * flight, the queued work is started when the control transfer is
+ * done. Interrupt and bulk transfers are started in round robin order
+ *
+ */
+struct transfer_scheduler {
+    // the state of every chief_transfer_class
+    transfer_class_state classes[chief_transfer_class_count];
+
+    // semaphore with a count for every free slot in the control budget
+    KSEMAPHORE control_slots;
+
+    // amount of requests to start queued transfers. Only the caller
+    // that increments this from zero starts transfers, the other
+    // requests are handled by that caller
+    volatile LONG dispatch_requests;
+
+    // the class that gets the first chance in the next dispatch
+    volatile LONG next_class;
+};
+
+/**
+ * @brief Initialize the scheduler
+ *
+ * @param DeviceObject
+ */
+void scheduler_init(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Submit a irp with a prepared next stack location to the usb
+ * stack. Queues the irp when the budget of the class is used
+ *
+ * @param DeviceObject
+ * @param Irp
+ * @param Class
+ * @return NTSTATUS
+ */
+NTSTATUS scheduler_submit(PDEVICE_OBJECT DeviceObject, PIRP Irp, chief_transfer_class Class);
+
+/**
+ * @brief Mark a transfer that was started by the scheduler as done
+ *
+ * @param DeviceObject
+ * @param Class
+ */
+void scheduler_complete(PDEVICE_OBJECT DeviceObject, chief_transfer_class Class);
+
+/**
+ * @brief Wait for a slot in the control budget. Should be called at
+ * passive level before every control transfer
+ *
+ * @param DeviceObject
+ */
+void scheduler_control_begin(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Release the slot in the control budget and start the
+ * transfers that were waiting for the control transfer
+ *
+ * @param DeviceObject
+ */
+void scheduler_control_end(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Change the budgets of the interrupt and bulk transfers. 
+ * Transfers above a smaller budget finish normally, queued transfers
+ * are started when a budget gets bigger
+ *
+ * @param DeviceObject
+ * @param InterruptBudget
+ * @param BulkBudget
+ */
+void scheduler_set_budgets(PDEVICE_OBJECT DeviceObject, ULONG InterruptBudget, ULONG BulkBudget);
+
+/**
+ * @brief Cancel all the transfers that are waiting in the scheduler
+ *
+ * @param DeviceObject
+ */
+void scheduler_flush(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Get the statistics of the scheduler
+ *
+ * @param DeviceObject
+ * @param OutStats
+ */
+void scheduler_get_stats(PDEVICE_OBJECT DeviceObject, usb_chief_scheduler_stats& OutStats);
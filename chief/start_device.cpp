@@ -0,0 +1,373 @@
+#include "start_device.hpp"
+#include "device_extension.hpp"
+#include "device_state.hpp"
+#include "pipe.hpp"
+#include "tap.hpp"
+#include "urb.hpp"
+#include "usb.hpp"
+#include "watchdog.hpp"
+#include "status_cache.hpp"
+#include "notify.hpp"
+#include "tunables.hpp"
+
+// the size of the first configuration descriptor request. Most
+// devices fit so we only need a second request for large ones
+constexpr static ULONG start_configuration_size = 64;
+
+// the steps that are chained through the completion routine
+enum class start_step : ULONG {
+    device_descriptor,
+    configuration_descriptor,
+};
+
+/**
+ * @brief State of a start that is in progress
+ *
+ */
+struct start_context {
+    // our device and the start irp we pended
+    PDEVICE_OBJECT device_object;
+    PIRP start_irp;
+
+    // the irp we reuse for every descriptor request
+    PIRP irp;
+
+    // the work item for the select configuration
+    PIO_WORKITEM work_item;
+
+    // the step the current request is for
+    start_step step;
+
+    // the deadline of the current request. The dpc cancels the irp
+    // when the device does not answer in time
+    KTIMER timer;
+    KDPC dpc;
+
+    // 1 when the dpc cancelled the current request
+    volatile LONG timed_out;
+
+    // the completion routine and the armed timer both hold a 
+    // reference to the current request. The last one to release it
+    // continues with the next step
+    volatile LONG references;
+
+    // the status of the current request
+    NTSTATUS status;
+
+    // the urb of the current request
+    _URB_CONTROL_DESCRIPTOR_REQUEST urb;
+
+    // the descriptors we read
+    USB_DEVICE_DESCRIPTOR device_descriptor;
+    PUSB_CONFIGURATION_DESCRIPTOR configuration;
+    ULONG configuration_size;
+};
+
+static void start_finish(start_context* Context, NTSTATUS Status) {
+    PDEVICE_OBJECT device_object = Context->device_object;
+    PIRP start_irp = Context->start_irp;
+
+    // free the configuration descriptor when we did not store it
+    if (Context->configuration) {
+        ExFreePool(Context->configuration);
+    }
+
+    // free the resources of the start. We are in the completion 
+    // routine of the irp or in the work item, both allow this
+    IoFreeIrp(Context->irp);
+    IoFreeWorkItem(Context->work_item);
+    ExFreePool(Context);
+
+    // mark if we can accept new requests
+    try_transition_device_state(
+        device_object, device_state::starting,
+        (NT_SUCCESS(Status) ? device_state::started : device_state::stopped)
+    );
+
+    // watch for a hung device from now on, poll the status again and 
+    // let the application know it can use the device again
+    if (NT_SUCCESS(Status)) {
+        watchdog_start(device_object);
+        status_cache_start(device_object);
+        notify_event(device_object, chief_event_started);
+    }
+
+    start_irp->IoStatus.Status = Status;
+    IofCompleteRequest(start_irp, IO_NO_INCREMENT);
+
+    // release the count we took in mj_pnp
+    decrement_active_pipe_count_and_notify(device_object);
+}
+
+static NTSTATUS start_request_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context);
+
+static void start_request_descriptor(start_context* Context, start_step Step, UCHAR DescriptorType, PVOID Buffer, ULONG Length) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(Context->device_object);
+
+    Context->step = Step;
+
+    urb_build_get_descriptor(Context->urb, DescriptorType, 0, 0, Buffer, Length);
+
+    // reuse the irp of the previous step
+    IoReuseIrp(Context->irp, STATUS_SUCCESS);
+
+    PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(Context->irp);
+
+    stack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    stack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+    stack->Parameters.Others.Argument1 = &Context->urb;
+
+    IoSetCompletionRoutine(Context->irp, start_request_complete, Context, true, true, true);
+
+    // record the urb when the tap is enabled
+    if (dev_ext->tap_enabled) {
+        tap_urb(Context->device_object, urb_cast(Context->urb), &Context->urb, false);
+    }
+
+    // arm the deadline of the request. The same timeout as the 
+    // synchronous control requests, 0 waits forever
+    const ULONG timeout = get_tunables().control_timeout;
+
+    Context->timed_out = 0;
+    Context->references = timeout ? 2 : 1;
+
+    if (timeout) {
+        // a negative value is relative in 100ns units
+        LARGE_INTEGER deadline;
+        deadline.QuadPart = -10000LL * timeout;
+
+        KeSetTimer(&Context->timer, deadline, &Context->dpc);
+    }
+
+    IofCallDriver(dev_ext->attachedDeviceObject, Context->irp);
+}
+
+static bool start_request_configuration(start_context* Context, ULONG Size) {
+    // free the descriptor that was too small
+    if (Context->configuration) {
+        ExFreePool(Context->configuration);
+    }
+
+    Context->configuration = reinterpret_cast<PUSB_CONFIGURATION_DESCRIPTOR>(ExAllocatePoolWithTag(
+        NonPagedPool,
+        Size,
+        0x206D6457u
+    ));
+
+    // check if we got memory
+    if (!Context->configuration) {
+        return false;
+    }
+
+    Context->configuration_size = Size;
+
+    start_request_descriptor(
+        Context, start_step::configuration_descriptor, USB_CONFIGURATION_DESCRIPTOR_TYPE, 
+        Context->configuration, Size
+    );
+
+    return true;
+}
+
+static void start_select_configuration(PDEVICE_OBJECT DeviceObject, PVOID Context) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // select the first alternate setting. This parses the descriptor 
+    // so it needs passive level
+    const NTSTATUS status = usb_set_alternate_setting(DeviceObject, dev_ext->usb_config_desc, 0);
+
+    start_finish(reinterpret_cast<start_context*>(Context), status);
+}
+
+static void start_request_done(start_context* Context) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(Context->device_object);
+
+    // a request we cancelled after the deadline timed out
+    const NTSTATUS status = (Context->timed_out && Context->status == STATUS_CANCELLED) ? 
+        STATUS_IO_TIMEOUT : Context->status;
+
+    switch (Context->step) {
+        case start_step::device_descriptor:
+            // check if we got the device descriptor
+            if (!NT_SUCCESS(status)) {
+                // clear the bcdUSB value
+                dev_ext->bcdUSB.clear();
+
+                start_finish(Context, status);
+                break;
+            }
+
+            // store the bcdUSB value
+            dev_ext->bcdUSB.set(Context->device_descriptor.bcdUSB);
+
+            // get the configuration descriptor
+            if (!start_request_configuration(Context, start_configuration_size)) {
+                start_finish(Context, STATUS_INSUFFICIENT_RESOURCES);
+            }
+            break;
+
+        case start_step::configuration_descriptor:
+            if (!NT_SUCCESS(status)) {
+                start_finish(Context, status);
+                break;
+            }
+
+            // request the full descriptor when it did not fit
+            if (Context->urb.TransferBufferLength && Context->configuration->wTotalLength > Context->configuration_size) {
+                if (!start_request_configuration(Context, Context->configuration->wTotalLength)) {
+                    start_finish(Context, STATUS_INSUFFICIENT_RESOURCES);
+                }
+                break;
+            }
+
+            // store the descriptor. Free the one of a earlier start
+            if (dev_ext->usb_config_desc) {
+                ExFreePool(dev_ext->usb_config_desc);
+            }
+
+            dev_ext->usb_config_desc = Context->configuration;
+            Context->configuration = nullptr;
+
+            // select the configuration at passive level
+            IoQueueWorkItem(Context->work_item, start_select_configuration, DelayedWorkQueue, Context);
+            break;
+    }
+}
+
+static void start_request_release(start_context* Context, LONG Count) {
+    // continue with the next step when the completion routine and 
+    // the dpc are both done with the request
+    if (InterlockedExchangeAdd(&Context->references, -Count) == Count) {
+        start_request_done(Context);
+    }
+}
+
+static void start_request_timeout(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    start_context* context = reinterpret_cast<start_context*>(DeferredContext);
+
+    // the device did not answer in time. The irp can not be reused 
+    // before we release our reference, so it is safe to cancel it 
+    // even when it just completed
+    InterlockedExchange(&context->timed_out, 1);
+    IoCancelIrp(context->irp);
+
+    start_request_release(context, 1);
+}
+
+static NTSTATUS start_request_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context) {
+    // the irp is ours so we do not get a device object
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    start_context* context = reinterpret_cast<start_context*>(Context);
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(context->device_object);
+
+    // record the result when the tap is enabled
+    if (dev_ext->tap_enabled) {
+        tap_urb(context->device_object, urb_cast(context->urb), &context->urb, true);
+    }
+
+    context->status = Irp->IoStatus.Status;
+
+    // release the reference of the timer too when we stopped it 
+    // before it fired
+    start_request_release(context, KeCancelTimer(&context->timer) ? 2 : 1);
+
+    // the irp is freed or reused by us
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+static NTSTATUS start_lower_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context) {
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    start_context* context = reinterpret_cast<start_context*>(Context);
+
+    // check if the start device was successful on the lower driver
+    if (!NT_SUCCESS(Irp->IoStatus.Status)) {
+        start_finish(context, Irp->IoStatus.Status);
+    }
+    else {
+        // get the device descriptor
+        start_request_descriptor(
+            context, start_step::device_descriptor, USB_DEVICE_DESCRIPTOR_TYPE,
+            &context->device_descriptor, sizeof(USB_DEVICE_DESCRIPTOR)
+        );
+    }
+
+    // we complete the start irp when the last step is done
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+NTSTATUS start_device(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // mark we are starting. We cannot accept new requests 
+    // until we have a configuration
+    transition_device_state(DeviceObject, device_state::starting);
+
+    // allocate everything the start needs up front so the 
+    // completion routines cannot fail on a allocation
+    start_context* context = reinterpret_cast<start_context*>(ExAllocatePoolWithTag(
+        NonPagedPool,
+        sizeof(start_context),
+        0x206D6457u
+    ));
+
+    PIRP irp = IoAllocateIrp(dev_ext->attachedDeviceObject->StackSize, false);
+    PIO_WORKITEM work_item = IoAllocateWorkItem(DeviceObject);
+
+    // check if we got everything
+    if (!context || !irp || !work_item) {
+        if (context) {
+            ExFreePool(context);
+        }
+
+        if (irp) {
+            IoFreeIrp(irp);
+        }
+
+        if (work_item) {
+            IoFreeWorkItem(work_item);
+        }
+
+        try_transition_device_state(DeviceObject, device_state::starting, device_state::stopped);
+
+        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+        IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        // release the count we took in mj_pnp
+        decrement_active_pipe_count_and_notify(DeviceObject);
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    memset(context, 0x00, sizeof(start_context));
+
+    context->device_object = DeviceObject;
+    context->start_irp = Irp;
+    context->irp = irp;
+    context->work_item = work_item;
+
+    KeInitializeTimer(&context->timer);
+    KeInitializeDpc(&context->dpc, start_request_timeout, context);
+
+    // the start irp is completed by the last step
+    IoMarkIrpPending(Irp);
+
+    // start the lower driver first
+    IoCopyCurrentIrpStackLocationToNext(Irp);
+    IoSetCompletionRoutine(Irp, start_lower_complete, context, true, true, true);
+
+    IofCallDriver(dev_ext->attachedDeviceObject, Irp);
+
+    return STATUS_PENDING;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+/**
+ * @brief Handle IRP_MN_START_DEVICE without blocking the pnp thread.
+ * The irp is pended and the start is done from completion routines:
+ * the lower driver, the device descriptor and the configuration 
+ * descriptor are chained and only the select configuration runs in a
+ * work item as it needs passive level. The irp is completed and the
+ * pipe count released when the last step is done
+ *
+ * @param DeviceObject
+ * @param Irp
+ * @return NTSTATUS STATUS_PENDING or the error when the start could
+ * not begin
+ */
+NTSTATUS start_device(PDEVICE_OBJECT DeviceObject, PIRP Irp);
@@ -0,0 +1,315 @@
+#include "status_cache.hpp"
+#include "device_extension.hpp"
+#include "device_state.hpp"
+#include "pipe.hpp"
+#include "usb.hpp"
+
+static void status_cache_refresh(PDEVICE_OBJECT DeviceObject, PVOID Context) {
+    UNREFERENCED_PARAMETER(Context);
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    status_cache& cache = dev_ext->status_poll;
+
+    // allow a new refresh to be queued while we are busy. This makes
+    // sure a invalidation during this refresh is never missed
+    InterlockedExchange(&cache.refresh_queued, 0);
+
+    // only talk to the device when it is started
+    for (ULONG i = 0; get_device_state(DeviceObject) == device_state::started; i++) {
+        KIRQL irql;
+        KeAcquireSpinLock(&cache.lock, &irql);
+
+        // check if we are done
+        if (i >= cache.count) {
+            KeReleaseSpinLock(&cache.lock, irql);
+            break;
+        }
+
+        // copy the request so we can release the lock while
+        // we talk to the device
+        const usb_chief_status_entry entry = cache.entries[i].request;
+        const ULONG generation = cache.generation;
+
+        KeReleaseSpinLock(&cache.lock, irql);
+
+        // do the vendor request
+        UCHAR buffer[chief_max_status_length];
+
+        usb_chief_vendor_request request = {};
+        request.request = entry.request;
+        request.value = entry.value;
+        request.index = entry.index;
+        request.length = entry.length;
+        request.data = buffer;
+
+        const NTSTATUS status = usb_send_receive_vendor_request(DeviceObject, &request, true);
+
+        KeAcquireSpinLock(&cache.lock, &irql);
+
+        // only store the result if the cache did not change while
+        // we were talking to the device
+        if (generation == cache.generation) {
+            usb_chief_cached_status& result = cache.entries[i].result;
+
+            result.status = status;
+            result.valid = NT_SUCCESS(status);
+
+            if (NT_SUCCESS(status)) {
+                // store the data we received
+                result.length = request.length;
+                memcpy(result.data, buffer, request.length);
+
+                result.sequence++;
+            }
+        }
+
+        KeReleaseSpinLock(&cache.lock, irql);
+    }
+
+    // release the count we got when queueing the refresh
+    decrement_active_pipe_count_and_notify(DeviceObject);
+}
+
+static void status_cache_queue_refresh(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    status_cache& cache = dev_ext->status_poll;
+
+    // check if we already have a refresh queued
+    if (InterlockedCompareExchange(&cache.refresh_queued, 1, 0) != 0) {
+        return;
+    }
+
+    // make sure the device is not removed while the refresh
+    // is queued. The refresh releases the count when done
+    increment_active_pipe_count(DeviceObject);
+
+    // do the refresh at passive level
+    IoQueueWorkItem(cache.work_item, status_cache_refresh, DelayedWorkQueue, nullptr);
+}
+
+static void status_cache_timer(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    // queue a refresh of the cache
+    status_cache_queue_refresh(reinterpret_cast<PDEVICE_OBJECT>(DeferredContext));
+}
+
+static void status_cache_cancel_timer(status_cache& Cache) {
+    // stop the timer and wait until a dpc that is already
+    // running is done queueing the refresh
+    KeCancelTimer(&Cache.timer);
+    KeFlushQueuedDpcs();
+}
+
+static void status_cache_arm(PDEVICE_OBJECT DeviceObject, ULONG Interval) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    status_cache& cache = dev_ext->status_poll;
+
+    // start the timer. The due time is relative in 100ns units
+    LARGE_INTEGER due_time;
+    due_time.QuadPart = -10000LL * Interval;
+
+    KeSetTimerEx(&cache.timer, due_time, static_cast<LONG>(Interval), &cache.dpc);
+
+    // get the first results right away
+    status_cache_queue_refresh(DeviceObject);
+}
+
+NTSTATUS status_cache_init(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    status_cache& cache = dev_ext->status_poll;
+
+    // initialize the lock, timer and dpc
+    KeInitializeSpinLock(&cache.lock);
+    KeInitializeTimer(&cache.timer);
+    KeInitializeDpc(&cache.dpc, status_cache_timer, DeviceObject);
+
+    // allocate the work item for the refreshes
+    cache.work_item = IoAllocateWorkItem(DeviceObject);
+
+    // check if we got memory
+    if (!cache.work_item) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+void status_cache_free(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    status_cache& cache = dev_ext->status_poll;
+
+    // make sure the timer is stopped
+    status_cache_stop(DeviceObject);
+
+    // free the work item
+    if (cache.work_item) {
+        IoFreeWorkItem(cache.work_item);
+        cache.work_item = nullptr;
+    }
+}
+
+NTSTATUS status_cache_configure(PDEVICE_OBJECT DeviceObject, const usb_chief_status_poll_config& Config) {
+    // check if we have a valid amount of entries
+    if (Config.count > chief_max_status_entries) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // check if we have a valid interval
+    if (Config.interval && (Config.interval < chief_min_status_interval || Config.interval > chief_max_status_interval)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // check if all the entries fit in the cache
+    for (ULONG i = 0; i < Config.count; i++) {
+        if (!Config.entries[i].length || Config.entries[i].length > chief_max_status_length) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    status_cache& cache = dev_ext->status_poll;
+
+    // stop the current poller
+    status_cache_cancel_timer(cache);
+
+    KIRQL irql;
+    KeAcquireSpinLock(&cache.lock, &irql);
+
+    // store the new configuration and clear all the results
+    for (ULONG i = 0; i < chief_max_status_entries; i++) {
+        cache.entries[i] = {};
+
+        if (i < Config.count) {
+            cache.entries[i].request = Config.entries[i];
+        }
+    }
+
+    cache.count = (Config.interval ? Config.count : 0);
+    cache.interval = (cache.count ? Config.interval : 0);
+    cache.resume_interval = 0;
+
+    // drop the results of a refresh that is still running
+    cache.generation++;
+
+    KeReleaseSpinLock(&cache.lock, irql);
+
+    // check if we need to start the poller
+    if (cache.interval) {
+        status_cache_arm(DeviceObject, cache.interval);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS status_cache_get(PDEVICE_OBJECT DeviceObject, const usb_chief_status_entry& Request, usb_chief_cached_status& OutStatus) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    status_cache& cache = dev_ext->status_poll;
+
+    NTSTATUS status = STATUS_NOT_FOUND;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&cache.lock, &irql);
+
+    // search for the polled request
+    for (ULONG i = 0; i < cache.count; i++) {
+        const usb_chief_status_entry& entry = cache.entries[i].request;
+
+        if (entry.request == Request.request && entry.value == Request.value && entry.index == Request.index) {
+            // copy the last result
+            OutStatus = cache.entries[i].result;
+            status = STATUS_SUCCESS;
+            break;
+        }
+    }
+
+    KeReleaseSpinLock(&cache.lock, irql);
+
+    return status;
+}
+
+void status_cache_invalidate(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    status_cache& cache = dev_ext->status_poll;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&cache.lock, &irql);
+
+    // mark all the results as invalid
+    for (ULONG i = 0; i < cache.count; i++) {
+        cache.entries[i].result.valid = 0;
+    }
+
+    // drop the results of a refresh that is still running
+    cache.generation++;
+
+    const bool polling = (cache.interval != 0);
+
+    KeReleaseSpinLock(&cache.lock, irql);
+
+    // refresh the results right away if we are polling
+    if (polling) {
+        status_cache_queue_refresh(DeviceObject);
+    }
+}
+
+void status_cache_stop(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    status_cache& cache = dev_ext->status_poll;
+
+    status_cache_cancel_timer(cache);
+
+    KIRQL irql;
+    KeAcquireSpinLock(&cache.lock, &irql);
+
+    // the results are from before the stop. Mark them as invalid so
+    // nobody uses them while the device is gone or reconfigured
+    for (ULONG i = 0; i < cache.count; i++) {
+        cache.entries[i].result.valid = 0;
+    }
+
+    // drop the results of a refresh that is still running
+    cache.generation++;
+
+    // mark we are not polling anymore. A second stop (surprise removal
+    // after a stop) keeps the interval of the first
+    if (cache.interval) {
+        cache.resume_interval = cache.interval;
+    }
+
+    cache.interval = 0;
+
+    KeReleaseSpinLock(&cache.lock, irql);
+}
+
+void status_cache_start(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    status_cache& cache = dev_ext->status_poll;
+
+    KIRQL irql;
+    KeAcquireSpinLock(&cache.lock, &irql);
+
+    // continue with the interval of before the stop
+    const ULONG interval = cache.resume_interval;
+
+    cache.interval = interval;
+    cache.resume_interval = 0;
+
+    KeReleaseSpinLock(&cache.lock, irql);
+
+    if (interval) {
+        status_cache_arm(DeviceObject, interval);
+    }
+}
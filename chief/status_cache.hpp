@@ -0,0 +1,121 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+#include "ioctl.hpp"
+
+/**
+ * @brief Cached result of a single polled vendor request
+ *
+ */
+struct status_cache_entry {
+    // the request we are polling
+    usb_chief_status_entry request;
+
+    // the last result we got from the device
+    usb_chief_cached_status result;
+};
+
+/**
+ * @brief Cache with the results of the vendor status reads
+ * the driver polls on a timer
+ *
+ */
+struct status_cache {
+    // spinlock to protect the entries
+    KSPIN_LOCK lock;
+
+    // the timer and dpc that trigger a refresh
+    KTIMER timer;
+    KDPC dpc;
+
+    // work item to do the vendor requests at passive level
+    PIO_WORKITEM work_item;
+
+    // flag if a refresh is queued. Should only be modified
+    // using Interlocked functions
+    volatile LONG refresh_queued;
+
+    // incremented every time the cache is invalidated. Used
+    // to drop results that were requested before the
+    // invalidation. Protected by the lock
+    ULONG generation;
+
+    // the current poll interval in milliseconds. 0 when
+    // the poller is stopped
+    ULONG interval;
+
+    // the interval that was used when the device was stopped. The
+    // poller is started again with it on the next start
+    ULONG resume_interval;
+
+    // amount of valid entries
+    ULONG count;
+
+    // all the entries we poll
+    status_cache_entry entries[chief_max_status_entries];
+};
+
+/**
+ * @brief Initialize the status cache
+ *
+ * @param DeviceObject
+ * @return NTSTATUS
+ */
+NTSTATUS status_cache_init(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Stop the poller and free the resources of the status cache.
+ * Should only be called when no requests are active anymore
+ *
+ * @param DeviceObject
+ */
+void status_cache_free(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Change the polled requests and the interval
+ *
+ * @param DeviceObject
+ * @param Config
+ * @return NTSTATUS
+ */
+NTSTATUS status_cache_configure(PDEVICE_OBJECT DeviceObject, const usb_chief_status_poll_config& Config);
+
+/**
+ * @brief Get the cached result of a polled request
+ *
+ * @param DeviceObject
+ * @param Request
+ * @param OutStatus
+ * @return NTSTATUS
+ */
+NTSTATUS status_cache_get(PDEVICE_OBJECT DeviceObject, const usb_chief_status_entry& Request, usb_chief_cached_status& OutStatus);
+
+/**
+ * @brief Invalidate all the cached results and refresh them as
+ * soon as possible. Should be called after every request that
+ * can change the status of the device
+ *
+ * @param DeviceObject
+ */
+void status_cache_invalidate(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Stop the poller when the device is stopped or removed. Waits
+ * until the timer can not queue any new refreshes and invalidates the
+ * cached results, they are from a device that may be gone. The
+ * interval is kept for status_cache_start
+ *
+ * @param DeviceObject
+ */
+void status_cache_stop(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Start the poller again with the interval it had when the
+ * device was stopped. Does nothing when it was not polling
+ *
+ * @param DeviceObject
+ */
+void status_cache_start(PDEVICE_OBJECT DeviceObject);
@@ -0,0 +1,203 @@
+#include "tap.hpp"
+#include "device_extension.hpp"
+
+extern "C" {
+    #include <usbdlib.h>
+}
+
+static void tap_write_setup(usb_chief_tap_record& Record, UCHAR RequestType, UCHAR Request, USHORT Value, USHORT Index, ULONG Length) {
+    // the setup packet is little endian
+    Record.setup[0] = RequestType;
+    Record.setup[1] = Request;
+    Record.setup[2] = static_cast<UCHAR>(Value & 0xff);
+    Record.setup[3] = static_cast<UCHAR>(Value >> 8);
+    Record.setup[4] = static_cast<UCHAR>(Index & 0xff);
+    Record.setup[5] = static_cast<UCHAR>(Index >> 8);
+    Record.setup[6] = static_cast<UCHAR>(Length & 0xff);
+    Record.setup[7] = static_cast<UCHAR>((Length >> 8) & 0xff);
+
+    Record.setup_valid = 1;
+}
+
+static const USBD_PIPE_INFORMATION* tap_find_pipe(chief_device_extension* DeviceExtension, USBD_PIPE_HANDLE Handle) {
+    PUSBD_INTERFACE_INFORMATION interface_info = DeviceExtension->usb_interface_info;
+
+    // check if we have a interface
+    if (!interface_info) {
+        return nullptr;
+    }
+
+    for (ULONG i = 0; i < interface_info->NumberOfPipes; i++) {
+        if (interface_info->Pipes[i].PipeHandle == Handle) {
+            return &interface_info->Pipes[i];
+        }
+    }
+
+    return nullptr;
+}
+
+NTSTATUS tap_configure(PDEVICE_OBJECT DeviceObject, const usb_chief_tap_config& Config) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // check if we have a valid configuration
+    if (Config.enable > 1 || Config.snapshot_length > chief_max_tap_snapshot) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!Config.enable) {
+        // stop recording. The ring is kept so the records can still be drained
+        InterlockedExchange(&dev_ext->tap_enabled, 0);
+        return STATUS_SUCCESS;
+    }
+
+    // allocate the ring the first time the tap is enabled
+    const NTSTATUS status = dev_ext->tap.ring.install();
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    InterlockedExchange(&dev_ext->tap.snapshot_length, static_cast<LONG>(Config.snapshot_length));
+
+    // start recording
+    InterlockedExchange(&dev_ext->tap_enabled, 1);
+
+    return STATUS_SUCCESS;
+}
+
+void tap_urb(PDEVICE_OBJECT DeviceObject, PURB Urb, const void* Id, bool Completion) {
+    // stamp the urb as early as possible
+    const LARGE_INTEGER timestamp = KeQueryPerformanceCounter(nullptr);
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    tap_ring::ring_type* ring = dev_ext->tap.ring.get();
+
+    if (!ring) {
+        return;
+    }
+
+    // reserve a record. When the ring is full the urb is counted as dropped
+    ULONG position;
+    usb_chief_tap_record* record = ring->begin_push(position);
+
+    if (!record) {
+        return;
+    }
+
+    record->timestamp = static_cast<ULONGLONG>(timestamp.QuadPart);
+    record->irp_id = reinterpret_cast<ULONG_PTR>(Id);
+    record->status = Completion ? Urb->UrbHeader.Status : 0;
+    record->length = 0;
+    record->function = Urb->UrbHeader.Function;
+    record->info = Completion ? chief_tap_info_completion : 0;
+    record->endpoint = 0;
+    record->transfer = chief_tap_transfer_irp_info;
+    record->setup_valid = 0;
+    record->captured = 0;
+
+    // the buffer of the transfer
+    void* buffer = nullptr;
+    PMDL mdl = nullptr;
+    bool in = false;
+
+    switch (Urb->UrbHeader.Function) {
+        case URB_FUNCTION_VENDOR_DEVICE:
+            {
+                const _URB_CONTROL_VENDOR_OR_CLASS_REQUEST& request = Urb->UrbControlVendorClassRequest;
+
+                record->transfer = chief_tap_transfer_control;
+                record->length = request.TransferBufferLength;
+
+                tap_write_setup(
+                    *record, request.RequestTypeReservedBits, request.Request, 
+                    request.Value, request.Index, request.TransferBufferLength
+                );
+
+                in = (request.TransferFlags & USBD_TRANSFER_DIRECTION_IN) != 0;
+                buffer = request.TransferBuffer;
+                mdl = request.TransferBufferMDL;
+            }
+            break;
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+            {
+                const _URB_CONTROL_DESCRIPTOR_REQUEST& request = Urb->UrbControlDescriptorRequest;
+
+                record->transfer = chief_tap_transfer_control;
+                record->length = request.TransferBufferLength;
+
+                // standard device to host GET_DESCRIPTOR request
+                tap_write_setup(
+                    *record, 0x80, 0x06, static_cast<USHORT>((request.DescriptorType << 8) | request.Index), 
+                    request.LanguageId, request.TransferBufferLength
+                );
+
+                in = true;
+                buffer = request.TransferBuffer;
+                mdl = request.TransferBufferMDL;
+            }
+            break;
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+            {
+                const _URB_BULK_OR_INTERRUPT_TRANSFER& request = Urb->UrbBulkOrInterruptTransfer;
+                const USBD_PIPE_INFORMATION* pipe = tap_find_pipe(dev_ext, request.PipeHandle);
+
+                record->transfer = (pipe && pipe->PipeType == UsbdPipeTypeInterrupt) ? 
+                    chief_tap_transfer_interrupt : chief_tap_transfer_bulk;
+                record->endpoint = pipe ? pipe->EndpointAddress : 0;
+                record->length = request.TransferBufferLength;
+
+                in = (request.TransferFlags & USBD_TRANSFER_DIRECTION_IN) != 0;
+                buffer = request.TransferBuffer;
+                mdl = request.TransferBufferMDL;
+            }
+            break;
+        default:
+            // urbs without data only store the header
+            break;
+    }
+
+    // control transfers use the direction of the endpoint
+    if (record->transfer == chief_tap_transfer_control && in) {
+        record->endpoint = 0x80;
+    }
+
+    // out data is captured on the submit and in data on the completion
+    const ULONG snapshot = static_cast<ULONG>(dev_ext->tap.snapshot_length);
+
+    if (snapshot && record->length && in == Completion) {
+        // map the mdl when we do not have a virtual address
+        if (!buffer && mdl) {
+            buffer = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority);
+        }
+
+        if (buffer) {
+            const ULONG length = (record->length < snapshot) ? record->length : snapshot;
+
+            memcpy(record->data, buffer, length);
+            record->captured = static_cast<unsigned short>(length);
+        }
+    }
+
+    // publish the record
+    ring->end_push(position);
+}
+
+NTSTATUS tap_drain(PDEVICE_OBJECT DeviceObject, void* Buffer, ULONG Length, ULONG& OutLength) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    return dev_ext->tap.ring.drain<usb_chief_tap_drain>(Buffer, Length, OutLength);
+}
+
+void tap_free(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // stop recording
+    InterlockedExchange(&dev_ext->tap_enabled, 0);
+
+    // free the ring
+    dev_ext->tap.ring.free();
+}
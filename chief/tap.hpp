@@ -0,0 +1,71 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+    #include <usb.h>
+}
+
+#include "ioctl.hpp"
+#include "ring.hpp"
+
+// the amount of records the tap can hold between two drains
+constexpr static ULONG tap_ring_size = 512;
+
+// the ring with the records of the tap
+using tap_ring = ring_owner<usb_chief_tap_record, tap_ring_size>;
+
+/**
+ * @brief Tap that copies the urbs the driver sends to the usb stack
+ * into a ring. The flag that enables the tap is in the hot section
+ * of the device extension so the disabled tap only costs a single
+ * read
+ *
+ */
+struct urb_tap {
+    // the ring with the records. Allocated the first time the
+    // tap is enabled and freed when the device is removed
+    tap_ring ring;
+
+    // the amount of payload bytes to store with every record
+    volatile LONG snapshot_length;
+};
+
+/**
+ * @brief Enable or disable the tap
+ *
+ * @param DeviceObject
+ * @param Config
+ * @return NTSTATUS
+ */
+NTSTATUS tap_configure(PDEVICE_OBJECT DeviceObject, const usb_chief_tap_config& Config);
+
+/**
+ * @brief Record a urb. Should only be called when the tap is enabled.
+ * Can be called at dispatch level
+ *
+ * @param DeviceObject
+ * @param Urb
+ * @param Id id that is the same for the submit and the completion
+ * @param Completion true when the usb stack completed the urb
+ */
+void tap_urb(PDEVICE_OBJECT DeviceObject, PURB Urb, const void* Id, bool Completion);
+
+/**
+ * @brief Move the records from the tap to a usb_chief_tap_drain 
+ * header and the records that fit after it
+ *
+ * @param DeviceObject
+ * @param Buffer
+ * @param Length
+ * @param OutLength the amount of bytes written to the buffer
+ * @return NTSTATUS
+ */
+NTSTATUS tap_drain(PDEVICE_OBJECT DeviceObject, void* Buffer, ULONG Length, ULONG& OutLength);
+
+/**
+ * @brief Disable the tap and free the ring. Should only be called 
+ * when no urbs are sent anymore
+ *
+ * @param DeviceObject
+ */
+void tap_free(PDEVICE_OBJECT DeviceObject);
@@ -0,0 +1,173 @@
+#include "trace.hpp"
+#include "device_extension.hpp"
+#include "file_context.hpp"
+
+NTSTATUS trace_configure(PDEVICE_OBJECT DeviceObject, const usb_chief_trace_config& Config) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // check if we have a valid configuration
+    if (Config.enable > 1) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (!Config.enable) {
+        // stop recording. The ring is kept so the records can still be drained
+        InterlockedExchange(&dev_ext->trace_enabled, 0);
+        return STATUS_SUCCESS;
+    }
+
+    // allocate the ring the first time the recorder is enabled
+    const NTSTATUS status = dev_ext->trace.ring.install();
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // start recording
+    InterlockedExchange(&dev_ext->trace_enabled, 1);
+
+    return STATUS_SUCCESS;
+}
+
+void trace_request(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+    // stamp the request as early as possible
+    const LARGE_INTEGER timestamp = KeQueryPerformanceCounter(nullptr);
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    trace_ring::ring_type* ring = dev_ext->trace.ring.get();
+
+    if (!ring) {
+        return;
+    }
+
+    // get the current stack location
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+    ULONG code = 0;
+    UCHAR major;
+
+    switch (stack->MajorFunction) {
+        case IRP_MJ_READ:
+            major = chief_trace_read;
+            break;
+        case IRP_MJ_WRITE:
+            major = chief_trace_write;
+            break;
+        case IRP_MJ_DEVICE_CONTROL:
+            code = stack->Parameters.DeviceIoControl.IoControlCode;
+
+            // only record the requests of the original software
+            if (code != ioctl_vendor_send && code != ioctl_vendor_receive && code != ioctl_set_alternate_setting) {
+                return;
+            }
+
+            major = chief_trace_device_control;
+            break;
+        default:
+            return;
+    }
+
+    // reserve a record. When the ring is full the request is counted as dropped
+    ULONG position;
+    usb_chief_trace_record* record = ring->begin_push(position);
+
+    if (!record) {
+        return;
+    }
+
+    memset(record, 0x00, sizeof(usb_chief_trace_record));
+
+    record->timestamp = static_cast<ULONGLONG>(timestamp.QuadPart);
+    record->code = code;
+    record->major = major;
+
+    if (major != chief_trace_device_control) {
+        // get the pipe of the handle
+        const chief_file_context* context = get_file_context(stack->FileObject);
+
+        record->pipe = context ? static_cast<UCHAR>(context->pipe_index) : 0xff;
+        record->length = Irp->MdlAddress ? MmGetMdlByteCount(Irp->MdlAddress) : 0;
+    }
+    else if (stack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(usb_chief_vendor_request)) {
+        const usb_chief_vendor_request* request = reinterpret_cast<usb_chief_vendor_request*>(Irp->AssociatedIrp.SystemBuffer);
+
+        record->request = request->request;
+        record->value = request->value;
+        record->index = request->index;
+        record->length = request->length;
+
+        // store the start of the data we send so the request can be replayed
+        if (code == ioctl_vendor_send && request->length && request->data) {
+            const ULONG length = (request->length < chief_max_trace_data) ? request->length : chief_max_trace_data;
+
+            __try {
+                // the data pointer is provided by the application
+                if (Irp->RequestorMode != KernelMode) {
+                    ProbeForRead(request->data, length, 1);
+                }
+
+                memcpy(record->data, request->data, length);
+                record->captured = static_cast<UCHAR>(length);
+            }
+            __except (EXCEPTION_EXECUTE_HANDLER) {
+                record->captured = 0;
+            }
+        }
+    }
+
+    // publish the record
+    ring->end_push(position);
+}
+
+void trace_recovery(PDEVICE_OBJECT DeviceObject, UCHAR Action, UCHAR Reason, NTSTATUS Status) {
+    // stamp the recovery
+    const LARGE_INTEGER timestamp = KeQueryPerformanceCounter(nullptr);
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    trace_ring::ring_type* ring = dev_ext->trace.ring.get();
+
+    if (!ring) {
+        return;
+    }
+
+    // reserve a record. When the ring is full the recovery is counted as dropped
+    ULONG position;
+    usb_chief_trace_record* record = ring->begin_push(position);
+
+    if (!record) {
+        return;
+    }
+
+    memset(record, 0x00, sizeof(usb_chief_trace_record));
+
+    record->timestamp = static_cast<ULONGLONG>(timestamp.QuadPart);
+    record->major = chief_trace_recovery;
+    record->pipe = 0xff;
+    record->request = Action;
+    record->value = Reason;
+    record->length = static_cast<ULONG>(Status);
+
+    // publish the record
+    ring->end_push(position);
+}
+
+NTSTATUS trace_drain(PDEVICE_OBJECT DeviceObject, void* Buffer, ULONG Length, ULONG& OutLength) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    return dev_ext->trace.ring.drain<usb_chief_trace_drain>(Buffer, Length, OutLength);
+}
+
+void trace_free(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // stop recording
+    InterlockedExchange(&dev_ext->trace_enabled, 0);
+
+    // free the ring
+    dev_ext->trace.ring.free();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+#include "ioctl.hpp"
+#include "ring.hpp"
+
+// the amount of records the recorder can hold between two drains
+constexpr static ULONG trace_ring_size = 1024;
+
+// the ring with the records of the recorder
+using trace_ring = ring_owner<usb_chief_trace_record, trace_ring_size>;
+
+/**
+ * @brief Recorder for the requests the application sends to the
+ * driver. The flag that enables the recorder is in the hot section 
+ * of the device extension
+ *
+ */
+struct request_trace {
+    // the ring with the records. Allocated the first time the
+    // recorder is enabled and freed when the device is removed
+    trace_ring ring;
+};
+
+/**
+ * @brief Enable or disable the recorder
+ *
+ * @param DeviceObject
+ * @param Config
+ * @return NTSTATUS
+ */
+NTSTATUS trace_configure(PDEVICE_OBJECT DeviceObject, const usb_chief_trace_config& Config);
+
+/**
+ * @brief Record a read, write or vendor request. Other requests are 
+ * ignored. Should only be called when the recorder is enabled
+ *
+ * @param DeviceObject
+ * @param Irp
+ */
+void trace_request(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+
+/**
+ * @brief Record a recovery of the watchdog. Should only be called 
+ * when the recorder is enabled
+ *
+ * @param DeviceObject
+ * @param Action chief_watchdog_action
+ * @param Reason chief_watchdog_reason
+ * @param Status the result of the action
+ */
+void trace_recovery(PDEVICE_OBJECT DeviceObject, UCHAR Action, UCHAR Reason, NTSTATUS Status);
+
+/**
+ * @brief Move the records from the recorder to a usb_chief_trace_drain
+ * header and the records that fit after it
+ *
+ * @param DeviceObject
+ * @param Buffer
+ * @param Length
+ * @param OutLength the amount of bytes written to the buffer
+ * @return NTSTATUS
+ */
+NTSTATUS trace_drain(PDEVICE_OBJECT DeviceObject, void* Buffer, ULONG Length, ULONG& OutLength);
+
+/**
+ * @brief Disable the recorder and free the ring. Should only be 
+ * called when no requests are received anymore
+ *
+ * @param DeviceObject
+ */
+void trace_free(PDEVICE_OBJECT DeviceObject);
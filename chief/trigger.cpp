@@ -0,0 +1,198 @@
+#include "trigger.hpp"
+
+#include <emmintrin.h>
+
+static bool trigger_match(const usb_chief_trigger_pattern& Pattern, const UCHAR* Data) {
+    // check every byte of the pattern with the mask
+    for (ULONG i = 0; i < Pattern.length; i++) {
+        if ((Data[i] ^ Pattern.pattern[i]) & Pattern.mask[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static ULONG trigger_find_scalar(const usb_chief_trigger_pattern& Pattern, ULONG Anchor, const UCHAR* Data, ULONG Start, ULONG End) {
+    const UCHAR mask = Pattern.mask[Anchor];
+    const UCHAR value = Pattern.pattern[Anchor] & mask;
+
+    // check the anchor byte first and the full pattern after that
+    for (ULONG i = Start; i < End; i++) {
+        if ((Data[i + Anchor] & mask) == value && trigger_match(Pattern, Data + i)) {
+            return i;
+        }
+    }
+
+    return End;
+}
+
+static ULONG trigger_find_sse2(const usb_chief_trigger_pattern& Pattern, ULONG Anchor, const UCHAR* Data, ULONG End) {
+    const __m128i mask = _mm_set1_epi8(static_cast<char>(Pattern.mask[Anchor]));
+    const __m128i value = _mm_set1_epi8(static_cast<char>(Pattern.pattern[Anchor] & Pattern.mask[Anchor]));
+
+    ULONG i = 0;
+
+    // compare the anchor byte at 16 positions at once. The last
+    // load ends at the last byte a pattern can start in
+    for (; (i + 16) <= End; i += 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Data + i + Anchor));
+        ULONG candidates = static_cast<ULONG>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(block, mask), value)));
+
+        // check the full pattern at every candidate
+        while (candidates) {
+            ULONG bit;
+            BitScanForward(&bit, candidates);
+
+            if (trigger_match(Pattern, Data + i + bit)) {
+                return i + bit;
+            }
+
+            candidates &= candidates - 1;
+        }
+    }
+
+    // check the positions that do not fill a full block
+    return trigger_find_scalar(Pattern, Anchor, Data, i, End);
+}
+
+void trigger_init(trigger_filter& Filter) {
+    KeInitializeSpinLock(&Filter.lock);
+
+    // a count of 0 disables the filter
+    memset(&Filter.config, 0x00, sizeof(Filter.config));
+    memset(Filter.anchors, 0x00, sizeof(Filter.anchors));
+}
+
+NTSTATUS trigger_configure(trigger_filter& Filter, const usb_chief_trigger_config& Config) {
+    // check if we have a valid amount of patterns
+    if (Config.count > chief_max_trigger_patterns) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG anchors[chief_max_trigger_patterns] = {};
+
+    // check every pattern and get the first byte with a mask
+    for (ULONG i = 0; i < Config.count; i++) {
+        const usb_chief_trigger_pattern& pattern = Config.patterns[i];
+
+        if (!pattern.length || pattern.length > chief_max_trigger_length) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        ULONG anchor = 0;
+
+        while (anchor < pattern.length && !pattern.mask[anchor]) {
+            anchor++;
+        }
+
+        // a pattern without a mask matches everything
+        if (anchor == pattern.length) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        anchors[i] = anchor;
+    }
+
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&Filter.lock, &irql);
+
+    Filter.config = Config;
+    memcpy(Filter.anchors, anchors, sizeof(anchors));
+
+    // release the spinlock
+    KeReleaseSpinLock(&Filter.lock, irql);
+
+    return STATUS_SUCCESS;
+}
+
+bool trigger_is_enabled(const trigger_filter& Filter) {
+    // read without the lock. The reads check it again under the lock
+    const volatile unsigned long& count = Filter.config.count;
+
+    return count != 0;
+}
+
+ULONG trigger_filter_buffer(trigger_filter& Filter, trigger_window& Window, UCHAR* Data, ULONG Length) {
+    // acquire the spinlock
+    KIRQL irql;
+    KeAcquireSpinLock(&Filter.lock, &irql);
+
+    // check if the filter was disabled in the meantime
+    if (!Filter.config.count) {
+        KeReleaseSpinLock(&Filter.lock, irql);
+        return Length;
+    }
+
+    // the sse registers can only be used when we save the state
+    KFLOATING_SAVE state;
+    const bool vector = NT_SUCCESS(KeSaveFloatingPointState(&state));
+
+    ULONG match = Length;
+    ULONG match_length = 0;
+
+    // find the first match of any pattern
+    for (ULONG i = 0; i < Filter.config.count; i++) {
+        const usb_chief_trigger_pattern& pattern = Filter.config.patterns[i];
+
+        if (pattern.length > Length) {
+            continue;
+        }
+
+        // only search the positions before the current first match
+        const ULONG last = Length - pattern.length + 1;
+        const ULONG end = (last < match) ? last : match;
+
+        const ULONG offset = vector ?
+            trigger_find_sse2(pattern, Filter.anchors[i], Data, end) :
+            trigger_find_scalar(pattern, Filter.anchors[i], Data, 0, end);
+
+        if (offset < end) {
+            match = offset;
+            match_length = pattern.length;
+        }
+    }
+
+    if (vector) {
+        KeRestoreFloatingPointState(&state);
+    }
+
+    // get the window we return. The post window of a earlier
+    // match continues from the start of this buffer
+    ULONG start = Length;
+    ULONGLONG end = 0;
+
+    if (Window.post_remaining) {
+        start = 0;
+        end = Window.post_remaining;
+    }
+
+    if (match < Length) {
+        const ULONG pre_start = (match > Filter.config.pre_window) ? (match - Filter.config.pre_window) : 0;
+        const ULONGLONG post_end = static_cast<ULONGLONG>(match) + match_length + Filter.config.post_window;
+
+        start = (pre_start < start) ? pre_start : start;
+        end = (post_end > end) ? post_end : end;
+    }
+
+    // store what is left of the post window for the next buffer
+    Window.post_remaining = (end > Length) ? static_cast<ULONG>(end - Length) : 0;
+
+    // release the spinlock
+    KeReleaseSpinLock(&Filter.lock, irql);
+
+    // check if we have anything to return
+    if (start >= Length) {
+        return 0;
+    }
+
+    const ULONG stop = (end < Length) ? static_cast<ULONG>(end) : Length;
+
+    // move the window to the start of the buffer
+    if (start) {
+        RtlMoveMemory(Data, Data + start, stop - start);
+    }
+
+    return stop - start;
+}
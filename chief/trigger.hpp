@@ -0,0 +1,73 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+#include "ioctl.hpp"
+
+/**
+ * @brief Trigger filter of a pipe handle. Scans the completed bulk in
+ * buffers for the patterns and only keeps the data around a match
+ *
+ */
+struct trigger_filter {
+    // spinlock to protect the configuration
+    KSPIN_LOCK lock;
+
+    // the configuration. A count of 0 disables the filter
+    usb_chief_trigger_config config;
+
+    // the first byte of every pattern with a mask. Used for the 
+    // vectorized search
+    ULONG anchors[chief_max_trigger_patterns];
+};
+
+/**
+ * @brief Window state of a single filtered read. The reads of a handle
+ * can complete out of order, so the post window of a match only 
+ * continues in the next transfers of the same read
+ *
+ */
+struct trigger_window {
+    // amount of bytes of the post window we still need to return
+    ULONG post_remaining;
+};
+
+/**
+ * @brief Initialize a disabled trigger filter
+ *
+ * @param Filter
+ */
+void trigger_init(trigger_filter& Filter);
+
+/**
+ * @brief Set the configuration of a trigger filter
+ *
+ * @param Filter
+ * @param Config
+ * @return NTSTATUS
+ */
+NTSTATUS trigger_configure(trigger_filter& Filter, const usb_chief_trigger_config& Config);
+
+/**
+ * @brief Check if the trigger filter is enabled
+ *
+ * @param Filter
+ * @return true
+ * @return false
+ */
+bool trigger_is_enabled(const trigger_filter& Filter);
+
+/**
+ * @brief Filter a completed buffer. The data we keep is moved to the
+ * start of the buffer. Called at dispatch level
+ *
+ * @param Filter
+ * @param Window the window state of the read. Should be zeroed for
+ * the first buffer of a read
+ * @param Data
+ * @param Length
+ * @return ULONG the amount of bytes to return. 0 when nothing matched
+ */
+ULONG trigger_filter_buffer(trigger_filter& Filter, trigger_window& Window, UCHAR* Data, ULONG Length);
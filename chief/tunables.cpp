@@ -0,0 +1,239 @@
+#include <stddef.h>
+
+#include "tunables.hpp"
+#include "scheduler.hpp"
+#include "fanout.hpp"
+#include "tap.hpp"
+#include "trace.hpp"
+#include "watchdog.hpp"
+#include "device_state.hpp"
+#include "device_extension.hpp"
+
+/**
+ * @brief A single tunable with its registry value name and the range
+ * of valid values
+ *
+ */
+struct tunable_descriptor {
+    // the name of the REG_DWORD in the Parameters key
+    const wchar_t* name;
+
+    // the offset of the field in usb_chief_tunables
+    ULONG offset;
+
+    // the default and the valid range
+    ULONG value;
+    ULONG min;
+    ULONG max;
+};
+
+// all the tunables. Used for the registry and to validate the ioctl
+static const tunable_descriptor tunable_descriptors[] = {
+    { L"MaxTransferSize", offsetof(usb_chief_tunables, max_transfer_size), 64000, 1, 1024 * 1024 },
+    { L"MaxAdaptiveSize", offsetof(usb_chief_tunables, max_adaptive_size), chief_max_adaptive_size, 512, 1024 * 1024 },
+    { L"InterruptBudget", offsetof(usb_chief_tunables, interrupt_budget), scheduler_interrupt_budget, 1, 64 },
+    { L"BulkBudget", offsetof(usb_chief_tunables, bulk_budget), scheduler_bulk_budget, 1, 256 },
+    { L"FanoutDepth", offsetof(usb_chief_tunables, fanout_depth), fanout_default_depth, 1, chief_max_fanout_depth },
+    { L"FanoutPoolDepth", offsetof(usb_chief_tunables, fanout_pool_depth), 0, 0, 1024 },
+    { L"TraceMask", offsetof(usb_chief_tunables, trace_mask), 0, 0, chief_trace_mask_tap | chief_trace_mask_requests },
+    { L"TapSnapshot", offsetof(usb_chief_tunables, tap_snapshot), chief_max_tap_snapshot, 0, chief_max_tap_snapshot },
+    { L"WatchdogInterval", offsetof(usb_chief_tunables, watchdog_interval), 1000, 0, 60000 },
+    { L"ControlDeadline", offsetof(usb_chief_tunables, control_deadline), 5000, 100, 60000 },
+    { L"ControlTimeout", offsetof(usb_chief_tunables, control_timeout), 10000, 0, 600000 },
+    { L"ConfigurationTimeout", offsetof(usb_chief_tunables, configuration_timeout), 10000, 0, 600000 },
+    { L"PortTimeout", offsetof(usb_chief_tunables, port_timeout), 10000, 0, 600000 },
+};
+
+constexpr static ULONG tunable_count = sizeof(tunable_descriptors) / sizeof(tunable_descriptors[0]);
+
+// the current tunables
+static usb_chief_tunables tunables;
+
+// spinlock to serialize the changes
+static KSPIN_LOCK tunables_lock;
+
+// the devices that get the changed tunables
+static LIST_ENTRY tunables_devices;
+
+// mutex to protect the device list. Held while the tunables are
+// applied so a device can not be removed meanwhile
+static KMUTEX tunables_devices_lock;
+
+static ULONG& tunable_field(usb_chief_tunables& Tunables, const tunable_descriptor& Descriptor) {
+    return *reinterpret_cast<ULONG*>(reinterpret_cast<UCHAR*>(&Tunables) + Descriptor.offset);
+}
+
+static ULONG tunable_field(const usb_chief_tunables& Tunables, const tunable_descriptor& Descriptor) {
+    return *reinterpret_cast<const ULONG*>(reinterpret_cast<const UCHAR*>(&Tunables) + Descriptor.offset);
+}
+
+static NTSTATUS tunables_query_value(PWSTR ValueName, ULONG ValueType, PVOID ValueData, ULONG ValueLength, PVOID Context, PVOID EntryContext) {
+    UNREFERENCED_PARAMETER(ValueName);
+    UNREFERENCED_PARAMETER(Context);
+
+    const tunable_descriptor& descriptor = *reinterpret_cast<const tunable_descriptor*>(EntryContext);
+
+    // ignore values with the wrong type. We keep the default
+    if (ValueType != REG_DWORD || ValueLength != sizeof(ULONG)) {
+        return STATUS_SUCCESS;
+    }
+
+    const ULONG value = *reinterpret_cast<const ULONG*>(ValueData);
+
+    // ignore values that are out of range
+    if (value < descriptor.min || value > descriptor.max) {
+        return STATUS_SUCCESS;
+    }
+
+    tunable_field(tunables, descriptor) = value;
+
+    return STATUS_SUCCESS;
+}
+
+void tunables_load(PUNICODE_STRING RegistryPath) {
+    KeInitializeSpinLock(&tunables_lock);
+    KeInitializeMutex(&tunables_devices_lock, 0);
+    InitializeListHead(&tunables_devices);
+
+    // start with the defaults
+    for (ULONG i = 0; i < tunable_count; i++) {
+        tunable_field(tunables, tunable_descriptors[i]) = tunable_descriptors[i].value;
+    }
+
+    // the registry path is not always null terminated. Make a copy
+    // we can give to RtlQueryRegistryValues
+    PWSTR path = reinterpret_cast<PWSTR>(ExAllocatePoolWithTag(
+        PagedPool,
+        RegistryPath->Length + sizeof(WCHAR),
+        0x206D6457u
+    ));
+
+    // check if we got memory. We keep the defaults when we did not
+    if (!path) {
+        return;
+    }
+
+    memcpy(path, RegistryPath->Buffer, RegistryPath->Length);
+    path[RegistryPath->Length / sizeof(WCHAR)] = L'\0';
+
+    // the first entry selects the Parameters key, the last entry is 
+    // empty to end the table
+    RTL_QUERY_REGISTRY_TABLE table[tunable_count + 2] = {};
+
+    table[0].Flags = RTL_QUERY_REGISTRY_SUBKEY;
+    table[0].Name = const_cast<PWSTR>(L"Parameters");
+
+    for (ULONG i = 0; i < tunable_count; i++) {
+        table[i + 1].QueryRoutine = tunables_query_value;
+        table[i + 1].Name = const_cast<PWSTR>(tunable_descriptors[i].name);
+        table[i + 1].EntryContext = const_cast<tunable_descriptor*>(&tunable_descriptors[i]);
+    }
+
+    // missing values and a missing Parameters key keep the defaults
+    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, path, table, nullptr, nullptr);
+
+    ExFreePool(path);
+}
+
+const usb_chief_tunables& get_tunables() {
+    return tunables;
+}
+
+static void tunables_apply_trace(PDEVICE_OBJECT DeviceObject, const usb_chief_tunables& Previous, const usb_chief_tunables& Current) {
+    const ULONG changed = Previous.trace_mask ^ Current.trace_mask;
+
+    // start or stop the tap. Also reconfigure it when the snapshot 
+    // length changed while it is enabled by the mask
+    if ((changed & chief_trace_mask_tap) || 
+        ((Current.trace_mask & chief_trace_mask_tap) && Previous.tap_snapshot != Current.tap_snapshot)) {
+        
+        const usb_chief_tap_config config = {
+            (Current.trace_mask & chief_trace_mask_tap) ? 1ul : 0ul, Current.tap_snapshot
+        };
+
+        tap_configure(DeviceObject, config);
+    }
+
+    // start or stop the request recorder
+    if (changed & chief_trace_mask_requests) {
+        const usb_chief_trace_config config = {
+            (Current.trace_mask & chief_trace_mask_requests) ? 1ul : 0ul
+        };
+
+        trace_configure(DeviceObject, config);
+    }
+}
+
+void tunables_apply(PDEVICE_OBJECT DeviceObject) {
+    // nothing is traced before the device is added
+    const usb_chief_tunables previous = {};
+
+    KeWaitForSingleObject(&tunables_devices_lock, Executive, KernelMode, false, nullptr);
+
+    tunables_apply_trace(DeviceObject, previous, tunables);
+
+    // changes from now on are applied to this device too
+    InsertTailList(&tunables_devices, &get_device_extension(DeviceObject)->tunables_entry);
+
+    KeReleaseMutex(&tunables_devices_lock, false);
+}
+
+void tunables_remove(PDEVICE_OBJECT DeviceObject) {
+    KeWaitForSingleObject(&tunables_devices_lock, Executive, KernelMode, false, nullptr);
+
+    RemoveEntryList(&get_device_extension(DeviceObject)->tunables_entry);
+
+    KeReleaseMutex(&tunables_devices_lock, false);
+}
+
+NTSTATUS tunables_set(const usb_chief_tunables& Tunables) {
+    // check if every value is in range before we change anything
+    for (ULONG i = 0; i < tunable_count; i++) {
+        const ULONG value = tunable_field(Tunables, tunable_descriptors[i]);
+
+        if (value < tunable_descriptors[i].min || value > tunable_descriptors[i].max) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    // a second change is applied after this one
+    KeWaitForSingleObject(&tunables_devices_lock, Executive, KernelMode, false, nullptr);
+
+    KIRQL irql;
+
+    // acquire the spinlock
+    KeAcquireSpinLock(&tunables_lock, &irql);
+
+    const usb_chief_tunables previous = tunables;
+
+    // store the fields one at a time. Readers do not take the lock
+    for (ULONG i = 0; i < tunable_count; i++) {
+        InterlockedExchange(
+            reinterpret_cast<volatile LONG*>(&tunable_field(tunables, tunable_descriptors[i])),
+            static_cast<LONG>(tunable_field(Tunables, tunable_descriptors[i]))
+        );
+    }
+
+    // release the spinlock
+    KeReleaseSpinLock(&tunables_lock, irql);
+
+    // the values are shared so every device gets them
+    for (PLIST_ENTRY entry = tunables_devices.Flink; entry != &tunables_devices; entry = entry->Flink) {
+        PDEVICE_OBJECT device_object = CONTAINING_RECORD(entry, chief_device_extension, tunables_entry)->device_object;
+
+        // change the budgets. Queued transfers are started when a 
+        // budget got bigger
+        scheduler_set_budgets(device_object, Tunables.interrupt_budget, Tunables.bulk_budget);
+
+        tunables_apply_trace(device_object, previous, Tunables);
+
+        // restart the watchdog with the new interval
+        if (previous.watchdog_interval != Tunables.watchdog_interval && get_device_state(device_object) == device_state::started) {
+            watchdog_start(device_object);
+        }
+    }
+
+    KeReleaseMutex(&tunables_devices_lock, false);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+#include "ioctl.hpp"
+
+/**
+ * @brief Set the tunables to the defaults and override them with the
+ * values in the Parameters key of the service. Values that are not a
+ * REG_DWORD or out of range are ignored. Should be called once in 
+ * DriverEntry
+ *
+ * @param RegistryPath the service key we got in DriverEntry
+ */
+void tunables_load(PUNICODE_STRING RegistryPath);
+
+/**
+ * @brief Get the current tunables. Every field can be read at any 
+ * irql, a field can change between two reads
+ *
+ * @return const usb_chief_tunables&
+ */
+const usb_chief_tunables& get_tunables();
+
+/**
+ * @brief Enable the tracing that is selected in the trace mask and
+ * add the device to the devices that get changed tunables. Should be
+ * called at passive level when the device is added
+ *
+ * @param DeviceObject
+ */
+void tunables_apply(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Remove the device from the devices that get changed 
+ * tunables. Should be called at passive level before the device is
+ * deleted
+ *
+ * @param DeviceObject
+ */
+void tunables_remove(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Validate and store new tunables. The tunables are shared by
+ * every device, the scheduler budgets, the trace mask and the 
+ * watchdog interval are applied to all of them right away. The other
+ * values are used by the next request, pipe configuration or fan-out
+ * that uses them. Should be called at passive level
+ *
+ * @param Tunables
+ * @return NTSTATUS
+ */
+NTSTATUS tunables_set(const usb_chief_tunables& Tunables);
@@ -0,0 +1,214 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+    #include <usb.h>
+    #include <usbdi.h>
+    #include <usb100.h>
+}
+
+#include <stddef.h>
+
+/**
+ * @brief Maps a urb function to the urb structure it uses. Only the
+ * functions the driver sends are defined, using any other function
+ * does not compile
+ *
+ * @tparam Function URB_FUNCTION_xxx
+ */
+template <USHORT Function>
+struct urb_function_traits;
+
+template <>
+struct urb_function_traits<URB_FUNCTION_SELECT_CONFIGURATION> {
+    using type = _URB_SELECT_CONFIGURATION;
+};
+
+template <>
+struct urb_function_traits<URB_FUNCTION_ABORT_PIPE> {
+    using type = _URB_PIPE_REQUEST;
+};
+
+template <>
+struct urb_function_traits<URB_FUNCTION_RESET_PIPE> {
+    using type = _URB_PIPE_REQUEST;
+};
+
+template <>
+struct urb_function_traits<URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER> {
+    using type = _URB_BULK_OR_INTERRUPT_TRANSFER;
+};
+
+template <>
+struct urb_function_traits<URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE> {
+    using type = _URB_CONTROL_DESCRIPTOR_REQUEST;
+};
+
+template <>
+struct urb_function_traits<URB_FUNCTION_VENDOR_DEVICE> {
+    using type = _URB_CONTROL_VENDOR_OR_CLASS_REQUEST;
+};
+
+/**
+ * @brief The urb structure of a urb function
+ *
+ * @tparam Function URB_FUNCTION_xxx
+ */
+template <USHORT Function>
+using urb_type = typename urb_function_traits<Function>::type;
+
+/**
+ * @brief Get a urb structure as a PURB. Only compiles for structures
+ * that start with the header and fit in the URB union
+ *
+ * @tparam T
+ * @param Urb
+ * @return PURB
+ */
+template <typename T>
+inline PURB urb_cast(T& Urb) {
+    static_assert(offsetof(T, Hdr) == 0, "the urb should start with the header");
+    static_assert(sizeof(T) <= sizeof(URB), "the urb should fit in the URB union");
+
+    return reinterpret_cast<PURB>(&Urb);
+}
+
+/**
+ * @brief Set the header of a urb. The length and function are picked
+ * at compile time and the compiler checks the structure matches the
+ * function
+ *
+ * @tparam Function URB_FUNCTION_xxx
+ * @param Urb
+ */
+template <USHORT Function>
+inline void urb_set_header(urb_type<Function>& Urb) {
+    static_assert(sizeof(urb_type<Function>) <= 0xffff, "the urb length should fit in the header");
+    static_assert(offsetof(urb_type<Function>, Hdr) == 0, "the urb should start with the header");
+
+    Urb.Hdr.Length = static_cast<USHORT>(sizeof(urb_type<Function>));
+    Urb.Hdr.Function = Function;
+    Urb.Hdr.Status = 0;
+    Urb.Hdr.UsbdDeviceHandle = nullptr;
+    Urb.Hdr.UsbdFlags = 0;
+}
+
+/**
+ * @brief Build a bulk or interrupt transfer. Every field the usb
+ * stack reads is set, so the urb does not need to be cleared first.
+ * Can be used on a urb in a transfer context that is reused
+ *
+ * @param Urb
+ * @param PipeHandle
+ * @param Flags USBD_TRANSFER_DIRECTION_xxx and USBD_SHORT_TRANSFER_OK
+ * @param Buffer nullptr when the mdl is used
+ * @param Mdl nullptr when the buffer is used
+ * @param Length
+ */
+inline void urb_build_bulk_or_interrupt(_URB_BULK_OR_INTERRUPT_TRANSFER& Urb, USBD_PIPE_HANDLE PipeHandle,
+    ULONG Flags, PVOID Buffer, PMDL Mdl, ULONG Length) {
+
+    urb_set_header<URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER>(Urb);
+
+    Urb.PipeHandle = PipeHandle;
+    Urb.TransferFlags = Flags;
+    Urb.TransferBufferLength = Length;
+    Urb.TransferBuffer = Buffer;
+    Urb.TransferBufferMDL = Mdl;
+    Urb.UrbLink = nullptr;
+
+    // the host controller area is only for the usb stack. Clear what
+    // it left from the previous transfer
+    memset(&Urb.hca, 0x00, sizeof(Urb.hca));
+}
+
+/**
+ * @brief Build a vendor request to the device
+ *
+ * @param Urb
+ * @param In true for a device to host request
+ * @param Request
+ * @param Value
+ * @param Index
+ * @param Buffer
+ * @param Length
+ */
+inline void urb_build_vendor_request(_URB_CONTROL_VENDOR_OR_CLASS_REQUEST& Urb, bool In, UCHAR Request,
+    USHORT Value, USHORT Index, PVOID Buffer, ULONG Length) {
+
+    // control requests are rare. Clear the reserved fields as well
+    memset(&Urb, 0x00, sizeof(Urb));
+    urb_set_header<URB_FUNCTION_VENDOR_DEVICE>(Urb);
+
+    Urb.TransferFlags = (
+        In ? (USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK) : USBD_TRANSFER_DIRECTION_OUT
+    );
+    Urb.TransferBufferLength = Length;
+    Urb.TransferBuffer = Buffer;
+    Urb.RequestTypeReservedBits = static_cast<UCHAR>(
+        ((In ? BMREQUEST_DEVICE_TO_HOST : BMREQUEST_HOST_TO_DEVICE) << 7) |
+        (BMREQUEST_VENDOR << 5) | BMREQUEST_TO_DEVICE
+    );
+    Urb.Request = Request;
+    Urb.Value = Value;
+    Urb.Index = Index;
+}
+
+/**
+ * @brief Build a request for a descriptor of the device
+ *
+ * @param Urb
+ * @param DescriptorType USB_xxx_DESCRIPTOR_TYPE
+ * @param Index
+ * @param LanguageId
+ * @param Buffer
+ * @param Length
+ */
+inline void urb_build_get_descriptor(_URB_CONTROL_DESCRIPTOR_REQUEST& Urb, UCHAR DescriptorType,
+    UCHAR Index, USHORT LanguageId, PVOID Buffer, ULONG Length) {
+
+    // control requests are rare. Clear the reserved fields as well
+    memset(&Urb, 0x00, sizeof(Urb));
+    urb_set_header<URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE>(Urb);
+
+    Urb.TransferBufferLength = Length;
+    Urb.TransferBuffer = Buffer;
+    Urb.DescriptorType = DescriptorType;
+    Urb.Index = Index;
+    Urb.LanguageId = LanguageId;
+}
+
+/**
+ * @brief Build a request on a pipe
+ *
+ * @tparam Function URB_FUNCTION_ABORT_PIPE or URB_FUNCTION_RESET_PIPE
+ * @param Urb
+ * @param PipeHandle
+ */
+template <USHORT Function>
+inline void urb_build_pipe_request(_URB_PIPE_REQUEST& Urb, USBD_PIPE_HANDLE PipeHandle) {
+    static_assert(
+        Function == URB_FUNCTION_ABORT_PIPE || Function == URB_FUNCTION_RESET_PIPE,
+        "the function should be a pipe request"
+    );
+
+    urb_set_header<Function>(Urb);
+
+    Urb.PipeHandle = PipeHandle;
+    Urb.Reserved = 0;
+}
+
+/**
+ * @brief Build a select configuration without interfaces. Only used
+ * to deselect the configuration with a nullptr descriptor, the size
+ * of a request with interfaces is only known at runtime
+ *
+ * @param Urb
+ * @param Descriptor
+ */
+inline void urb_build_select_configuration(_URB_SELECT_CONFIGURATION& Urb, PUSB_CONFIGURATION_DESCRIPTOR Descriptor) {
+    memset(&Urb, 0x00, sizeof(Urb));
+    urb_set_header<URB_FUNCTION_SELECT_CONFIGURATION>(Urb);
+
+    Urb.ConfigurationDescriptor = Descriptor;
+}
@@ -1,49 +1,86 @@
 #include "usb.hpp"
 #include "pipe.hpp"
+#include "file_context.hpp"
+#include "scheduler.hpp"
+#include "tap.hpp"
+#include "trigger.hpp"
+#include "crc32c.hpp"
+#include "urb.hpp"
+#include "watchdog.hpp"
+#include "tunables.hpp"
+#include "major_functions.hpp"
+#include "notify.hpp"
+#include "protocol.hpp"
+#include "vendor_stats.hpp"
+#include "control_channel.hpp"
 
 extern "C" {
     #include <usbdlib.h>
 }
 
-// the amount of alternate settings we support
-constexpr static ULONG max_alternate_settings = 2;
 
-
-static NTSTATUS usb_send_urb(_DEVICE_OBJECT* DeviceObject, PURB Urb) {
+/**
+ * @brief Send a internal ioctl to the usb stack and wait for it with a
+ * deadline. When the deadline expires the irp is cancelled and we wait
+ * until the usb stack gives it back, so the caller can free what the
+ * irp points to when we return
+ * 
+ * @param DeviceObject 
+ * @param IoControlCode IOCTL_INTERNAL_USB_xxx
+ * @param Argument1 
+ * @param Timeout in milliseconds. 0 waits until the irp completes
+ * @return NTSTATUS STATUS_IO_TIMEOUT when the deadline expired
+ */
+static NTSTATUS usb_call_with_deadline(_DEVICE_OBJECT* DeviceObject, ULONG IoControlCode, PVOID Argument1, ULONG Timeout) {
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // use a irp we own. A irp from IoBuildDeviceIoControlRequest is 
+    // freed by the io manager on completion, so we could not touch it 
+    // anymore to cancel it after the deadline. This is the irp of the
+    // control channel when it is free
+    PIRP irp = control_channel_acquire_irp(DeviceObject);
+
+    if (!irp) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
     // create a event
     KEVENT event;
     KeInitializeEvent(&event, NotificationEvent, false);
 
-    struct _IO_STATUS_BLOCK IoStatusBlock = {};
+    // set the internal ioctl on the next stack location
+    PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    stack->Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+    stack->Parameters.Others.Argument1 = Argument1;
 
-    PIRP irp = IoBuildDeviceIoControlRequest(
-        IOCTL_INTERNAL_USB_SUBMIT_URB,
-        dev_ext->attachedDeviceObject,
-        nullptr,
-        0,
-        nullptr,
-        0,
-        true,
-        &event,
-        &IoStatusBlock
-    );
+    irp->IoStatus.Status = STATUS_NOT_SUPPORTED;
 
-    if (!irp) {
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    // the completion routine keeps the irp for us
+    IoSetCompletionRoutine(irp, signal_event_complete, &event, true, true, true);
 
-    // get the next stack location and store the URB pointer for the USB stack
-    PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(irp);
-    stack->Parameters.Others.Argument1 = static_cast<void*>(Urb);
+    IofCallDriver(dev_ext->attachedDeviceObject, irp);
+
+    // a negative value is relative in 100ns units
+    LARGE_INTEGER deadline;
+    deadline.QuadPart = -10000LL * Timeout;
+
+    // wait for the completion or the deadline
+    NTSTATUS status = KeWaitForSingleObject(
+        &event,
+        Suspended,
+        KernelMode,
+        false,
+        Timeout ? &deadline : nullptr
+    );
 
-    NTSTATUS status = IofCallDriver(dev_ext->attachedDeviceObject, irp);
+    if (status == STATUS_TIMEOUT) {
+        // the device did not answer in time. Cancel the irp and wait
+        // for the usb stack to give it back. This does not take long,
+        // the usb stack completes a cancelled irp right away
+        IoCancelIrp(irp);
 
-    // check if we have a pending status
-    if (status == STATUS_PENDING) {
-        // wait for the event to be signaled
         KeWaitForSingleObject(
             &event,
             Suspended,
@@ -52,13 +89,295 @@ static NTSTATUS usb_send_urb(_DEVICE_OBJECT* DeviceObject, PURB Urb) {
             nullptr
         );
 
-        status = IoStatusBlock.Status;
+        // the irp can still complete before the cancel. Keep the 
+        // result in that case
+        status = (irp->IoStatus.Status == STATUS_CANCELLED) ? STATUS_IO_TIMEOUT : irp->IoStatus.Status;
+    }
+    else {
+        status = irp->IoStatus.Status;
     }
 
+    // the irp always comes back to us, also after a cancel. It can be
+    // used again by the next request
+    control_channel_release_irp(DeviceObject, irp);
+
     return status;
 }
 
+static NTSTATUS usb_send_urb(_DEVICE_OBJECT* DeviceObject, PURB Urb, ULONG Timeout) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // record the urb when the tap is enabled
+    if (dev_ext->tap_enabled) {
+        tap_urb(DeviceObject, Urb, Urb, false);
+    }
+
+    // send the urb and wait for it until the deadline
+    const NTSTATUS status = usb_call_with_deadline(DeviceObject, IOCTL_INTERNAL_USB_SUBMIT_URB, Urb, Timeout);
+
+    // record the result when the tap is enabled
+    if (dev_ext->tap_enabled) {
+        tap_urb(DeviceObject, Urb, Urb, true);
+    }
+
+    return status;
+}
+
+static NTSTATUS usb_send_control_urb(_DEVICE_OBJECT* DeviceObject, PURB Urb) {
+    // wait for a slot in the control budget. This holds back new
+    // bulk and interrupt transfers until the control transfer is done
+    scheduler_control_begin(DeviceObject);
+
+    // send the urb. The watchdog checks the deadline while it is
+    // with the usb stack
+    watchdog_control_begin(DeviceObject);
+
+    const NTSTATUS status = usb_send_urb(DeviceObject, Urb, get_tunables().control_timeout);
+
+    watchdog_control_end(DeviceObject);
+
+    // release the slot and restart the waiting transfers
+    scheduler_control_end(DeviceObject);
+
+    return status;
+}
+
+/**
+ * @brief Context for a single bulk or interrupt transfer
+ * 
+ */
+struct bulk_transfer_context {
+    // the urb we send to the usb stack. Should stay the first field,
+    // the fields after it are cleared when the context is created
+    _URB_BULK_OR_INTERRUPT_TRANSFER urb;
+
+    // partial mdls for the data and the frame header when the 
+    // read is framed. nullptr when the irp mdl is used directly
+    PMDL data_mdl;
+    PMDL header_mdl;
+
+    // performance counter value when the transfer completed
+    LONGLONG timestamp;
+
+    // the scheduler class of the transfer
+    chief_transfer_class transfer_class;
+
+    // the state of the pipe and the length we requested. Adaptive 
+    // is true when the length was picked by the adaptive sizing
+    pipe_state* pipe;
+    ULONG length;
+    bool adaptive;
+
+    // the trigger filter of the handle. nullptr when the data is 
+    // returned without filtering
+    trigger_filter* trigger;
+
+    // the post window of the read and the amount of data it kept at
+    // the start of the buffer. The next transfer of the read fills 
+    // the buffer after the kept data
+    trigger_window window;
+    ULONG kept;
+
+    // the mdl of the whole buffer of a filtered read and a partial
+    // mdl for the part after the kept data
+    PMDL transfer_mdl;
+    PMDL rest_mdl;
+
+    // dpc that sends the next transfer of a filtered read. This keeps 
+    // the completion routine from calling the usb stack again
+    KDPC restart_dpc;
+
+    // true when the frame header should have the crc32c of the data
+    bool crc;
+
+    // the handle when the transfer uses a registered buffer. The 
+    // buffer is released when the transfer is freed
+    chief_file_context* registered;
+};
+
+static void usb_free_bulk_or_interrupt_transfer(bulk_transfer_context* Context) {
+    // free the partial mdls. The mdls can be mapped by 
+    // the lower drivers so we need to prepare them first
+    if (Context->data_mdl) {
+        MmPrepareMdlForReuse(Context->data_mdl);
+        IoFreeMdl(Context->data_mdl);
+    }
+
+    if (Context->header_mdl) {
+        MmPrepareMdlForReuse(Context->header_mdl);
+        IoFreeMdl(Context->header_mdl);
+    }
+
+    if (Context->rest_mdl) {
+        MmPrepareMdlForReuse(Context->rest_mdl);
+        IoFreeMdl(Context->rest_mdl);
+    }
+
+    // the registered buffer can be unregistered again
+    if (Context->registered) {
+        file_context_release_buffer(Context->registered);
+    }
+
+    // free the context
+    ExFreePool(Context);
+}
+
+static NTSTATUS usb_bulk_or_interrupt_transfer_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context);
+
+static void usb_set_transfer_stack_location(PIRP Irp, bulk_transfer_context* Context) {
+    // get the next stack location
+    PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(Irp);
+
+    stack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
+    stack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
+    stack->Parameters.Others.Argument1 = &Context->urb;
+    stack->CompletionRoutine = usb_bulk_or_interrupt_transfer_complete;
+    stack->Context = Context;
+    stack->Control = SL_INVOKE_ON_SUCCESS | SL_INVOKE_ON_ERROR | SL_INVOKE_ON_CANCEL;
+}
+
+static void usb_restart_dpc(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    UNREFERENCED_PARAMETER(Dpc);
+
+    bulk_transfer_context* context = reinterpret_cast<bulk_transfer_context*>(DeferredContext);
+    PIRP irp = reinterpret_cast<PIRP>(SystemArgument1);
+    PDEVICE_OBJECT device_object = reinterpret_cast<PDEVICE_OBJECT>(SystemArgument2);
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(device_object);
+
+    // record the urb when the tap is enabled
+    if (dev_ext->tap_enabled) {
+        tap_urb(device_object, urb_cast(context->urb), irp, false);
+    }
+
+    // the transfer keeps its slot in the scheduler. The context can 
+    // be freed by the completion as soon as the irp is sent
+    IofCallDriver(dev_ext->attachedDeviceObject, irp);
+}
+
+static bool usb_restart_bulk_or_interrupt_transfer(PDEVICE_OBJECT DeviceObject, PIRP Irp, bulk_transfer_context* Context) {
+    _URB_BULK_OR_INTERRUPT_TRANSFER* urb = &Context->urb;
+
+    PMDL mdl = Context->transfer_mdl;
+
+    // the next transfer fills the buffer after the data we keep
+    if (Context->kept) {
+        UCHAR* address = reinterpret_cast<UCHAR*>(MmGetMdlVirtualAddress(Context->transfer_mdl));
+
+        // the partial mdl is large enough for the whole buffer so it
+        // can be used for every part of it
+        if (!Context->rest_mdl) {
+            Context->rest_mdl = IoAllocateMdl(address, Context->length, false, false, nullptr);
+
+            if (!Context->rest_mdl) {
+                return false;
+            }
+        }
+        else {
+            MmPrepareMdlForReuse(Context->rest_mdl);
+        }
+
+        IoBuildPartialMdl(
+            Context->transfer_mdl, Context->rest_mdl, address + Context->kept, Context->length - Context->kept
+        );
+
+        mdl = Context->rest_mdl;
+    }
+
+    // build the urb again with the same pipe and flags. The usb stack 
+    // changed the length and the host controller area
+    urb_build_bulk_or_interrupt(
+        *urb, urb->PipeHandle, urb->TransferFlags, nullptr, mdl, Context->length - Context->kept
+    );
+
+    // reuse the irp for the next transfer
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+
+    usb_set_transfer_stack_location(Irp, Context);
+
+    // send it from a dpc. Calling the usb stack from its own 
+    // completion routine can nest without a limit when the transfers
+    // complete right away
+    KeInsertQueueDpc(&Context->restart_dpc, Irp, DeviceObject);
+
+    return true;
+}
+
 static NTSTATUS usb_bulk_or_interrupt_transfer_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context) {
+    // stamp the transfer as early as possible
+    const LARGE_INTEGER timestamp = KeQueryPerformanceCounter(nullptr);
+
+    // get the transfer context
+    bulk_transfer_context* context = reinterpret_cast<bulk_transfer_context*>(Context);
+    _URB_BULK_OR_INTERRUPT_TRANSFER* urb = &context->urb;
+
+    // store when the transfer completed
+    context->timestamp = timestamp.QuadPart;
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    // the device is still responding
+    watchdog_progress(DeviceObject);
+
+    // record the result when the tap is enabled
+    if (dev_ext->tap_enabled) {
+        tap_urb(DeviceObject, urb_cast(*urb), Irp, true);
+    }
+
+    // update the statistics and the adaptive size of the pipe. A 
+    // filtered read only requests the part after the kept data
+    pipe_state_complete(
+        context->pipe, context->length - context->kept, urb->TransferBufferLength, Irp->IoStatus.Status, context->adaptive
+    );
+
+    // let the application know the pipe stalled
+    if (urb->Hdr.Status == USBD_STATUS_STALL_PID) {
+        notify_event(
+            DeviceObject, chief_event_stall, context->pipe ? static_cast<ULONG>(context->pipe - dev_ext->pipes) : MAXULONG
+        );
+    }
+
+    // check if we only need to return the data around a trigger
+    if (context->trigger) {
+        if (NT_SUCCESS(Irp->IoStatus.Status) && urb->TransferBufferLength) {
+            UCHAR* data = reinterpret_cast<UCHAR*>(
+                MmGetSystemAddressForMdlSafe(context->transfer_mdl, NormalPagePriority)
+            );
+
+            // the new data is after the data we kept. When we cannot 
+            // map the buffer we return the data unfiltered
+            if (data) {
+                context->kept += trigger_filter_buffer(
+                    *context->trigger, context->window, data + context->kept, urb->TransferBufferLength
+                );
+            }
+            else {
+                context->kept += urb->TransferBufferLength;
+                context->window.post_remaining = 0;
+            }
+        }
+
+        // nothing to return yet or the post window continues in the 
+        // rest of the buffer. Reuse the irp for the next transfer as 
+        // long as nobody is waiting for it to finish
+        const bool more = !context->kept || (context->window.post_remaining && context->kept < context->length);
+
+        if (more && NT_SUCCESS(Irp->IoStatus.Status) && !Irp->Cancel && 
+            get_device_state(DeviceObject) == device_state::started &&
+            usb_restart_bulk_or_interrupt_transfer(DeviceObject, Irp, context)) 
+        {
+            return STATUS_MORE_PROCESSING_REQUIRED;
+        }
+
+        // return everything the read kept
+        urb->TransferBufferMDL = context->transfer_mdl;
+        urb->TransferBufferLength = context->kept;
+    }
+
     // check if we have a pending return
     if (Irp->PendingReturned) {
         IoGetCurrentIrpStackLocation(Irp)->Control |= SL_PENDING_RETURNED;
@@ -67,55 +386,182 @@ static NTSTATUS usb_bulk_or_interrupt_transfer_complete(PDEVICE_OBJECT DeviceObj
     // decrement the pipe open count
     decrement_active_pipe_count_and_notify(DeviceObject);
 
-    // get the context urb
-    _URB_BULK_OR_INTERRUPT_TRANSFER* urb = reinterpret_cast<_URB_BULK_OR_INTERRUPT_TRANSFER*>(Context);
+    // release the slot in the scheduler and start the next transfer
+    scheduler_complete(DeviceObject, context->transfer_class);
 
     // set the irp status to success
     Irp->IoStatus.Status = STATUS_SUCCESS;
     Irp->IoStatus.Information = urb->TransferBufferLength;
 
+    // check if we need to write the frame header in front of the data
+    if (context->header_mdl) {
+        chief_read_frame_header* header = reinterpret_cast<chief_read_frame_header*>(
+            MmGetSystemAddressForMdlSafe(context->header_mdl, NormalPagePriority)
+        );
+
+        if (header) {
+            header->timestamp = context->timestamp;
+            header->length = urb->TransferBufferLength;
+            header->status = urb->Hdr.Status;
+            header->crc = 0;
+            header->flags = 0;
+
+            // check if we need to add the crc of the data
+            const UCHAR* data = (context->crc && urb->TransferBufferLength) ? reinterpret_cast<const UCHAR*>(
+                MmGetSystemAddressForMdlSafe(urb->TransferBufferMDL, NormalPagePriority)
+            ) : nullptr;
+
+            if (data) {
+                const LARGE_INTEGER start = KeQueryPerformanceCounter(nullptr);
+
+                header->crc = crc32c(data, urb->TransferBufferLength);
+                header->flags = chief_frame_crc;
+
+                // keep the cost of the crc in the pipe statistics
+                pipe_state_add_crc(
+                    context->pipe, urb->TransferBufferLength, KeQueryPerformanceCounter(nullptr).QuadPart - start.QuadPart
+                );
+            }
+
+            // return the header with the data
+            Irp->IoStatus.Information += sizeof(chief_read_frame_header);
+        }
+        else {
+            // we could not map the header
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            Irp->IoStatus.Information = 0;
+        }
+    }
+
+    // free the bulk or interrupt request. The partial mdls describe
+    // pages of the irp mdl and a registered buffer should be released
+    // before the handle can be closed by the completion
+    usb_free_bulk_or_interrupt_transfer(context);
+
     // complete the irp
     IofCompleteRequest(Irp, IO_NO_INCREMENT);
 
-    // free the bulk or interrupt request
-    ExFreePool(urb);
-
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
-_URB_BULK_OR_INTERRUPT_TRANSFER* usb_create_bulk_or_interrupt_transfer(__inout struct _IRP *Irp, USBD_PIPE_INFORMATION* Payload, bool isInDirection) {
-    // get the amount of data to transfer
-    const int length = (Irp->MdlAddress) ? MmGetMdlByteCount(Irp->MdlAddress) : 0;
+static bulk_transfer_context* usb_create_bulk_or_interrupt_transfer(PMDL Mdl, PVOID Address, ULONG length, USBD_PIPE_INFORMATION* Payload, bool isInDirection, bool framed, pipe_state* Pipe) {
 
-    // create the urb
-    _URB_BULK_OR_INTERRUPT_TRANSFER* request = reinterpret_cast<_URB_BULK_OR_INTERRUPT_TRANSFER*>(ExAllocatePoolWithTag(
+    // get the length of the data without the frame header
+    const ULONG data_length = framed ? (length - sizeof(chief_read_frame_header)) : length;
+
+    // only bulk in transfers use the adaptive size. The usb stack 
+    // completes the transfer when it has this amount of data
+    bool adaptive = false;
+    const ULONG transfer_length = (isInDirection && Payload->PipeType == UsbdPipeTypeBulk) ? 
+        pipe_state_transfer_size(Pipe, data_length, adaptive) : data_length;
+
+    // create the context
+    bulk_transfer_context* context = reinterpret_cast<bulk_transfer_context*>(ExAllocatePoolWithTag(
         NonPagedPool,
-        sizeof(_URB_BULK_OR_INTERRUPT_TRANSFER),
+        sizeof(bulk_transfer_context),
         0x206D6457u
     ));
 
     // check if we got memory
-    if (!request) {
+    if (!context) {
         return nullptr;
     }
 
+    // clear the fields after the urb. The builder sets every field 
+    // of the urb so it does not need to be cleared
+    memset(
+        &context->data_mdl, 0x00, 
+        sizeof(bulk_transfer_context) - offsetof(bulk_transfer_context, data_mdl)
+    );
+
     // initialize the urb
-    memset(request, 0x00, sizeof(_URB_BULK_OR_INTERRUPT_TRANSFER));
-    request->Hdr.Length = sizeof(_URB_BULK_OR_INTERRUPT_TRANSFER);
-    request->Hdr.Function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
-    request->PipeHandle = Payload->PipeHandle;
-    request->UrbLink = nullptr;
-    request->TransferFlags = (
-        (isInDirection ? USBD_TRANSFER_DIRECTION_IN : USBD_TRANSFER_DIRECTION_OUT) | USBD_SHORT_TRANSFER_OK
+    _URB_BULK_OR_INTERRUPT_TRANSFER* request = &context->urb;
+
+    urb_build_bulk_or_interrupt(
+        *request, Payload->PipeHandle,
+        (isInDirection ? USBD_TRANSFER_DIRECTION_IN : USBD_TRANSFER_DIRECTION_OUT) | USBD_SHORT_TRANSFER_OK,
+        nullptr, Mdl, transfer_length
     );
-    request->TransferBufferMDL = Irp->MdlAddress;
-    request->TransferBufferLength = length;
-    request->TransferBuffer = nullptr;
 
-    return request;
+    // store the length so we know how full the transfer came back
+    context->pipe = Pipe;
+    context->length = transfer_length;
+    context->adaptive = adaptive;
+
+    // check if we need to reserve space for a frame header
+    if (framed) {
+        UCHAR* address = reinterpret_cast<UCHAR*>(Address);
+        constexpr ULONG header_size = sizeof(chief_read_frame_header);
+
+        // allocate partial mdls for the header and the data after it
+        context->header_mdl = IoAllocateMdl(address, header_size, false, false, nullptr);
+        context->data_mdl = IoAllocateMdl(address + header_size, transfer_length, false, false, nullptr);
+
+        if (!context->header_mdl || !context->data_mdl) {
+            usb_free_bulk_or_interrupt_transfer(context);
+            return nullptr;
+        }
+
+        IoBuildPartialMdl(Mdl, context->header_mdl, address, header_size);
+        IoBuildPartialMdl(Mdl, context->data_mdl, address + header_size, transfer_length);
+
+        // only transfer the data after the header
+        request->TransferBufferMDL = context->data_mdl;
+    }
+    else if (Mdl && (Address != MmGetMdlVirtualAddress(Mdl) || length != MmGetMdlByteCount(Mdl))) {
+        // the transfer only uses a part of a registered buffer. The 
+        // partial mdl uses the pages that are already locked
+        context->data_mdl = IoAllocateMdl(Address, transfer_length, false, false, nullptr);
+
+        if (!context->data_mdl) {
+            usb_free_bulk_or_interrupt_transfer(context);
+            return nullptr;
+        }
+
+        IoBuildPartialMdl(Mdl, context->data_mdl, Address, transfer_length);
+
+        request->TransferBufferMDL = context->data_mdl;
+    }
+
+    return context;
 }
 
-NTSTATUS usb_send_bulk_or_interrupt_transfer(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp, bool read) {
+void usb_cancel_bulk_or_interrupt_transfer(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+    // get the transfer context we stored in the next stack location
+    bulk_transfer_context* context = reinterpret_cast<bulk_transfer_context*>(
+        IoGetNextIrpStackLocation(Irp)->Context
+    );
+
+    // free the bulk or interrupt request. The transfer was never
+    // sent to the usb stack so we do not have a completion
+    usb_free_bulk_or_interrupt_transfer(context);
+
+    // decrement the pipe open count
+    decrement_active_pipe_count_and_notify(DeviceObject);
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+
+    // complete the irp
+    IofCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+static NTSTATUS usb_fail_transfer(PIRP Irp, NTSTATUS Status, chief_file_context* Registered) {
+    // release the registered buffer the transfer would have used
+    if (Registered) {
+        file_context_release_buffer(Registered);
+    }
+
+    Irp->IoStatus.Status = Status;
+    Irp->IoStatus.Information = 0;
+
+    // complete the irp
+    IofCompleteRequest(Irp, 0);
+
+    return Status;
+}
+
+static NTSTATUS usb_send_transfer(_DEVICE_OBJECT *DeviceObject, PIRP Irp, bool read, PMDL Mdl, PVOID Address, ULONG Length, chief_file_context* Registered) {
     // get the current stack location
     PIO_STACK_LOCATION current_stack = IoGetCurrentIrpStackLocation(Irp);
 
@@ -124,57 +570,228 @@ NTSTATUS usb_send_bulk_or_interrupt_transfer(__in struct _DEVICE_OBJECT *DeviceO
 
     // check for a valid fs context
     if (!file || !file->FsContext) {
-        Irp->IoStatus.Status = STATUS_INVALID_HANDLE;
-        Irp->IoStatus.Information = 0;
-
-        // complete the irp
-        IofCompleteRequest(Irp, 0);
-
-        return STATUS_INVALID_HANDLE;
+        return usb_fail_transfer(Irp, STATUS_INVALID_HANDLE, Registered);
     }
 
     // get the payload from the fs context
     USBD_PIPE_INFORMATION* pipe_info = reinterpret_cast<USBD_PIPE_INFORMATION*>(file->FsContext);
 
-    _URB_BULK_OR_INTERRUPT_TRANSFER* request = usb_create_bulk_or_interrupt_transfer(
-        Irp, pipe_info, read
+    // check if we need to return a frame header in front of the data
+    chief_file_context* file_context = get_file_context(file);
+    const bool framed = read && file_context && (file_context->read_mode & chief_read_mode_framed);
+
+    // a framed read needs space for the header and at least one byte of data
+    if (framed && Length <= sizeof(chief_read_frame_header)) {
+        return usb_fail_transfer(Irp, STATUS_INVALID_BUFFER_SIZE, Registered);
+    }
+
+    // get the sizing and statistics of the pipe
+    pipe_state* pipe = file_context ? get_pipe_state(DeviceObject, file_context->pipe_index) : nullptr;
+
+    bulk_transfer_context* request = usb_create_bulk_or_interrupt_transfer(
+        Mdl, Address, Length, pipe_info, read, framed, pipe
     );
 
     if (!request) {
-        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-        Irp->IoStatus.Information = 0;
+        return usb_fail_transfer(Irp, STATUS_INSUFFICIENT_RESOURCES, Registered);
+    }
 
-        // complete the irp
-        IofCompleteRequest(Irp, 0);
+    // interrupt pipes get their own budget in the scheduler
+    request->transfer_class = (pipe_info->PipeType == UsbdPipeTypeInterrupt) ?
+        chief_transfer_interrupt : chief_transfer_bulk;
 
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
+    // check if the frame header should have the crc of the data
+    request->crc = framed && (file_context->read_mode & chief_read_mode_crc);
 
-    // get the next stack location
-    PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(Irp);
+    // the transfer releases the registered buffer when it is freed
+    request->registered = Registered;
 
-    stack->MajorFunction = IRP_MJ_INTERNAL_DEVICE_CONTROL;
-    stack->Parameters.DeviceIoControl.IoControlCode = IOCTL_INTERNAL_USB_SUBMIT_URB;
-    stack->Parameters.Others.Argument1 = request;
-    stack->CompletionRoutine = usb_bulk_or_interrupt_transfer_complete;
-    stack->Context = request;
-    stack->Control = SL_INVOKE_ON_SUCCESS | SL_INVOKE_ON_ERROR | SL_INVOKE_ON_CANCEL;
+    // only bulk in data can be filtered with a trigger
+    if (read && file_context && pipe_info->PipeType == UsbdPipeTypeBulk && trigger_is_enabled(file_context->trigger)) {
+        request->trigger = &file_context->trigger;
+        request->transfer_mdl = request->urb.TransferBufferMDL;
+
+        KeInitializeDpc(&request->restart_dpc, usb_restart_dpc, request);
+    }
+
+    // set the next stack location
+    usb_set_transfer_stack_location(Irp, request);
 
     // acquire the spinlock
     increment_active_pipe_count(DeviceObject);
 
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
 
-    return IofCallDriver(dev_ext->attachedDeviceObject, Irp);
+    // record the urb when the tap is enabled. The submit is recorded
+    // when the driver accepts the transfer, before it is scheduled
+    if (dev_ext->tap_enabled) {
+        tap_urb(DeviceObject, urb_cast(request->urb), Irp, false);
+    }
+
+    // a filtered transfer can be restarted from the completion so it
+    // should always be pending
+    if (request->trigger) {
+        IoMarkIrpPending(Irp);
+        scheduler_submit(DeviceObject, Irp, request->transfer_class);
+
+        return STATUS_PENDING;
+    }
+
+    // send the transfer to the usb stack or queue it when the 
+    // budget of the class is used
+    return scheduler_submit(DeviceObject, Irp, request->transfer_class);
+}
+
+NTSTATUS usb_send_bulk_or_interrupt_transfer(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp, bool read) {
+    // the io manager locked the buffer of the request in the mdl
+    PMDL mdl = Irp->MdlAddress;
+
+    return usb_send_transfer(
+        DeviceObject, Irp, read, mdl, mdl ? MmGetMdlVirtualAddress(mdl) : nullptr, mdl ? MmGetMdlByteCount(mdl) : 0, nullptr
+    );
 }
 
+NTSTATUS usb_send_registered_transfer(_DEVICE_OBJECT* DeviceObject, PIRP Irp, bool read, const usb_chief_registered_transfer& Transfer) {
+    // get the context of the pipe handle
+    chief_file_context* file_context = get_file_context(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+    // the buffers are registered on a normal pipe handle
+    if (!file_context || file_context->subscriber) {
+        return usb_fail_transfer(Irp, STATUS_INVALID_HANDLE, nullptr);
+    }
+
+    PMDL mdl = nullptr;
+    PVOID address = nullptr;
+
+    // get the part of the registered buffer. The pages are already 
+    // locked so we skip the probe and lock of a normal transfer
+    const NTSTATUS status = file_context_acquire_buffer(file_context, Transfer, mdl, address);
+
+    if (!NT_SUCCESS(status)) {
+        return usb_fail_transfer(Irp, status, nullptr);
+    }
+
+    return usb_send_transfer(DeviceObject, Irp, read, mdl, address, Transfer.length, file_context);
+}
+
+/**
+ * @brief Transport of the protocol core on the usb stack. Images come
+ * from the memory of the application
+ *
+ */
+struct usb_control_transport {
+    PDEVICE_OBJECT device_object;
+
+    // the configuration of a setting we select
+    PUSB_CONFIGURATION_DESCRIPTOR configuration;
+
+    long read_image(const void* Image, unsigned long Offset, void* Buffer, unsigned long Length) {
+        // the image is in user space, it can be freed while we copy
+        __try {
+            memcpy(Buffer, reinterpret_cast<const UCHAR*>(Image) + Offset, Length);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return STATUS_ACCESS_VIOLATION;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    long control(const chief_setup_packet& Setup, void* Buffer, unsigned long& OutLength) {
+        // initialize the urb
+        _URB_CONTROL_VENDOR_OR_CLASS_REQUEST usb;
+        urb_build_vendor_request(
+            usb, protocol_setup_is_in(Setup), Setup.request, Setup.value, Setup.index, Buffer, Setup.length
+        );
+
+        // send the urb
+        const LONGLONG start = KeQueryPerformanceCounter(nullptr).QuadPart;
+        const NTSTATUS status = usb_send_control_urb(device_object, urb_cast(usb));
+
+        // the usb stack updates the length with the amount we got
+        OutLength = usb.TransferBufferLength;
+
+        // add the request to the statistics of its request code
+        vendor_stats_add(
+            device_object, Setup.request, OutLength, status, KeQueryPerformanceCounter(nullptr).QuadPart - start
+        );
+
+        return status;
+    }
+    long select_setting(const void* Interface, const chief_interface_setting& Setting) {
+        // array must have N+1 elements for N interfaces, with last 
+        // element null-terminated
+        struct _USBD_INTERFACE_LIST_ENTRY InterfaceList[2];
+        InterfaceList[0].InterfaceDescriptor = reinterpret_cast<PUSB_INTERFACE_DESCRIPTOR>(const_cast<void*>(Interface));
+        InterfaceList[0].Interface = nullptr;
+        InterfaceList[1].InterfaceDescriptor = nullptr;
+        InterfaceList[1].Interface = nullptr;
+
+        // create the urb
+        PURB urb = USBD_CreateConfigurationRequestEx(configuration, InterfaceList);
+
+        if (!urb) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        // get the device extension
+        chief_device_extension* dev_ext = get_device_extension(device_object);
+
+        // set the urb
+        urb->UrbHeader.Function = URB_FUNCTION_SELECT_CONFIGURATION;
+
+        // fixes the original issue. This was skipping the size of the
+        // _URB_SELECT_CONFIGURATION structure and causing a 0x7e error
+        urb->UrbHeader.Length = static_cast<USHORT>(GET_SELECT_CONFIGURATION_REQUEST_SIZE(1, Setting.endpoint_count));
+        urb->UrbSelectConfiguration.ConfigurationDescriptor = configuration;
+
+        // send the urb
+        NTSTATUS status = usb_send_urb(device_object, reinterpret_cast<PURB>(urb), get_tunables().configuration_timeout);
+
+        // check if we need to update the interface information
+        if (NT_SUCCESS(status)) {
+            // check if we need to free the old usb interface info
+            if (dev_ext->usb_interface_info) {
+                ExFreePool(dev_ext->usb_interface_info);
+            }
+
+            // allocate new memory for the usb interface info
+            dev_ext->usb_interface_info = reinterpret_cast<PUSBD_INTERFACE_INFORMATION>(ExAllocatePoolWithTag(
+                NonPagedPool,
+                InterfaceList[0].Interface->Length,
+                0x206D6457u
+            ));
+
+            if (dev_ext->usb_interface_info) {
+                // copy the interface info
+                memcpy(dev_ext->usb_interface_info, InterfaceList[0].Interface, InterfaceList[0].Interface->Length);
+            }
+
+            // the pipes could have changed. Reset the sizing and statistics
+            pipe_state_reset(device_object);
+
+            // no pipe handle is open during a reselect. Release the claims
+            // that are left so the new pipes start without a owner
+            pipe_revoke_all(device_object);
+
+            // store the setting so the watchdog can select it again
+            dev_ext->alternate_setting = Setting.alternate_setting;
+        }
+
+        ExFreePool(urb);
+
+        return STATUS_SUCCESS;
+    }
+};
+
 NTSTATUS usb_send_receive_vendor_request(_DEVICE_OBJECT* DeviceObject, usb_chief_vendor_request* Request, bool receive) {
     void* buffer = nullptr;
 
-    // check if we need to allocate memeory
+    // check if we need to allocate memeory. Most requests fit in the 
+    // buffer of the control channel
     if (Request->length) {
-        buffer = ExAllocatePoolWithTag(NonPagedPool, Request->length, 0x206D6457u);
+        buffer = control_channel_acquire_buffer(DeviceObject, Request->length);
 
         if (!buffer) {
             return STATUS_INSUFFICIENT_RESOURCES;
@@ -187,250 +804,114 @@ NTSTATUS usb_send_receive_vendor_request(_DEVICE_OBJECT* DeviceObject, usb_chief
         }
     }
 
-    // initialize the urb
-    _URB_CONTROL_VENDOR_OR_CLASS_REQUEST usb = {};
-    usb.Hdr.Function = URB_FUNCTION_VENDOR_DEVICE;
-    usb.Hdr.Length = sizeof(_URB_CONTROL_VENDOR_OR_CLASS_REQUEST);
-    usb.TransferBufferLength = Request->length;
-    usb.TransferBufferMDL = nullptr;
-    usb.TransferBuffer = buffer;
-    usb.RequestTypeReservedBits = (
-        ((receive ? BMREQUEST_DEVICE_TO_HOST : BMREQUEST_HOST_TO_DEVICE) << 7) |
-        (BMREQUEST_VENDOR << 5) | BMREQUEST_TO_DEVICE
-    );
-    usb.Request = Request->request & 0xff;
-    usb.Value = Request->value;
-    usb.Index = Request->index;
-    usb.TransferFlags = (
-        receive ? (USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK) : (USBD_TRANSFER_DIRECTION_OUT)
-    );
-    usb.UrbLink = nullptr;
+    // send the request
+    usb_control_transport transport = { DeviceObject };
+    unsigned long length = 0;
 
-    // send the urb
-    NTSTATUS status = usb_send_urb(DeviceObject, reinterpret_cast<PURB>(&usb));
+    NTSTATUS status = transport.control(
+        protocol_vendor_setup(receive, Request->request & 0xff, Request->value, Request->index, Request->length),
+        buffer, length
+    );
 
     // check if we need to copy data back
     if (NT_SUCCESS(status) && receive && buffer) {
         // update the request length
-        Request->length = usb.TransferBufferLength & 0xffff;
+        Request->length = length & 0xffff;
 
         // copy the data back to the request structure
-        memcpy(Request->data, buffer, usb.TransferBufferLength);
+        memcpy(Request->data, buffer, length);
     }
 
-    if (buffer) {
-        ExFreePool(buffer);
-    }
+    control_channel_release_buffer(DeviceObject, buffer);
 
     return status;
 }
 
-NTSTATUS usb_set_alternate_setting(_DEVICE_OBJECT *deviceObject, PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor, unsigned char AlternateSetting) {
-    // check if we have a valid alternate setting
-    if (AlternateSetting >= max_alternate_settings) {
-        return STATUS_INVALID_PARAMETER;
-    }
-
-    // switch to the alternate setting
-    _USB_INTERFACE_DESCRIPTOR *descriptor = USBD_ParseConfigurationDescriptorEx(
-        ConfigurationDescriptor,
-        ConfigurationDescriptor,
-        0,
-        AlternateSetting,
-        -1,
-        -1,
-        -1
-    );
-
-    if (!descriptor) {
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    // array must have N+1 elements for N interfaces, with last 
-    // element null-terminated
-    struct _USBD_INTERFACE_LIST_ENTRY InterfaceList[2];
-    InterfaceList[0].InterfaceDescriptor = descriptor;
-    InterfaceList[0].Interface = nullptr;
-    InterfaceList[1].InterfaceDescriptor = nullptr;
-    InterfaceList[1].Interface = nullptr;
-
-    // create the urb
-    PURB urb = USBD_CreateConfigurationRequestEx(
-        ConfigurationDescriptor,
-        InterfaceList
-    );
+NTSTATUS usb_download_image(_DEVICE_OBJECT* DeviceObject, usb_chief_image_download& Request, KPROCESSOR_MODE RequestorMode) {
+    // clear the output fields
+    Request.transferred = 0;
+    Request.status = STATUS_SUCCESS;
 
-    if (!urb) {
-        return STATUS_INSUFFICIENT_RESOURCES;
+    // check if we have a valid chunk length and a image
+    if (!protocol_image_download_valid(Request)) {
+        return STATUS_INVALID_PARAMETER;
     }
 
-    // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(deviceObject->DeviceExtension);
-
-    // free the allocated pipes if we have any
-    if (dev_ext->allocated_pipes) {
-        // TODO: maybe we dont need to free this. If the number of pipes
-        // doesnt change between alternate settings?
-        ExFreePool(dev_ext->allocated_pipes);
+    // make sure the image is in user space when we are called from user mode
+    if (RequestorMode != KernelMode) {
+        __try {
+            ProbeForRead(const_cast<void*>(Request.data), Request.length, 1);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER) {
+            return STATUS_ACCESS_VIOLATION;
+        }
     }
 
-    // allocate new memory for the allocated pipes
-    dev_ext->allocated_pipes = reinterpret_cast<bool*>(ExAllocatePoolWithTag(
-        NonPagedPool,
-        sizeof(bool) * InterfaceList[0].Interface->NumberOfPipes,
-        0x206D6457u
-    ));
+    // get one bounce buffer we use for every chunk
+    void* buffer = control_channel_acquire_buffer(DeviceObject, Request.chunk_length);
 
-    // check if we got memory
-    if (!dev_ext->allocated_pipes) {
-        // The original driver doesnt do this, but we should
-        // free the urb before we exit
-        ExFreePool(urb);
-        
-        // return we have an error
+    if (!buffer) {
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    // zero the allocated pipes
-    memset(dev_ext->allocated_pipes, 0x00, sizeof(bool) * InterfaceList[0].Interface->NumberOfPipes);
+    // send all the chunks. The transferred field has the offset of 
+    // the failing chunk
+    usb_control_transport transport = { DeviceObject };
+    unsigned long transferred = 0;
 
-    // set the urb
-    urb->UrbHeader.Function = URB_FUNCTION_SELECT_CONFIGURATION;
+    const NTSTATUS status = protocol_download_image(transport, Request, buffer, transferred);
 
-    // fixes the original issue. This was skipping the size of the
-    // _URB_SELECT_CONFIGURATION structure and causing a 0x7e error
-    urb->UrbHeader.Length = static_cast<USHORT>(GET_SELECT_CONFIGURATION_REQUEST_SIZE(
-        1, InterfaceList[0].Interface->NumberOfPipes
-    ));
-    urb->UrbSelectConfiguration.ConfigurationDescriptor = ConfigurationDescriptor;
+    control_channel_release_buffer(DeviceObject, buffer);
 
-    // send the urb
-    NTSTATUS status = usb_send_urb(deviceObject, reinterpret_cast<PURB>(urb));
+    // store the result of the download
+    Request.transferred = transferred;
+    Request.status = status;
 
-    // check if we need to update the interface information
-    if (NT_SUCCESS(status)) {
-        // check if we need to free the old usb interface info
-        if (dev_ext->usb_interface_info) {
-            ExFreePool(dev_ext->usb_interface_info);
-        }
+    return STATUS_SUCCESS;
+}
 
-        // allocate new memory for the usb interface info
-        dev_ext->usb_interface_info = reinterpret_cast<PUSBD_INTERFACE_INFORMATION>(ExAllocatePoolWithTag(
-            NonPagedPool,
-            InterfaceList[0].Interface->Length,
-            0x206D6457u
-        ));
+NTSTATUS usb_set_alternate_setting(_DEVICE_OBJECT *deviceObject, PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor, unsigned char AlternateSetting) {
+    // find the setting with the same parser as the linux backend
+    chief_interface_setting setting;
 
-        if (dev_ext->usb_interface_info) {
-            // copy the interface info
-            memcpy(dev_ext->usb_interface_info, InterfaceList[0].Interface, InterfaceList[0].Interface->Length);
-        }
+    if (!ConfigurationDescriptor || !protocol_find_setting(
+        ConfigurationDescriptor, ConfigurationDescriptor->wTotalLength, AlternateSetting, setting)) {
+        return STATUS_INVALID_PARAMETER;
     }
-    
-    ExFreePool(urb);
 
-    return STATUS_SUCCESS;
-}
+    usb_control_transport transport = { deviceObject, ConfigurationDescriptor };
 
-static NTSTATUS usb_get_port_status(_DEVICE_OBJECT* DeviceObject, ULONG& Status) {
-    // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
-
-    struct _IO_STATUS_BLOCK IoStatusBlock;
+    return protocol_select_setting(transport, ConfigurationDescriptor, setting);
+}
 
+NTSTATUS usb_get_port_status(_DEVICE_OBJECT* DeviceObject, ULONG& Status) {
     // clear the status 
     Status = 0;
 
-    // create an event
-    KEVENT event;
-    KeInitializeEvent(&event, NotificationEvent, false);
-
-    // get the usb port status IOCTL_INTERNAL_USB_GET_PORT_STATUS
-    PIRP irp = IoBuildDeviceIoControlRequest(
-        IOCTL_INTERNAL_USB_GET_PORT_STATUS,
-        dev_ext->attachedDeviceObject,
-        nullptr,
-        0,
-        nullptr,
-        0,
-        true,
-        &event,
-        &IoStatusBlock
+    // get the usb port status IOCTL_INTERNAL_USB_GET_PORT_STATUS. The
+    // hub writes the status when the irp completes, we always wait
+    // for the completion so the status can be on the stack
+    return usb_call_with_deadline(
+        DeviceObject, IOCTL_INTERNAL_USB_GET_PORT_STATUS, &Status, get_tunables().port_timeout
     );
-
-    // get the next stack location
-    PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(irp);
-    stack->Parameters.Others.Argument1 = &Status;
-
-    // call the driver
-    NTSTATUS status = IofCallDriver(dev_ext->attachedDeviceObject, irp);
-
-    if (status == STATUS_PENDING) {
-        // wait for the event to be signaled
-        KeWaitForSingleObject(
-            &event,
-            Suspended,
-            KernelMode,
-            false,
-            nullptr
-        );
-
-        status = IoStatusBlock.Status;
-    }
-
-    return status;
 }
 
 NTSTATUS usb_reset_upstream_port(_DEVICE_OBJECT *deviceObject) {
-    struct _IO_STATUS_BLOCK IoStatusBlock;
-
-    // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(deviceObject->DeviceExtension);
-
-    // create an event
-    KEVENT event;
-    KeInitializeEvent(&event, NotificationEvent, false);
-
     // reset the upstream usb port IOCTL_INTERNAL_USB_RESET_PORT
-    PIRP request = IoBuildDeviceIoControlRequest(
-        IOCTL_INTERNAL_USB_RESET_PORT,
-        dev_ext->attachedDeviceObject,
-        nullptr,
-        0,
-        nullptr,
-        0,
-        true,
-        &event,
-        &IoStatusBlock
+    return usb_call_with_deadline(
+        deviceObject, IOCTL_INTERNAL_USB_RESET_PORT, nullptr, get_tunables().port_timeout
     );
-
-    NTSTATUS status = IofCallDriver(dev_ext->attachedDeviceObject, request);
-
-    if (status == STATUS_PENDING) {
-        // wait for the event to be signaled
-        KeWaitForSingleObject(
-            &event,
-            Suspended,
-            KernelMode,
-            false,
-            nullptr
-        );
-
-        status = IoStatusBlock.Status;
-    }
-
-    return status;
 }
 
 NTSTATUS usb_reset_if_not_enabled_but_conected(_DEVICE_OBJECT* DeviceObject) {
-    ULONG status;
+    ULONG status = 0;
 
     // get the current port status
     NTSTATUS res = usb_get_port_status(DeviceObject, status);
 
     // check if we got a success and if the port is not enabled (bit 0) 
     // and if we are connected (bit 1)
-    if (NT_SUCCESS(res) && ((status & 0x1) == 0) || ((status & 0x2) != 0)) {
+    if (NT_SUCCESS(res) && !(status & USBD_PORT_ENABLED) && (status & USBD_PORT_CONNECTED)) {
         // we are connected but not enabled, reset the upstream port
         return usb_reset_upstream_port(DeviceObject);
     }
@@ -440,57 +921,61 @@ NTSTATUS usb_reset_if_not_enabled_but_conected(_DEVICE_OBJECT* DeviceObject) {
 
 NTSTATUS usb_sync_reset_pipe_clear_stall(__in struct _DEVICE_OBJECT *DeviceObject, USBD_PIPE_INFORMATION* Pipe) {
     // create the urb
-    _URB_PIPE_REQUEST request = {};
-
-    // initialize the urb
-    request.Hdr.Length = sizeof(_URB_PIPE_REQUEST);
-    request.Hdr.Function = URB_FUNCTION_RESET_PIPE;
-    request.PipeHandle = Pipe->PipeHandle;
+    _URB_PIPE_REQUEST request;
+    urb_build_pipe_request<URB_FUNCTION_RESET_PIPE>(request, Pipe->PipeHandle);
 
     // send the urb
-    return usb_send_urb(DeviceObject, reinterpret_cast<PURB>(&request));
+    return usb_send_urb(DeviceObject, urb_cast(request), get_tunables().configuration_timeout);
+}
+
+NTSTATUS usb_abort_single_pipe(_DEVICE_OBJECT* DeviceObject, USBD_PIPE_HANDLE PipeHandle) {
+    // initialize the URB for abort pipe
+    _URB_PIPE_REQUEST urb;
+    urb_build_pipe_request<URB_FUNCTION_ABORT_PIPE>(urb, PipeHandle);
+
+    // send the URB
+    return usb_send_urb(DeviceObject, urb_cast(urb), get_tunables().configuration_timeout);
 }
 
 NTSTATUS usb_pipe_abort(_DEVICE_OBJECT* DeviceObject) {
     // get the device extension
-    chief_device_extension* dev_ext = reinterpret_cast<chief_device_extension*>(DeviceObject->DeviceExtension);
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
 
     NTSTATUS status = STATUS_SUCCESS;
     PUSBD_INTERFACE_INFORMATION interface_info = dev_ext->usb_interface_info;
 
+    // cancel the transfers that are still waiting in the scheduler. 
+    // These are not known by the usb stack yet
+    scheduler_flush(DeviceObject);
+
     // check if we have any pipes to abort
     if (!interface_info || !interface_info->NumberOfPipes) {
         return status;
     }
 
+    // get the pipes that have a owner
+    const ULONG claimed = pipe_claimed_mask(DeviceObject);
+
     // iterate through all pipes
-    for (ULONG i = 0; i < interface_info->NumberOfPipes; i++) {
+    for (ULONG i = 0; i < interface_info->NumberOfPipes && i < chief_max_pipes; i++) {
         // check if the pipe is allocated
-        if (!dev_ext->allocated_pipes[i]) {
+        if (!(claimed & (1ul << i))) {
             continue;
         }
         
-        // initialize the URB for abort pipe
-        _URB_PIPE_REQUEST urb = {};
-        urb.Hdr.Length = sizeof(_URB_PIPE_REQUEST);
-        urb.Hdr.Function = URB_FUNCTION_ABORT_PIPE;
-        urb.PipeHandle = interface_info->Pipes[i].PipeHandle;
-
-        // send the URB
-        status = usb_send_urb(DeviceObject, reinterpret_cast<PURB>(&urb));
+        // abort the transfers on the pipe
+        status = usb_abort_single_pipe(DeviceObject, interface_info->Pipes[i].PipeHandle);
 
         // check if we have an error
         if (!NT_SUCCESS(status)) {
             return status;
         }
-
-        // mark the pipe as free
-        dev_ext->allocated_pipes[i] = false;
-
-        // decrement the pipe count
-        decrement_active_pipe_count(DeviceObject);
     }
 
+    // mark the pipes as free and decrement the pipe count for each of
+    // them. The handles that are still open cannot release them again
+    pipe_revoke_all(DeviceObject);
+
     return status;
 }
 
@@ -519,19 +1004,11 @@ NTSTATUS usb_get_configuration_desc(_DEVICE_OBJECT* DeviceObject, PUSB_CONFIGURA
         }
 
         // initialize the URB for getting configuration descriptor
-        _URB_CONTROL_DESCRIPTOR_REQUEST urb = {};
-        urb.Hdr.Function = URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE;
-        urb.Hdr.Length = sizeof(_URB_CONTROL_DESCRIPTOR_REQUEST);
-        urb.TransferBufferLength = buffer_size;
-        urb.TransferBufferMDL = nullptr;
-        urb.TransferBuffer = reinterpret_cast<void*>(descriptor);
-        urb.DescriptorType = USB_CONFIGURATION_DESCRIPTOR_TYPE;
-        urb.Index = 0;
-        urb.LanguageId = 0;
-        urb.UrbLink = nullptr;
+        _URB_CONTROL_DESCRIPTOR_REQUEST urb;
+        urb_build_get_descriptor(urb, USB_CONFIGURATION_DESCRIPTOR_TYPE, 0, 0, descriptor, buffer_size);
 
         // send the URB
-        status = usb_send_urb(DeviceObject, reinterpret_cast<PURB>(&urb));
+        status = usb_send_control_urb(DeviceObject, urb_cast(urb));
 
         // check if we got an error
         if (!NT_SUCCESS(status)) {
@@ -563,34 +1040,25 @@ NTSTATUS usb_get_configuration_desc(_DEVICE_OBJECT* DeviceObject, PUSB_CONFIGURA
 }
 
 NTSTATUS usb_get_device_desc(_DEVICE_OBJECT* DeviceObject, USB_DEVICE_DESCRIPTOR& OutDescriptor) {
-    // create a usb request
-    _URB_CONTROL_DESCRIPTOR_REQUEST usb_request = {};
-
-    // initialize the URB for getting device descriptor
-    usb_request.Hdr.Function = URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE;
-    usb_request.Hdr.Length = sizeof(_URB_CONTROL_DESCRIPTOR_REQUEST);
-    usb_request.TransferBufferLength = sizeof(USB_DEVICE_DESCRIPTOR);
-    usb_request.TransferBuffer = reinterpret_cast<void*>(&OutDescriptor);
-    usb_request.DescriptorType = USB_DEVICE_DESCRIPTOR_TYPE;
-    usb_request.Index = 0;
-    usb_request.LanguageId = 0;
+    // create the URB for getting device descriptor
+    _URB_CONTROL_DESCRIPTOR_REQUEST usb_request;
+    urb_build_get_descriptor(
+        usb_request, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, &OutDescriptor, sizeof(USB_DEVICE_DESCRIPTOR)
+    );
 
     // send the URB
-    return usb_send_urb(DeviceObject, reinterpret_cast<PURB>(&usb_request));;
+    return usb_send_control_urb(DeviceObject, urb_cast(usb_request));
 }
 
 NTSTATUS usb_clear_config_desc(_DEVICE_OBJECT* DeviceObject) {
     // get the device extension
-    chief_device_extension* dev_ext = (chief_device_extension*)DeviceObject->DeviceExtension;
-
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
     // initialize the URB to deselect configuration (set to NULL)
-    _URB_SELECT_CONFIGURATION urb = {};
-    urb.Hdr.Function = URB_FUNCTION_SELECT_CONFIGURATION;
-    urb.Hdr.Length = sizeof(_URB_SELECT_CONFIGURATION);
-    urb.ConfigurationDescriptor = nullptr;
+    _URB_SELECT_CONFIGURATION urb;
+    urb_build_select_configuration(urb, nullptr);
 
     // send the urb
-    const NTSTATUS status = usb_send_urb(DeviceObject, reinterpret_cast<PURB>(&urb));
+    const NTSTATUS status = usb_send_urb(DeviceObject, urb_cast(urb), get_tunables().configuration_timeout);
 
     // if successful, mark that we no longer have a config descriptor
     if (NT_SUCCESS(status)) {
@@ -12,6 +12,28 @@
  */
 NTSTATUS usb_send_bulk_or_interrupt_transfer(__in struct _DEVICE_OBJECT *DeviceObject, __inout struct _IRP *Irp, bool read);
 
+/**
+ * @brief Send a usb bulk or interrupt transfer on a part of a buffer
+ * that is registered on the handle of the irp. Completes the irp
+ * with the amount of data that is transferred
+ *
+ * @param DeviceObject
+ * @param Irp
+ * @param read
+ * @param Transfer
+ * @return NTSTATUS
+ */
+NTSTATUS usb_send_registered_transfer(_DEVICE_OBJECT* DeviceObject, PIRP Irp, bool read, const usb_chief_registered_transfer& Transfer);
+
+/**
+ * @brief Cancel a bulk or interrupt transfer that was not sent to
+ * the usb stack yet. Frees the transfer and completes the irp
+ *
+ * @param DeviceObject
+ * @param Irp
+ */
+void usb_cancel_bulk_or_interrupt_transfer(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+
 /**
  * @brief Send or receive a vendor-specific usb request
  * 
@@ -23,7 +45,21 @@ NTSTATUS usb_send_bulk_or_interrupt_transfer(__in struct _DEVICE_OBJECT *DeviceO
 NTSTATUS usb_send_receive_vendor_request(_DEVICE_OBJECT* DeviceObject, usb_chief_vendor_request* Request, bool receive);
 
 /**
- * @brief Set the alternate setting for the usb device
+ * @brief Download a image to the device using back to back vendor
+ * OUT requests. The result and the progress are stored in the 
+ * request
+ * 
+ * @param DeviceObject 
+ * @param Request 
+ * @param RequestorMode 
+ * @return NTSTATUS 
+ */
+NTSTATUS usb_download_image(_DEVICE_OBJECT* DeviceObject, usb_chief_image_download& Request, KPROCESSOR_MODE RequestorMode);
+
+/**
+ * @brief Set the alternate setting for the usb device. This replaces
+ * the pipes, the caller should make sure no pipe handle is open with
+ * pipe_begin_reselect
  * 
  * @param deviceObject 
  * @param ConfigurationDescriptor 
@@ -32,6 +68,44 @@ NTSTATUS usb_send_receive_vendor_request(_DEVICE_OBJECT* DeviceObject, usb_chief
  */
 NTSTATUS usb_set_alternate_setting(_DEVICE_OBJECT *deviceObject, PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor, unsigned char AlternateSetting);
 
+/**
+ * @brief Abort the transfers on a single pipe. Should be called at
+ * passive level
+ * 
+ * @param DeviceObject 
+ * @param PipeHandle 
+ * @return NTSTATUS 
+ */
+NTSTATUS usb_abort_single_pipe(_DEVICE_OBJECT* DeviceObject, USBD_PIPE_HANDLE PipeHandle);
+
+/**
+ * @brief Reset a pipe and clear a stall. Should be called at passive
+ * level when the pipe has no transfers
+ * 
+ * @param DeviceObject 
+ * @param Pipe 
+ * @return NTSTATUS 
+ */
+NTSTATUS usb_sync_reset_pipe_clear_stall(__in struct _DEVICE_OBJECT *DeviceObject, USBD_PIPE_INFORMATION* Pipe);
+
+/**
+ * @brief Get the status of the upstream port (USBD_PORT_ENABLED and
+ * USBD_PORT_CONNECTED). Should be called at passive level
+ * 
+ * @param DeviceObject 
+ * @param Status 
+ * @return NTSTATUS 
+ */
+NTSTATUS usb_get_port_status(_DEVICE_OBJECT* DeviceObject, ULONG& Status);
+
+/**
+ * @brief Reset the upstream port. Should be called at passive level
+ * 
+ * @param deviceObject 
+ * @return NTSTATUS 
+ */
+NTSTATUS usb_reset_upstream_port(_DEVICE_OBJECT *deviceObject);
+
 /**
  * @brief Abort all usb pipes
  * 
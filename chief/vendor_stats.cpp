@@ -0,0 +1,137 @@
+#include "vendor_stats.hpp"
+#include "device_extension.hpp"
+
+static vendor_stats& get_vendor_stats(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    return dev_ext->vendor;
+}
+
+static vendor_code_counters* vendor_stats_get_codes(vendor_stats& Stats) {
+    // the counters are created with the first request
+    if (Stats.codes) {
+        return Stats.codes;
+    }
+
+    const SIZE_T size = sizeof(vendor_code_counters) * 256;
+
+    vendor_code_counters* codes = reinterpret_cast<vendor_code_counters*>(ExAllocatePoolWithTag(
+        NonPagedPool,
+        size,
+        0x206D6457u
+    ));
+
+    // check if we got memory. The request is not counted
+    if (!codes) {
+        return nullptr;
+    }
+
+    memset(codes, 0x00, size);
+
+    // another request could have been first
+    if (InterlockedCompareExchangePointer(reinterpret_cast<PVOID volatile*>(&Stats.codes), codes, nullptr)) {
+        ExFreePool(codes);
+    }
+
+    return Stats.codes;
+}
+
+static ULONG vendor_stats_bucket(ULONGLONG Latency) {
+    // the first bucket that is above the latency
+    ULONG bucket = 0;
+    ULONGLONG bound = chief_vendor_latency_base;
+
+    while (bucket < (chief_vendor_latency_buckets - 1) && Latency >= bound) {
+        bound <<= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+static ULONGLONG vendor_stats_read(volatile LONGLONG& Value, bool Reset) {
+    // a 64 bit read is not atomic on x86. Both exchanges return the
+    // value, only the reset changes it
+    return static_cast<ULONGLONG>(Reset ? InterlockedExchange64(&Value, 0) : InterlockedCompareExchange64(&Value, 0, 0));
+}
+
+void vendor_stats_add(PDEVICE_OBJECT DeviceObject, UCHAR Request, ULONG Bytes, NTSTATUS Status, LONGLONG Ticks) {
+    vendor_code_counters* codes = vendor_stats_get_codes(get_vendor_stats(DeviceObject));
+
+    if (!codes) {
+        return;
+    }
+
+    vendor_code_counters& code = codes[Request];
+
+    // convert the ticks to microseconds
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+
+    const LONGLONG latency = (Ticks > 0 && frequency.QuadPart) ? ((Ticks * 1000000) / frequency.QuadPart) : 0;
+
+    InterlockedIncrement64(&code.requests);
+
+    if (NT_SUCCESS(Status)) {
+        InterlockedExchangeAdd64(&code.bytes, Bytes);
+    }
+    else {
+        InterlockedIncrement64(&code.errors);
+    }
+
+    InterlockedExchangeAdd64(&code.total_latency, latency);
+    InterlockedIncrement(&code.latency[vendor_stats_bucket(static_cast<ULONGLONG>(latency))]);
+
+    // update the maximum when no other request raised it meanwhile
+    LONGLONG max_latency = InterlockedCompareExchange64(&code.max_latency, 0, 0);
+
+    while (latency > max_latency) {
+        const LONGLONG previous = InterlockedCompareExchange64(&code.max_latency, latency, max_latency);
+
+        if (previous == max_latency) {
+            break;
+        }
+
+        max_latency = previous;
+    }
+}
+
+void vendor_stats_get(PDEVICE_OBJECT DeviceObject, usb_chief_vendor_stats& Stats) {
+    vendor_code_counters* codes = get_vendor_stats(DeviceObject).codes;
+
+    const bool reset = (Stats.flags & chief_vendor_stats_reset) != 0;
+
+    memset(Stats.codes, 0x00, sizeof(Stats.codes));
+
+    // nothing was sent yet
+    if (!codes) {
+        return;
+    }
+
+    for (ULONG i = 0; i < 256; i++) {
+        vendor_code_counters& code = codes[i];
+        usb_chief_vendor_code_stats& out = Stats.codes[i];
+
+        out.requests = vendor_stats_read(code.requests, reset);
+        out.bytes = vendor_stats_read(code.bytes, reset);
+        out.errors = vendor_stats_read(code.errors, reset);
+        out.total_latency = vendor_stats_read(code.total_latency, reset);
+        out.max_latency = vendor_stats_read(code.max_latency, reset);
+
+        for (ULONG bucket = 0; bucket < chief_vendor_latency_buckets; bucket++) {
+            out.latency[bucket] = static_cast<unsigned long>(
+                reset ? InterlockedExchange(&code.latency[bucket], 0) : code.latency[bucket]
+            );
+        }
+    }
+}
+
+void vendor_stats_free(PDEVICE_OBJECT DeviceObject) {
+    vendor_stats& stats = get_vendor_stats(DeviceObject);
+
+    if (stats.codes) {
+        ExFreePool(stats.codes);
+        stats.codes = nullptr;
+    }
+}
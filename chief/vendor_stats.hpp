@@ -0,0 +1,63 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+#include "ioctl.hpp"
+
+/**
+ * @brief Counters of a single vendor request code. Should only be
+ * modified using Interlocked functions
+ *
+ */
+struct vendor_code_counters {
+    volatile LONGLONG requests;
+    volatile LONGLONG bytes;
+    volatile LONGLONG errors;
+
+    // in microseconds
+    volatile LONGLONG total_latency;
+    volatile LONGLONG max_latency;
+
+    volatile LONG latency[chief_vendor_latency_buckets];
+};
+
+/**
+ * @brief Statistics of the vendor requests for every request code
+ *
+ */
+struct vendor_stats {
+    // the counters of every request code. Allocated with the first
+    // vendor request and freed when the device is removed
+    vendor_code_counters* volatile codes;
+};
+
+/**
+ * @brief Add a completed vendor request to the statistics. Should be
+ * called at passive level
+ *
+ * @param DeviceObject
+ * @param Request the request code
+ * @param Bytes the amount of data bytes that are transferred
+ * @param Status the status of the request
+ * @param Ticks the performance counter ticks the request took
+ */
+void vendor_stats_add(PDEVICE_OBJECT DeviceObject, UCHAR Request, ULONG Bytes, NTSTATUS Status, LONGLONG Ticks);
+
+/**
+ * @brief Get the statistics of all the request codes. The flags of
+ * the stats are used as input
+ *
+ * @param DeviceObject
+ * @param Stats
+ */
+void vendor_stats_get(PDEVICE_OBJECT DeviceObject, usb_chief_vendor_stats& Stats);
+
+/**
+ * @brief Free the counters. Should be called when the device is
+ * removed
+ *
+ * @param DeviceObject
+ */
+void vendor_stats_free(PDEVICE_OBJECT DeviceObject);
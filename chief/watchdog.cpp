@@ -0,0 +1,339 @@
+#include "watchdog.hpp"
+#include "device_extension.hpp"
+#include "device_state.hpp"
+#include "pipe.hpp"
+#include "tunables.hpp"
+#include "usb.hpp"
+#include "notify.hpp"
+#include "control_channel.hpp"
+
+static device_watchdog& get_watchdog(PDEVICE_OBJECT DeviceObject) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    return dev_ext->watchdog;
+}
+
+static NTSTATUS watchdog_for_each_pipe(PDEVICE_OBJECT DeviceObject, bool Reset) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    PUSBD_INTERFACE_INFORMATION interface_info = dev_ext->usb_interface_info;
+
+    NTSTATUS result = STATUS_SUCCESS;
+
+    if (!interface_info) {
+        return result;
+    }
+
+    // the handles stay open. Only the transfers on the pipes are 
+    // completed with a error
+    for (ULONG i = 0; i < interface_info->NumberOfPipes; i++) {
+        NTSTATUS status = usb_abort_single_pipe(DeviceObject, interface_info->Pipes[i].PipeHandle);
+
+        // clear a stall after the transfers are gone
+        if (NT_SUCCESS(status) && Reset) {
+            status = usb_sync_reset_pipe_clear_stall(DeviceObject, &interface_info->Pipes[i]);
+        }
+
+        // keep going with the other pipes. Report the first error
+        if (!NT_SUCCESS(status) && NT_SUCCESS(result)) {
+            result = status;
+        }
+    }
+
+    return result;
+}
+
+static NTSTATUS watchdog_recover(PDEVICE_OBJECT DeviceObject, chief_watchdog_action Action) {
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+
+    switch (Action) {
+        case chief_watchdog_abort_pipes:
+            return watchdog_for_each_pipe(DeviceObject, false);
+        case chief_watchdog_reset_pipes:
+            return watchdog_for_each_pipe(DeviceObject, true);
+        case chief_watchdog_reset_port:
+            return usb_reset_upstream_port(DeviceObject);
+        case chief_watchdog_select_configuration: {
+            // the handles point to the pipes of the current interface.
+            // We cannot replace them while a handle is open, and no 
+            // handle can be opened while we replace them
+            if (!pipe_begin_reselect(DeviceObject)) {
+                return STATUS_DEVICE_BUSY;
+            }
+
+            const NTSTATUS status = usb_set_alternate_setting(
+                DeviceObject, dev_ext->usb_config_desc, dev_ext->alternate_setting
+            );
+
+            pipe_end_reselect(DeviceObject);
+
+            return status;
+        }
+        default:
+            return STATUS_INVALID_PARAMETER;
+    }
+}
+
+static chief_watchdog_reason watchdog_find_hang(PDEVICE_OBJECT DeviceObject) {
+    device_watchdog& watchdog = get_watchdog(DeviceObject);
+
+    // check if the control transfer is past the deadline. The 
+    // interrupt time is in 100ns units
+    const LONGLONG started = InterlockedCompareExchange64(&watchdog.control_started, 0, 0);
+    const LONGLONG deadline = 10000LL * get_tunables().control_deadline;
+
+    if (started && static_cast<LONGLONG>(KeQueryInterruptTime()) - started > deadline) {
+        return chief_watchdog_control_timeout;
+    }
+
+    // the device is responding when transfers completed since the
+    // last check. Only ask for the port status when it is quiet
+    const LONG completions = InterlockedCompareExchange(&watchdog.completions, 0, 0);
+
+    if (InterlockedExchange(&watchdog.checked_completions, completions) != completions) {
+        return static_cast<chief_watchdog_reason>(0);
+    }
+
+    ULONG port_status = 0;
+
+    // check if the port got disabled while the device is connected
+    if (NT_SUCCESS(usb_get_port_status(DeviceObject, port_status)) &&
+        (port_status & USBD_PORT_CONNECTED) && !(port_status & USBD_PORT_ENABLED)) {
+        return chief_watchdog_port_disabled;
+    }
+
+    return static_cast<chief_watchdog_reason>(0);
+}
+
+static void watchdog_check_done(PDEVICE_OBJECT DeviceObject) {
+    device_watchdog& watchdog = get_watchdog(DeviceObject);
+
+    // allow the next check to be queued. Only after the recovery is
+    // done, a second check could select the configuration again while
+    // this one is still using the pipes
+    InterlockedExchange(&watchdog.check_queued, 0);
+
+    // wake a stop that waits for the checks
+    if (!InterlockedDecrement(&watchdog.checks)) {
+        KeSetEvent(&watchdog.checks_done, IO_NO_INCREMENT, false);
+    }
+
+    // release the count we got when queueing the check
+    decrement_active_pipe_count_and_notify(DeviceObject);
+}
+
+static void watchdog_check(PDEVICE_OBJECT DeviceObject, PVOID Context) {
+    UNREFERENCED_PARAMETER(Context);
+
+    // get the device extension
+    chief_device_extension* dev_ext = get_device_extension(DeviceObject);
+    device_watchdog& watchdog = dev_ext->watchdog;
+
+    // only check the device when it is started
+    if (get_device_state(DeviceObject) != device_state::started) {
+        watchdog_check_done(DeviceObject);
+        return;
+    }
+
+    // the requests of the check do not wait in line behind the
+    // request that hangs
+    control_channel_begin_bypass(DeviceObject);
+
+    const chief_watchdog_reason reason = watchdog_find_hang(DeviceObject);
+
+    KIRQL irql;
+    KeAcquireSpinLock(&watchdog.lock, &irql);
+
+    watchdog.stats.checks++;
+
+    ULONG action = 0;
+
+    if (!reason) {
+        // the device is healthy. Start with the first action next time
+        watchdog.stats.level = 0;
+    }
+    else {
+        if (reason == chief_watchdog_control_timeout) {
+            watchdog.stats.control_timeouts++;
+        }
+        else {
+            watchdog.stats.port_disabled++;
+        }
+
+        // a disabled port does not need the pipe actions
+        action = watchdog.stats.level + 1;
+
+        if (reason == chief_watchdog_port_disabled && action < chief_watchdog_reset_port) {
+            action = chief_watchdog_reset_port;
+        }
+
+        // wait for the device to recover when we tried everything
+        if (action > chief_watchdog_action_count) {
+            watchdog.stats.exhausted++;
+            action = 0;
+        }
+        else {
+            watchdog.stats.level = action;
+        }
+    }
+
+    KeReleaseSpinLock(&watchdog.lock, irql);
+
+    if (action) {
+        const NTSTATUS status = watchdog_recover(DeviceObject, static_cast<chief_watchdog_action>(action));
+
+        KeAcquireSpinLock(&watchdog.lock, &irql);
+
+        // update the counters of the action
+        watchdog.stats.actions[action - 1]++;
+
+        if (status == STATUS_DEVICE_BUSY) {
+            watchdog.stats.skipped++;
+        }
+        else if (!NT_SUCCESS(status)) {
+            watchdog.stats.failed++;
+        }
+
+        KeReleaseSpinLock(&watchdog.lock, irql);
+
+        // record the recovery when the request recorder is enabled
+        if (dev_ext->trace_enabled) {
+            trace_recovery(DeviceObject, static_cast<UCHAR>(action), static_cast<UCHAR>(reason), status);
+        }
+
+        // let the application know its transfers could be aborted
+        notify_event(DeviceObject, chief_event_recovery, action);
+
+        // the status of the device could have changed
+        if (action >= chief_watchdog_reset_port) {
+            status_cache_invalidate(DeviceObject);
+        }
+    }
+
+    control_channel_end_bypass(DeviceObject);
+
+    watchdog_check_done(DeviceObject);
+}
+
+static void watchdog_timer(PKDPC Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2) {
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    PDEVICE_OBJECT device_object = reinterpret_cast<PDEVICE_OBJECT>(DeferredContext);
+    device_watchdog& watchdog = get_watchdog(device_object);
+
+    // check if the last check is still queued or running. A recovery
+    // can take longer than the interval
+    if (InterlockedCompareExchange(&watchdog.check_queued, 1, 0) != 0) {
+        return;
+    }
+
+    // make sure the device is not removed while the check is 
+    // queued. The check releases the count when done
+    increment_active_pipe_count(device_object);
+    InterlockedIncrement(&watchdog.checks);
+
+    // do the check at passive level
+    IoQueueWorkItem(watchdog.work_item, watchdog_check, DelayedWorkQueue, nullptr);
+}
+
+NTSTATUS watchdog_init(PDEVICE_OBJECT DeviceObject) {
+    device_watchdog& watchdog = get_watchdog(DeviceObject);
+
+    // initialize the lock, timer and dpc
+    KeInitializeSpinLock(&watchdog.lock);
+    KeInitializeTimer(&watchdog.timer);
+    KeInitializeDpc(&watchdog.dpc, watchdog_timer, DeviceObject);
+    KeInitializeEvent(&watchdog.checks_done, SynchronizationEvent, false);
+
+    // allocate the work item for the checks
+    watchdog.work_item = IoAllocateWorkItem(DeviceObject);
+
+    // check if we got memory
+    if (!watchdog.work_item) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+void watchdog_free(PDEVICE_OBJECT DeviceObject) {
+    device_watchdog& watchdog = get_watchdog(DeviceObject);
+
+    // make sure the timer is stopped
+    watchdog_stop(DeviceObject);
+
+    // free the work item
+    if (watchdog.work_item) {
+        IoFreeWorkItem(watchdog.work_item);
+        watchdog.work_item = nullptr;
+    }
+}
+
+void watchdog_start(PDEVICE_OBJECT DeviceObject) {
+    device_watchdog& watchdog = get_watchdog(DeviceObject);
+    const ULONG interval = get_tunables().watchdog_interval;
+
+    // the watchdog is disabled in the tunables
+    if (!interval) {
+        watchdog_stop(DeviceObject);
+        return;
+    }
+
+    // start fresh. Transfers of a earlier start do not count
+    InterlockedExchange(&watchdog.checked_completions, InterlockedCompareExchange(&watchdog.completions, 0, 0));
+
+    // start the timer. The due time is relative in 100ns units
+    LARGE_INTEGER due_time;
+    due_time.QuadPart = -10000LL * interval;
+
+    KeSetTimerEx(&watchdog.timer, due_time, static_cast<LONG>(interval), &watchdog.dpc);
+}
+
+void watchdog_stop(PDEVICE_OBJECT DeviceObject) {
+    device_watchdog& watchdog = get_watchdog(DeviceObject);
+
+    // stop the timer and wait until a dpc that is already
+    // running is done queueing the check
+    KeCancelTimer(&watchdog.timer);
+    KeFlushQueuedDpcs();
+
+    // wait for the checks that are queued. A check can start a 
+    // recovery on the configuration the caller is about to clear.
+    // The event can be left signaled by a earlier check, so look 
+    // at the count again after every wake
+    while (InterlockedCompareExchange(&watchdog.checks, 0, 0)) {
+        KeWaitForSingleObject(&watchdog.checks_done, Executive, KernelMode, false, nullptr);
+    }
+}
+
+void watchdog_progress(PDEVICE_OBJECT DeviceObject) {
+    InterlockedIncrement(&get_watchdog(DeviceObject).completions);
+}
+
+void watchdog_control_begin(PDEVICE_OBJECT DeviceObject) {
+    InterlockedExchange64(&get_watchdog(DeviceObject).control_started, static_cast<LONGLONG>(KeQueryInterruptTime()));
+}
+
+void watchdog_control_end(PDEVICE_OBJECT DeviceObject) {
+    device_watchdog& watchdog = get_watchdog(DeviceObject);
+
+    InterlockedExchange64(&watchdog.control_started, 0);
+
+    // a completed control transfer is progress as well
+    InterlockedIncrement(&watchdog.completions);
+}
+
+void watchdog_get_stats(PDEVICE_OBJECT DeviceObject, usb_chief_watchdog_stats& OutStats) {
+    device_watchdog& watchdog = get_watchdog(DeviceObject);
+
+    KIRQL irql;
+    KeAcquireSpinLock(&watchdog.lock, &irql);
+
+    OutStats = watchdog.stats;
+
+    KeReleaseSpinLock(&watchdog.lock, irql);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+#include "ioctl.hpp"
+
+/**
+ * @brief Watchdog that checks if the device stopped responding. A
+ * check runs on every interval and looks at the deadline of the 
+ * control transfer and, when no transfer completed since the last
+ * check, at the port status. A hung device gets the next recovery 
+ * action on every check until it responds again
+ *
+ */
+struct device_watchdog {
+    // spinlock to protect the statistics
+    KSPIN_LOCK lock;
+
+    // the timer and dpc that trigger a check
+    KTIMER timer;
+    KDPC dpc;
+
+    // work item to do the check at passive level
+    PIO_WORKITEM work_item;
+
+    // flag if a check is queued or running. Should only be modified
+    // using Interlocked functions
+    volatile LONG check_queued;
+
+    // amount of checks that are queued or running and the event that
+    // is signaled when the last one is done. Used to wait for the
+    // checks when the watchdog is stopped
+    volatile LONG checks;
+    KEVENT checks_done;
+
+    // amount of completed transfers. Should only be modified 
+    // using Interlocked functions
+    volatile LONG completions;
+
+    // interrupt time when the current control transfer was sent. 0
+    // when no control transfer is with the usb stack
+    volatile LONGLONG control_started;
+
+    // the amount of completions at the last check. Should only be 
+    // modified using Interlocked functions, the start resets it while
+    // a check can run
+    volatile LONG checked_completions;
+
+    // the statistics. Protected by the lock, level is the last action
+    // that was done
+    usb_chief_watchdog_stats stats;
+};
+
+/**
+ * @brief Initialize the watchdog
+ *
+ * @param DeviceObject
+ * @return NTSTATUS
+ */
+NTSTATUS watchdog_init(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Stop the watchdog and free its resources. Should only be
+ * called when no requests are active anymore
+ *
+ * @param DeviceObject
+ */
+void watchdog_free(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Start the watchdog with the interval of the tunables. Stops
+ * it when the interval is 0. Should be called when the device is 
+ * started and when the tunables change
+ *
+ * @param DeviceObject
+ */
+void watchdog_start(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Stop the watchdog. Waits until the timer can not queue any
+ * new checks and the queued checks are done. Should be called at
+ * passive level
+ *
+ * @param DeviceObject
+ */
+void watchdog_stop(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Mark that a transfer completed. Can be called at any irql
+ * up to dispatch level
+ *
+ * @param DeviceObject
+ */
+void watchdog_progress(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Start and end the deadline of a control transfer. Control
+ * transfers are serialized by the scheduler so only one is tracked
+ *
+ * @param DeviceObject
+ */
+void watchdog_control_begin(PDEVICE_OBJECT DeviceObject);
+void watchdog_control_end(PDEVICE_OBJECT DeviceObject);
+
+/**
+ * @brief Get the statistics of the watchdog
+ *
+ * @param DeviceObject
+ * @param OutStats
+ */
+void watchdog_get_stats(PDEVICE_OBJECT DeviceObject, usb_chief_watchdog_stats& OutStats);
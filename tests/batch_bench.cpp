@@ -0,0 +1,198 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+
+#include "fake_usb_device.hpp"
+
+/**
+ * @brief Batch submit and reap against a loop of reads. Both keep the
+ * same amount of bulk in transfers outstanding on the pipe. The read
+ * loop sends a read for every transfer like overlapped ReadFile calls,
+ * the batch loop sends the free entries with one submit and gets the
+ * results with one reap. Reports the transfers per second and the
+ * calls into the driver per transfer, without a urb latency so the
+ * cost of the calls shows and with a latency like a busy bus
+ *
+ * usage: batch_bench [transfers per run]
+ *
+ */
+
+// the transfers that are kept outstanding
+constexpr static ULONG bench_depth = chief_max_batch_entries;
+
+/**
+ * @brief The result of a run
+ *
+ */
+struct batch_result {
+    double transfers_per_second = 0;
+    double calls_per_transfer = 0;
+};
+
+static double seconds_since(std::chrono::steady_clock::time_point Start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+}
+
+static void failed(const char* Message) {
+    printf("%s\n", Message);
+    exit(1);
+}
+
+/**
+ * @brief Keep the reads outstanding until all transfers are done
+ *
+ */
+static batch_result run_reads(fake_usb_device& Fake, fake_usb_handle& Pipe, ULONG Transfers, ULONG Size) {
+    std::vector<UCHAR> buffer(bench_depth * Size);
+    std::deque<fake_usb_request*> outstanding;
+
+    ULONG next = 0;
+    ULONG done = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    while (done < Transfers) {
+        while (outstanding.size() < bench_depth && next < Transfers) {
+            UCHAR* data = &buffer[(next++ % bench_depth) * Size];
+            outstanding.push_back(Fake.begin(&Pipe, IRP_MJ_READ, 0, data, 0, Size));
+        }
+
+        ULONG_PTR information = 0;
+
+        if (Fake.wait(outstanding.front(), &information) != STATUS_SUCCESS || information != Size) {
+            failed("a read failed");
+        }
+
+        outstanding.pop_front();
+        done++;
+    }
+
+    batch_result result;
+    result.transfers_per_second = Transfers / seconds_since(start);
+    result.calls_per_transfer = 1;
+
+    return result;
+}
+
+/**
+ * @brief Submit the free entries and reap the results until all
+ * transfers are done
+ *
+ */
+static batch_result run_batches(fake_usb_device& Fake, fake_usb_handle& Pipe, ULONG Transfers, ULONG Size) {
+    std::vector<UCHAR> buffer(bench_depth * Size);
+
+    usb_chief_register_buffers buffers = {};
+    buffers.count = 1;
+    buffers.buffers[0] = { buffer.data(), static_cast<unsigned long>(buffer.size()), 0 };
+
+    if (Fake.ioctl(&Pipe, ioctl_register_buffers, &buffers, sizeof(buffers), 0) != STATUS_SUCCESS) {
+        failed("the buffer was not registered");
+    }
+
+    struct {
+        usb_chief_batch_submit header;
+        usb_chief_batch_entry entries[chief_max_batch_entries];
+    } submit;
+
+    struct {
+        usb_chief_batch_reap header;
+        usb_chief_batch_result results[chief_max_batch_entries];
+    } reap;
+
+    ULONG next = 0;
+    ULONG done = 0;
+    ULONG inflight = 0;
+    ULONG calls = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    while (done < Transfers) {
+        const ULONG free = bench_depth - inflight;
+        const ULONG count = (Transfers - next < free) ? Transfers - next : free;
+
+        if (count) {
+            submit.header = { count, 0 };
+
+            for (ULONG i = 0; i < count; i++, next++) {
+                submit.entries[i] = { next, 0, (next % bench_depth) * Size, Size, 0 };
+            }
+
+            const ULONG length = sizeof(submit.header) + count * sizeof(usb_chief_batch_entry);
+
+            if (Fake.ioctl(&Pipe, ioctl_submit_batch, &submit, length, 0) != STATUS_SUCCESS) {
+                failed("a submit failed");
+            }
+
+            inflight += count;
+            calls++;
+        }
+
+        if (Fake.ioctl(&Pipe, ioctl_reap_batch, &reap, 0, sizeof(reap)) != STATUS_SUCCESS) {
+            failed("a reap failed");
+        }
+
+        for (ULONG i = 0; i < reap.header.count; i++) {
+            if (reap.results[i].status != STATUS_SUCCESS || reap.results[i].length != Size) {
+                failed("a batch transfer failed");
+            }
+        }
+
+        inflight -= reap.header.count;
+        done += reap.header.count;
+        calls++;
+    }
+
+    batch_result result;
+    result.transfers_per_second = Transfers / seconds_since(start);
+    result.calls_per_transfer = static_cast<double>(calls) / Transfers;
+
+    Fake.ioctl(&Pipe, ioctl_unregister_buffers, nullptr, 0, 0);
+
+    return result;
+}
+
+int main(int argc, char** argv) {
+    const unsigned long count = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 200000;
+    const ULONG transfers = count ? count : 1;
+
+    fake_usb_device fake;
+
+    if (fake.start() != STATUS_SUCCESS) {
+        failed("the device did not start");
+    }
+
+    fake_usb_handle pipe;
+    fake.open(pipe, L"\\PIPE00");
+
+    printf("%u transfers, %u outstanding\n", transfers, bench_depth);
+    printf("latency us  size   read loop/s   calls     batch/s   calls\n");
+
+    // no latency shows the cost of the calls, a high speed frame
+    // on a shared bus is closer to a real device
+    const ULONG latencies[] = { 0, 125 };
+    const ULONG sizes[] = { 512, 16 * 1024 };
+
+    for (ULONG latency : latencies) {
+        fake.latency = latency;
+        fake.shared_bus = latency != 0;
+
+        // a busy bus needs less transfers for the same time
+        const ULONG run = latency ? (transfers / 50) + 1 : transfers;
+
+        for (ULONG size : sizes) {
+            const batch_result reads = run_reads(fake, pipe, run, size);
+            const batch_result batches = run_batches(fake, pipe, run, size);
+
+            printf("%-11u %-6u %11.0f %7.2f %11.0f %7.2f\n", latency, size,
+                reads.transfers_per_second, reads.calls_per_transfer,
+                batches.transfers_per_second, batches.calls_per_transfer);
+        }
+    }
+
+    fake.close(pipe);
+
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+
+// the registered buffer of the tests and the size of every transfer
+constexpr static ULONG test_buffer_size = 64 * 1024;
+constexpr static ULONG test_transfer_size = 512;
+
+/**
+ * @brief The output of a reap with room for a full batch
+ *
+ */
+struct reap_output {
+    usb_chief_batch_reap header;
+    usb_chief_batch_result results[chief_max_batch_entries];
+};
+
+/**
+ * @brief A started fake with a handle on the bulk in pipe that has
+ * a registered buffer
+ *
+ */
+struct batch_pipe {
+    fake_usb_device fake;
+    fake_usb_handle pipe;
+    std::vector<UCHAR> buffer = std::vector<UCHAR>(test_buffer_size);
+
+    batch_pipe() {
+        fake.start();
+        fake.open(pipe, L"\\PIPE00");
+
+        usb_chief_register_buffers buffers = {};
+        buffers.count = 1;
+        buffers.buffers[0] = { buffer.data(), test_buffer_size, 0 };
+
+        fake.ioctl(&pipe, ioctl_register_buffers, &buffers, sizeof(buffers), 0);
+    }
+
+    ~batch_pipe() {
+        fake.close(pipe);
+    }
+
+    /**
+     * @brief Submit reads of the transfer size one after the other in
+     * the buffer. The cookie is the index of the read
+     *
+     */
+    NTSTATUS submit(ULONG Count, ULONG First = 0, ULONG Slot = 0) {
+        std::vector<UCHAR> input(sizeof(usb_chief_batch_submit) + Count * sizeof(usb_chief_batch_entry));
+
+        usb_chief_batch_submit* header = reinterpret_cast<usb_chief_batch_submit*>(input.data());
+        usb_chief_batch_entry* entries = reinterpret_cast<usb_chief_batch_entry*>(header + 1);
+
+        header->count = Count;
+
+        for (ULONG i = 0; i < Count; i++) {
+            const ULONG index = First + i;
+            entries[i] = { index, Slot, (index * test_transfer_size) % test_buffer_size, test_transfer_size, 0 };
+        }
+
+        return fake.ioctl(&pipe, ioctl_submit_batch, input.data(), static_cast<ULONG>(input.size()), 0);
+    }
+
+    fake_usb_request* begin_reap(reap_output& Output) {
+        return fake.begin(&pipe, IRP_MJ_DEVICE_CONTROL, ioctl_reap_batch, &Output, 0, sizeof(Output));
+    }
+
+    NTSTATUS reap(reap_output& Output) {
+        return fake.wait(begin_reap(Output));
+    }
+};
+
+TEST(results_of_a_batch) {
+    batch_pipe test;
+
+    // a reap without transfers returns right away
+    reap_output output = {};
+    CHECK_EQUAL(test.reap(output), STATUS_SUCCESS);
+    CHECK_EQUAL(output.header.count, 0u);
+
+    CHECK_EQUAL(test.submit(8), STATUS_SUCCESS);
+    CHECK_EQUAL(test.fake.bulk_transfers, 8u);
+
+    CHECK_EQUAL(test.reap(output), STATUS_SUCCESS);
+    CHECK_EQUAL(output.header.count, 8u);
+    CHECK_EQUAL(output.header.pending, 0u);
+
+    // every read got its own part of the buffer
+    ULONG wrong = 0;
+
+    for (ULONG i = 0; i < output.header.count; i++) {
+        const usb_chief_batch_result& result = output.results[i];
+        wrong += (result.status != STATUS_SUCCESS || result.length != test_transfer_size) ? 1 : 0;
+        wrong += (test.buffer[result.cookie * test_transfer_size + 100] != 100) ? 1 : 0;
+    }
+
+    CHECK_EQUAL(wrong, 0u);
+}
+
+TEST(bad_entries_return_a_result) {
+    batch_pipe test;
+
+    // a slot that is not registered. The entry still has a result
+    CHECK_EQUAL(test.submit(2, 0, 1), STATUS_SUCCESS);
+
+    reap_output output = {};
+    CHECK_EQUAL(test.reap(output), STATUS_SUCCESS);
+    CHECK_EQUAL(output.header.count, 2u);
+    CHECK(!NT_SUCCESS(output.results[0].status));
+    CHECK_EQUAL(test.fake.bulk_transfers, 0u);
+
+    // a empty batch and one that is too large
+    CHECK_EQUAL(test.submit(0), STATUS_INVALID_PARAMETER);
+    CHECK_EQUAL(test.submit(chief_max_batch_entries + 1), STATUS_INVALID_PARAMETER);
+}
+
+TEST(reap_waits_for_the_transfers) {
+    batch_pipe test;
+    test.fake.hold_bulk = true;
+
+    CHECK_EQUAL(test.submit(4), STATUS_SUCCESS);
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == 4; }));
+
+    reap_output output = {};
+    fake_usb_request* request = test.begin_reap(output);
+    CHECK(!fake_usb_device::done(request));
+
+    test.fake.hold_bulk = false;
+    test.fake.release(false);
+
+    // the reap returns the first results, the rest come with the next
+    CHECK_EQUAL(test.fake.wait(request), STATUS_SUCCESS);
+
+    ULONG reaped = output.header.count;
+    CHECK(reaped >= 1);
+
+    while (reaped < 4 && test.reap(output) == STATUS_SUCCESS && output.header.count) {
+        reaped += output.header.count;
+    }
+
+    CHECK_EQUAL(reaped, 4u);
+}
+
+TEST(inflight_transfers_are_limited) {
+    batch_pipe test;
+    test.fake.hold_bulk = true;
+
+    for (ULONG i = 0; i < chief_max_batch_inflight / chief_max_batch_entries; i++) {
+        CHECK_EQUAL(test.submit(chief_max_batch_entries, i * chief_max_batch_entries), STATUS_SUCCESS);
+    }
+
+    // every result needs room until it is reaped
+    CHECK_EQUAL(test.submit(1), STATUS_DEVICE_BUSY);
+
+    test.fake.hold_bulk = false;
+    test.fake.release(false);
+
+    ULONG reaped = 0;
+    reap_output output = {};
+
+    while (reaped < chief_max_batch_inflight && test.reap(output) == STATUS_SUCCESS && output.header.count) {
+        reaped += output.header.count;
+    }
+
+    CHECK_EQUAL(reaped, chief_max_batch_inflight);
+    CHECK_EQUAL(test.submit(1), STATUS_SUCCESS);
+}
+
+TEST(close_cancels_the_transfers) {
+    batch_pipe test;
+    test.fake.hold_bulk = true;
+
+    CHECK_EQUAL(test.submit(16), STATUS_SUCCESS);
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == 16; }));
+
+    reap_output output = {};
+    fake_usb_request* request = test.begin_reap(output);
+
+    // the cleanup aborts the pipe. The waiting reap gets the first
+    // aborted transfers, the cleanup returns when the last one is
+    // done with the handle
+    test.fake.close(test.pipe);
+
+    CHECK_EQUAL(test.fake.wait(request), STATUS_SUCCESS);
+    CHECK(output.header.count >= 1);
+    CHECK_EQUAL(test.fake.cancelled, 16u);
+    CHECK_EQUAL(test.fake.held_count(false), 0u);
+
+    // a new handle for the destructor
+    test.fake.hold_bulk = false;
+    CHECK_EQUAL(test.fake.open(test.pipe, L"\\PIPE00"), STATUS_SUCCESS);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
@@ -0,0 +1,216 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "tools/chunk_compressor.hpp"
+
+/**
+ * @brief Data that compresses: a short pattern with a counter every
+ * few bytes. Random data does not compress at all
+ *
+ */
+static std::vector<uint8_t> make_data(size_t Size, bool Random, unsigned Seed = 1) {
+    std::vector<uint8_t> data(Size);
+    srand(Seed);
+
+    for (size_t i = 0; i < Size; i++) {
+        data[i] = Random ? static_cast<uint8_t>(rand()) : static_cast<uint8_t>((i % 16) ? (i % 7) : (i / 16));
+    }
+
+    return data;
+}
+
+static bool round_trip(const std::vector<uint8_t>& Data) {
+    lz4::block_compressor compressor;
+    std::vector<uint8_t> packed(lz4::compress_bound(Data.size()));
+    std::vector<uint8_t> raw(Data.size() + 16);
+
+    const size_t size = compressor.compress(Data.data(), Data.size(), packed.data(), packed.size());
+
+    if (!size || lz4::decompress(packed.data(), size, raw.data(), raw.size()) != Data.size()) {
+        return false;
+    }
+
+    // a output that is one byte too small is a error
+    if (Data.size() && lz4::decompress(packed.data(), size, raw.data(), Data.size() - 1) != SIZE_MAX) {
+        return false;
+    }
+
+    return !memcmp(raw.data(), Data.data(), Data.size());
+}
+
+TEST(block_round_trip) {
+    // the sizes around the match limit and the last literals
+    const size_t sizes[] = { 0, 1, 4, 12, 13, 17, 100, 4096, 70000 };
+
+    for (size_t size : sizes) {
+        CHECK(round_trip(make_data(size, false)));
+        CHECK(round_trip(make_data(size, true)));
+    }
+
+    // a match that is longer than the 15 the token has
+    CHECK(round_trip(std::vector<uint8_t>(1000, 0xaa)));
+}
+
+TEST(compress_needs_the_bound) {
+    lz4::block_compressor compressor;
+    const std::vector<uint8_t> data = make_data(1000, false);
+    std::vector<uint8_t> packed(lz4::compress_bound(data.size()) - 1);
+
+    CHECK_EQUAL(compressor.compress(data.data(), data.size(), packed.data(), packed.size()), 0u);
+}
+
+TEST(decompress_rejects_bad_blocks) {
+    uint8_t raw[64];
+
+    // a match before the start of the output
+    const uint8_t before_start[] = { 0x14, 'a', 0x02, 0x00 };
+    CHECK_EQUAL(lz4::decompress(before_start, sizeof(before_start), raw, sizeof(raw)), SIZE_MAX);
+
+    // a offset of 0
+    const uint8_t zero_offset[] = { 0x14, 'a', 0x00, 0x00 };
+    CHECK_EQUAL(lz4::decompress(zero_offset, sizeof(zero_offset), raw, sizeof(raw)), SIZE_MAX);
+
+    // more literals than the block has and a cut off offset
+    const uint8_t literals[] = { 0x50, 'a', 'b' };
+    CHECK_EQUAL(lz4::decompress(literals, sizeof(literals), raw, sizeof(raw)), SIZE_MAX);
+
+    const uint8_t offset[] = { 0x10, 'a', 0x01 };
+    CHECK_EQUAL(lz4::decompress(offset, sizeof(offset), raw, sizeof(raw)), SIZE_MAX);
+
+    // and a valid block: 'a' and a match of 5 on it
+    const uint8_t valid[] = { 0x11, 'a', 0x01, 0x00 };
+    CHECK_EQUAL(lz4::decompress(valid, sizeof(valid), raw, sizeof(raw)), 6u);
+    CHECK(!memcmp(raw, "aaaaaa", 6));
+}
+
+TEST(chunks_are_written_in_order) {
+    // chunks with very different sizes so the workers finish them out
+    // of order
+    std::vector<std::vector<uint8_t>> chunks;
+
+    for (unsigned i = 0; i < 200; i++) {
+        const size_t size = (i % 9 == 0) ? 256 * 1024 : 1 + (i * 37) % 2000;
+        chunks.push_back(make_data(size, i % 3 == 0, i));
+    }
+
+    uint64_t expected = 0;
+    uint32_t wrong = 0;
+
+    chunk_compressor compressor(8, [&](const compressed_chunk& Chunk) {
+        wrong += (Chunk.sequence != expected++) ? 1 : 0;
+
+        if (Chunk.sequence >= chunks.size()) {
+            return false;
+        }
+
+        // every chunk decompresses on its own
+        const std::vector<uint8_t>& data = chunks[Chunk.sequence];
+        std::vector<uint8_t> raw(data.size());
+
+        const size_t size = Chunk.stored ? Chunk.size :
+            lz4::decompress(Chunk.data, Chunk.size, raw.data(), raw.size());
+
+        const uint8_t* output = Chunk.stored ? Chunk.data : raw.data();
+
+        wrong += (Chunk.raw_size != data.size() || size != data.size() || memcmp(output, data.data(), size)) ? 1 : 0;
+
+        return true;
+    });
+
+    for (const std::vector<uint8_t>& chunk : chunks) {
+        CHECK(compressor.submit(chunk.data(), chunk.size()));
+    }
+
+    CHECK(compressor.finish());
+    CHECK_EQUAL(expected, chunks.size());
+    CHECK_EQUAL(wrong, 0u);
+}
+
+TEST(incompressible_chunks_are_stored) {
+    const std::vector<uint8_t> random = make_data(64 * 1024, true);
+    const std::vector<uint8_t> counter = make_data(64 * 1024, false);
+
+    std::vector<compressed_chunk> written;
+
+    chunk_compressor compressor(2, [&](const compressed_chunk& Chunk) {
+        written.push_back(Chunk);
+        return true;
+    });
+
+    compressor.submit(random.data(), random.size());
+    compressor.submit(counter.data(), counter.size());
+    compressor.finish();
+
+    REQUIRE(written.size() == 2);
+
+    CHECK(written[0].stored);
+    CHECK_EQUAL(written[0].size, random.size());
+    CHECK_EQUAL(written[0].raw_size, random.size());
+
+    CHECK(!written[1].stored);
+    CHECK(written[1].size < counter.size() / 4);
+    CHECK_EQUAL(written[1].raw_size, counter.size());
+}
+
+TEST(sink_failure_stops_the_compressor) {
+    const std::vector<uint8_t> data = make_data(1024, false);
+    std::atomic<uint32_t> calls{ 0 };
+
+    chunk_compressor compressor(4, [&](const compressed_chunk& Chunk) {
+        calls++;
+        return Chunk.sequence != 3;
+    });
+
+    // submit fails some time after the fourth chunk
+    bool failed = false;
+
+    for (uint32_t i = 0; i < 1000 && !failed; i++) {
+        failed = !compressor.submit(data.data(), data.size());
+    }
+
+    CHECK(failed);
+    CHECK(!compressor.finish());
+
+    // the sink is not called after it failed
+    CHECK_EQUAL(calls.load(), 4u);
+}
+
+TEST(submit_blocks_when_every_slot_is_used) {
+    const std::vector<uint8_t> data = make_data(1024, false);
+    std::atomic<bool> release{ false };
+    std::atomic<uint32_t> submitted{ 0 };
+
+    // the sink holds the first chunk. One thread has 2 slots
+    chunk_compressor compressor(1, [&](const compressed_chunk&) {
+        while (!release) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        return true;
+    });
+
+    std::thread reader([&] {
+        for (uint32_t i = 0; i < 8; i++) {
+            compressor.submit(data.data(), data.size());
+            submitted++;
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK_EQUAL(submitted.load(), 2u);
+
+    release = true;
+    reader.join();
+
+    CHECK_EQUAL(submitted.load(), 8u);
+    CHECK(compressor.finish());
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "fake_usb_device.hpp"
+#include "chief/control_channel.hpp"
+#include "chief/usb.hpp"
+
+/**
+ * @brief Latency of a burst of vendor requests with the irp and the
+ * bounce buffer of the control channel against a irp and a buffer
+ * that are allocated for every request. The allocation is the path
+ * the watchdog takes when the channel is busy, skipping the line of a
+ * busy channel sends every request that way. The urbs complete right
+ * away so only the cost in the driver shows. The shim allocates from
+ * the heap, the pool of the kernel costs more
+ *
+ * usage: control_channel_bench [requests per run]
+ *
+ */
+
+/**
+ * @brief The result of a run
+ *
+ */
+struct channel_result {
+    double average = 0;
+    double median = 0;
+    double p99 = 0;
+    double allocations = 0;
+};
+
+/**
+ * @brief Send the requests one after the other and time every one
+ *
+ * @param Fake
+ * @param Requests
+ * @param Length the length of the vendor request
+ * @return channel_result
+ */
+static channel_result run(fake_usb_device& Fake, ULONG Requests, USHORT Length) {
+    std::vector<double> latencies(Requests);
+    std::vector<UCHAR> data(Length);
+
+    const ULONGLONG allocations = shim_pool_allocations();
+
+    for (ULONG i = 0; i < Requests; i++) {
+        usb_chief_vendor_request request = { 0x10, 0, 0, Length, data.data() };
+
+        const auto start = std::chrono::steady_clock::now();
+
+        if (usb_send_receive_vendor_request(Fake.device, &request, true) != STATUS_SUCCESS) {
+            printf("vendor request failed\n");
+            exit(1);
+        }
+
+        latencies[i] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    channel_result result;
+    result.allocations = static_cast<double>(shim_pool_allocations() - allocations) / Requests;
+
+    for (double latency : latencies) {
+        result.average += latency / Requests;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    result.median = latencies[Requests / 2];
+    result.p99 = latencies[(Requests * 99) / 100];
+
+    return result;
+}
+
+static void print(const char* Name, USHORT Length, const channel_result& Result) {
+    printf("%-9s %6u %9.0f %9.0f %9.0f %13.2f\n", Name, Length, Result.average, Result.median, Result.p99, Result.allocations);
+}
+
+int main(int argc, char** argv) {
+    const unsigned long count = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 100000;
+    const ULONG requests = count ? count : 1;
+
+    fake_usb_device fake;
+
+    if (fake.start() != STATUS_SUCCESS) {
+        printf("the device did not start\n");
+        return 1;
+    }
+
+    control_channel& channel = fake.extension()->control;
+
+    printf("%u vendor requests per run\n", requests);
+    printf("path      length    avg ns    p50 ns    p99 ns   allocations\n");
+
+    // the statistics of the request code are allocated once
+    run(fake, 1, 8);
+
+    const USHORT lengths[] = { 8, 64, 1024 };
+
+    for (USHORT length : lengths) {
+        print("channel", length, run(fake, requests, length));
+
+        // every request allocates a irp and a buffer
+        channel.irp_busy = 1;
+        channel.buffer_busy = 1;
+        control_channel_begin_bypass(fake.device);
+
+        print("allocate", length, run(fake, requests, length));
+
+        control_channel_end_bypass(fake.device);
+        channel.irp_busy = 0;
+        channel.buffer_busy = 0;
+    }
+
+    return 0;
+}
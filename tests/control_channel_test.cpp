@@ -0,0 +1,220 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+#include "chief/control_channel.hpp"
+#include "chief/usb.hpp"
+
+static NTSTATUS vendor_receive(fake_usb_device& Fake, UCHAR* Data, USHORT Length) {
+    usb_chief_vendor_request request = { 0x10, 0, 0, Length, Data };
+
+    return usb_send_receive_vendor_request(Fake.device, &request, true);
+}
+
+/**
+ * @brief A vendor request on a thread that the stalled fake keeps
+ * until it is released
+ *
+ */
+struct held_request {
+    fake_usb_device& fake;
+    UCHAR data[8] = {};
+    NTSTATUS status = STATUS_PENDING;
+    std::thread thread;
+
+    held_request(fake_usb_device& Fake) : fake(Fake) {
+        fake.stalled = true;
+        thread = std::thread([this] { status = vendor_receive(fake, data, sizeof(data)); });
+
+        fake_usb_device::wait_until([this] { return fake.held_count(true) == 1; });
+    }
+
+    NTSTATUS finish() {
+        fake.stalled = false;
+        fake.release(true);
+        thread.join();
+
+        return status;
+    }
+};
+
+TEST(vendor_requests_do_not_allocate) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    // the first request allocates the statistics of its request code
+    UCHAR data[64] = {};
+    CHECK_EQUAL(vendor_receive(fake, data, sizeof(data)), STATUS_SUCCESS);
+
+    const ULONGLONG allocations = shim_pool_allocations();
+    ULONG failed = 0;
+
+    for (ULONG i = 0; i < 100; i++) {
+        failed += (vendor_receive(fake, data, sizeof(data)) != STATUS_SUCCESS) ? 1 : 0;
+    }
+
+    CHECK_EQUAL(failed, 0u);
+    CHECK_EQUAL(shim_pool_allocations(), allocations);
+    CHECK_EQUAL(data[63], 0x10);
+}
+
+TEST(requests_use_the_channel_irp) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    held_request held(fake);
+
+    {
+        std::lock_guard<std::mutex> guard(fake.lock);
+        REQUIRE(!fake.pending.empty());
+        CHECK(fake.pending.front().irp == fake.extension()->control.irp);
+    }
+
+    CHECK_EQUAL(fake.extension()->control.irp_busy, 1);
+    CHECK_EQUAL(fake.extension()->control.buffer_busy, 1);
+
+    CHECK_EQUAL(held.finish(), STATUS_SUCCESS);
+
+    // both are free for the next request
+    CHECK_EQUAL(fake.extension()->control.irp_busy, 0);
+    CHECK_EQUAL(fake.extension()->control.buffer_busy, 0);
+}
+
+TEST(busy_channel_queues_the_requests) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    // the statistics of the request codes are allocated once
+    for (UCHAR code = 0x20; code < 0x23; code++) {
+        UCHAR data[8] = {};
+        usb_chief_vendor_request request = { code, 0, 0, sizeof(data), data };
+
+        usb_send_receive_vendor_request(fake.device, &request, true);
+    }
+
+    fake.vendor_requests = 0;
+    fake.vendor_codes.clear();
+
+    held_request held(fake);
+
+    const LONG outstanding = shim_pool_outstanding();
+    const ULONGLONG allocations = shim_pool_allocations();
+
+    // every request gets in line behind the ones before it
+    std::vector<std::thread> threads;
+    std::vector<NTSTATUS> statuses(3, STATUS_PENDING);
+
+    for (ULONG i = 0; i < statuses.size(); i++) {
+        threads.emplace_back([&fake, &statuses, i] {
+            UCHAR data[8] = {};
+            usb_chief_vendor_request request = { static_cast<unsigned char>(0x20 + i), 0, 0, sizeof(data), data };
+
+            statuses[i] = usb_send_receive_vendor_request(fake.device, &request, true);
+        });
+
+        CHECK(fake_usb_device::wait_until([&] { return fake.extension()->control.waiting == static_cast<LONG>(i + 1); }));
+    }
+
+    // nothing went past the held request
+    CHECK_EQUAL(fake.vendor_requests, 0u);
+    CHECK_EQUAL(held.finish(), STATUS_SUCCESS);
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (NTSTATUS status : statuses) {
+        CHECK_EQUAL(status, STATUS_SUCCESS);
+    }
+
+    // in the order they came and without a irp or a buffer of their own
+    {
+        std::lock_guard<std::mutex> guard(fake.lock);
+        CHECK(fake.vendor_codes == std::vector<UCHAR>({ 0x10, 0x20, 0x21, 0x22 }));
+    }
+
+    CHECK_EQUAL(fake.extension()->control.waiting, 0);
+    CHECK_EQUAL(shim_pool_allocations(), allocations);
+    CHECK_EQUAL(shim_pool_outstanding(), outstanding);
+}
+
+TEST(burst_of_requests_does_not_allocate) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    UCHAR data[8] = {};
+    CHECK_EQUAL(vendor_receive(fake, data, sizeof(data)), STATUS_SUCCESS);
+
+    // the threads send at the same time, the later ones wait in line
+    fake.latency = 100;
+
+    const ULONGLONG allocations = shim_pool_allocations();
+    std::atomic<ULONG> failed(0);
+    std::vector<std::thread> threads;
+
+    for (ULONG t = 0; t < 4; t++) {
+        threads.emplace_back([&] {
+            UCHAR buffer[64] = {};
+
+            for (ULONG i = 0; i < 50; i++) {
+                failed += (vendor_receive(fake, buffer, sizeof(buffer)) != STATUS_SUCCESS) ? 1 : 0;
+            }
+        });
+    }
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    CHECK_EQUAL(failed, 0u);
+    CHECK_EQUAL(fake.vendor_requests, 201u);
+    CHECK_EQUAL(shim_pool_allocations(), allocations);
+}
+
+TEST(watchdog_skips_the_line) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    held_request held(fake);
+
+    // the port status of the watchdog does not wait behind the held
+    // request, it allocates a irp of its own
+    const LONG outstanding = shim_pool_outstanding();
+    const ULONGLONG allocations = shim_pool_allocations();
+
+    control_channel_begin_bypass(fake.device);
+
+    ULONG status = 0;
+    CHECK_EQUAL(usb_get_port_status(fake.device, status), STATUS_SUCCESS);
+    CHECK_EQUAL(fake.port_requests, 1u);
+
+    control_channel_end_bypass(fake.device);
+
+    CHECK_EQUAL(shim_pool_allocations(), allocations + 1);
+    CHECK_EQUAL(shim_pool_outstanding(), outstanding);
+
+    CHECK_EQUAL(held.finish(), STATUS_SUCCESS);
+}
+
+TEST(large_request_gets_its_own_buffer) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    std::vector<UCHAR> data(control_channel_buffer_size * 2);
+    CHECK_EQUAL(vendor_receive(fake, data.data(), 8), STATUS_SUCCESS);
+
+    const LONG outstanding = shim_pool_outstanding();
+    const ULONGLONG allocations = shim_pool_allocations();
+
+    CHECK_EQUAL(vendor_receive(fake, data.data(), static_cast<USHORT>(data.size())), STATUS_SUCCESS);
+    CHECK_EQUAL(data.back(), 0x10);
+
+    CHECK_EQUAL(shim_pool_allocations(), allocations + 1);
+    CHECK_EQUAL(shim_pool_outstanding(), outstanding);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
@@ -0,0 +1,83 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "tools/crc32c.hpp"
+#include "chief/crc32c.hpp"
+
+/**
+ * @brief Speed of the crc of the framed reads with the crc32
+ * instruction against the table of the processors without it and
+ * the table of the tools. Runs every path over the same buffer at a
+ * aligned and a unaligned start. Reports the time for a gigabyte,
+ * the table does a byte at a time
+ *
+ * usage: crc32c_bench [megabytes per run]
+ *
+ */
+
+// the sizes of the buffers. A packet, a frame and a large transfer
+constexpr static ULONG bench_sizes[] = { 512, 16 * 1024, 256 * 1024 };
+
+// keeps the compiler from dropping the crcs
+static volatile ULONG bench_sink;
+
+/**
+ * @brief Time a path over the buffer until the bytes are done
+ *
+ * @return double the nanoseconds for a gigabyte
+ */
+template <typename Function>
+static double run(Function Crc, const UCHAR* Data, ULONG Length, double Bytes) {
+    const ULONG count = static_cast<ULONG>(Bytes / Length) + 1;
+    ULONG crc = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (ULONG i = 0; i < count; i++) {
+        crc ^= Crc(Data, Length);
+    }
+
+    const double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    bench_sink = crc;
+
+    return elapsed * (1024.0 * 1024.0 * 1024.0) / (static_cast<double>(count) * Length);
+}
+
+int main(int argc, char** argv) {
+    const unsigned long megabytes = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 256;
+    const double bytes = (megabytes ? megabytes : 1) * 1024.0 * 1024.0;
+
+    crc32c_init();
+
+    const crc32c_table tools;
+
+    std::vector<UCHAR> data(bench_sizes[2] + 8);
+
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<UCHAR>(i * 31);
+    }
+
+    auto table = [](const UCHAR* Data, ULONG Length) { return crc32c_software(0xffffffffu, Data, Length); };
+    auto instruction = [](const UCHAR* Data, ULONG Length) { return crc32c_instruction(0xffffffffu, Data, Length); };
+    auto portable = [&tools](const UCHAR* Data, ULONG Length) { return tools.calculate(Data, static_cast<size_t>(Length)); };
+
+    printf("%lu MB per run, the crc32 instruction is %s\n", megabytes, crc32c_has_instruction() ? "used" : "not there");
+    printf("size     start   instruction ns/GB   table ns/GB   tools ns/GB   speedup\n");
+
+    for (ULONG size : bench_sizes) {
+        for (ULONG offset : { 0u, 1u }) {
+            const UCHAR* start = data.data() + offset;
+
+            const double software = run(table, start, size, bytes);
+            const double hardware = crc32c_has_instruction() ? run(instruction, start, size, bytes) : 0;
+            const double other = run(portable, start, size, bytes);
+
+            printf("%-8lu %-7s %17.0f %13.0f %13.0f %8.1fx\n", static_cast<unsigned long>(size), offset ? "+1" : "aligned",
+                hardware, software, other, hardware ? software / hardware : 0);
+        }
+    }
+
+    return 0;
+}
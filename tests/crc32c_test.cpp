@@ -0,0 +1,128 @@
+#include <cstdlib>
+#include <vector>
+
+#include "test.hpp"
+#include "tools/crc32c.hpp"
+#include "chief/crc32c.hpp"
+
+/**
+ * @brief The crc of the driver with the table and with the crc32
+ * instruction. The instruction is only checked when the processor
+ * has it
+ *
+ */
+struct crc32c_paths {
+    ULONG table;
+    ULONG instruction;
+};
+
+static crc32c_paths calculate(const UCHAR* Data, ULONG Length) {
+    crc32c_paths result;
+    result.table = ~crc32c_software(0xffffffffu, Data, Length);
+    result.instruction = crc32c_has_instruction() ? ~crc32c_instruction(0xffffffffu, Data, Length) : result.table;
+
+    return result;
+}
+
+TEST(known_vectors) {
+    crc32c_init();
+
+    const crc32c_table tools;
+
+    // the check value of the castagnoli crc and the vectors of
+    // rfc 3720 (iscsi)
+    struct {
+        std::vector<UCHAR> data;
+        ULONG crc;
+    } vectors[] = {
+        { std::vector<UCHAR>({ '1', '2', '3', '4', '5', '6', '7', '8', '9' }), 0xE3069283u },
+        { std::vector<UCHAR>(32, 0x00), 0x8A9136AAu },
+        { std::vector<UCHAR>(32, 0xff), 0x62A8AB43u },
+        { std::vector<UCHAR>(32), 0x46DD794Eu },
+        { std::vector<UCHAR>(32), 0x113FDB5Cu },
+        { std::vector<UCHAR>(), 0x00000000u },
+    };
+
+    for (UCHAR i = 0; i < 32; i++) {
+        vectors[3].data[i] = i;
+        vectors[4].data[i] = 31 - i;
+    }
+
+    for (const auto& vector : vectors) {
+        const ULONG length = static_cast<ULONG>(vector.data.size());
+        const crc32c_paths paths = calculate(vector.data.data(), length);
+
+        CHECK_EQUAL(crc32c(vector.data.data(), length), vector.crc);
+        CHECK_EQUAL(paths.table, vector.crc);
+        CHECK_EQUAL(paths.instruction, vector.crc);
+        CHECK_EQUAL(tools.calculate(vector.data.data(), length), vector.crc);
+    }
+}
+
+TEST(unaligned_lengths) {
+    crc32c_init();
+
+    const crc32c_table tools;
+
+    std::vector<UCHAR> data(4096 + 64);
+    srand(1);
+
+    for (UCHAR& value : data) {
+        value = static_cast<UCHAR>(rand());
+    }
+
+    // every start in a word and the lengths around the word sizes
+    ULONG wrong = 0;
+    ULONG checked = 0;
+
+    for (ULONG offset = 0; offset < 16; offset++) {
+        for (ULONG length = 0; length < 4096; length = (length < 80) ? length + 1 : length * 2 + 3) {
+            const UCHAR* start = data.data() + offset;
+            const crc32c_paths paths = calculate(start, length);
+            const ULONG expected = tools.calculate(start, length);
+
+            wrong += (paths.table != expected || paths.instruction != expected) ? 1 : 0;
+            wrong += (crc32c(start, length) != expected) ? 1 : 0;
+            checked++;
+        }
+    }
+
+    CHECK(checked > 1000);
+    CHECK_EQUAL(wrong, 0u);
+}
+
+TEST(split_buffer_gives_the_same_crc) {
+    crc32c_init();
+
+    std::vector<UCHAR> data(1000);
+
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<UCHAR>(i * 7);
+    }
+
+    const ULONG length = static_cast<ULONG>(data.size());
+    const ULONG whole = crc32c(data.data(), length);
+
+    // the paths continue the crc of the part before at any split,
+    // also from one path to the other
+    ULONG wrong = 0;
+
+    for (ULONG split = 0; split <= length; split += 37) {
+        ULONG crc = crc32c_software(0xffffffffu, data.data(), split);
+
+        if (crc32c_has_instruction()) {
+            crc = crc32c_instruction(crc, data.data() + split, length - split);
+        }
+        else {
+            crc = crc32c_software(crc, data.data() + split, length - split);
+        }
+
+        wrong += (~crc != whole) ? 1 : 0;
+    }
+
+    CHECK_EQUAL(wrong, 0u);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
@@ -0,0 +1,143 @@
+#include <chrono>
+#include <thread>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+#include "chief/device_state.hpp"
+#include "chief/tunables.hpp"
+#include "chief/usb.hpp"
+
+// the deadline of the control requests in the tests in milliseconds
+constexpr static ULONG test_timeout = 50;
+
+/**
+ * @brief Set the deadline of the control requests. The watchdog is
+ * off so only the deadline cancels a stalled request
+ *
+ */
+static void set_control_timeout(ULONG Timeout) {
+    usb_chief_tunables tunables = get_tunables();
+    tunables.control_timeout = Timeout;
+    tunables.watchdog_interval = 0;
+
+    tunables_set(tunables);
+}
+
+static NTSTATUS vendor_receive(fake_usb_device& Fake) {
+    UCHAR data[8] = {};
+    usb_chief_vendor_request request = { 0x10, 0, 0, sizeof(data), data };
+
+    return usb_send_receive_vendor_request(Fake.device, &request, true);
+}
+
+static double milliseconds_since(std::chrono::steady_clock::time_point Start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+}
+
+TEST(stalled_request_times_out) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    set_control_timeout(test_timeout);
+    fake.stalled = true;
+
+    const auto start = std::chrono::steady_clock::now();
+    CHECK_EQUAL(vendor_receive(fake), STATUS_IO_TIMEOUT);
+
+    const double elapsed = milliseconds_since(start);
+    CHECK(elapsed >= test_timeout);
+    CHECK(elapsed < test_timeout * 20);
+
+    // the urb was cancelled and the usb stack gave the irp back
+    CHECK_EQUAL(fake.cancelled, 1u);
+    CHECK_EQUAL(fake.held_count(true), 0u);
+
+    // the irp of the control channel works for the next request
+    fake.stalled = false;
+    CHECK_EQUAL(vendor_receive(fake), STATUS_SUCCESS);
+    CHECK_EQUAL(fake.vendor_requests, 1u);
+}
+
+TEST(answer_before_the_deadline_keeps_the_result) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    set_control_timeout(1000);
+    fake.latency = 5000;
+
+    CHECK_EQUAL(vendor_receive(fake), STATUS_SUCCESS);
+    CHECK_EQUAL(fake.cancelled, 0u);
+}
+
+TEST(zero_timeout_waits_for_the_device) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    set_control_timeout(0);
+    fake.stalled = true;
+
+    NTSTATUS status = STATUS_PENDING;
+    std::thread sender([&] { status = vendor_receive(fake); });
+
+    // still waiting well after the deadline the other tests use
+    CHECK(fake_usb_device::wait_until([&] { return fake.held_count(true) == 1; }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(test_timeout * 2));
+    CHECK_EQUAL(fake.held_count(true), 1u);
+
+    fake.release(true);
+    sender.join();
+
+    CHECK_EQUAL(status, STATUS_SUCCESS);
+    CHECK_EQUAL(fake.cancelled, 0u);
+}
+
+TEST(deadline_races_the_completion) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    // the device answers right around the deadline. Every request
+    // either completes or times out and nothing is lost
+    set_control_timeout(2);
+    fake.latency = 2000;
+
+    // the first request allocates the statistics of its request
+    // code
+    vendor_receive(fake);
+    fake.vendor_requests = 0;
+    fake.cancelled = 0;
+
+    const LONG outstanding = shim_pool_outstanding();
+    ULONG wrong = 0;
+
+    for (ULONG i = 0; i < 50; i++) {
+        const NTSTATUS status = vendor_receive(fake);
+        wrong += (status != STATUS_SUCCESS && status != STATUS_IO_TIMEOUT) ? 1 : 0;
+    }
+
+    CHECK_EQUAL(wrong, 0u);
+    CHECK_EQUAL(fake.vendor_requests + fake.cancelled, 50u);
+    CHECK_EQUAL(shim_pool_outstanding(), outstanding);
+}
+
+TEST(stalled_start_times_out) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.add(), STATUS_SUCCESS);
+
+    // the device never answers the device descriptor request
+    set_control_timeout(test_timeout);
+    fake.stalled = true;
+
+    CHECK_EQUAL(fake.pnp(IRP_MN_START_DEVICE), STATUS_IO_TIMEOUT);
+    CHECK(get_device_state(fake.device) == device_state::stopped);
+    CHECK_EQUAL(fake.cancelled, 1u);
+
+    // the pnp manager can start it again when the device answers
+    fake.stalled = false;
+
+    CHECK_EQUAL(fake.pnp(IRP_MN_START_DEVICE), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::started);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
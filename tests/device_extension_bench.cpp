@@ -0,0 +1,163 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "shim.hpp"
+#include "chief/device_extension.hpp"
+
+/**
+ * @brief Contention between the readers of the hot section and the
+ * writers of the pipe count. The readers do what every request does
+ * first (read the state and the interface information), the writers
+ * take and release the pipe count like mj_create and mj_cleanup. Runs
+ * on the layout of the driver and on a layout with all the fields on
+ * one cache line, like the extension before the split. On a single
+ * core both are the same
+ *
+ * usage: device_extension_bench [million reads per reader]
+ *
+ */
+
+/**
+ * @brief The fields of the extension before the split. The pipe
+ * count shares the line with the state
+ *
+ */
+struct alignas(cache_line_size) shared_line_extension {
+    volatile LONG state;
+    PDEVICE_OBJECT attachedDeviceObject;
+    PUSBD_INTERFACE_INFORMATION usb_interface_info;
+    KSPIN_LOCK device_lock;
+    LONG active_pipe_count;
+};
+
+static_assert(sizeof(shared_line_extension) <= cache_line_size, "The shared layout should be one cache line");
+
+/**
+ * @brief Run the readers and the writers on a layout and get the reads
+ * per second
+ *
+ * @param Extension chief_device_extension or shared_line_extension
+ * @param Reads the reads of every reader
+ * @param Threads the amount of readers and the amount of writers
+ * @return double
+ */
+template <typename Layout>
+static double run(Layout& Extension, uint64_t Reads, unsigned Threads) {
+    std::atomic<bool> running(true);
+    std::atomic<unsigned> ready(0);
+    std::atomic<uint64_t> seen(0);
+    std::vector<std::thread> writers;
+    std::vector<std::thread> readers;
+
+    for (unsigned t = 0; t < Threads; t++) {
+        writers.emplace_back([&] {
+            ready++;
+
+            while (running.load(std::memory_order_relaxed)) {
+                KIRQL irql;
+
+                KeAcquireSpinLock(&Extension.device_lock, &irql);
+                InterlockedIncrement(&Extension.active_pipe_count);
+                KeReleaseSpinLock(&Extension.device_lock, irql);
+
+                KeAcquireSpinLock(&Extension.device_lock, &irql);
+                InterlockedDecrement(&Extension.active_pipe_count);
+                KeReleaseSpinLock(&Extension.device_lock, irql);
+            }
+        });
+    }
+
+    // wait for the writers so the readers always see them
+    while (ready.load() != Threads) {
+        std::this_thread::yield();
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (unsigned t = 0; t < Threads; t++) {
+        readers.emplace_back([&] {
+            uint64_t started = 0;
+
+            for (uint64_t i = 0; i < Reads; i++) {
+                // the state and the interface of the request
+                started += (Extension.state == static_cast<LONG>(device_state::started) &&
+                    *reinterpret_cast<PUSBD_INTERFACE_INFORMATION volatile*>(&Extension.usb_interface_info)) ? 1 : 0;
+            }
+
+            seen += started;
+        });
+    }
+
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    running = false;
+
+    for (auto& writer : writers) {
+        writer.join();
+    }
+
+    // every read should have seen a started device
+    if (seen != Reads * Threads) {
+        printf("a reader saw a torn state\n");
+        exit(1);
+    }
+
+    return (Reads * Threads) / elapsed;
+}
+
+int main(int argc, char** argv) {
+    const unsigned long millions = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 100;
+    const uint64_t reads = static_cast<uint64_t>(millions ? millions : 1) * 1000 * 1000;
+
+    // half of the cores read, the other half write
+    const unsigned cores = std::thread::hardware_concurrency();
+    const unsigned threads = (cores > 2) ? cores / 2 : 1;
+
+    // the extension of the driver, aligned like in the driver
+    PDRIVER_OBJECT driver = shim_create_driver();
+    PDEVICE_OBJECT device = nullptr;
+
+    if (!NT_SUCCESS(IoCreateDevice(driver, chief_device_extension_size, nullptr, FILE_DEVICE_USB, 0, FALSE, &device))) {
+        printf("no memory for the device\n");
+        return 1;
+    }
+
+    chief_device_extension* split = get_device_extension(device);
+    memset(static_cast<void*>(split), 0, sizeof(chief_device_extension));
+
+    shared_line_extension* shared = new shared_line_extension();
+
+    USBD_INTERFACE_INFORMATION info = {};
+
+    split->state = static_cast<LONG>(device_state::started);
+    split->usb_interface_info = &info;
+    KeInitializeSpinLock(&split->device_lock);
+
+    shared->state = static_cast<LONG>(device_state::started);
+    shared->usb_interface_info = &info;
+    KeInitializeSpinLock(&shared->device_lock);
+
+    printf("%u readers and %u writers, %lu million reads per reader\n", threads, threads, millions);
+
+    const double shared_rate = run(*shared, reads, threads);
+    const double split_rate = run(*split, reads, threads);
+
+    printf("layout       Mreads/s\n");
+    printf("shared line  %.1f\n", shared_rate / 1e6);
+    printf("split        %.1f\n", split_rate / 1e6);
+    printf("speedup      %.2fx\n", split_rate / shared_rate);
+
+    delete shared;
+    IoDeleteDevice(device);
+    shim_free_driver(driver);
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <cstdint>
+#include <vector>
+
+#include "test.hpp"
+#include "shim.hpp"
+#include "chief/device_extension.hpp"
+
+static uintptr_t line_of(const volatile void* Address) {
+    return reinterpret_cast<uintptr_t>(Address) / cache_line_size;
+}
+
+TEST(extension_is_aligned_for_every_pool_alignment) {
+    // the pool only aligns to 16 bytes on x64 and 8 bytes on x86
+    std::vector<UCHAR> memory(chief_device_extension_size + cache_line_size);
+    const uintptr_t base = (reinterpret_cast<uintptr_t>(memory.data()) + cache_line_size - 1) & ~static_cast<uintptr_t>(cache_line_size - 1);
+
+    for (uintptr_t offset = 0; offset < cache_line_size; offset += 8) {
+        DEVICE_OBJECT device = {};
+        device.DeviceExtension = reinterpret_cast<PVOID>(base + offset);
+
+        const uintptr_t extension = reinterpret_cast<uintptr_t>(get_device_extension(&device));
+
+        // on a cache line and inside the allocation
+        CHECK_EQUAL(extension % cache_line_size, 0u);
+        CHECK(extension >= base + offset);
+        CHECK(extension + sizeof(chief_device_extension) <= base + offset + chief_device_extension_size);
+    }
+}
+
+TEST(sections_are_on_their_own_lines) {
+    PDRIVER_OBJECT driver = shim_create_driver();
+    PDEVICE_OBJECT device = nullptr;
+
+    CHECK_EQUAL(IoCreateDevice(driver, chief_device_extension_size, nullptr, FILE_DEVICE_USB, 0, FALSE, &device), STATUS_SUCCESS);
+
+    chief_device_extension* dev_ext = get_device_extension(device);
+
+    // the fields of every request share the first line
+    CHECK_EQUAL(line_of(&dev_ext->state), line_of(&dev_ext->tap_enabled));
+    CHECK_EQUAL(line_of(&dev_ext->state), line_of(&dev_ext->attachedDeviceObject));
+    CHECK_EQUAL(line_of(&dev_ext->state), line_of(&dev_ext->usb_interface_info));
+    CHECK_EQUAL(line_of(&dev_ext->state), line_of(&dev_ext->usb_config_desc));
+
+    // the counters that are written on every request do not
+    CHECK_EQUAL(line_of(&dev_ext->device_lock), line_of(&dev_ext->active_pipe_count));
+    CHECK_EQUAL(line_of(&dev_ext->device_lock), line_of(&dev_ext->pipe_owners));
+    CHECK(line_of(&dev_ext->device_lock) != line_of(&dev_ext->state));
+    CHECK(line_of(&dev_ext->power_irp_count) != line_of(&dev_ext->state));
+    CHECK(line_of(&dev_ext->power_irp_count) != line_of(&dev_ext->active_pipe_count));
+    CHECK(line_of(&dev_ext->scheduler) != line_of(&dev_ext->power_irp_count));
+
+    // and the cold section starts after the pipes
+    CHECK(line_of(&dev_ext->device_object) > line_of(&dev_ext->pipes[chief_max_pipes - 1]));
+
+    IoDeleteDevice(device);
+    shim_free_driver(driver);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
@@ -0,0 +1,233 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+#include "chief/device_state.hpp"
+
+// the threads that race for the same transition and the rounds they do
+constexpr static ULONG race_threads = 4;
+constexpr static ULONG race_rounds = 20000;
+
+static void set_state(fake_usb_device& Fake, device_state State) {
+    Fake.extension()->state = static_cast<LONG>(State);
+}
+
+TEST(every_transition_matches_the_table) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.add(), STATUS_SUCCESS);
+
+    for (LONG from = 0; from < device_state_count; from++) {
+        for (LONG to = 0; to < device_state_count; to++) {
+            const device_state f = static_cast<device_state>(from);
+            const device_state t = static_cast<device_state>(to);
+            const bool valid = device_state_transitions[from][to];
+
+            set_state(fake, f);
+            CHECK_EQUAL(try_transition_device_state(fake.device, f, t), valid);
+            CHECK(get_device_state(fake.device) == (valid ? t : f));
+
+            // a state that is not the current one never changes it
+            const device_state other = static_cast<device_state>((from + 1) % device_state_count);
+
+            set_state(fake, f);
+            CHECK(!try_transition_device_state(fake.device, other, t));
+            CHECK(get_device_state(fake.device) == f);
+
+            set_state(fake, f);
+            CHECK_EQUAL(transition_device_state(fake.device, t), valid);
+            CHECK(get_device_state(fake.device) == (valid ? t : f));
+        }
+    }
+
+    // the states past the table are never valid
+    CHECK(!is_valid_device_state_transition(device_state::count, device_state::removed));
+    CHECK(!is_valid_device_state_transition(device_state::started, device_state::count));
+
+    set_state(fake, device_state::started);
+    CHECK(!transition_device_state(fake.device, device_state::count));
+    CHECK(get_device_state(fake.device) == device_state::started);
+
+    // removed is final, leave it so the remove can run
+    set_state(fake, device_state::started);
+}
+
+/**
+ * @brief Let the threads race for a transition in every round. Counts
+ * the threads that won every round and keeps the state the round
+ * ended in. Checked on the main thread, the checks are not thread safe
+ *
+ */
+struct transition_race {
+    std::vector<ULONG> winners = std::vector<ULONG>(race_rounds, 0);
+    std::vector<ULONG> winner = std::vector<ULONG>(race_rounds, 0);
+    std::vector<device_state> states = std::vector<device_state>(race_rounds, device_state::count);
+
+    template <typename Transition>
+    void run(fake_usb_device& Fake, device_state Start, Transition Function) {
+        std::atomic<ULONG> round(0);
+        std::atomic<ULONG> arrived(0);
+        std::vector<std::thread> threads;
+
+        for (ULONG t = 0; t < race_threads; t++) {
+            threads.emplace_back([&, t] {
+                for (ULONG r = 0; r < race_rounds; r++) {
+                    // wait until the main thread started the round
+                    while (round.load() != r + 1) {
+                        std::this_thread::yield();
+                    }
+
+                    if (Function(t)) {
+                        __atomic_fetch_add(&winners[r], 1, __ATOMIC_SEQ_CST);
+                        winner[r] = t;
+                    }
+
+                    arrived++;
+                }
+            });
+        }
+
+        for (ULONG r = 0; r < race_rounds; r++) {
+            set_state(Fake, Start);
+            arrived = 0;
+            round = r + 1;
+
+            while (arrived.load() != race_threads) {
+                std::this_thread::yield();
+            }
+
+            states[r] = get_device_state(Fake.device);
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+};
+
+TEST(one_thread_wins_a_transition) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.add(), STATUS_SUCCESS);
+
+    // the transitions that leave the started state. Every thread
+    // takes a other one like the pnp and surprise removal paths
+    const device_state targets[race_threads] = {
+        device_state::stop_pending, device_state::stopped, device_state::remove_pending, device_state::surprise_removed
+    };
+
+    transition_race race;
+    race.run(fake, device_state::started, [&](ULONG Thread) {
+        return try_transition_device_state(fake.device, device_state::started, targets[Thread]);
+    });
+
+    ULONG single_winner = 0;
+    ULONG winner_state = 0;
+
+    for (ULONG r = 0; r < race_rounds; r++) {
+        single_winner += (race.winners[r] == 1) ? 1 : 0;
+        winner_state += (race.states[r] == targets[race.winner[r]]) ? 1 : 0;
+    }
+
+    // every round has exactly one winner and ends in its state
+    CHECK_EQUAL(single_winner, race_rounds);
+    CHECK_EQUAL(winner_state, race_rounds);
+
+    set_state(fake, device_state::started);
+}
+
+TEST(one_thread_removes_the_device) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.add(), STATUS_SUCCESS);
+
+    // removed is final so only one of the loops can get there, 
+    // whatever state the others moved the device to first
+    const device_state targets[race_threads] = {
+        device_state::removed, device_state::surprise_removed, device_state::removed, device_state::stopped
+    };
+
+    transition_race race;
+    race.run(fake, device_state::started, [&](ULONG Thread) {
+        return transition_device_state(fake.device, targets[Thread]) && targets[Thread] == device_state::removed;
+    });
+
+    ULONG single_winner = 0;
+    ULONG removed = 0;
+
+    for (ULONG r = 0; r < race_rounds; r++) {
+        single_winner += (race.winners[r] == 1) ? 1 : 0;
+        removed += (race.states[r] == device_state::removed) ? 1 : 0;
+    }
+
+    CHECK_EQUAL(single_winner, race_rounds);
+    CHECK_EQUAL(removed, race_rounds);
+
+    set_state(fake, device_state::started);
+}
+
+TEST(pnp_sequence) {
+    fake_usb_device fake;
+    const LONG outstanding = shim_pool_outstanding();
+
+    CHECK_EQUAL(fake.add(), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::not_started);
+
+    CHECK_EQUAL(fake.pnp(IRP_MN_START_DEVICE), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::started);
+    CHECK(fake.extension()->usb_interface_info != nullptr);
+
+    // a stop that is cancelled goes back to started
+    CHECK_EQUAL(fake.pnp(IRP_MN_QUERY_STOP_DEVICE), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::stop_pending);
+    CHECK_EQUAL(fake.pnp(IRP_MN_CANCEL_STOP_DEVICE), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::started);
+
+    // and a remove as well
+    CHECK_EQUAL(fake.pnp(IRP_MN_QUERY_REMOVE_DEVICE), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::remove_pending);
+    CHECK_EQUAL(fake.pnp(IRP_MN_CANCEL_REMOVE_DEVICE), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::started);
+
+    // a query the lower driver fails keeps us started
+    fake.query_status = STATUS_UNSUCCESSFUL;
+    CHECK_EQUAL(fake.pnp(IRP_MN_QUERY_STOP_DEVICE), STATUS_UNSUCCESSFUL);
+    CHECK(get_device_state(fake.device) == device_state::started);
+    fake.query_status = STATUS_SUCCESS;
+
+    // stop and start again like a resource rebalance
+    CHECK_EQUAL(fake.pnp(IRP_MN_QUERY_STOP_DEVICE), STATUS_SUCCESS);
+    CHECK_EQUAL(fake.pnp(IRP_MN_STOP_DEVICE), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::stopped);
+    CHECK(fake.extension()->usb_config_desc == nullptr);
+
+    CHECK_EQUAL(fake.pnp(IRP_MN_START_DEVICE), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::started);
+
+    // the device is unplugged. Nothing brings it back
+    CHECK_EQUAL(fake.pnp(IRP_MN_SURPRISE_REMOVAL), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::surprise_removed);
+    CHECK(!transition_device_state(fake.device, device_state::started));
+
+    fake.remove();
+
+    // the remove freed everything the driver allocated
+    CHECK_EQUAL(shim_pool_outstanding(), outstanding);
+}
+
+TEST(failed_start_is_stopped) {
+    fake_usb_device fake;
+    fake.start_status = STATUS_UNSUCCESSFUL;
+
+    CHECK_EQUAL(fake.start(), STATUS_UNSUCCESSFUL);
+    CHECK(get_device_state(fake.device) == device_state::stopped);
+
+    // a stopped device can be started again
+    fake.start_status = STATUS_SUCCESS;
+
+    CHECK_EQUAL(fake.pnp(IRP_MN_START_DEVICE), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::started);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
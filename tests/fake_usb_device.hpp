@@ -0,0 +1,1008 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "shim.hpp"
+#include "chief/driver.hpp"
+#include "chief/device_extension.hpp"
+
+extern "C" {
+    #include <usbdi.h>
+}
+
+/**
+ * @brief Configuration descriptor of the fake device. One interface
+ * with two alternate settings, both with a bulk in, a bulk out and a
+ * interrupt in endpoint
+ *
+ */
+#pragma pack(push, 1)
+struct fake_usb_configuration {
+    USB_CONFIGURATION_DESCRIPTOR configuration;
+
+    USB_INTERFACE_DESCRIPTOR setting0;
+    USB_ENDPOINT_DESCRIPTOR endpoints0[3];
+
+    USB_INTERFACE_DESCRIPTOR setting1;
+    USB_ENDPOINT_DESCRIPTOR endpoints1[3];
+};
+#pragma pack(pop)
+
+// the amount of pipes of every alternate setting
+constexpr static ULONG fake_usb_pipes = 3;
+
+// the status of the port of a connected and enabled device
+constexpr static ULONG fake_usb_port_status = USBD_PORT_ENABLED | USBD_PORT_CONNECTED;
+
+/**
+ * @brief The requests the watchdog sends to recover a hung device
+ *
+ */
+enum class fake_usb_recovery {
+    abort_pipe,
+    reset_pipe,
+    reset_port,
+    select_configuration
+};
+
+/**
+ * @brief A handle of the application on the device of the driver
+ *
+ */
+struct fake_usb_handle {
+    FILE_OBJECT file = {};
+    wchar_t name[32] = {};
+};
+
+/**
+ * @brief A request of the application or the pnp manager that the driver
+ * can pend. The io manager sets the event when the irp is completed
+ *
+ */
+struct fake_usb_request {
+    PIRP irp = nullptr;
+    PMDL mdl = nullptr;
+    KEVENT event;
+    IO_STATUS_BLOCK iosb = {};
+};
+
+/**
+ * @brief Fake usb stack below the driver. The physical device object
+ * of the fake answers the pnp and power irps and the urbs like the
+ * usb hub and host controller would. The urbs complete right away or
+ * after a latency on a thread of the fake, a stalled device keeps
+ * the control urbs until they are cancelled or released. A abort
+ * cancels the transfers of its pipe. On a shared bus the urbs take
+ * turns. The recovery and vendor requests are logged in the order
+ * they come. Brings the driver up on top of it with add and removes it
+ * again with remove. The application side opens handles and sends
+ * its reads and ioctls with open, begin and wait
+ *
+ */
+struct fake_usb_device {
+    // a irp the device keeps. A held irp waits for a cancel or a
+    // release, the others complete when they are due
+    struct pending_irp {
+        PIRP irp;
+        bool held;
+        std::chrono::steady_clock::time_point due;
+    };
+
+    // the fake usb stack
+    PDRIVER_OBJECT lower_driver = nullptr;
+    PDEVICE_OBJECT pdo = nullptr;
+
+    // the driver and the device it added on top of the pdo
+    PDRIVER_OBJECT driver = nullptr;
+    PDEVICE_OBJECT device = nullptr;
+
+    // true when the driver was loaded by another fake. That fake
+    // frees it
+    bool shared_driver = false;
+
+    // the descriptors the device returns
+    USB_DEVICE_DESCRIPTOR device_descriptor = {};
+    fake_usb_configuration configuration = {};
+
+    // the pipe handles are the addresses of these
+    UCHAR pipe_handles[2][fake_usb_pipes] = {};
+
+    // the status the lower driver gives the irps of the pnp minor
+    // functions
+    std::atomic<NTSTATUS> start_status{ STATUS_SUCCESS };
+    std::atomic<NTSTATUS> query_status{ STATUS_SUCCESS };
+
+    // the control urbs or the bulk and interrupt urbs are kept
+    // until they are cancelled or released
+    std::atomic<bool> stalled{ false };
+    std::atomic<bool> hold_bulk{ false };
+
+    // the time every internal ioctl takes in microseconds. 0
+    // completes them in the dispatch routine
+    std::atomic<ULONG> latency{ 0 };
+
+    // the internal ioctls take turns, every one starts when the one
+    // before it is done like the transfers on a bus
+    std::atomic<bool> shared_bus{ false };
+
+    // the amount of bytes a bulk in transfer returns. 0 fills the
+    // whole buffer
+    std::atomic<ULONG> bulk_in_length{ 0 };
+
+    // what the device got
+    std::atomic<ULONG> descriptor_requests{ 0 };
+    std::atomic<ULONG> vendor_requests{ 0 };
+    std::atomic<ULONG> select_configurations{ 0 };
+    std::atomic<ULONG> bulk_transfers{ 0 };
+    std::atomic<ULONG> pipe_requests{ 0 };
+    std::atomic<ULONG> port_requests{ 0 };
+    std::atomic<ULONG> cancelled{ 0 };
+
+    // the recovery requests in the order the device got them and the
+    // most that were with the device at the same time. Protected by 
+    // the lock
+    std::vector<fake_usb_recovery> recoveries;
+    ULONG recovering = 0;
+    ULONG max_recovering = 0;
+
+    // the request codes of the vendor requests in the order the device
+    // answered them. Protected by the lock
+    std::vector<UCHAR> vendor_codes;
+
+    // the irps the device keeps and the thread that completes them
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<pending_irp> pending;
+    std::chrono::steady_clock::time_point bus_free;
+    bool running = true;
+    std::thread completer;
+
+    fake_usb_device() {
+        build_descriptors();
+
+        lower_driver = shim_create_driver();
+
+        for (ULONG i = 0; i <= IRP_MJ_MAXIMUM_FUNCTION; i++) {
+            lower_driver->MajorFunction[i] = dispatch;
+        }
+
+        IoCreateDevice(lower_driver, sizeof(fake_usb_device*), nullptr, FILE_DEVICE_USB, 0, FALSE, &pdo);
+
+        *static_cast<fake_usb_device**>(pdo->DeviceExtension) = this;
+        pdo->Flags &= ~DO_DEVICE_INITIALIZING;
+
+        completer = std::thread([this] { complete_pending(); });
+    }
+
+    ~fake_usb_device() {
+        // take the driver off the device when the test did not
+        if (device) {
+            remove();
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running = false;
+        }
+
+        wake.notify_all();
+        completer.join();
+
+        IoDeleteDevice(pdo);
+        shim_free_driver(lower_driver);
+    }
+
+    /**
+     * @brief Load the driver and let it add its device on top of the
+     * pdo, like the pnp manager when the device is plugged in
+     *
+     * @return NTSTATUS of AddDevice
+     */
+    NTSTATUS add() {
+        UNICODE_STRING registry_path;
+        RtlInitUnicodeString(&registry_path, L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\usbchief");
+
+        driver = shim_create_driver();
+        DriverEntry(driver, &registry_path);
+
+        const NTSTATUS status = driver->DriverExtension->AddDevice(driver, pdo);
+
+        // the driver attached its device right above the pdo
+        device = pdo->AttachedDevice;
+
+        return status;
+    }
+
+    /**
+     * @brief Let the driver of another fake add its device on top of
+     * the pdo, like a second device of the same driver. The driver is
+     * not loaded again so both devices share its globals
+     *
+     * @param Other the fake that loaded the driver. Should be removed
+     * after this one
+     * @return NTSTATUS of AddDevice
+     */
+    NTSTATUS add(fake_usb_device& Other) {
+        driver = Other.driver;
+        shared_driver = true;
+
+        const NTSTATUS status = driver->DriverExtension->AddDevice(driver, pdo);
+
+        device = pdo->AttachedDevice;
+
+        return status;
+    }
+
+    /**
+     * @brief Send a pnp irp to the top of the stack. Returns when the
+     * driver returns from its dispatch routine, wait for it with wait
+     *
+     * @param MinorFunction IRP_MN_xxx
+     * @return fake_usb_request*
+     */
+    fake_usb_request* begin_pnp(UCHAR MinorFunction) {
+        fake_usb_request* request = new fake_usb_request();
+        KeInitializeEvent(&request->event, NotificationEvent, FALSE);
+
+        request->irp = IoAllocateIrp(device->StackSize, FALSE);
+        request->irp->UserEvent = &request->event;
+        request->irp->UserIosb = &request->iosb;
+
+        // the pnp manager starts every irp with not supported
+        request->irp->IoStatus.Status = STATUS_NOT_SUPPORTED;
+
+        PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(request->irp);
+        stack->MajorFunction = IRP_MJ_PNP;
+        stack->MinorFunction = MinorFunction;
+
+        IofCallDriver(device, request->irp);
+
+        return request;
+    }
+
+    /**
+     * @brief Send a pnp irp to the top of the stack and wait until it
+     * is completed
+     *
+     * @param MinorFunction IRP_MN_xxx
+     * @return NTSTATUS of the irp
+     */
+    NTSTATUS pnp(UCHAR MinorFunction) {
+        return wait(begin_pnp(MinorFunction));
+    }
+
+    /**
+     * @brief Add the driver and start the device
+     *
+     * @return NTSTATUS of the start irp
+     */
+    NTSTATUS start() {
+        if (!device && !NT_SUCCESS(add())) {
+            return STATUS_NO_SUCH_DEVICE;
+        }
+
+        return pnp(IRP_MN_START_DEVICE);
+    }
+
+    /**
+     * @brief Remove the device of the driver and wait until the dpcs
+     * and work items of the driver are done
+     *
+     */
+    void remove() {
+        pnp(IRP_MN_REMOVE_DEVICE);
+        shim_wait_idle();
+
+        device = nullptr;
+
+        if (!shared_driver) {
+            shim_free_driver(driver);
+        }
+
+        driver = nullptr;
+    }
+
+    /**
+     * @brief Get the device extension of the driver
+     *
+     * @return chief_device_extension*
+     */
+    chief_device_extension* extension() {
+        return get_device_extension(device);
+    }
+
+    /**
+     * @brief Get the amount of irps the device keeps
+     *
+     * @return size_t
+     */
+    size_t pending_count() {
+        std::lock_guard<std::mutex> guard(lock);
+
+        return pending.size();
+    }
+
+    /**
+     * @brief Let the held urbs complete
+     *
+     * @param Control true for the control urbs, false for the bulk
+     * and interrupt urbs
+     */
+    void release(bool Control) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            for (pending_irp& current : pending) {
+                if (current.held && is_control(current.irp) == Control) {
+                    current.held = false;
+                    current.due = std::chrono::steady_clock::now();
+                }
+            }
+        }
+
+        wake.notify_all();
+    }
+
+    /**
+     * @brief Get the amount of held urbs
+     *
+     * @param Control true for the control urbs, false for the bulk
+     * and interrupt urbs
+     * @return size_t
+     */
+    size_t held_count(bool Control) {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t count = 0;
+
+        for (const pending_irp& current : pending) {
+            count += (current.held && is_control(current.irp) == Control) ? 1 : 0;
+        }
+
+        return count;
+    }
+
+    /**
+     * @brief Wait until a other thread of the test or the fake made
+     * the predicate true
+     *
+     * @param Predicate
+     * @param Milliseconds the time to wait before giving up
+     * @return false when the time passed
+     */
+    template <typename Predicate>
+    static bool wait_until(Predicate Function, ULONG Milliseconds = 5000) {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(Milliseconds);
+
+        while (!Function()) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                return false;
+            }
+
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Open a handle like CreateFile on the device name with the
+     * name after it. A empty name opens the device itself
+     *
+     * @param Handle
+     * @param Name like L"\\PIPE00"
+     * @return NTSTATUS of the create
+     */
+    NTSTATUS open(fake_usb_handle& Handle, const wchar_t* Name) {
+        Handle.file = {};
+        wcsncpy(Handle.name, Name, (sizeof(Handle.name) / sizeof(wchar_t)) - 1);
+
+        Handle.file.DeviceObject = device;
+        RtlInitUnicodeString(&Handle.file.FileName, Handle.name);
+
+        return wait(begin(&Handle, IRP_MJ_CREATE, 0, nullptr, 0, 0));
+    }
+
+    /**
+     * @brief Close a handle of open like CloseHandle
+     *
+     * @param Handle
+     */
+    void close(fake_usb_handle& Handle) {
+        wait(begin(&Handle, IRP_MJ_CLEANUP, 0, nullptr, 0, 0));
+        wait(begin(&Handle, IRP_MJ_CLOSE, 0, nullptr, 0, 0));
+    }
+
+    /**
+     * @brief Send a irp of the application to the driver without
+     * waiting for it. Reads and writes get a mdl of the buffer like
+     * direct io, the ioctls use it as the system buffer
+     *
+     * @param Handle
+     * @param MajorFunction IRP_MJ_xxx
+     * @param IoControlCode for IRP_MJ_DEVICE_CONTROL
+     * @param Buffer
+     * @param InputLength
+     * @param OutputLength the length of a read or a write
+     * @return fake_usb_request* should be given to wait
+     */
+    fake_usb_request* begin(fake_usb_handle* Handle, UCHAR MajorFunction, ULONG IoControlCode, void* Buffer, ULONG InputLength, ULONG OutputLength) {
+        fake_usb_request* request = new fake_usb_request();
+        KeInitializeEvent(&request->event, NotificationEvent, FALSE);
+
+        request->irp = IoAllocateIrp(device->StackSize, FALSE);
+        request->irp->UserEvent = &request->event;
+        request->irp->UserIosb = &request->iosb;
+
+        PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(request->irp);
+        stack->MajorFunction = MajorFunction;
+        stack->FileObject = Handle ? &Handle->file : nullptr;
+
+        if (MajorFunction == IRP_MJ_READ || MajorFunction == IRP_MJ_WRITE) {
+            if (OutputLength) {
+                request->mdl = IoAllocateMdl(Buffer, OutputLength, FALSE, FALSE, nullptr);
+                request->irp->MdlAddress = request->mdl;
+            }
+
+            stack->Parameters.Read.Length = OutputLength;
+        }
+        else {
+            request->irp->AssociatedIrp.SystemBuffer = Buffer;
+
+            stack->Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+            stack->Parameters.DeviceIoControl.InputBufferLength = InputLength;
+            stack->Parameters.DeviceIoControl.OutputBufferLength = OutputLength;
+        }
+
+        IofCallDriver(device, request->irp);
+
+        return request;
+    }
+
+    /**
+     * @brief Check if a request of begin is completed
+     *
+     * @param Request
+     * @return true when wait returns right away
+     */
+    static bool done(fake_usb_request* Request) {
+        return KeReadStateEvent(&Request->event) != 0;
+    }
+
+    /**
+     * @brief Wait until a request of begin is completed and free it
+     *
+     * @param Request
+     * @param Information the information of the irp. Can be nullptr
+     * @return NTSTATUS of the irp
+     */
+    NTSTATUS wait(fake_usb_request* Request, ULONG_PTR* Information = nullptr) {
+        KeWaitForSingleObject(&Request->event, Executive, KernelMode, FALSE, nullptr);
+
+        const IO_STATUS_BLOCK iosb = Request->iosb;
+
+        if (Request->mdl) {
+            IoFreeMdl(Request->mdl);
+        }
+
+        IoFreeIrp(Request->irp);
+        delete Request;
+
+        if (Information) {
+            *Information = iosb.Information;
+        }
+
+        return iosb.Status;
+    }
+
+    /**
+     * @brief Send a buffered ioctl and wait for it
+     *
+     * @return NTSTATUS of the irp
+     */
+    NTSTATUS ioctl(fake_usb_handle* Handle, ULONG IoControlCode, void* Buffer, ULONG InputLength, ULONG OutputLength, ULONG_PTR* Information = nullptr) {
+        return wait(begin(Handle, IRP_MJ_DEVICE_CONTROL, IoControlCode, Buffer, InputLength, OutputLength), Information);
+    }
+
+    /**
+     * @brief Read from a pipe handle and wait for it
+     *
+     * @return NTSTATUS of the irp
+     */
+    NTSTATUS read(fake_usb_handle& Handle, void* Buffer, ULONG Length, ULONG_PTR* Information = nullptr) {
+        return wait(begin(&Handle, IRP_MJ_READ, 0, Buffer, 0, Length), Information);
+    }
+
+    void build_descriptors() {
+        device_descriptor.bLength = sizeof(USB_DEVICE_DESCRIPTOR);
+        device_descriptor.bDescriptorType = USB_DEVICE_DESCRIPTOR_TYPE;
+        device_descriptor.bcdUSB = 0x0200;
+        device_descriptor.bMaxPacketSize0 = 64;
+        device_descriptor.idVendor = 0x1234;
+        device_descriptor.idProduct = 0x5678;
+        device_descriptor.bNumConfigurations = 1;
+
+        configuration.configuration.bLength = sizeof(USB_CONFIGURATION_DESCRIPTOR);
+        configuration.configuration.bDescriptorType = USB_CONFIGURATION_DESCRIPTOR_TYPE;
+        configuration.configuration.wTotalLength = sizeof(fake_usb_configuration);
+        configuration.configuration.bNumInterfaces = 1;
+        configuration.configuration.bConfigurationValue = 1;
+
+        USB_INTERFACE_DESCRIPTOR* settings[2] = { &configuration.setting0, &configuration.setting1 };
+        USB_ENDPOINT_DESCRIPTOR* endpoints[2] = { configuration.endpoints0, configuration.endpoints1 };
+
+        // the endpoints of the second setting have larger packets
+        const UCHAR addresses[fake_usb_pipes] = { 0x81, 0x02, 0x83 };
+        const UCHAR types[fake_usb_pipes] = { USB_ENDPOINT_TYPE_BULK, USB_ENDPOINT_TYPE_BULK, USB_ENDPOINT_TYPE_INTERRUPT };
+
+        for (UCHAR setting = 0; setting < 2; setting++) {
+            settings[setting]->bLength = sizeof(USB_INTERFACE_DESCRIPTOR);
+            settings[setting]->bDescriptorType = USB_INTERFACE_DESCRIPTOR_TYPE;
+            settings[setting]->bAlternateSetting = setting;
+            settings[setting]->bNumEndpoints = fake_usb_pipes;
+            settings[setting]->bInterfaceClass = 0xff;
+
+            for (ULONG i = 0; i < fake_usb_pipes; i++) {
+                endpoints[setting][i].bLength = sizeof(USB_ENDPOINT_DESCRIPTOR);
+                endpoints[setting][i].bDescriptorType = USB_ENDPOINT_DESCRIPTOR_TYPE;
+                endpoints[setting][i].bEndpointAddress = addresses[i];
+                endpoints[setting][i].bmAttributes = types[i];
+                endpoints[setting][i].wMaxPacketSize = static_cast<USHORT>(setting ? 1024 : 512);
+                endpoints[setting][i].bInterval = (types[i] == USB_ENDPOINT_TYPE_INTERRUPT) ? 1 : 0;
+            }
+        }
+    }
+
+    static fake_usb_device* get(PDEVICE_OBJECT DeviceObject) {
+        return *static_cast<fake_usb_device**>(DeviceObject->DeviceExtension);
+    }
+
+    static NTSTATUS complete(PIRP Irp, NTSTATUS Status, ULONG_PTR Information = 0) {
+        Irp->IoStatus.Status = Status;
+        Irp->IoStatus.Information = Information;
+        IofCompleteRequest(Irp, IO_NO_INCREMENT);
+
+        return Status;
+    }
+
+    static NTSTATUS dispatch(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+        fake_usb_device* fake = get(DeviceObject);
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+        switch (stack->MajorFunction) {
+            case IRP_MJ_PNP:
+                return fake->dispatch_pnp(Irp, stack->MinorFunction);
+
+            case IRP_MJ_POWER:
+                PoStartNextPowerIrp(Irp);
+                return complete(Irp, STATUS_SUCCESS);
+
+            case IRP_MJ_INTERNAL_DEVICE_CONTROL:
+                return fake->dispatch_internal(Irp);
+
+            default:
+                return complete(Irp, STATUS_INVALID_DEVICE_REQUEST);
+        }
+    }
+
+    NTSTATUS dispatch_pnp(PIRP Irp, UCHAR MinorFunction) {
+        switch (MinorFunction) {
+            case IRP_MN_START_DEVICE:
+                return complete(Irp, start_status);
+
+            case IRP_MN_QUERY_STOP_DEVICE:
+            case IRP_MN_QUERY_REMOVE_DEVICE:
+                return complete(Irp, query_status);
+
+            case IRP_MN_QUERY_CAPABILITIES:
+            case IRP_MN_STOP_DEVICE:
+            case IRP_MN_CANCEL_STOP_DEVICE:
+            case IRP_MN_CANCEL_REMOVE_DEVICE:
+            case IRP_MN_SURPRISE_REMOVAL:
+            case IRP_MN_REMOVE_DEVICE:
+                return complete(Irp, STATUS_SUCCESS);
+
+            default:
+                // the bus driver keeps the status of the irps it does
+                // not handle
+                return complete(Irp, Irp->IoStatus.Status, Irp->IoStatus.Information);
+        }
+    }
+
+    static bool is_bulk(PIRP Irp) {
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+        return stack->Parameters.DeviceIoControl.IoControlCode == IOCTL_INTERNAL_USB_SUBMIT_URB &&
+            static_cast<PURB>(stack->Parameters.Others.Argument1)->UrbHeader.Function == URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+    }
+
+    static bool is_control(PIRP Irp) {
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+        if (stack->Parameters.DeviceIoControl.IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB) {
+            return false;
+        }
+
+        const USHORT function = static_cast<PURB>(stack->Parameters.Others.Argument1)->UrbHeader.Function;
+
+        return function == URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE || function == URB_FUNCTION_VENDOR_DEVICE;
+    }
+
+    /**
+     * @brief Get the recovery request of a irp
+     *
+     * @param Irp
+     * @param OutRecovery
+     * @return false when the irp is not a recovery request
+     */
+    static bool get_recovery(PIRP Irp, fake_usb_recovery& OutRecovery) {
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+        if (stack->Parameters.DeviceIoControl.IoControlCode == IOCTL_INTERNAL_USB_RESET_PORT) {
+            OutRecovery = fake_usb_recovery::reset_port;
+            return true;
+        }
+
+        if (stack->Parameters.DeviceIoControl.IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB) {
+            return false;
+        }
+
+        switch (static_cast<PURB>(stack->Parameters.Others.Argument1)->UrbHeader.Function) {
+            case URB_FUNCTION_ABORT_PIPE:
+                OutRecovery = fake_usb_recovery::abort_pipe;
+                return true;
+            case URB_FUNCTION_RESET_PIPE:
+                OutRecovery = fake_usb_recovery::reset_pipe;
+                return true;
+            case URB_FUNCTION_SELECT_CONFIGURATION:
+                OutRecovery = fake_usb_recovery::select_configuration;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * @brief Log a recovery request when the device gets it and stop
+     * counting it before it is completed
+     *
+     */
+    void recovery_begin(PIRP Irp) {
+        fake_usb_recovery recovery;
+
+        if (get_recovery(Irp, recovery)) {
+            std::lock_guard<std::mutex> guard(lock);
+
+            recoveries.push_back(recovery);
+            recovering++;
+            max_recovering = (recovering > max_recovering) ? recovering : max_recovering;
+        }
+    }
+
+    void recovery_end(PIRP Irp) {
+        fake_usb_recovery recovery;
+
+        if (get_recovery(Irp, recovery)) {
+            std::lock_guard<std::mutex> guard(lock);
+            recovering--;
+        }
+    }
+
+    NTSTATUS dispatch_internal(PIRP Irp) {
+        recovery_begin(Irp);
+
+        const bool hold = (stalled && is_control(Irp)) || (hold_bulk && is_bulk(Irp));
+        const ULONG delay = latency;
+
+        // answer right away like a host controller with a idle bus
+        if (!hold && !delay) {
+            return finish(Irp);
+        }
+
+        IoMarkIrpPending(Irp);
+
+        std::unique_lock<std::mutex> guard(lock);
+
+        // on a shared bus the urb starts when the one before it is done
+        const auto now = std::chrono::steady_clock::now();
+        const auto start = (shared_bus && bus_free > now) ? bus_free : now;
+        const auto due = start + std::chrono::microseconds(delay);
+
+        if (!hold) {
+            bus_free = due;
+        }
+
+        pending.push_back({ Irp, hold, due });
+        IoSetCancelRoutine(Irp, cancel_routine);
+
+        // the irp could be cancelled before the cancel routine was set
+        if (Irp->Cancel && IoSetCancelRoutine(Irp, nullptr)) {
+            pending.pop_back();
+            guard.unlock();
+
+            cancelled++;
+            recovery_end(Irp);
+            complete(Irp, STATUS_CANCELLED);
+
+            return STATUS_PENDING;
+        }
+
+        guard.unlock();
+        wake.notify_all();
+
+        return STATUS_PENDING;
+    }
+
+    static void cancel_routine(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+        IoReleaseCancelSpinLock(Irp->CancelIrql);
+
+        fake_usb_device* fake = get(DeviceObject);
+
+        {
+            std::lock_guard<std::mutex> guard(fake->lock);
+
+            for (auto current = fake->pending.begin(); current != fake->pending.end(); ++current) {
+                if (current->irp == Irp) {
+                    fake->pending.erase(current);
+                    break;
+                }
+            }
+        }
+
+        fake->cancelled++;
+        fake->recovery_end(Irp);
+
+        PURB urb = static_cast<PURB>(IoGetCurrentIrpStackLocation(Irp)->Parameters.Others.Argument1);
+
+        if (urb && IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.IoControlCode == IOCTL_INTERNAL_USB_SUBMIT_URB) {
+            urb->UrbHeader.Status = USBD_STATUS_CANCELED;
+        }
+
+        complete(Irp, STATUS_CANCELLED);
+    }
+
+    void complete_pending() {
+        std::unique_lock<std::mutex> guard(lock);
+
+        while (running) {
+            // find the first irp that is due. The irps with a cancel
+            // routine that is running are completed by the routine
+            auto next = pending.end();
+
+            for (auto current = pending.begin(); current != pending.end(); ++current) {
+                if (!current->held && (next == pending.end() || current->due < next->due)) {
+                    next = current;
+                }
+            }
+
+            if (next == pending.end()) {
+                wake.wait(guard);
+                continue;
+            }
+
+            if (next->due > std::chrono::steady_clock::now()) {
+                wake.wait_until(guard, next->due);
+                continue;
+            }
+
+            PIRP irp = next->irp;
+
+            if (!IoSetCancelRoutine(irp, nullptr)) {
+                // the cancel routine takes it out of the list
+                next->held = true;
+                continue;
+            }
+
+            pending.erase(next);
+            guard.unlock();
+
+            // the host controller completes the urbs from its dpc
+            const KIRQL irql = shim_set_irql(DISPATCH_LEVEL);
+            finish(irp);
+            shim_set_irql(irql);
+
+            guard.lock();
+        }
+    }
+
+    NTSTATUS finish(PIRP Irp) {
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+        // the driver can send the next request when this one completes
+        recovery_end(Irp);
+
+        switch (stack->Parameters.DeviceIoControl.IoControlCode) {
+            case IOCTL_INTERNAL_USB_SUBMIT_URB: {
+                PURB urb = static_cast<PURB>(stack->Parameters.Others.Argument1);
+                const NTSTATUS status = submit(urb);
+
+                urb->UrbHeader.Status = NT_SUCCESS(status) ? USBD_STATUS_SUCCESS : USBD_STATUS_STALL_PID;
+
+                return complete(Irp, status);
+            }
+
+            case IOCTL_INTERNAL_USB_GET_PORT_STATUS:
+                port_requests++;
+                *static_cast<ULONG*>(stack->Parameters.Others.Argument1) = fake_usb_port_status;
+
+                return complete(Irp, STATUS_SUCCESS);
+
+            case IOCTL_INTERNAL_USB_RESET_PORT:
+                port_requests++;
+
+                return complete(Irp, STATUS_SUCCESS);
+
+            default:
+                return complete(Irp, STATUS_INVALID_DEVICE_REQUEST);
+        }
+    }
+
+    static UCHAR* transfer_buffer(PVOID Buffer, PMDL Mdl) {
+        return static_cast<UCHAR*>(Mdl ? MmGetMdlVirtualAddress(Mdl) : Buffer);
+    }
+
+    NTSTATUS submit(PURB Urb) {
+        switch (Urb->UrbHeader.Function) {
+            case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+                return get_descriptor(Urb->UrbControlDescriptorRequest);
+
+            case URB_FUNCTION_SELECT_CONFIGURATION:
+                return select_configuration(Urb->UrbSelectConfiguration);
+
+            case URB_FUNCTION_VENDOR_DEVICE:
+                return vendor_request(Urb->UrbControlVendorClassRequest);
+
+            case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+                return bulk_transfer(Urb->UrbBulkOrInterruptTransfer);
+
+            case URB_FUNCTION_ABORT_PIPE:
+                pipe_requests++;
+                abort_pipe(Urb->UrbPipeRequest.PipeHandle);
+                return STATUS_SUCCESS;
+
+            case URB_FUNCTION_RESET_PIPE:
+                pipe_requests++;
+                return STATUS_SUCCESS;
+
+            default:
+                return STATUS_NOT_SUPPORTED;
+        }
+    }
+
+    /**
+     * @brief Cancel the transfers the fake keeps on a pipe like the
+     * usb stack does for a abort
+     *
+     * @param PipeHandle
+     */
+    void abort_pipe(USBD_PIPE_HANDLE PipeHandle) {
+        std::vector<PIRP> aborted;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+
+            for (auto current = pending.begin(); current != pending.end();) {
+                PIRP irp = current->irp;
+                PURB urb = static_cast<PURB>(IoGetCurrentIrpStackLocation(irp)->Parameters.Others.Argument1);
+
+                // the cancel routine takes the others out of the list
+                if (!is_bulk(irp) || urb->UrbBulkOrInterruptTransfer.PipeHandle != PipeHandle || !IoSetCancelRoutine(irp, nullptr)) {
+                    ++current;
+                    continue;
+                }
+
+                aborted.push_back(irp);
+                current = pending.erase(current);
+            }
+        }
+
+        for (PIRP irp : aborted) {
+            cancelled++;
+
+            static_cast<PURB>(IoGetCurrentIrpStackLocation(irp)->Parameters.Others.Argument1)->UrbHeader.Status = USBD_STATUS_CANCELED;
+            complete(irp, STATUS_CANCELLED);
+        }
+    }
+
+    NTSTATUS get_descriptor(_URB_CONTROL_DESCRIPTOR_REQUEST& Urb) {
+        descriptor_requests++;
+
+        const void* descriptor = nullptr;
+        ULONG length = 0;
+
+        if (Urb.DescriptorType == USB_DEVICE_DESCRIPTOR_TYPE) {
+            descriptor = &device_descriptor;
+            length = sizeof(device_descriptor);
+        }
+        else if (Urb.DescriptorType == USB_CONFIGURATION_DESCRIPTOR_TYPE) {
+            descriptor = &configuration;
+            length = sizeof(configuration);
+        }
+        else {
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        // a short buffer gets the start of the descriptor
+        length = (Urb.TransferBufferLength < length) ? Urb.TransferBufferLength : length;
+
+        memcpy(transfer_buffer(Urb.TransferBuffer, Urb.TransferBufferMDL), descriptor, length);
+        Urb.TransferBufferLength = length;
+
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS select_configuration(_URB_SELECT_CONFIGURATION& Urb) {
+        select_configurations++;
+
+        // a nullptr descriptor puts the device in the unconfigured state
+        if (!Urb.ConfigurationDescriptor) {
+            return STATUS_SUCCESS;
+        }
+
+        PUSBD_INTERFACE_INFORMATION info = &Urb.Interface;
+
+        if (info->AlternateSetting > 1 || info->NumberOfPipes != fake_usb_pipes) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        const USB_ENDPOINT_DESCRIPTOR* endpoints = info->AlternateSetting ? configuration.endpoints1 : configuration.endpoints0;
+
+        Urb.ConfigurationHandle = &configuration;
+        info->InterfaceHandle = &configuration.setting0 + info->AlternateSetting;
+
+        for (ULONG i = 0; i < fake_usb_pipes; i++) {
+            const UCHAR type = endpoints[i].bmAttributes & USB_ENDPOINT_TYPE_MASK;
+
+            info->Pipes[i].MaximumPacketSize = endpoints[i].wMaxPacketSize;
+            info->Pipes[i].EndpointAddress = endpoints[i].bEndpointAddress;
+            info->Pipes[i].Interval = endpoints[i].bInterval;
+            info->Pipes[i].PipeType = (type == USB_ENDPOINT_TYPE_INTERRUPT) ? UsbdPipeTypeInterrupt : UsbdPipeTypeBulk;
+            info->Pipes[i].PipeHandle = &pipe_handles[info->AlternateSetting][i];
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS vendor_request(_URB_CONTROL_VENDOR_OR_CLASS_REQUEST& Urb) {
+        vendor_requests++;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            vendor_codes.push_back(Urb.Request);
+        }
+
+        // a in request gets the request code in every byte
+        if ((Urb.TransferFlags & USBD_TRANSFER_DIRECTION_IN) && Urb.TransferBufferLength) {
+            memset(transfer_buffer(Urb.TransferBuffer, Urb.TransferBufferMDL), Urb.Request, Urb.TransferBufferLength);
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS bulk_transfer(_URB_BULK_OR_INTERRUPT_TRANSFER& Urb) {
+        bulk_transfers++;
+
+        // a in transfer gets its offset in every byte
+        if (Urb.TransferFlags & USBD_TRANSFER_DIRECTION_IN) {
+            const ULONG length = bulk_in_length;
+
+            if (length && length < Urb.TransferBufferLength) {
+                Urb.TransferBufferLength = length;
+            }
+
+            UCHAR* buffer = transfer_buffer(Urb.TransferBuffer, Urb.TransferBufferMDL);
+
+            for (ULONG i = 0; i < Urb.TransferBufferLength; i++) {
+                buffer[i] = static_cast<UCHAR>(i);
+            }
+        }
+
+        return STATUS_SUCCESS;
+    }
+};
@@ -0,0 +1,280 @@
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+
+// the length of the transfers of the first round. Every round is a
+// bit longer so the buffers of the rounds can be told apart
+constexpr static ULONG test_first_length = 100;
+
+/**
+ * @brief A frame of a fan-out handle
+ *
+ */
+struct fanout_frame {
+    chief_read_frame_header header;
+    UCHAR data[1024];
+};
+
+/**
+ * @brief A started fake that holds the transfers of the pump until
+ * a round is released
+ *
+ */
+struct fanout_device {
+    fake_usb_device fake;
+    ULONG rounds = 0;
+
+    fanout_device() {
+        fake.start();
+        fake.hold_bulk = true;
+    }
+
+    /**
+     * @brief Open a framed fan-out handle on the bulk in pipe
+     *
+     */
+    NTSTATUS open(fake_usb_handle& Handle, ULONG Policy = chief_fanout_lossy, ULONG Depth = 0) {
+        const NTSTATUS status = fake.open(Handle, L"\\PIPE00\\FANOUT");
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        usb_chief_read_mode mode = { chief_read_mode_framed };
+        fake.ioctl(&Handle, ioctl_set_read_mode, &mode, sizeof(mode), 0);
+
+        usb_chief_fanout_config config = { Policy, Depth };
+
+        return fake.ioctl(&Handle, ioctl_configure_fanout, &config, sizeof(config), 0);
+    }
+
+    usb_chief_fanout_stats stats(fake_usb_handle& Handle) {
+        usb_chief_fanout_stats result = {};
+        fake.ioctl(&Handle, ioctl_get_fanout_stats, &result, 0, sizeof(result));
+
+        return result;
+    }
+
+    fanout_hub* hub() {
+        return fake.extension()->fanouts[0];
+    }
+
+    /**
+     * @brief Complete the held transfers with the length of the next
+     * round and wait until the pump sent the ones that follow
+     *
+     * @param Next the transfers the pump sends again
+     * @return the length of the transfers of the round
+     */
+    ULONG release(ULONG Next = fanout_pump_depth) {
+        const ULONG length = test_first_length + (rounds++ * 10);
+
+        fake.bulk_in_length = length;
+        fake.release(false);
+
+        fake_usb_device::wait_until([&] { return fake.held_count(false) == Next && hub()->running == Next; });
+
+        return length;
+    }
+
+    NTSTATUS read(fake_usb_handle& Handle, fanout_frame& Frame) {
+        return fake.read(Handle, &Frame, sizeof(Frame));
+    }
+};
+
+TEST(handles_get_the_same_buffers) {
+    fanout_device test;
+
+    fake_usb_handle first;
+    fake_usb_handle second;
+
+    CHECK_EQUAL(test.open(first), STATUS_SUCCESS);
+    CHECK_EQUAL(test.open(second), STATUS_SUCCESS);
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == fanout_pump_depth; }));
+
+    // the pump reads the pipe once for both handles
+    std::vector<ULONG> lengths;
+
+    for (ULONG i = 0; i < 3; i++) {
+        const ULONG length = test.release();
+        lengths.insert(lengths.end(), fanout_pump_depth, length);
+    }
+
+    CHECK_EQUAL(test.fake.bulk_transfers, 3 * fanout_pump_depth);
+    CHECK_EQUAL(test.stats(first).queued, lengths.size());
+    CHECK_EQUAL(test.stats(second).queued, lengths.size());
+    CHECK_EQUAL(test.stats(first).subscribers, 2u);
+
+    // both get every buffer in the same order with the same data
+    ULONG wrong = 0;
+
+    for (ULONG length : lengths) {
+        fanout_frame a = {};
+        fanout_frame b = {};
+
+        CHECK_EQUAL(test.read(first, a), STATUS_SUCCESS);
+        CHECK_EQUAL(test.read(second, b), STATUS_SUCCESS);
+
+        wrong += (a.header.length != length || b.header.length != length) ? 1 : 0;
+        wrong += (a.header.timestamp != b.header.timestamp) ? 1 : 0;
+        wrong += (memcmp(a.data, b.data, length) != 0 || a.data[length - 1] != static_cast<UCHAR>(length - 1)) ? 1 : 0;
+    }
+
+    CHECK_EQUAL(wrong, 0u);
+    CHECK_EQUAL(test.stats(first).delivered, lengths.size());
+    CHECK_EQUAL(test.stats(second).dropped, 0u);
+
+    test.fake.close(first);
+    test.fake.close(second);
+}
+
+TEST(lossy_handle_drops_the_oldest) {
+    fanout_device test;
+
+    fake_usb_handle handle;
+    CHECK_EQUAL(test.open(handle, chief_fanout_lossy, fanout_pump_depth), STATUS_SUCCESS);
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == fanout_pump_depth; }));
+
+    ULONG length = 0;
+
+    for (ULONG i = 0; i < 3; i++) {
+        length = test.release();
+    }
+
+    // a lossy handle never holds the pump. It keeps the last round
+    const usb_chief_fanout_stats stats = test.stats(handle);
+    CHECK_EQUAL(stats.queued, fanout_pump_depth);
+    CHECK_EQUAL(stats.dropped, 2 * fanout_pump_depth);
+
+    fanout_frame frame = {};
+    CHECK_EQUAL(test.read(handle, frame), STATUS_SUCCESS);
+    CHECK_EQUAL(frame.header.length, length);
+
+    CHECK_EQUAL(test.stats(handle).delivered, 1u);
+
+    test.fake.close(handle);
+}
+
+TEST(blocking_handle_holds_the_pump) {
+    fanout_device test;
+
+    fake_usb_handle blocking;
+    fake_usb_handle lossy;
+
+    CHECK_EQUAL(test.open(blocking, chief_fanout_blocking, fanout_pump_depth), STATUS_SUCCESS);
+    CHECK_EQUAL(test.open(lossy), STATUS_SUCCESS);
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == fanout_pump_depth; }));
+
+    // the last buffer of the round fills the blocking handle, the
+    // transfers that were already sent still complete. After that
+    // nothing is read for any handle
+    test.release(fanout_pump_depth - 1);
+    test.release(0);
+
+    CHECK_EQUAL(test.hub()->held, fanout_pump_depth);
+
+    const ULONG transfers = test.fake.bulk_transfers;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    CHECK_EQUAL(test.fake.bulk_transfers, transfers);
+    CHECK_EQUAL(test.fake.held_count(false), 0u);
+
+    const ULONG queued = (2 * fanout_pump_depth) - 1;
+    CHECK_EQUAL(test.stats(blocking).queued, queued);
+    CHECK_EQUAL(test.stats(lossy).queued, queued);
+    CHECK_EQUAL(test.stats(blocking).dropped, 0u);
+
+    // reading the lossy handle does not help
+    fanout_frame frame = {};
+    CHECK_EQUAL(test.read(lossy, frame), STATUS_SUCCESS);
+    CHECK_EQUAL(test.fake.held_count(false), 0u);
+
+    // the pump starts again when the blocking handle is below its depth
+    for (ULONG i = 0; i < queued - fanout_pump_depth; i++) {
+        CHECK_EQUAL(test.read(blocking, frame), STATUS_SUCCESS);
+        CHECK_EQUAL(test.fake.held_count(false), 0u);
+    }
+
+    CHECK_EQUAL(test.read(blocking, frame), STATUS_SUCCESS);
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == fanout_pump_depth; }));
+    CHECK_EQUAL(test.hub()->held, 0u);
+
+    // and the handles get the new data
+    const ULONG length = test.release();
+
+    CHECK_EQUAL(test.stats(lossy).queued, queued - 1 + fanout_pump_depth);
+    CHECK_EQUAL(test.stats(blocking).queued, fanout_pump_depth - 1 + fanout_pump_depth);
+
+    // the rest of the second round and then the new round in order
+    ULONG wrong = 0;
+
+    for (ULONG i = 0; i < (2 * fanout_pump_depth) - 1; i++) {
+        CHECK_EQUAL(test.read(blocking, frame), STATUS_SUCCESS);
+        wrong += (frame.header.length != ((i < fanout_pump_depth - 1) ? test_first_length + 10 : length)) ? 1 : 0;
+    }
+
+    CHECK_EQUAL(wrong, 0u);
+    CHECK_EQUAL(test.stats(blocking).dropped, 0u);
+
+    test.fake.close(blocking);
+    test.fake.close(lossy);
+}
+
+TEST(unsubscribe_with_transfers_in_flight) {
+    fanout_device test;
+
+    const LONG outstanding = shim_pool_outstanding();
+
+    fake_usb_handle first;
+    fake_usb_handle second;
+
+    CHECK_EQUAL(test.open(first), STATUS_SUCCESS);
+    CHECK_EQUAL(test.open(second), STATUS_SUCCESS);
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == fanout_pump_depth; }));
+
+    // both handles wait for data
+    fanout_frame first_frame = {};
+    fanout_frame second_frame = {};
+
+    fake_usb_request* first_read = test.fake.begin(&first, IRP_MJ_READ, 0, &first_frame, 0, sizeof(first_frame));
+    fake_usb_request* second_read = test.fake.begin(&second, IRP_MJ_READ, 0, &second_frame, 0, sizeof(second_frame));
+
+    CHECK(!fake_usb_device::done(first_read));
+    CHECK(!fake_usb_device::done(second_read));
+
+    // the handle that goes away cancels its read. The pump keeps
+    // running for the other one
+    test.fake.close(second);
+
+    CHECK_EQUAL(test.fake.wait(second_read), STATUS_CANCELLED);
+    CHECK_EQUAL(test.fake.cancelled, 0u);
+    CHECK_EQUAL(test.fake.held_count(false), fanout_pump_depth);
+
+    const ULONG length = test.release();
+
+    CHECK_EQUAL(test.fake.wait(first_read), STATUS_SUCCESS);
+    CHECK_EQUAL(first_frame.header.length, length);
+    CHECK_EQUAL(test.stats(first).subscribers, 1u);
+
+    // the last handle aborts the transfers with the usb stack and
+    // frees the pump and the buffers
+    test.fake.close(first);
+
+    CHECK_EQUAL(test.fake.cancelled, fanout_pump_depth);
+    CHECK_EQUAL(test.fake.held_count(false), 0u);
+    CHECK(test.hub() == nullptr);
+    CHECK_EQUAL(shim_pool_outstanding(), outstanding);
+
+    // the pipe is free for a normal handle again
+    fake_usb_handle pipe;
+    test.fake.hold_bulk = false;
+
+    CHECK_EQUAL(test.fake.open(pipe, L"\\PIPE00"), STATUS_SUCCESS);
+    test.fake.close(pipe);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+
+#include "tools/usbfs_stream.hpp"
+
+/**
+ * @brief Fake usbfs device for usbfs_stream. The device fills the
+ * oldest submitted urb when it is reaped with a stream of 32-bit
+ * counters, so a reader can check that no byte is lost or reordered
+ *
+ */
+struct loopback_device {
+    // the urbs that are with the device, oldest first
+    std::deque<usbdevfs_urb*> pending;
+
+    // the urbs that are discarded and still need to be reaped
+    std::deque<usbdevfs_urb*> discarded;
+
+    // the next counter of the stream and the bytes of it that are sent
+    uint32_t counter = 0;
+    uint32_t counter_offset = 0;
+
+    // every n-th urb is short. 0 for no short urbs
+    unsigned long short_every = 0;
+
+    // the urb with this number completes with a error. 0 for none
+    unsigned long error_urb = 0;
+
+    // the submit with this number fails. 0 for none
+    unsigned long fail_submit = 0;
+
+    // the reap with this number fails. 0 for none
+    unsigned long fail_reap = 0;
+
+    unsigned long submits = 0;
+    unsigned long reaps = 0;
+    unsigned long completed = 0;
+
+    int submit(usbdevfs_urb* Urb) {
+        if (++submits == fail_submit) {
+            return -ENODEV;
+        }
+
+        pending.push_back(Urb);
+
+        return 0;
+    }
+
+    int reap(usbdevfs_urb*& Urb) {
+        if (++reaps == fail_reap) {
+            return -ENODEV;
+        }
+
+        // the discarded urbs come back first
+        if (!discarded.empty()) {
+            Urb = discarded.front();
+            discarded.pop_front();
+
+            Urb->status = -ENOENT;
+            Urb->actual_length = 0;
+
+            return 0;
+        }
+
+        // a real device would block forever here
+        if (pending.empty()) {
+            return -EAGAIN;
+        }
+
+        Urb = pending.front();
+        pending.pop_front();
+
+        completed++;
+
+        if (completed == error_urb) {
+            Urb->status = -EPROTO;
+            Urb->actual_length = 0;
+
+            return 0;
+        }
+
+        int length = Urb->buffer_length;
+
+        if (short_every && !(completed % short_every)) {
+            length /= 2;
+        }
+
+        fill(static_cast<uint8_t*>(Urb->buffer), static_cast<size_t>(length));
+
+        Urb->status = 0;
+        Urb->actual_length = length;
+
+        return 0;
+    }
+
+    void discard(usbdevfs_urb* Urb) {
+        for (auto current = pending.begin(); current != pending.end(); ++current) {
+            if (*current == Urb) {
+                pending.erase(current);
+                discarded.push_back(Urb);
+
+                return;
+            }
+        }
+    }
+
+    void fill(uint8_t* Buffer, size_t Length) {
+        size_t i = 0;
+
+        // whole counters at a time when we are at the start of one
+        if (!counter_offset) {
+            for (; i + sizeof(counter) <= Length; i += sizeof(counter)) {
+                const uint8_t bytes[4] = {
+                    static_cast<uint8_t>(counter), static_cast<uint8_t>(counter >> 8),
+                    static_cast<uint8_t>(counter >> 16), static_cast<uint8_t>(counter >> 24)
+                };
+
+                memcpy(Buffer + i, bytes, sizeof(bytes));
+                counter++;
+            }
+        }
+
+        for (; i < Length; i++) {
+            Buffer[i] = static_cast<uint8_t>(counter >> (counter_offset * 8));
+
+            if (++counter_offset == sizeof(counter)) {
+                counter_offset = 0;
+                counter++;
+            }
+        }
+    }
+};
+
+/**
+ * @brief Checks the stream of counters of a loopback_device
+ *
+ */
+struct loopback_checker {
+    uint32_t counter = 0;
+    uint32_t counter_offset = 0;
+    uint64_t bytes = 0;
+    bool valid = true;
+
+    void check(const uint8_t* Buffer, size_t Length) {
+        for (size_t i = 0; i < Length; i++) {
+            valid = valid && Buffer[i] == static_cast<uint8_t>(counter >> (counter_offset * 8));
+
+            if (++counter_offset == sizeof(counter)) {
+                counter_offset = 0;
+                counter++;
+            }
+        }
+
+        bytes += Length;
+    }
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "chief/protocol.hpp"
+
+/**
+ * @brief Transport of the protocol core that loops back to a fake
+ * device. OUT requests are stored in the memory of the device at the
+ * address in the value and index, IN requests read it back. Every
+ * setup packet and selected setting is kept so the tests can check
+ * the sequence
+ *
+ */
+struct loopback_transport {
+    // the setup packets in the order they are sent
+    std::vector<chief_setup_packet> requests;
+
+    // the data of all the OUT requests in order
+    std::vector<uint8_t> received;
+
+    // the settings that are selected in order and the interface
+    // descriptor of the last one
+    std::vector<unsigned char> settings;
+    const void* setting_interface = nullptr;
+
+    // the memory of the device
+    std::map<uint32_t, uint8_t> memory;
+
+    // fail the control request with this index (0 based). -1 to
+    // never fail
+    long fail_request = -1;
+
+    // fail the read_image at this offset. -1 to never fail
+    long fail_read_offset = -1;
+
+    // the status of the failing request or read
+    long fail_status = -5;
+
+    long read_image(const void* Image, unsigned long Offset, void* Buffer, unsigned long Length) {
+        if (fail_read_offset >= 0 && Offset == static_cast<unsigned long>(fail_read_offset)) {
+            return fail_status;
+        }
+
+        memcpy(Buffer, static_cast<const uint8_t*>(Image) + Offset, Length);
+
+        return 0;
+    }
+
+    long control(const chief_setup_packet& Setup, void* Buffer, unsigned long& OutLength) {
+        const long index = static_cast<long>(requests.size());
+        requests.push_back(Setup);
+
+        OutLength = 0;
+
+        if (index == fail_request) {
+            return fail_status;
+        }
+
+        const uint32_t address = (static_cast<uint32_t>(Setup.index) << 16) | Setup.value;
+        uint8_t* data = static_cast<uint8_t*>(Buffer);
+
+        for (unsigned long i = 0; i < Setup.length; i++) {
+            if (protocol_setup_is_in(Setup)) {
+                data[i] = memory[address + static_cast<uint32_t>(i)];
+            }
+            else {
+                memory[address + static_cast<uint32_t>(i)] = data[i];
+                received.push_back(data[i]);
+            }
+        }
+
+        OutLength = Setup.length;
+
+        return 0;
+    }
+
+    long select_setting(const void* Interface, const chief_interface_setting& Setting) {
+        settings.push_back(Setting.alternate_setting);
+        setting_interface = Interface;
+
+        return 0;
+    }
+
+    /**
+     * @brief Get a copy of the memory of the device
+     *
+     * @param Address
+     * @param Length
+     * @return std::vector<uint8_t>
+     */
+    std::vector<uint8_t> memory_at(uint32_t Address, size_t Length) {
+        std::vector<uint8_t> data(Length);
+
+        for (size_t i = 0; i < Length; i++) {
+            data[i] = memory[Address + static_cast<uint32_t>(i)];
+        }
+
+        return data;
+    }
+};
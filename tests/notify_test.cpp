@@ -0,0 +1,165 @@
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+
+/**
+ * @brief A started fake with a handle on the device that waits for
+ * its events. The started event of the start is already taken
+ *
+ */
+struct notify_device {
+    fake_usb_device fake;
+    fake_usb_handle control;
+
+    notify_device() {
+        fake.start();
+        fake.open(control, L"");
+
+        usb_chief_event_record record = {};
+        wait(record);
+    }
+
+    ~notify_device() {
+        fake.close(control);
+    }
+
+    fake_usb_request* begin_wait(usb_chief_event_record& Record) {
+        return fake.begin(&control, IRP_MJ_DEVICE_CONTROL, ioctl_wait_event, &Record, 0, sizeof(Record));
+    }
+
+    NTSTATUS wait(usb_chief_event_record& Record) {
+        return fake.wait(begin_wait(Record));
+    }
+
+    NTSTATUS set_alternate_setting(ULONG Setting) {
+        usb_chief_vendor_request request = {};
+        request.request = Setting;
+
+        return fake.ioctl(&control, ioctl_set_alternate_setting, &request, sizeof(request), sizeof(request));
+    }
+};
+
+TEST(started_event) {
+    fake_usb_device fake;
+    fake.start();
+
+    fake_usb_handle control;
+    fake.open(control, L"");
+
+    // the start happened before we waited, the record is returned
+    // right away
+    usb_chief_event_record record = {};
+    CHECK_EQUAL(fake.wait(fake.begin(&control, IRP_MJ_DEVICE_CONTROL, ioctl_wait_event, &record, 0, sizeof(record))), STATUS_SUCCESS);
+
+    CHECK_EQUAL(record.events, static_cast<ULONG>(chief_event_started));
+    CHECK_EQUAL(record.count, 1u);
+    CHECK_EQUAL(record.sequence, 1u);
+    CHECK_EQUAL(record.power_state, static_cast<ULONG>(PowerDeviceD0));
+
+    // the output should fit a record
+    ULONG small = 0;
+    CHECK_EQUAL(fake.ioctl(&control, ioctl_wait_event, &small, 0, sizeof(small)), STATUS_BUFFER_TOO_SMALL);
+
+    fake.close(control);
+}
+
+TEST(events_are_coalesced) {
+    notify_device test;
+
+    // nothing happened since the last record, the request waits
+    usb_chief_event_record record = {};
+    fake_usb_request* request = test.begin_wait(record);
+
+    CHECK(!fake_usb_device::done(request));
+
+    CHECK_EQUAL(test.set_alternate_setting(1), STATUS_SUCCESS);
+    CHECK_EQUAL(test.fake.wait(request), STATUS_SUCCESS);
+    CHECK_EQUAL(record.events, static_cast<ULONG>(chief_event_alternate_setting));
+    CHECK_EQUAL(record.alternate_setting, 1u);
+    CHECK_EQUAL(record.sequence, 2u);
+
+    // the events without a waiting request go in one record
+    notify_event(test.fake.device, chief_event_stall, 0);
+    notify_event(test.fake.device, chief_event_power, PowerDeviceD2);
+    notify_event(test.fake.device, chief_event_stall, 2);
+    notify_event(test.fake.device, chief_event_stall, 0);
+    notify_event(test.fake.device, chief_event_recovery, 1);
+
+    CHECK_EQUAL(test.wait(record), STATUS_SUCCESS);
+    CHECK_EQUAL(record.events, static_cast<ULONG>(chief_event_stall | chief_event_power | chief_event_recovery));
+    CHECK_EQUAL(record.count, 5u);
+    CHECK_EQUAL(record.sequence, 3u);
+    CHECK_EQUAL(record.stalled_pipes, 0x5u);
+    CHECK(record.first_timestamp <= record.last_timestamp);
+
+    // the record keeps the state of the events before it
+    CHECK_EQUAL(record.power_state, static_cast<ULONG>(PowerDeviceD2));
+    CHECK_EQUAL(record.alternate_setting, 1u);
+
+    // a pipe index that does not fit the bitmap is still counted
+    notify_event(test.fake.device, chief_event_stall, sizeof(record.stalled_pipes) * 8);
+
+    CHECK_EQUAL(test.wait(record), STATUS_SUCCESS);
+    CHECK_EQUAL(record.count, 1u);
+    CHECK_EQUAL(record.stalled_pipes, 0u);
+    CHECK_EQUAL(record.sequence, 4u);
+}
+
+TEST(waiting_requests_get_the_same_record) {
+    notify_device test;
+
+    usb_chief_event_record first = {};
+    usb_chief_event_record second = {};
+
+    fake_usb_request* requests[] = { test.begin_wait(first), test.begin_wait(second) };
+
+    notify_event(test.fake.device, chief_event_recovery, 2);
+
+    CHECK_EQUAL(test.fake.wait(requests[0]), STATUS_SUCCESS);
+    CHECK_EQUAL(test.fake.wait(requests[1]), STATUS_SUCCESS);
+    CHECK_EQUAL(first.sequence, second.sequence);
+    CHECK_EQUAL(first.count, 1u);
+    CHECK(memcmp(&first, &second, sizeof(first)) == 0);
+
+    // the next event starts a new record
+    notify_event(test.fake.device, chief_event_recovery, 3);
+
+    usb_chief_event_record next = {};
+    CHECK_EQUAL(test.wait(next), STATUS_SUCCESS);
+    CHECK_EQUAL(next.sequence, first.sequence + 1);
+    CHECK_EQUAL(next.count, 1u);
+}
+
+TEST(wait_after_remove) {
+    notify_device test;
+
+    usb_chief_event_record record = {};
+    fake_usb_request* request = test.begin_wait(record);
+
+    // the waiting request gets the removal
+    CHECK_EQUAL(test.fake.pnp(IRP_MN_SURPRISE_REMOVAL), STATUS_SUCCESS);
+    CHECK_EQUAL(test.fake.wait(request), STATUS_SUCCESS);
+    CHECK_EQUAL(record.events, static_cast<ULONG>(chief_event_removed));
+
+    // no events follow, a new request fails right away
+    notify_event(test.fake.device, chief_event_stall, 0);
+
+    CHECK_EQUAL(test.wait(record), STATUS_DELETE_PENDING);
+    CHECK_EQUAL(test.wait(record), STATUS_DELETE_PENDING);
+}
+
+TEST(removal_without_a_waiting_request) {
+    notify_device test;
+
+    // the removal is returned first, then the channel is closed
+    CHECK_EQUAL(test.fake.pnp(IRP_MN_SURPRISE_REMOVAL), STATUS_SUCCESS);
+
+    usb_chief_event_record record = {};
+    CHECK_EQUAL(test.wait(record), STATUS_SUCCESS);
+    CHECK_EQUAL(record.events, static_cast<ULONG>(chief_event_removed));
+
+    CHECK_EQUAL(test.wait(record), STATUS_DELETE_PENDING);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
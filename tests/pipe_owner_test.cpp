@@ -0,0 +1,336 @@
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+#include "chief/device_extension.hpp"
+#include "chief/pipe.hpp"
+
+// the pipes the threads fight over. Less pipes than threads so every
+// pipe has contention
+constexpr static ULONG test_pipes = 4;
+constexpr static ULONG test_threads = 8;
+constexpr static ULONG test_iterations = 200000;
+
+/**
+ * @brief Device object with only the fields of the extension the pipe
+ * ownership uses. The active pipe count starts at 1 like after
+ * add_device
+ *
+ */
+struct owner_device {
+    PDRIVER_OBJECT driver = nullptr;
+    PDEVICE_OBJECT device = nullptr;
+
+    owner_device() {
+        driver = shim_create_driver();
+        IoCreateDevice(driver, chief_device_extension_size, nullptr, FILE_DEVICE_USB, 0, FALSE, &device);
+
+        chief_device_extension* dev_ext = get_device_extension(device);
+        memset(static_cast<void*>(dev_ext), 0, sizeof(chief_device_extension));
+
+        KeInitializeSpinLock(&dev_ext->device_lock);
+        KeInitializeEvent(&dev_ext->pipe_count_empty, NotificationEvent, FALSE);
+
+        increment_active_pipe_count(device);
+    }
+
+    ~owner_device() {
+        IoDeleteDevice(device);
+        shim_free_driver(driver);
+    }
+
+    LONG active_pipe_count() {
+        return get_device_extension(device)->active_pipe_count;
+    }
+};
+
+TEST(claim_and_release) {
+    owner_device owner;
+    ULONG epoch = 0;
+    ULONG second_epoch = 0;
+
+    CHECK(pipe_claim(owner.device, 1, epoch));
+    CHECK(!pipe_claim(owner.device, 1, second_epoch));
+    CHECK(pipe_claim(owner.device, 2, second_epoch));
+    CHECK_EQUAL(epoch, second_epoch);
+    CHECK_EQUAL(pipe_claimed_mask(owner.device), 0x6u);
+
+    // a other epoch is not the owner
+    CHECK(!pipe_release(owner.device, 1, epoch + 1));
+    CHECK(pipe_release(owner.device, 1, epoch));
+    CHECK(!pipe_release(owner.device, 1, epoch));
+    CHECK_EQUAL(pipe_claimed_mask(owner.device), 0x4u);
+
+    // the pipe can be claimed again after the release
+    CHECK(pipe_claim(owner.device, 1, second_epoch));
+    CHECK_EQUAL(pipe_claimed_mask(owner.device), 0x6u);
+}
+
+TEST(claim_out_of_range) {
+    owner_device owner;
+    ULONG epoch = 0;
+
+    CHECK(!pipe_claim(owner.device, chief_max_pipes, epoch));
+    CHECK(!pipe_release(owner.device, chief_max_pipes, epoch));
+    CHECK_EQUAL(pipe_claimed_mask(owner.device), 0u);
+}
+
+TEST(revoke_starts_a_epoch) {
+    owner_device owner;
+    ULONG epoch = 0;
+    ULONG new_epoch = 0;
+
+    // count the pipes like mj_create
+    increment_active_pipe_count(owner.device);
+    CHECK(pipe_claim(owner.device, 0, epoch));
+    increment_active_pipe_count(owner.device);
+    CHECK(pipe_claim(owner.device, 3, epoch));
+
+    CHECK_EQUAL(pipe_revoke_all(owner.device), 0x9u);
+    CHECK_EQUAL(pipe_claimed_mask(owner.device), 0u);
+    CHECK_EQUAL(owner.active_pipe_count(), 1);
+
+    // the old owner can not release the pipe of the new owner
+    CHECK(pipe_claim(owner.device, 0, new_epoch));
+    CHECK_EQUAL(new_epoch, epoch + 1);
+    CHECK(!pipe_release(owner.device, 0, epoch));
+    CHECK_EQUAL(pipe_claimed_mask(owner.device), 0x1u);
+    CHECK(pipe_release(owner.device, 0, new_epoch));
+
+    // nothing to revoke
+    CHECK_EQUAL(pipe_revoke_all(owner.device), 0u);
+}
+
+TEST(one_reselect_at_a_time) {
+    owner_device owner;
+
+    CHECK(pipe_begin_reselect(owner.device));
+
+    // the watchdog and the application can not both replace the pipes
+    CHECK(!pipe_begin_reselect(owner.device));
+    CHECK(!pipe_handle_open(owner.device));
+
+    pipe_end_reselect(owner.device);
+
+    // a open handle blocks the reselect
+    CHECK(pipe_handle_open(owner.device));
+    CHECK(!pipe_begin_reselect(owner.device));
+
+    pipe_handle_close(owner.device);
+    CHECK(pipe_begin_reselect(owner.device));
+    pipe_end_reselect(owner.device);
+}
+
+static NTSTATUS set_alternate_setting(fake_usb_device& Fake, fake_usb_handle& Handle, ULONG Setting) {
+    usb_chief_vendor_request request = {};
+    request.request = Setting;
+
+    return Fake.ioctl(&Handle, ioctl_set_alternate_setting, &request, sizeof(request), sizeof(request));
+}
+
+TEST(new_setting_waits_for_the_pipe_handles) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    fake_usb_handle control;
+    fake_usb_handle pipe;
+    fake_usb_handle fanout;
+
+    CHECK_EQUAL(fake.open(control, L""), STATUS_SUCCESS);
+    CHECK_EQUAL(fake.open(pipe, L"\\PIPE00"), STATUS_SUCCESS);
+
+    // the handle points at the pipe of the first setting. The setting
+    // is not replaced under it
+    CHECK_EQUAL(set_alternate_setting(fake, control, 1), STATUS_DEVICE_BUSY);
+    CHECK_EQUAL(fake.select_configurations, 1u);
+
+    UCHAR data[1024] = {};
+    CHECK_EQUAL(fake.read(pipe, data, sizeof(data)), STATUS_SUCCESS);
+
+    fake.close(pipe);
+
+    // the same for a fan-out handle
+    CHECK_EQUAL(fake.open(fanout, L"\\PIPE00\\FANOUT"), STATUS_SUCCESS);
+    CHECK_EQUAL(set_alternate_setting(fake, control, 1), STATUS_DEVICE_BUSY);
+    fake.close(fanout);
+
+    // without pipe handles the pipes are replaced
+    CHECK_EQUAL(set_alternate_setting(fake, control, 1), STATUS_SUCCESS);
+    CHECK_EQUAL(fake.select_configurations, 2u);
+    CHECK_EQUAL(fake.extension()->usb_interface_info->Pipes[0].MaximumPacketSize, 1024u);
+
+    // and the new handles use the new pipes
+    CHECK_EQUAL(fake.open(pipe, L"\\PIPE00"), STATUS_SUCCESS);
+    CHECK(pipe.file.FsContext == &fake.extension()->usb_interface_info->Pipes[0]);
+    CHECK_EQUAL(fake.read(pipe, data, sizeof(data)), STATUS_SUCCESS);
+
+    fake.close(pipe);
+    fake.close(control);
+}
+
+/**
+ * @brief Result of a thread of the stress test. Checked on the main
+ * thread, the checks are not thread safe
+ *
+ */
+struct owner_stats {
+    uint64_t claims = 0;
+    uint64_t releases = 0;
+    uint64_t lost = 0;
+    uint64_t revoked = 0;
+    uint64_t revokes = 0;
+    bool exclusive = true;
+    bool epochs_increase = true;
+};
+
+// the owner of a pipe in a epoch. Owner 0 is a released pipe
+static uint64_t owner_token(ULONG Epoch, ULONG Owner) {
+    return (static_cast<uint64_t>(Epoch) << 32) | Owner;
+}
+
+TEST(stress_claim_release_revoke) {
+    owner_device owner;
+
+    // the epoch and the thread that owns every pipe as seen by the 
+    // threads. A new owner may only replace a owner of a older epoch,
+    // that one was revoked
+    std::atomic<uint64_t> holders[test_pipes];
+
+    for (auto& holder : holders) {
+        holder = 0;
+    }
+
+    std::atomic<bool> running(true);
+    std::vector<owner_stats> stats(test_threads + 1);
+    std::vector<std::thread> threads;
+
+    for (ULONG t = 0; t < test_threads; t++) {
+        threads.emplace_back([&, t] {
+            owner_stats& result = stats[t];
+            ULONG last_epoch = 0;
+
+            for (ULONG i = 0; i < test_iterations; i++) {
+                const ULONG index = (t + i) % test_pipes;
+                ULONG epoch = 0;
+
+                // the same order as mj_create
+                increment_active_pipe_count(owner.device);
+
+                if (!pipe_claim(owner.device, index, epoch)) {
+                    decrement_active_pipe_count(owner.device);
+                    continue;
+                }
+
+                result.claims++;
+                result.epochs_increase = result.epochs_increase && epoch >= last_epoch;
+                last_epoch = epoch;
+
+                // take the slot of the pipe. A token of a newer epoch
+                // means we were revoked already
+                const uint64_t token = owner_token(epoch, t + 1);
+                uint64_t previous = holders[index].load();
+
+                while ((previous >> 32) <= epoch) {
+                    // a other owner in the same epoch
+                    if ((previous >> 32) == epoch && (previous & 0xffffffff)) {
+                        result.exclusive = false;
+                        break;
+                    }
+
+                    if (holders[index].compare_exchange_weak(previous, token)) {
+                        break;
+                    }
+                }
+
+                // let the others run while we own the pipe
+                if (!(i % 8)) {
+                    std::this_thread::yield();
+                }
+
+                // give up the slot before the pipe so the next owner
+                // finds it free. Keep the epoch so a revoked owner
+                // does not take it anymore
+                uint64_t expected = token;
+                const bool still_holder = holders[index].compare_exchange_strong(expected, owner_token(epoch, 0));
+
+                // the same order as mj_cleanup
+                if (pipe_release(owner.device, index, epoch)) {
+                    decrement_active_pipe_count(owner.device);
+                    result.releases++;
+
+                    result.exclusive = result.exclusive && still_holder;
+                }
+                else {
+                    result.lost++;
+                }
+
+                // the threads revoke too, the revoke thread does not
+                // get much time on a machine with few cores
+                if (!(i % 97)) {
+                    result.revokes++;
+                    result.revoked += static_cast<uint64_t>(__builtin_popcount(pipe_revoke_all(owner.device)));
+                }
+            }
+        });
+    }
+
+    // revoke all the owners while the threads claim, like a abort or
+    // a new alternate setting
+    threads.emplace_back([&] {
+        owner_stats& result = stats[test_threads];
+
+        while (running) {
+            const ULONG mask = pipe_revoke_all(owner.device);
+
+            result.revokes++;
+            result.revoked += static_cast<uint64_t>(__builtin_popcount(mask));
+
+            std::this_thread::yield();
+        }
+    });
+
+    for (ULONG t = 0; t < test_threads; t++) {
+        threads[t].join();
+    }
+
+    running = false;
+    threads.back().join();
+
+    owner_stats total;
+
+    for (const owner_stats& result : stats) {
+        total.claims += result.claims;
+        total.releases += result.releases;
+        total.lost += result.lost;
+        total.revoked += result.revoked;
+        total.revokes += result.revokes;
+        total.exclusive = total.exclusive && result.exclusive;
+        total.epochs_increase = total.epochs_increase && result.epochs_increase;
+    }
+
+    printf("  %llu claims, %llu releases, %llu revoked in %llu revokes\n",
+        static_cast<unsigned long long>(total.claims), static_cast<unsigned long long>(total.releases),
+        static_cast<unsigned long long>(total.revoked), static_cast<unsigned long long>(total.revokes));
+
+    CHECK(total.exclusive);
+    CHECK(total.epochs_increase);
+
+    // every claim ends with exactly one release or revoke
+    CHECK_EQUAL(pipe_claimed_mask(owner.device), 0u);
+    CHECK_EQUAL(total.claims, total.releases + total.revoked);
+    CHECK_EQUAL(total.lost, total.revoked);
+
+    // and the pipe count is back where it started
+    CHECK_EQUAL(owner.active_pipe_count(), 1);
+
+    // the test means nothing when the threads never met
+    CHECK(total.claims > test_iterations);
+    CHECK(total.revokes > 0);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
@@ -0,0 +1,216 @@
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <vector>
+
+#include "shim.hpp"
+#include "chief/pipe.hpp"
+
+/**
+ * @brief Adaptive against fixed bulk in transfer sizes on a simulated
+ * bursty device. The device has a fifo with a latency timer like the
+ * usb serial chips: a transfer completes when the fifo has enough data
+ * to fill it, or short with what the fifo has when the timer expired
+ * since the last transfer. The data comes in bursts at a high rate
+ * with sparse traffic in between. A big transfer needs less
+ * completions in a burst, a small one returns the data sooner. The
+ * adaptive size is picked by the sizing of the driver. It settles where
+ * the transfers start to come back short, so it lands on the curve of
+ * the fixed sizes next to the one with the same completions. The ramp
+ * after a burst starts costs it some latency, it does not beat that size
+ *
+ * usage: pipe_sizing_bench [simulated seconds]
+ *
+ */
+
+// the time step of the simulation in microseconds
+constexpr static double bench_step = 10;
+
+// the latency timer of the device in microseconds
+constexpr static double bench_latency_timer = 16000;
+
+// the data rate in bytes per microsecond in and between the bursts
+constexpr static double bench_burst_rate = 8;
+constexpr static double bench_sparse_rate = 0.04;
+
+// the bounds of the transfer size
+constexpr static ULONG bench_packet_size = 512;
+constexpr static ULONG bench_max_size = 64 * 1024;
+
+/**
+ * @brief The data rate in every step. The same for every run
+ *
+ * @param Steps
+ * @return std::vector<double>
+ */
+static std::vector<double> bursty_workload(size_t Steps) {
+    std::vector<double> rates(Steps);
+    unsigned long long seed = 0x2545f4914f6cdd1dull;
+
+    // a simple lcg so every platform gets the same workload
+    auto next = [&](ULONG Min, ULONG Max) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        return Min + static_cast<ULONG>((seed >> 33) % (Max - Min + 1));
+    };
+
+    size_t step = 0;
+
+    while (step < Steps) {
+        // a burst of 5 to 30 ms and a pause of 20 to 200 ms
+        const size_t burst = next(5000, 30000) / static_cast<ULONG>(bench_step);
+        const size_t pause = next(20000, 200000) / static_cast<ULONG>(bench_step);
+
+        for (size_t i = 0; i < burst && step < Steps; i++) {
+            rates[step++] = bench_burst_rate;
+        }
+
+        for (size_t i = 0; i < pause && step < Steps; i++) {
+            rates[step++] = bench_sparse_rate;
+        }
+    }
+
+    return rates;
+}
+
+/**
+ * @brief The result of a run
+ *
+ */
+struct sizing_result {
+    double completions = 0;
+    double bytes = 0;
+    double latency = 0;
+    double short_transfers = 0;
+};
+
+/**
+ * @brief Run the workload with a fixed size or with the adaptive size
+ * of a pipe state
+ *
+ * @param Rates
+ * @param Size the fixed size. Not used with a state
+ * @param State the pipe state with the adaptive sizing. Can be nullptr
+ * @return sizing_result
+ */
+static sizing_result run(const std::vector<double>& Rates, ULONG Size, pipe_state* State) {
+    // the data in the fifo and the time it arrived
+    struct chunk {
+        double bytes;
+        double time;
+    };
+
+    std::deque<chunk> fifo;
+    double queued = 0;
+    double last_completion = 0;
+
+    sizing_result result;
+
+    bool adaptive = false;
+    ULONG size = State ? pipe_state_transfer_size(State, bench_max_size, adaptive) : Size;
+
+    for (size_t step = 0; step < Rates.size(); step++) {
+        const double now = step * bench_step;
+
+        fifo.push_back({ Rates[step] * bench_step, now });
+        queued += Rates[step] * bench_step;
+
+        // complete the transfers the fifo can fill or the timer ends
+        while (queued >= size || (queued >= 1 && now - last_completion >= bench_latency_timer)) {
+            double wanted = (queued >= size) ? size : queued;
+            const double transferred = wanted;
+
+            // the data leaves the fifo in order
+            while (wanted > 0 && !fifo.empty()) {
+                chunk& front = fifo.front();
+                const double taken = (front.bytes < wanted) ? front.bytes : wanted;
+
+                result.latency += taken * (now - front.time);
+                front.bytes -= taken;
+                wanted -= taken;
+
+                if (front.bytes <= 0) {
+                    fifo.pop_front();
+                }
+            }
+
+            queued -= transferred;
+            last_completion = now;
+
+            result.completions++;
+            result.bytes += transferred;
+            result.short_transfers += (transferred < size) ? 1 : 0;
+
+            if (State) {
+                pipe_state_complete(State, size, static_cast<ULONG>(transferred), STATUS_SUCCESS, adaptive);
+                size = pipe_state_transfer_size(State, bench_max_size, adaptive);
+            }
+        }
+    }
+
+    return result;
+}
+
+static void print(const char* Name, const sizing_result& Result, double Seconds) {
+    printf("%-10s %12.0f %12.3f %9.1f%%\n", Name, Result.completions / Seconds,
+        (Result.latency / Result.bytes) / 1000, (100 * Result.short_transfers) / Result.completions);
+}
+
+int main(int argc, char** argv) {
+    const unsigned long argument = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 60;
+    const double seconds = argument ? argument : 1;
+
+    const std::vector<double> rates = bursty_workload(static_cast<size_t>((seconds * 1e6) / bench_step));
+
+    printf("%.0f s of bursts at %.0f MB/s and sparse data at %.0f KB/s, %.0f ms latency timer\n",
+        seconds, bench_burst_rate, bench_sparse_rate * 1000, bench_latency_timer / 1000);
+    printf("size        completions/s  latency ms    short\n");
+
+    std::vector<sizing_result> fixed;
+
+    for (ULONG size = bench_packet_size; size <= bench_max_size; size *= 2) {
+        fixed.push_back(run(rates, size, nullptr));
+
+        char name[16];
+        snprintf(name, sizeof(name), "%lu", static_cast<unsigned long>(size));
+
+        print(name, fixed.back(), seconds);
+    }
+
+    // the state of a pipe with the full range of sizes
+    pipe_state state = {};
+    KeInitializeSpinLock(&state.lock);
+
+    state.flags = chief_pipe_sizing_adaptive;
+    state.packet_size = bench_packet_size;
+    state.min_size = bench_packet_size;
+    state.max_size = bench_max_size;
+    state.transfer_size = bench_max_size;
+    state.fill_ratio = chief_fill_ratio_scale / 2;
+
+    const sizing_result adaptive = run(rates, 0, &state);
+    print("adaptive", adaptive, seconds);
+
+    // the best fixed size with the same completion budget is the
+    // smallest one that needs no more completions than the adaptive
+    // size. The adaptive size wins when it has less latency
+    sizing_result best;
+    ULONG best_size = 0;
+
+    for (ULONG size = bench_packet_size; size <= bench_max_size; size += bench_packet_size) {
+        best = run(rates, size, nullptr);
+        best_size = size;
+
+        if (best.completions <= adaptive.completions) {
+            break;
+        }
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "%lu", static_cast<unsigned long>(best_size));
+    print(name, best, seconds);
+
+    printf("adaptive latency is %.0f%% of the best fixed size with the same completions\n",
+        (100 * adaptive.latency / adaptive.bytes) / (best.latency / best.bytes));
+
+    return 0;
+}
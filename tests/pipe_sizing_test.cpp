@@ -0,0 +1,204 @@
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+#include "chief/pipe.hpp"
+
+// the bounds of the adaptive size in the tests. The fake has 512 byte
+// packets in the first setting, the usb stack takes transfers up to 
+// the default maximum transfer size
+constexpr static ULONG test_packet_size = 512;
+constexpr static ULONG test_max_size = PAGE_SIZE;
+
+/**
+ * @brief A started fake with a handle on the bulk in pipe
+ *
+ */
+struct sizing_pipe {
+    fake_usb_device fake;
+    fake_usb_handle pipe;
+
+    sizing_pipe() {
+        fake.start();
+        fake.open(pipe, L"\\PIPE00");
+    }
+
+    ~sizing_pipe() {
+        fake.close(pipe);
+    }
+
+    NTSTATUS configure(ULONG Pipe, ULONG Flags, ULONG MinSize, ULONG MaxSize) {
+        usb_chief_pipe_sizing sizing = { Pipe, Flags, MinSize, MaxSize };
+
+        return fake.ioctl(&pipe, ioctl_configure_pipe_sizing, &sizing, sizeof(sizing), 0);
+    }
+
+    usb_chief_pipe_stats stats() {
+        usb_chief_pipe_stats result = {};
+        fake.ioctl(&pipe, ioctl_get_pipe_stats, &result, sizeof(result.pipe), sizeof(result));
+
+        return result;
+    }
+
+    pipe_state* state() {
+        return get_pipe_state(fake.device, 0);
+    }
+
+    // complete transfers with the adaptive size that return the fill
+    // ratio of the size
+    void complete(ULONG Count, ULONG Numerator, ULONG Denominator) {
+        for (ULONG i = 0; i < Count; i++) {
+            bool adaptive = false;
+            const ULONG size = pipe_state_transfer_size(state(), test_max_size, adaptive);
+
+            pipe_state_complete(state(), size, (size * Numerator) / Denominator, STATUS_SUCCESS, adaptive);
+        }
+    }
+};
+
+TEST(fixed_size_uses_the_user_buffer) {
+    sizing_pipe test;
+    bool adaptive = true;
+
+    CHECK_EQUAL(pipe_state_transfer_size(test.state(), 3000, adaptive), 3000u);
+    CHECK(!adaptive);
+
+    // a pipe without a state is never limited
+    CHECK_EQUAL(pipe_state_transfer_size(nullptr, 3000, adaptive), 3000u);
+    CHECK(!adaptive);
+}
+
+TEST(size_follows_the_fill_ratio) {
+    sizing_pipe test;
+    CHECK_EQUAL(test.configure(0, chief_pipe_sizing_adaptive, 0, test_max_size), STATUS_SUCCESS);
+
+    // the current size is kept in the new bounds
+    CHECK_EQUAL(test.stats().transfer_size, test_max_size);
+    CHECK_EQUAL(test.stats().min_size, test_packet_size);
+
+    // sparse traffic halves the size until it hits the bound
+    test.complete(64, 1, 16);
+    CHECK_EQUAL(test.stats().transfer_size, test_packet_size);
+
+    // a smaller user buffer is not limited and does not count
+    bool adaptive = true;
+    CHECK_EQUAL(pipe_state_transfer_size(test.state(), 100, adaptive), 100u);
+    CHECK(!adaptive);
+
+    // full transfers double it back to the other bound
+    test.complete(64, 1, 1);
+    CHECK_EQUAL(test.stats().transfer_size, test_max_size);
+
+    // a half full transfer is what we want. The size stays
+    test.complete(64, 1, 2);
+    CHECK_EQUAL(test.stats().transfer_size, test_max_size);
+}
+
+TEST(size_changes_one_step_at_a_time) {
+    sizing_pipe test;
+    CHECK_EQUAL(test.configure(0, chief_pipe_sizing_adaptive, 0, test_max_size), STATUS_SUCCESS);
+
+    ULONG size = test_max_size;
+    ULONG steps = 0;
+
+    // every change halves the size and starts the average again
+    for (ULONG i = 0; i < 64 && size > test_packet_size; i++) {
+        test.complete(1, 0, 1);
+
+        const ULONG next = test.stats().transfer_size;
+
+        if (next != size) {
+            CHECK_EQUAL(next, size / 2);
+            CHECK_EQUAL(test.stats().fill_ratio, chief_fill_ratio_scale / 2);
+
+            size = next;
+            steps++;
+        }
+    }
+
+    CHECK_EQUAL(size, test_packet_size);
+    CHECK_EQUAL(steps, 3u);
+}
+
+TEST(failed_transfers_keep_the_size) {
+    sizing_pipe test;
+    CHECK_EQUAL(test.configure(0, chief_pipe_sizing_adaptive, 0, test_max_size), STATUS_SUCCESS);
+
+    for (ULONG i = 0; i < 64; i++) {
+        pipe_state_complete(test.state(), test_max_size, 0, STATUS_CANCELLED, true);
+
+        // and transfers with the size of the user buffer
+        pipe_state_complete(test.state(), 100, 0, STATUS_SUCCESS, false);
+    }
+
+    const usb_chief_pipe_stats stats = test.stats();
+    CHECK_EQUAL(stats.transfer_size, test_max_size);
+    CHECK_EQUAL(stats.transfers, 128u);
+    CHECK_EQUAL(stats.errors, 64u);
+    CHECK_EQUAL(stats.short_transfers, 64u);
+    CHECK_EQUAL(stats.bytes, 0u);
+}
+
+TEST(configure_checks_the_bounds) {
+    sizing_pipe test;
+
+    // unknown flags, inverted bounds and a pipe that does not exist
+    CHECK_EQUAL(test.configure(0, 0x80, 0, 0), STATUS_INVALID_PARAMETER);
+    CHECK_EQUAL(test.configure(0, chief_pipe_sizing_adaptive, 4096, 1024), STATUS_INVALID_PARAMETER);
+    CHECK_EQUAL(test.configure(0, chief_pipe_sizing_adaptive, 0, test_max_size * 2), STATUS_INVALID_PARAMETER);
+    CHECK_EQUAL(test.configure(fake_usb_pipes, chief_pipe_sizing_adaptive, 0, 0), STATUS_INVALID_PARAMETER);
+
+    // the sizes are rounded down to the packet size
+    CHECK_EQUAL(test.configure(0, chief_pipe_sizing_adaptive, 1000, 3000), STATUS_SUCCESS);
+
+    const usb_chief_pipe_stats stats = test.stats();
+    CHECK_EQUAL(stats.flags, static_cast<ULONG>(chief_pipe_sizing_adaptive));
+    CHECK_EQUAL(stats.min_size, 512u);
+    CHECK_EQUAL(stats.max_size, 2560u);
+    CHECK_EQUAL(stats.transfer_size, 2560u);
+}
+
+TEST(reads_use_the_adaptive_size) {
+    sizing_pipe test;
+    CHECK_EQUAL(test.configure(0, chief_pipe_sizing_adaptive, 0, test_max_size), STATUS_SUCCESS);
+
+    std::vector<UCHAR> buffer(test_max_size);
+    ULONG_PTR information = 0;
+
+    // the device sends small messages
+    test.fake.bulk_in_length = 64;
+
+    for (ULONG i = 0; i < 32; i++) {
+        CHECK_EQUAL(test.fake.read(test.pipe, buffer.data(), test_max_size, &information), STATUS_SUCCESS);
+        CHECK_EQUAL(information, 64u);
+    }
+
+    usb_chief_pipe_stats stats = test.stats();
+    CHECK_EQUAL(stats.transfer_size, test_packet_size);
+    CHECK_EQUAL(stats.transfers, 32u);
+    CHECK_EQUAL(stats.short_transfers, 32u);
+    CHECK_EQUAL(stats.bytes, 32u * 64);
+
+    // a read gets at most the adaptive size, the device fills it
+    test.fake.bulk_in_length = 0;
+
+    CHECK_EQUAL(test.fake.read(test.pipe, buffer.data(), test_max_size, &information), STATUS_SUCCESS);
+    CHECK_EQUAL(information, test_packet_size);
+
+    // a stream of data grows it back
+    for (ULONG i = 0; i < 32; i++) {
+        test.fake.read(test.pipe, buffer.data(), test_max_size, &information);
+    }
+
+    CHECK_EQUAL(information, test_max_size);
+    CHECK_EQUAL(test.stats().transfer_size, test_max_size);
+
+    // a fixed pipe reads the whole buffer again
+    CHECK_EQUAL(test.configure(0, 0, 0, 0), STATUS_SUCCESS);
+    test.fake.read(test.pipe, buffer.data(), 3000, &information);
+    CHECK_EQUAL(information, 3000u);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
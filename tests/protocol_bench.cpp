@@ -0,0 +1,106 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "loopback_device.hpp"
+#include "chief/protocol.hpp"
+
+/**
+ * @brief Throughput of the linux backend without a device. Streams a
+ * loopback device with usbfs_stream for a few urb sizes and amounts,
+ * and downloads a image through protocol_download_image to a
+ * transport that only copies. Shows the cost of the host side so it
+ * can be compared with the line rate of the device
+ *
+ * usage: protocol_bench [megabytes]
+ *
+ */
+
+// transport that takes every chunk without looking at it
+struct null_transport {
+    uint64_t bytes = 0;
+
+    long read_image(const void* Image, unsigned long Offset, void* Buffer, unsigned long Length) {
+        memcpy(Buffer, static_cast<const uint8_t*>(Image) + Offset, Length);
+
+        return 0;
+    }
+
+    long control(const chief_setup_packet& Setup, void*, unsigned long& OutLength) {
+        OutLength = Setup.length;
+        bytes += Setup.length;
+
+        return 0;
+    }
+};
+
+static double seconds_since(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    const unsigned long megabytes = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 1024;
+    const uint64_t total = static_cast<uint64_t>(megabytes ? megabytes : 1) * 1024 * 1024;
+
+    printf("stream of %lu MB\n", megabytes);
+    printf("urbs  urb size  MB/s      reaps/s\n");
+
+    const unsigned long counts[] = { 2, 8, 32 };
+    const unsigned long sizes[] = { 4 * 1024, 64 * 1024, 512 * 1024 };
+
+    for (unsigned long count : counts) {
+        for (unsigned long size : sizes) {
+            loopback_device device;
+            loopback_checker checker;
+            usbfs_stream_stats stats;
+
+            const auto start = std::chrono::steady_clock::now();
+
+            // only check the first urbs, the check costs more than the pump
+            usbfs_stream(device, 1, count, size, 0, [&](const usbdevfs_urb& urb) {
+                if (stats.transfers <= count) {
+                    checker.check(static_cast<const uint8_t*>(urb.buffer), static_cast<size_t>(urb.actual_length));
+                }
+
+                return stats.bytes < total;
+            }, stats);
+
+            const double elapsed = seconds_since(start);
+
+            if (!checker.valid) {
+                printf("the stream is corrupt\n");
+                return 1;
+            }
+
+            printf("%-5lu %-9lu %-9.1f %.0f\n", count, size, stats.bytes / elapsed / (1024.0 * 1024.0), device.reaps / elapsed);
+        }
+    }
+
+    // the image download is limited by the control requests of the
+    // device, this only shows that the host side is not
+    std::vector<uint8_t> image(static_cast<size_t>(total < 64 * 1024 * 1024 ? total : 64 * 1024 * 1024));
+    std::vector<uint8_t> bounce(chief_max_image_chunk_length);
+
+    usb_chief_image_download download = {};
+    download.chunk_length = static_cast<unsigned short>(chief_max_image_chunk_length);
+    download.flags = chief_image_flag_address;
+    download.length = static_cast<unsigned long>(image.size());
+    download.data = image.data();
+
+    null_transport transport;
+    unsigned long transferred = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    const long status = protocol_download_image(transport, download, bounce.data(), transferred);
+    const double elapsed = seconds_since(start);
+
+    if (status < 0 || transferred != image.size()) {
+        printf("the download failed\n");
+        return 1;
+    }
+
+    printf("image download: %.1f MB/s in %lu byte chunks\n", transferred / elapsed / (1024.0 * 1024.0), chief_max_image_chunk_length);
+
+    return 0;
+}
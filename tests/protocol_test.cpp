@@ -0,0 +1,313 @@
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+
+#include "test.hpp"
+#include "loopback_transport.hpp"
+
+static usb_chief_image_download make_download(const std::vector<uint8_t>& Image, unsigned short ChunkLength) {
+    usb_chief_image_download download = {};
+    download.request = 0xa0;
+    download.chunk_length = ChunkLength;
+    download.length = static_cast<unsigned long>(Image.size());
+    download.data = Image.data();
+
+    return download;
+}
+
+static std::vector<uint8_t> make_image(size_t Size) {
+    std::vector<uint8_t> image(Size);
+
+    for (size_t i = 0; i < Size; i++) {
+        image[i] = static_cast<uint8_t>((i * 7) ^ (i >> 8));
+    }
+
+    return image;
+}
+
+TEST(setup_packet) {
+    const chief_setup_packet in = protocol_vendor_setup(true, 0x12, 0x3456, 0x789a, 64);
+    const chief_setup_packet out = protocol_vendor_setup(false, 0x12, 0x3456, 0x789a, 64);
+
+    CHECK_EQUAL(in.request_type, chief_request_type_vendor_in);
+    CHECK_EQUAL(out.request_type, chief_request_type_vendor_out);
+    CHECK(protocol_setup_is_in(in));
+    CHECK(!protocol_setup_is_in(out));
+    CHECK_EQUAL(in.request, 0x12);
+    CHECK_EQUAL(in.value, 0x3456);
+    CHECK_EQUAL(in.index, 0x789a);
+    CHECK_EQUAL(in.length, 64);
+}
+
+TEST(download_valid) {
+    const std::vector<uint8_t> image = make_image(16);
+    usb_chief_image_download download = make_download(image, 8);
+
+    CHECK(protocol_image_download_valid(download));
+
+    download.chunk_length = 0;
+    CHECK(!protocol_image_download_valid(download));
+
+    download.chunk_length = static_cast<unsigned short>(chief_max_image_chunk_length + 1);
+    CHECK(!protocol_image_download_valid(download));
+
+    download.chunk_length = 8;
+    download.reserved = 1;
+    CHECK(!protocol_image_download_valid(download));
+
+    // a image without data is only valid when it is empty
+    download.reserved = 0;
+    download.data = nullptr;
+    CHECK(!protocol_image_download_valid(download));
+
+    download.length = 0;
+    CHECK(protocol_image_download_valid(download));
+}
+
+TEST(download_chunks) {
+    // the last chunk is shorter than the others
+    const std::vector<uint8_t> image = make_image(10000);
+    usb_chief_image_download download = make_download(image, 4096);
+    download.value = 0x10;
+    download.index = 0x20;
+    download.value_step = 1;
+    download.index_step = 2;
+
+    loopback_transport transport;
+    std::vector<uint8_t> bounce(download.chunk_length);
+    unsigned long transferred = 0;
+
+    CHECK_EQUAL(protocol_download_image(transport, download, bounce.data(), transferred), 0);
+    CHECK_EQUAL(transferred, 10000ul);
+
+    REQUIRE(transport.requests.size() == 3);
+    CHECK_EQUAL(transport.requests[0].length, 4096);
+    CHECK_EQUAL(transport.requests[1].length, 4096);
+    CHECK_EQUAL(transport.requests[2].length, 10000 - 8192);
+
+    for (size_t i = 0; i < transport.requests.size(); i++) {
+        const chief_setup_packet& setup = transport.requests[i];
+
+        CHECK_EQUAL(setup.request_type, chief_request_type_vendor_out);
+        CHECK_EQUAL(setup.request, 0xa0);
+        CHECK_EQUAL(setup.value, 0x10 + i);
+        CHECK_EQUAL(setup.index, 0x20 + (i * 2));
+    }
+
+    // the device got every byte in order
+    CHECK(transport.received == image);
+}
+
+TEST(download_address_carry) {
+    // the chunks cross the 64k boundary of the value
+    const std::vector<uint8_t> image = make_image(3 * 1024);
+    usb_chief_image_download download = make_download(image, 1024);
+    download.flags = chief_image_flag_address;
+    download.value = 0xfc00;
+    download.index = 0x0001;
+
+    loopback_transport transport;
+    std::vector<uint8_t> bounce(download.chunk_length);
+    unsigned long transferred = 0;
+
+    CHECK_EQUAL(protocol_download_image(transport, download, bounce.data(), transferred), 0);
+
+    REQUIRE(transport.requests.size() == 3);
+    CHECK_EQUAL(transport.requests[0].value, 0xfc00);
+    CHECK_EQUAL(transport.requests[0].index, 0x0001);
+    CHECK_EQUAL(transport.requests[1].value, 0x0000);
+    CHECK_EQUAL(transport.requests[1].index, 0x0002);
+    CHECK_EQUAL(transport.requests[2].value, 0x0400);
+    CHECK_EQUAL(transport.requests[2].index, 0x0002);
+
+    // the loopback stored every chunk at its address
+    CHECK(transport.memory_at(0x1fc00, image.size()) == image);
+}
+
+TEST(download_address_wraps) {
+    // the address wraps at 4GB instead of carrying out of the index
+    const std::vector<uint8_t> image = make_image(2 * 512);
+    usb_chief_image_download download = make_download(image, 512);
+    download.flags = chief_image_flag_address;
+    download.value = 0xfe00;
+    download.index = 0xffff;
+
+    loopback_transport transport;
+    std::vector<uint8_t> bounce(download.chunk_length);
+    unsigned long transferred = 0;
+
+    CHECK_EQUAL(protocol_download_image(transport, download, bounce.data(), transferred), 0);
+
+    REQUIRE(transport.requests.size() == 2);
+    CHECK_EQUAL(transport.requests[1].value, 0x0000);
+    CHECK_EQUAL(transport.requests[1].index, 0x0000);
+}
+
+TEST(download_stops_on_control_error) {
+    const std::vector<uint8_t> image = make_image(5 * 256);
+    usb_chief_image_download download = make_download(image, 256);
+
+    loopback_transport transport;
+    transport.fail_request = 2;
+    transport.fail_status = -EPIPE;
+
+    std::vector<uint8_t> bounce(download.chunk_length);
+    unsigned long transferred = 0;
+
+    CHECK_EQUAL(protocol_download_image(transport, download, bounce.data(), transferred), -EPIPE);
+
+    // the offset of the failing chunk, nothing is sent after it
+    CHECK_EQUAL(transferred, 2 * 256ul);
+    CHECK_EQUAL(transport.requests.size(), 3u);
+    CHECK_EQUAL(transport.received.size(), 2 * 256u);
+}
+
+TEST(download_stops_on_read_error) {
+    const std::vector<uint8_t> image = make_image(4 * 128);
+    usb_chief_image_download download = make_download(image, 128);
+
+    loopback_transport transport;
+    transport.fail_read_offset = 3 * 128;
+    transport.fail_status = -EFAULT;
+
+    std::vector<uint8_t> bounce(download.chunk_length);
+    unsigned long transferred = 0;
+
+    CHECK_EQUAL(protocol_download_image(transport, download, bounce.data(), transferred), -EFAULT);
+    CHECK_EQUAL(transferred, 3 * 128ul);
+    CHECK_EQUAL(transport.requests.size(), 3u);
+}
+
+TEST(download_empty) {
+    usb_chief_image_download download = {};
+    download.chunk_length = 64;
+
+    loopback_transport transport;
+    uint8_t bounce[64];
+    unsigned long transferred = 1;
+
+    CHECK_EQUAL(protocol_download_image(transport, download, bounce, transferred), 0);
+    CHECK_EQUAL(transferred, 0ul);
+    CHECK(transport.requests.empty());
+}
+
+/**
+ * @brief A configuration descriptor like the one of the device. The
+ * interface has a alternate setting 0 and 1 with a bulk in, a bulk out
+ * and a interrupt in endpoint, and a setting 2 we do not support. A
+ * class descriptor sits between the interface and the endpoints
+ *
+ */
+static std::vector<uint8_t> make_configuration() {
+    std::vector<uint8_t> data = { 9, chief_descriptor_configuration, 0, 0, 1, 1, 0, 0x80, 50 };
+
+    for (uint8_t setting = 0; setting < 3; setting++) {
+        const uint8_t packet = setting ? 0x04 : 0x02;
+
+        const std::vector<uint8_t> descriptors = {
+            9, chief_descriptor_interface, chief_interface_number, setting, 3, 0xff, 0, 0, 0,
+            6, 0x21, 0x10, 0x01, 0, 1,
+            7, chief_descriptor_endpoint, 0x81, chief_endpoint_type_bulk, 0x00, packet, 0,
+            7, chief_descriptor_endpoint, 0x02, chief_endpoint_type_bulk, 0x00, packet, 0,
+            7, chief_descriptor_endpoint, 0x83, 0x03, 0x40, 0x00, 4,
+        };
+
+        data.insert(data.end(), descriptors.begin(), descriptors.end());
+    }
+
+    data[2] = static_cast<uint8_t>(data.size() & 0xff);
+    data[3] = static_cast<uint8_t>(data.size() >> 8);
+
+    return data;
+}
+
+static bool find_setting(const std::vector<uint8_t>& Configuration, unsigned long Setting, chief_interface_setting& OutSetting) {
+    return protocol_find_setting(Configuration.data(), static_cast<unsigned long>(Configuration.size()), Setting, OutSetting);
+}
+
+TEST(find_setting) {
+    const std::vector<uint8_t> configuration = make_configuration();
+    chief_interface_setting setting = {};
+
+    REQUIRE(find_setting(configuration, 0, setting));
+    CHECK_EQUAL(setting.offset, 9ul);
+    CHECK_EQUAL(setting.alternate_setting, 0);
+    CHECK_EQUAL(setting.endpoint_count, 3ul);
+
+    // the endpoints in the order of the descriptor
+    CHECK_EQUAL(setting.endpoints[0].address, 0x81);
+    CHECK_EQUAL(setting.endpoints[0].max_packet_size, 512);
+    CHECK(protocol_endpoint_is_bulk_in(setting.endpoints[0]));
+    CHECK_EQUAL(setting.endpoints[1].address, 0x02);
+    CHECK(!protocol_endpoint_is_bulk_in(setting.endpoints[1]));
+    CHECK_EQUAL(setting.endpoints[2].interval, 4);
+    CHECK(!protocol_endpoint_is_bulk_in(setting.endpoints[2]));
+
+    // the second setting has its own endpoints
+    REQUIRE(find_setting(configuration, 1, setting));
+    CHECK_EQUAL(setting.alternate_setting, 1);
+    CHECK_EQUAL(setting.endpoint_count, 3ul);
+    CHECK_EQUAL(setting.endpoints[0].max_packet_size, 1024);
+    CHECK_EQUAL(configuration[setting.offset + 1], chief_descriptor_interface);
+    CHECK_EQUAL(configuration[setting.offset + 3], 1);
+
+    // the device has a third setting but we do not support it
+    CHECK(!find_setting(configuration, chief_max_alternate_settings, setting));
+}
+
+TEST(find_setting_in_a_broken_descriptor) {
+    const std::vector<uint8_t> valid = make_configuration();
+    chief_interface_setting setting = {};
+
+    // not a configuration
+    std::vector<uint8_t> configuration = valid;
+    configuration[1] = chief_descriptor_interface;
+    CHECK(!find_setting(configuration, 0, setting));
+
+    // a descriptor with a length of 0 in the setting
+    configuration = valid;
+    configuration[9 + 9] = 0;
+    CHECK(!find_setting(configuration, 0, setting));
+
+    // a endpoint that goes past the end
+    configuration.assign(valid.begin(), valid.begin() + 9 + 9 + 6 + 7 + 7 + 3);
+    CHECK(!find_setting(configuration, 0, setting));
+
+    // the total length is longer than what we got, the setting is cut
+    configuration.assign(valid.begin(), valid.begin() + 9 + 9 + 6 + 7 + 7);
+    CHECK(!find_setting(configuration, 0, setting));
+
+    // the total length ends the descriptors before the second setting
+    configuration = valid;
+    configuration[2] = 9 + 9 + 6 + 7 + 7 + 7;
+    configuration[3] = 0;
+    CHECK(find_setting(configuration, 0, setting));
+    CHECK(!find_setting(configuration, 1, setting));
+
+    // the interface has more endpoints than the descriptors
+    configuration = valid;
+    configuration[9 + 4] = 4;
+    CHECK(!find_setting(configuration, 0, setting));
+
+    // a empty descriptor
+    CHECK(!protocol_find_setting(nullptr, 0, 0, setting));
+}
+
+TEST(select_setting) {
+    const std::vector<uint8_t> configuration = make_configuration();
+    chief_interface_setting setting = {};
+
+    loopback_transport transport;
+
+    REQUIRE(find_setting(configuration, 1, setting));
+    CHECK_EQUAL(protocol_select_setting(transport, configuration.data(), setting), 0);
+
+    // the transport gets the interface descriptor of the setting
+    CHECK(transport.settings == std::vector<unsigned char>({ 1 }));
+    CHECK(transport.setting_interface == configuration.data() + setting.offset);
+    CHECK(transport.requests.empty());
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
@@ -0,0 +1,183 @@
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+
+// the size of the registered buffers of the tests
+constexpr static ULONG test_buffer_size = 4096;
+
+/**
+ * @brief A started fake with a handle on the bulk in pipe and two
+ * buffers to register on it
+ *
+ */
+struct registered_pipe {
+    fake_usb_device fake;
+    fake_usb_handle pipe;
+    std::vector<UCHAR> buffers[2];
+
+    registered_pipe() {
+        fake.start();
+        fake.open(pipe, L"\\PIPE00");
+
+        for (std::vector<UCHAR>& buffer : buffers) {
+            buffer.assign(test_buffer_size, 0xcc);
+        }
+    }
+
+    NTSTATUS register_buffers(ULONG Count = 2) {
+        usb_chief_register_buffers request = {};
+        request.count = Count;
+
+        for (ULONG i = 0; i < Count && i < 2; i++) {
+            request.buffers[i] = { buffers[i].data(), test_buffer_size, 0 };
+        }
+
+        return fake.ioctl(&pipe, ioctl_register_buffers, &request, sizeof(request), 0);
+    }
+
+    NTSTATUS unregister_buffers() {
+        return fake.ioctl(&pipe, ioctl_unregister_buffers, nullptr, 0, 0);
+    }
+
+    fake_usb_request* begin_read(usb_chief_registered_transfer& Transfer) {
+        return fake.begin(&pipe, IRP_MJ_DEVICE_CONTROL, ioctl_read_registered, &Transfer, sizeof(Transfer), 0);
+    }
+
+    NTSTATUS read(ULONG Slot, ULONG Offset, ULONG Length, ULONG_PTR* Information = nullptr) {
+        usb_chief_registered_transfer transfer = { Slot, Offset, Length, 0 };
+
+        return fake.wait(begin_read(transfer), Information);
+    }
+};
+
+TEST(read_into_a_registered_buffer) {
+    registered_pipe test;
+
+    CHECK_EQUAL(test.register_buffers(), STATUS_SUCCESS);
+
+    // the read only writes its part of the buffer
+    ULONG_PTR information = 0;
+    CHECK_EQUAL(test.read(1, 100, 512, &information), STATUS_SUCCESS);
+    CHECK_EQUAL(information, 512u);
+
+    const std::vector<UCHAR>& buffer = test.buffers[1];
+    ULONG wrong = 0;
+
+    for (ULONG i = 0; i < test_buffer_size; i++) {
+        const bool inside = i >= 100 && i < 612;
+        wrong += (buffer[i] != (inside ? static_cast<UCHAR>(i - 100) : 0xcc)) ? 1 : 0;
+    }
+
+    CHECK_EQUAL(wrong, 0u);
+    CHECK(test.buffers[0] == std::vector<UCHAR>(test_buffer_size, 0xcc));
+
+    // the part should be inside a registered slot
+    CHECK_EQUAL(test.read(2, 0, 512), STATUS_INVALID_HANDLE);
+    CHECK_EQUAL(test.read(0, test_buffer_size, 1), STATUS_INVALID_PARAMETER);
+    CHECK_EQUAL(test.read(0, test_buffer_size - 511, 512), STATUS_INVALID_PARAMETER);
+    CHECK_EQUAL(test.read(0, 0, 0), STATUS_INVALID_PARAMETER);
+    CHECK_EQUAL(test.fake.bulk_transfers, 1u);
+
+    test.fake.close(test.pipe);
+}
+
+TEST(register_buffers) {
+    registered_pipe test;
+
+    // no buffers or too many
+    CHECK_EQUAL(test.register_buffers(0), STATUS_INVALID_PARAMETER);
+    CHECK_EQUAL(test.register_buffers(chief_max_registered_buffers + 1), STATUS_INVALID_PARAMETER);
+    CHECK_EQUAL(test.read(0, 0, 512), STATUS_INVALID_HANDLE);
+
+    // only one set at a time
+    CHECK_EQUAL(test.register_buffers(), STATUS_SUCCESS);
+    CHECK_EQUAL(test.register_buffers(), STATUS_DEVICE_BUSY);
+
+    CHECK_EQUAL(test.unregister_buffers(), STATUS_SUCCESS);
+    CHECK_EQUAL(test.read(0, 0, 512), STATUS_INVALID_HANDLE);
+    CHECK_EQUAL(test.register_buffers(1), STATUS_SUCCESS);
+    CHECK_EQUAL(test.read(1, 0, 512), STATUS_INVALID_HANDLE);
+
+    test.fake.close(test.pipe);
+
+    // a fan-out handle does not own the pipe, it has no buffers
+    fake_usb_handle fanout;
+    CHECK_EQUAL(test.fake.open(fanout, L"\\PIPE00\\FANOUT"), STATUS_SUCCESS);
+
+    usb_chief_register_buffers request = {};
+    request.count = 1;
+    request.buffers[0] = { test.buffers[1].data(), test_buffer_size, 0 };
+
+    CHECK_EQUAL(test.fake.ioctl(&fanout, ioctl_register_buffers, &request, sizeof(request), 0), STATUS_INVALID_HANDLE);
+
+    test.fake.close(fanout);
+}
+
+TEST(register_with_transfers_in_flight) {
+    registered_pipe test;
+    test.fake.hold_bulk = true;
+
+    // a normal read does not use the buffers
+    std::vector<UCHAR> data(512);
+    fake_usb_request* normal = test.fake.begin(&test.pipe, IRP_MJ_READ, 0, data.data(), 0, static_cast<ULONG>(data.size()));
+
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == 1; }));
+    CHECK_EQUAL(test.register_buffers(), STATUS_SUCCESS);
+
+    usb_chief_registered_transfer first = { 0, 0, 512, 0 };
+    usb_chief_registered_transfer second = { 1, 512, 512, 0 };
+
+    fake_usb_request* reads[] = { test.begin_read(first), test.begin_read(second) };
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == 3; }));
+
+    // the buffers stay registered while the reads use them
+    CHECK_EQUAL(test.unregister_buffers(), STATUS_DEVICE_BUSY);
+    CHECK_EQUAL(test.register_buffers(), STATUS_DEVICE_BUSY);
+
+    test.fake.release(false);
+
+    CHECK_EQUAL(test.fake.wait(normal), STATUS_SUCCESS);
+    CHECK_EQUAL(test.fake.wait(reads[0]), STATUS_SUCCESS);
+    CHECK_EQUAL(test.fake.wait(reads[1]), STATUS_SUCCESS);
+
+    CHECK_EQUAL(test.buffers[0][511], 0xff);
+    CHECK_EQUAL(test.buffers[1][512 + 511], 0xff);
+
+    // the last read released them
+    CHECK_EQUAL(test.unregister_buffers(), STATUS_SUCCESS);
+
+    test.fake.close(test.pipe);
+}
+
+TEST(cleanup_with_registered_buffers) {
+    registered_pipe test;
+    test.fake.hold_bulk = true;
+
+    // the memory without the handle
+    test.fake.close(test.pipe);
+    const LONG outstanding = shim_pool_outstanding();
+
+    CHECK_EQUAL(test.fake.open(test.pipe, L"\\PIPE00"), STATUS_SUCCESS);
+    CHECK_EQUAL(test.register_buffers(), STATUS_SUCCESS);
+    CHECK(shim_pool_outstanding() > outstanding);
+
+    // a read on a idle pipe keeps the buffers until it is aborted
+    usb_chief_registered_transfer transfer = { 0, 0, 512, 0 };
+    fake_usb_request* read = test.begin_read(transfer);
+
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == 1; }));
+
+    // the cleanup aborts the pipe and unlocks the buffers. The driver
+    // completes the aborted read like every other transfer
+    test.fake.close(test.pipe);
+
+    CHECK_EQUAL(test.fake.wait(read), STATUS_SUCCESS);
+    CHECK_EQUAL(test.fake.cancelled, 1u);
+    CHECK_EQUAL(test.fake.held_count(false), 0u);
+    CHECK_EQUAL(shim_pool_outstanding(), outstanding);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
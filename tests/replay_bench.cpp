@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "fake_usb_device.hpp"
+#include "tools/trace_replay.hpp"
+
+/**
+ * @brief The replay of chief_replay against the driver on the fake
+ * device. Records a workload of vendor requests, reads and writes
+ * with the request recorder of the driver, writes it to a trace file
+ * and replays the file on a new device with the original timing and
+ * back to back. A trace of chief_replay record is replayed instead
+ * when it is given. Fails when a request of the replay fails
+ *
+ * usage: replay_bench [requests to record] [trace file]
+ *
+ */
+
+// the file the recorded workload is written to
+constexpr static const char* bench_trace_file = "replay_bench.trace";
+
+// the time between the recorded requests in microseconds
+constexpr static ULONG bench_request_gap = 200;
+
+static void failed(const char* Message) {
+    printf("%s\n", Message);
+    exit(1);
+}
+
+/**
+ * @brief The driver on the fake as the target of a replay. The pipes
+ * are opened when they are first used like in chief_replay
+ *
+ */
+struct fake_target {
+    fake_usb_device& fake;
+    fake_usb_handle control;
+    fake_usb_handle pipes[fake_usb_pipes];
+    bool opened[fake_usb_pipes] = {};
+
+    fake_target(fake_usb_device& Fake) : fake(Fake) {
+        if (fake.open(control, L"") != STATUS_SUCCESS) {
+            failed("the device was not opened");
+        }
+    }
+
+    ~fake_target() {
+        for (ULONG i = 0; i < fake_usb_pipes; i++) {
+            if (opened[i]) {
+                fake.close(pipes[i]);
+            }
+        }
+
+        fake.close(control);
+    }
+
+    bool vendor(unsigned long Code, usb_chief_vendor_request& Request) {
+        return fake.ioctl(&control, Code, &Request, sizeof(Request), sizeof(Request)) == STATUS_SUCCESS;
+    }
+
+    bool transfer(unsigned char Major, unsigned char Pipe, uint8_t* Buffer, unsigned long Length, unsigned long& Returned) {
+        if (Pipe >= fake_usb_pipes) {
+            return false;
+        }
+
+        if (!opened[Pipe]) {
+            wchar_t name[16];
+            swprintf(name, 16, L"\\PIPE%02u", static_cast<unsigned int>(Pipe));
+
+            if (fake.open(pipes[Pipe], name) != STATUS_SUCCESS) {
+                return false;
+            }
+
+            opened[Pipe] = true;
+        }
+
+        ULONG_PTR information = 0;
+        const UCHAR major = (Major == chief_trace_read) ? IRP_MJ_READ : IRP_MJ_WRITE;
+
+        const NTSTATUS status = fake.wait(fake.begin(&pipes[Pipe], major, 0, Buffer, 0, Length), &information);
+        Returned = static_cast<unsigned long>(information);
+
+        return status == STATUS_SUCCESS;
+    }
+};
+
+/**
+ * @brief Send a workload like the capture application with the
+ * recorder on and move the records out of the driver
+ *
+ * @param Requests
+ * @param OutFrequency of the timestamps
+ * @return std::vector<usb_chief_trace_record>
+ */
+static std::vector<usb_chief_trace_record> record(ULONG Requests, uint64_t& OutFrequency) {
+    fake_usb_device fake;
+
+    if (fake.start() != STATUS_SUCCESS) {
+        failed("the device did not start");
+    }
+
+    fake_target target(fake);
+
+    usb_chief_clock_info info = {};
+
+    if (fake.ioctl(&target.control, ioctl_get_clock_info, &info, 0, sizeof(info)) != STATUS_SUCCESS) {
+        failed("no clock info");
+    }
+
+    OutFrequency = info.frequency;
+
+    usb_chief_trace_config config = { 1 };
+
+    if (fake.ioctl(&target.control, ioctl_configure_trace, &config, sizeof(config), 0) != STATUS_SUCCESS) {
+        failed("the recorder was not enabled");
+    }
+
+    std::vector<uint8_t> buffer(16 * 1024);
+
+    // vendor sends and receives between the reads of the bulk in
+    // pipe, now and then a write of the bulk out pipe
+    for (ULONG i = 0; i < Requests; i++) {
+        unsigned long returned = 0;
+        bool success;
+
+        switch (i % 5) {
+            case 0:
+                {
+                    buffer[0] = static_cast<uint8_t>(i);
+                    usb_chief_vendor_request request = { 0x30, static_cast<unsigned short>(i), 0, 8, buffer.data() };
+                    success = target.vendor(ioctl_vendor_send, request);
+                }
+                break;
+            case 1:
+                {
+                    usb_chief_vendor_request request = { 0x31, 0, 0, 64, buffer.data() };
+                    success = target.vendor(ioctl_vendor_receive, request);
+                }
+                break;
+            case 4:
+                success = target.transfer(chief_trace_write, 1, buffer.data(), 512, returned);
+                break;
+            default:
+                success = target.transfer(chief_trace_read, 0, buffer.data(), (i & 1) ? 512 : 16 * 1024, returned);
+                break;
+        }
+
+        if (!success) {
+            failed("a recorded request failed");
+        }
+
+        std::this_thread::sleep_for(std::chrono::microseconds(bench_request_gap));
+    }
+
+    config.enable = 0;
+    fake.ioctl(&target.control, ioctl_configure_trace, &config, sizeof(config), 0);
+
+    std::vector<usb_chief_trace_record> records;
+    std::vector<uint8_t> drained(sizeof(usb_chief_trace_drain) + 512 * sizeof(usb_chief_trace_record));
+
+    while (true) {
+        ULONG_PTR information = 0;
+
+        if (fake.ioctl(&target.control, ioctl_drain_trace, drained.data(), 0, static_cast<ULONG>(drained.size()), &information) != STATUS_SUCCESS) {
+            failed("the recorder was not drained");
+        }
+
+        const usb_chief_trace_drain* drain = reinterpret_cast<const usb_chief_trace_drain*>(drained.data());
+        const usb_chief_trace_record* first = reinterpret_cast<const usb_chief_trace_record*>(drain + 1);
+
+        if (drain->dropped) {
+            failed("the recorder dropped requests");
+        }
+
+        if (!drain->count) {
+            break;
+        }
+
+        records.insert(records.end(), first, first + drain->count);
+    }
+
+    return records;
+}
+
+int main(int argc, char** argv) {
+    const unsigned long count = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 5000;
+    const ULONG requests = count ? count : 1;
+
+    const char* path = bench_trace_file;
+
+    // record a workload when we did not get a trace
+    if (argc > 2) {
+        path = argv[2];
+    }
+    else {
+        uint64_t frequency = 0;
+        const std::vector<usb_chief_trace_record> recorded = record(requests, frequency);
+
+        if (recorded.size() != requests) {
+            failed("the recorder missed requests");
+        }
+
+        if (!trace_file_write(path, frequency, recorded)) {
+            failed("the trace file was not written");
+        }
+    }
+
+    uint64_t frequency = 0;
+    std::vector<usb_chief_trace_record> records;
+
+    if (!trace_file_read(path, frequency, records)) {
+        failed("not a trace file");
+    }
+
+    printf("%zu requests from %s\n", records.size(), path);
+
+    fake_usb_device fake;
+
+    if (fake.start() != STATUS_SUCCESS) {
+        failed("the device did not start");
+    }
+
+    uint64_t errors = 0;
+
+    // the original timing, then back to back
+    for (bool max_speed : { false, true }) {
+        fake_target target(fake);
+
+        printf("\n%s\n", max_speed ? "max speed" : "original timing");
+
+        const trace_replay_result result = trace_replay(target, frequency, records, max_speed);
+        trace_replay_print(result);
+
+        errors += result.failed;
+    }
+
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "fake_usb_device.hpp"
+#include "chief/scheduler.hpp"
+#include "chief/tunables.hpp"
+
+/**
+ * @brief Latency of vendor requests while the bulk pipe is busy. The
+ * fake has a shared bus where every urb takes the same time, a control
+ * transfer waits for the bulk transfers the usb stack already has. A
+ * thread keeps a deep queue of bulk reads outstanding while the main
+ * thread sends vendor requests one by one. Runs without load and with
+ * the load for a few bulk budgets
+ *
+ * usage: scheduler_bench [vendor requests per run]
+ *
+ */
+
+// the time every urb takes on the bus in microseconds
+constexpr static ULONG bench_urb_latency = 50;
+
+// the reads the application keeps outstanding and their size
+constexpr static ULONG bench_read_depth = 64;
+constexpr static ULONG bench_read_length = 512;
+
+/**
+ * @brief Keeps the bulk reads outstanding on a thread until it is
+ * stopped. The reads complete in order on the shared bus, so the
+ * oldest is always waited for first
+ *
+ */
+struct bulk_load {
+    fake_usb_device& fake;
+    fake_usb_handle& pipe;
+    std::vector<UCHAR> buffers = std::vector<UCHAR>(bench_read_depth * bench_read_length);
+    std::atomic<bool> running{ true };
+    uint64_t reads = 0;
+    std::thread thread;
+
+    bulk_load(fake_usb_device& Fake, fake_usb_handle& Pipe) : fake(Fake), pipe(Pipe) {
+        thread = std::thread([this] { run(); });
+    }
+
+    ~bulk_load() {
+        running = false;
+        thread.join();
+    }
+
+    fake_usb_request* submit(uint64_t Index) {
+        UCHAR* buffer = &buffers[(Index % bench_read_depth) * bench_read_length];
+
+        return fake.begin(&pipe, IRP_MJ_READ, 0, buffer, 0, bench_read_length);
+    }
+
+    void run() {
+        std::deque<fake_usb_request*> outstanding;
+        uint64_t next = 0;
+
+        while (outstanding.size() < bench_read_depth) {
+            outstanding.push_back(submit(next++));
+        }
+
+        while (running) {
+            fake.wait(outstanding.front());
+            outstanding.pop_front();
+            reads++;
+
+            outstanding.push_back(submit(next++));
+        }
+
+        for (fake_usb_request* request : outstanding) {
+            fake.wait(request);
+        }
+    }
+};
+
+/**
+ * @brief The result of a run
+ *
+ */
+struct latency_result {
+    double average = 0;
+    double maximum = 0;
+    double reads_per_second = 0;
+};
+
+static void set_bulk_budget(ULONG Budget) {
+    usb_chief_tunables tunables = get_tunables();
+    tunables.bulk_budget = Budget;
+
+    tunables_set(tunables);
+}
+
+/**
+ * @brief Send the vendor requests and time every one of them
+ *
+ * @param Fake
+ * @param Handle a handle on the device
+ * @param Pipe the bulk in pipe. nullptr runs without load
+ * @param Requests
+ * @return latency_result
+ */
+static latency_result run(fake_usb_device& Fake, fake_usb_handle& Handle, fake_usb_handle* Pipe, ULONG Requests) {
+    latency_result result;
+    bulk_load* load = Pipe ? new bulk_load(Fake, *Pipe) : nullptr;
+
+    // let the load fill the bus
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    const auto start = std::chrono::steady_clock::now();
+    const uint64_t reads = load ? load->reads : 0;
+    double total = 0;
+
+    for (ULONG i = 0; i < Requests; i++) {
+        UCHAR data[8] = {};
+        usb_chief_vendor_request request = { 0x10, 0, 0, sizeof(data), data };
+
+        const auto begin = std::chrono::steady_clock::now();
+
+        if (Fake.ioctl(&Handle, ioctl_vendor_receive, &request, sizeof(request), sizeof(request)) != STATUS_SUCCESS) {
+            printf("vendor request failed\n");
+            exit(1);
+        }
+
+        const double latency = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+
+        total += latency;
+        result.maximum = std::max(result.maximum, latency);
+    }
+
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    result.average = total / Requests;
+    result.reads_per_second = load ? (load->reads - reads) / elapsed : 0;
+
+    delete load;
+
+    return result;
+}
+
+int main(int argc, char** argv) {
+    const unsigned long count = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 1000;
+    const ULONG requests = count ? count : 1;
+
+    fake_usb_device fake;
+
+    if (fake.start() != STATUS_SUCCESS) {
+        printf("the device did not start\n");
+        return 1;
+    }
+
+    fake_usb_handle handle;
+    fake_usb_handle pipe;
+
+    fake.open(handle, L"");
+    fake.open(pipe, L"\\PIPE00");
+
+    // every urb takes its turn on the bus
+    fake.latency = bench_urb_latency;
+    fake.shared_bus = true;
+
+    printf("%u vendor requests, %u reads of %u bytes outstanding, %u us per urb\n",
+        requests, bench_read_depth, bench_read_length, bench_urb_latency);
+    printf("load          avg us   max us   bulk reads/s\n");
+
+    const latency_result idle = run(fake, handle, nullptr, requests);
+    printf("none        %8.1f %8.1f\n", idle.average, idle.maximum);
+
+    // a smaller budget keeps less bulk transfers ahead of the control
+    // transfers on the bus
+    const ULONG budgets[] = { scheduler_bulk_budget, 8, 2 };
+
+    for (ULONG budget : budgets) {
+        set_bulk_budget(budget);
+
+        const latency_result loaded = run(fake, handle, &pipe, requests);
+        printf("budget %-3u  %8.1f %8.1f %14.0f\n", budget, loaded.average, loaded.maximum, loaded.reads_per_second);
+    }
+
+    fake.close(pipe);
+    fake.close(handle);
+
+    return 0;
+}
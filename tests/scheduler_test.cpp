@@ -0,0 +1,189 @@
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+#include "chief/scheduler.hpp"
+#include "chief/tunables.hpp"
+
+// the bulk budget of the tests and the reads they queue on top of it
+constexpr static ULONG test_budget = 4;
+constexpr static ULONG test_reads = 10;
+constexpr static ULONG test_read_length = 512;
+
+static void set_bulk_budget(ULONG Budget) {
+    usb_chief_tunables tunables = get_tunables();
+    tunables.bulk_budget = Budget;
+
+    tunables_set(tunables);
+}
+
+static usb_chief_queue_stats get_stats(fake_usb_device& Fake, chief_transfer_class Class) {
+    usb_chief_scheduler_stats stats = {};
+    scheduler_get_stats(Fake.device, stats);
+
+    return stats.classes[Class];
+}
+
+/**
+ * @brief A started fake with a bulk in pipe that keeps the bulk
+ * transfers until they are released
+ *
+ */
+struct held_pipe {
+    fake_usb_device fake;
+    fake_usb_handle pipe;
+    std::vector<fake_usb_request*> reads;
+    std::vector<UCHAR> buffers = std::vector<UCHAR>(test_reads * test_read_length);
+
+    held_pipe() {
+        fake.start();
+        set_bulk_budget(test_budget);
+
+        fake.open(pipe, L"\\PIPE00");
+        fake.hold_bulk = true;
+    }
+
+    ~held_pipe() {
+        fake.close(pipe);
+    }
+
+    void read(ULONG Count) {
+        for (ULONG i = 0; i < Count; i++) {
+            UCHAR* buffer = &buffers[reads.size() * test_read_length];
+            reads.push_back(fake.begin(&pipe, IRP_MJ_READ, 0, buffer, 0, test_read_length));
+        }
+    }
+
+    // let every read complete and count the ones that got their data
+    ULONG finish() {
+        fake.hold_bulk = false;
+        fake.release(false);
+
+        ULONG succeeded = 0;
+
+        for (fake_usb_request* request : reads) {
+            ULONG_PTR information = 0;
+
+            if (fake.wait(request, &information) == STATUS_SUCCESS && information == test_read_length) {
+                succeeded++;
+            }
+        }
+
+        reads.clear();
+
+        return succeeded;
+    }
+};
+
+TEST(bulk_budget_limits_the_outstanding_transfers) {
+    held_pipe test;
+    test.read(test_reads);
+
+    // the rest waits in the queue of the scheduler
+    CHECK_EQUAL(test.fake.held_count(false), test_budget);
+
+    usb_chief_queue_stats bulk = get_stats(test.fake, chief_transfer_bulk);
+    CHECK_EQUAL(bulk.outstanding, test_budget);
+    CHECK_EQUAL(bulk.budget, test_budget);
+    CHECK_EQUAL(bulk.depth, test_reads - test_budget);
+    CHECK_EQUAL(bulk.submitted, test_budget);
+    CHECK_EQUAL(bulk.queued, test_reads - test_budget);
+
+    // every completion starts the next queued transfer
+    test.fake.release(false);
+
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == test_budget; }));
+    CHECK_EQUAL(get_stats(test.fake, chief_transfer_bulk).depth, test_reads - (2 * test_budget));
+
+    CHECK_EQUAL(test.finish(), test_reads);
+
+    bulk = get_stats(test.fake, chief_transfer_bulk);
+    CHECK_EQUAL(bulk.outstanding, 0u);
+    CHECK_EQUAL(bulk.depth, 0u);
+    CHECK_EQUAL(bulk.max_depth, test_reads - test_budget);
+    CHECK_EQUAL(bulk.submitted, test_reads);
+    CHECK_EQUAL(bulk.queued, test_reads - test_budget);
+    CHECK(bulk.max_wait > 0);
+    CHECK(bulk.total_wait >= bulk.max_wait);
+}
+
+TEST(control_transfers_go_first) {
+    held_pipe test;
+    test.read(test_reads);
+
+    // a vendor request the device does not answer yet
+    fake_usb_handle handle;
+    CHECK_EQUAL(test.fake.open(handle, L""), STATUS_SUCCESS);
+
+    test.fake.stalled = true;
+
+    UCHAR data[8] = {};
+    usb_chief_vendor_request request = { 0x42, 0, 0, sizeof(data), data };
+    NTSTATUS vendor_status = STATUS_PENDING;
+
+    std::thread vendor([&] {
+        vendor_status = test.fake.ioctl(&handle, ioctl_vendor_receive, &request, sizeof(request), sizeof(request));
+    });
+
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(true) == 1; }));
+    CHECK_EQUAL(get_stats(test.fake, chief_transfer_control).outstanding, 1u);
+
+    // the bulk transfers that complete while the control transfer is
+    // active only keep one new transfer in flight
+    test.fake.release(false);
+
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == 1; }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    CHECK_EQUAL(test.fake.held_count(false), 1u);
+    CHECK_EQUAL(get_stats(test.fake, chief_transfer_bulk).depth, test_reads - test_budget - 1);
+
+    // the end of the control transfer starts the waiting transfers
+    test.fake.release(true);
+    vendor.join();
+
+    CHECK_EQUAL(vendor_status, STATUS_SUCCESS);
+    CHECK_EQUAL(data[0], 0x42);
+
+    CHECK(fake_usb_device::wait_until([&] { return test.fake.held_count(false) == test_budget; }));
+    CHECK_EQUAL(get_stats(test.fake, chief_transfer_bulk).depth, test_reads - test_budget - test_budget);
+
+    CHECK_EQUAL(test.finish(), test_reads);
+
+    const usb_chief_queue_stats control = get_stats(test.fake, chief_transfer_control);
+    CHECK_EQUAL(control.outstanding, 0u);
+    CHECK_EQUAL(control.submitted, 1u);
+
+    test.fake.stalled = false;
+    test.fake.close(handle);
+}
+
+TEST(stats_ioctl_matches_the_scheduler) {
+    held_pipe test;
+    test.read(test_reads);
+
+    fake_usb_handle handle;
+    CHECK_EQUAL(test.fake.open(handle, L""), STATUS_SUCCESS);
+
+    usb_chief_scheduler_stats stats = {};
+    ULONG_PTR information = 0;
+
+    CHECK_EQUAL(test.fake.ioctl(&handle, ioctl_get_scheduler_stats, &stats, 0, sizeof(stats), &information), STATUS_SUCCESS);
+    CHECK_EQUAL(information, sizeof(stats));
+
+    const usb_chief_queue_stats& bulk = stats.classes[chief_transfer_bulk];
+    CHECK_EQUAL(bulk.outstanding, test_budget);
+    CHECK_EQUAL(bulk.depth, test_reads - test_budget);
+    CHECK_EQUAL(bulk.budget, test_budget);
+
+    // a too small buffer gets nothing
+    CHECK(!NT_SUCCESS(test.fake.ioctl(&handle, ioctl_get_scheduler_stats, &stats, 0, sizeof(stats) - 1)));
+
+    CHECK_EQUAL(test.finish(), test_reads);
+    test.fake.close(handle);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+ * Host version of the msvc intrinsics the driver uses, for the host
+ * tests
+ */
+
+#include <cpuid.h>
+
+// msvc names the 64 bit target _M_X64
+#if defined(__x86_64__) && !defined(_M_X64)
+#define _M_X64 1
+#endif
+
+// cpuid.h has a __cpuid macro with other arguments
+#undef __cpuid
+
+inline void __cpuid(int Info[4], int Function) {
+    __cpuid_count(Function, 0, Info[0], Info[1], Info[2], Info[3]);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+extern "C" {
+    #include <wdm.h>
+}
+
+/**
+ * @brief Get the amount of pool allocations that are not freed
+ *
+ * @return LONG
+ */
+LONG shim_pool_outstanding();
+
+/**
+ * @brief Get the amount of pool allocations since the start, also the
+ * ones that are freed
+ *
+ * @return ULONGLONG
+ */
+ULONGLONG shim_pool_allocations();
+
+/**
+ * @brief Wait until the queued dpcs ran and every queued work item
+ * returned
+ *
+ */
+void shim_wait_idle();
+
+/**
+ * @brief Change the irql of the calling thread. For tests that call
+ * driver code that expects dispatch level
+ *
+ * @param Irql
+ * @return KIRQL the previous irql
+ */
+KIRQL shim_set_irql(KIRQL Irql);
+
+/**
+ * @brief Create a driver object with the driver extension, like the
+ * io manager does before DriverEntry
+ *
+ * @return PDRIVER_OBJECT
+ */
+PDRIVER_OBJECT shim_create_driver();
+
+/**
+ * @brief Free a driver object of shim_create_driver
+ *
+ * @param DriverObject
+ */
+void shim_free_driver(PDRIVER_OBJECT DriverObject);
+
+/**
+ * @brief Let KeSaveFloatingPointState fail, like on a system that has
+ * no memory for the state
+ *
+ * @param Fail
+ */
+void shim_fail_floating_save(bool Fail);
+
+/**
+ * @brief Get the amount of floating point states that were saved and
+ * not restored
+ *
+ * @return LONG
+ */
+LONG shim_floating_saved();
@@ -0,0 +1,90 @@
+extern "C" {
+    #include <wdm.h>
+    #include <usb.h>
+    #include <usbdlib.h>
+}
+
+/*
+ * Host runtime of the usbdlib.h shim. Parses the configuration
+ * descriptor like usbd.sys so the driver can select a configuration
+ * of a fake device
+ */
+
+// the transfer size usbd puts in a new configuration request
+constexpr static ULONG shim_default_transfer_size = PAGE_SIZE;
+
+static bool shim_matches(LONG Value, UCHAR Field) {
+    // -1 matches everything
+    return Value == -1 || Value == Field;
+}
+
+PUSB_INTERFACE_DESCRIPTOR USBD_ParseConfigurationDescriptorEx(PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor, PVOID StartPosition,
+    LONG InterfaceNumber, LONG AlternateSetting, LONG InterfaceClass, LONG InterfaceSubClass, LONG InterfaceProtocol) {
+    UCHAR* current = static_cast<UCHAR*>(StartPosition);
+    UCHAR* end = reinterpret_cast<UCHAR*>(ConfigurationDescriptor) + ConfigurationDescriptor->wTotalLength;
+
+    // walk every descriptor. A zero length would never end
+    while (current + 2 <= end && current[0]) {
+        if (current[1] == USB_INTERFACE_DESCRIPTOR_TYPE && current + sizeof(USB_INTERFACE_DESCRIPTOR) <= end) {
+            PUSB_INTERFACE_DESCRIPTOR descriptor = reinterpret_cast<PUSB_INTERFACE_DESCRIPTOR>(current);
+
+            if (shim_matches(InterfaceNumber, descriptor->bInterfaceNumber) &&
+                shim_matches(AlternateSetting, descriptor->bAlternateSetting) &&
+                shim_matches(InterfaceClass, descriptor->bInterfaceClass) &&
+                shim_matches(InterfaceSubClass, descriptor->bInterfaceSubClass) &&
+                shim_matches(InterfaceProtocol, descriptor->bInterfaceProtocol)) {
+                return descriptor;
+            }
+        }
+
+        current += current[0];
+    }
+
+    return nullptr;
+}
+
+static ULONG shim_interface_size(ULONG Pipes) {
+    return sizeof(USBD_INTERFACE_INFORMATION) + ((Pipes ? Pipes : 1) - 1) * sizeof(USBD_PIPE_INFORMATION);
+}
+
+PURB USBD_CreateConfigurationRequestEx(PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor, PUSBD_INTERFACE_LIST_ENTRY InterfaceList) {
+    // the interfaces follow each other in the urb
+    ULONG size = sizeof(_URB_SELECT_CONFIGURATION) - sizeof(USBD_INTERFACE_INFORMATION);
+
+    for (PUSBD_INTERFACE_LIST_ENTRY entry = InterfaceList; entry->InterfaceDescriptor; entry++) {
+        size += shim_interface_size(entry->InterfaceDescriptor->bNumEndpoints);
+    }
+
+    PURB urb = static_cast<PURB>(ExAllocatePoolWithTag(NonPagedPool, size, 0x44425355u));
+
+    if (!urb) {
+        return nullptr;
+    }
+
+    memset(urb, 0, size);
+
+    urb->UrbSelectConfiguration.Hdr.Length = static_cast<USHORT>(size);
+    urb->UrbSelectConfiguration.Hdr.Function = URB_FUNCTION_SELECT_CONFIGURATION;
+    urb->UrbSelectConfiguration.ConfigurationDescriptor = ConfigurationDescriptor;
+
+    UCHAR* current = reinterpret_cast<UCHAR*>(&urb->UrbSelectConfiguration.Interface);
+
+    for (PUSBD_INTERFACE_LIST_ENTRY entry = InterfaceList; entry->InterfaceDescriptor; entry++) {
+        PUSBD_INTERFACE_INFORMATION info = reinterpret_cast<PUSBD_INTERFACE_INFORMATION>(current);
+        const ULONG pipes = entry->InterfaceDescriptor->bNumEndpoints;
+
+        info->Length = static_cast<USHORT>(shim_interface_size(pipes));
+        info->InterfaceNumber = entry->InterfaceDescriptor->bInterfaceNumber;
+        info->AlternateSetting = entry->InterfaceDescriptor->bAlternateSetting;
+        info->NumberOfPipes = pipes;
+
+        for (ULONG i = 0; i < pipes; i++) {
+            info->Pipes[i].MaximumTransferSize = shim_default_transfer_size;
+        }
+
+        entry->Interface = info;
+        current += info->Length;
+    }
+
+    return urb;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+/*
+ * Host version of the internal usb ioctls of usbdi.h for the host tests
+ */
+
+#include "usb.h"
+
+#define IOCTL_INTERNAL_USB_SUBMIT_URB CTL_CODE(FILE_DEVICE_USB, 0, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_INTERNAL_USB_RESET_PORT CTL_CODE(FILE_DEVICE_USB, 1, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_INTERNAL_USB_GET_PORT_STATUS CTL_CODE(FILE_DEVICE_USB, 4, METHOD_NEITHER, FILE_ANY_ACCESS)
+
+#define USBD_PIPE_DIRECTION_IN(p) ((p)->EndpointAddress & 0x80)
@@ -0,0 +1,1222 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cwctype>
+#include <mutex>
+#include <thread>
+
+#include "shim.hpp"
+
+/*
+ * Host runtime of the wdm.h shim. Every dispatcher object is guarded
+ * by one mutex and every change of a signal state wakes all the
+ * waiters, the tests are too small for this to matter. Dpcs run one
+ * at a time on their own thread at dispatch level, timers fire from
+ * another thread and every work item gets a new thread
+ */
+
+struct shim_state {
+    // guards the signal states, the dpc queue and the timers
+    std::mutex lock;
+    std::condition_variable signal;
+
+    // the queued dpcs and the amount that is running
+    LIST_ENTRY dpcs;
+    LONG dpcs_running = 0;
+
+    // the timers that are set
+    LIST_ENTRY timers;
+
+    // the work items that did not return yet
+    LONG work_items = 0;
+};
+
+static void shim_dpc_thread();
+static void shim_timer_thread();
+
+static shim_state& shim() {
+    // never destroyed. The threads still use it while the process exits
+    static shim_state* state = [] {
+        shim_state* created = new shim_state();
+
+        InitializeListHead(&created->dpcs);
+        InitializeListHead(&created->timers);
+
+        return created;
+    }();
+
+    // start the threads after the state is set
+    static std::once_flag started;
+    std::call_once(started, [] {
+        std::thread(shim_dpc_thread).detach();
+        std::thread(shim_timer_thread).detach();
+    });
+
+    return *state;
+}
+
+static thread_local KIRQL shim_irql = PASSIVE_LEVEL;
+
+// the address identifies the thread that owns a mutex
+static thread_local char shim_thread_marker;
+
+static std::atomic<LONG> shim_allocations(0);
+static std::atomic<ULONGLONG> shim_allocations_total(0);
+
+static KSPIN_LOCK shim_cancel_lock = 0;
+
+[[noreturn]] static void shim_bugcheck(const char* Reason) {
+    fprintf(stderr, "bugcheck: %s\n", Reason);
+    abort();
+}
+
+static void* shim_allocate(size_t Size) {
+    void* memory = calloc(1, Size ? Size : 1);
+
+    if (memory) {
+        shim_allocations++;
+        shim_allocations_total++;
+    }
+
+    return memory;
+}
+
+static void shim_free(void* Memory) {
+    if (!Memory) {
+        shim_bugcheck("free of a nullptr");
+    }
+
+    shim_allocations--;
+    free(Memory);
+}
+
+/* time */
+static LONGLONG shim_interrupt_time() {
+    return std::chrono::duration_cast<std::chrono::duration<LONGLONG, std::ratio<1, 10000000>>>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+static LONGLONG shim_system_time() {
+    // 100ns units since 1601
+    return std::chrono::duration_cast<std::chrono::duration<LONGLONG, std::ratio<1, 10000000>>>(
+        std::chrono::system_clock::now().time_since_epoch()
+    ).count() + 116444736000000000LL;
+}
+
+static std::chrono::steady_clock::time_point shim_time_point(LONGLONG InterruptTime) {
+    return std::chrono::steady_clock::time_point(
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<LONGLONG, std::ratio<1, 10000000>>(InterruptTime)
+        )
+    );
+}
+
+static LONGLONG shim_due_time(LONGLONG DueTime) {
+    // negative is relative, positive a absolute system time
+    if (DueTime <= 0) {
+        return shim_interrupt_time() - DueTime;
+    }
+
+    const LONGLONG remaining = DueTime - shim_system_time();
+
+    return shim_interrupt_time() + ((remaining > 0) ? remaining : 0);
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER Frequency) {
+    if (Frequency) {
+        Frequency->QuadPart = 10000000;
+    }
+
+    LARGE_INTEGER counter;
+    counter.QuadPart = shim_interrupt_time();
+
+    return counter;
+}
+
+void KeQuerySystemTime(PLARGE_INTEGER Time) {
+    Time->QuadPart = shim_system_time();
+}
+
+ULONGLONG KeQueryInterruptTime() {
+    return static_cast<ULONGLONG>(shim_interrupt_time());
+}
+
+// the saved floating point states and if the next saves should fail
+static std::atomic<LONG> shim_floating_states(0);
+static std::atomic<bool> shim_floating_fail(false);
+
+NTSTATUS KeSaveFloatingPointState(PKFLOATING_SAVE State) {
+    UNREFERENCED_PARAMETER(State);
+
+    if (shim_floating_fail) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    shim_floating_states++;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS KeRestoreFloatingPointState(PKFLOATING_SAVE State) {
+    UNREFERENCED_PARAMETER(State);
+
+    shim_floating_states--;
+
+    return STATUS_SUCCESS;
+}
+
+void shim_fail_floating_save(bool Fail) {
+    shim_floating_fail = Fail;
+}
+
+LONG shim_floating_saved() {
+    return shim_floating_states;
+}
+
+/* irql */
+KIRQL KeGetCurrentIrql() {
+    return shim_irql;
+}
+
+PKTHREAD KeGetCurrentThread() {
+    // every host thread is a kernel thread
+    static thread_local char thread;
+
+    return reinterpret_cast<PKTHREAD>(&thread);
+}
+
+KIRQL shim_set_irql(KIRQL Irql) {
+    const KIRQL previous = shim_irql;
+    shim_irql = Irql;
+
+    return previous;
+}
+
+/* dispatcher objects */
+static bool shim_try_acquire(DISPATCHER_HEADER* Header) {
+    switch (Header->Type) {
+        case ShimNotificationEvent:
+        case ShimNotificationTimer:
+            return Header->SignalState > 0;
+
+        case ShimSynchronizationEvent:
+        case ShimSynchronizationTimer:
+            if (Header->SignalState > 0) {
+                Header->SignalState = 0;
+                return true;
+            }
+
+            return false;
+
+        case ShimSemaphore:
+            if (Header->SignalState > 0) {
+                Header->SignalState--;
+                return true;
+            }
+
+            return false;
+
+        case ShimMutex: {
+            // 1 is free, every recursive acquire goes one lower
+            PKMUTEX mutex = reinterpret_cast<PKMUTEX>(Header);
+
+            if (Header->SignalState > 0) {
+                Header->SignalState = 0;
+                mutex->OwnerThread = &shim_thread_marker;
+                return true;
+            }
+
+            if (mutex->OwnerThread == &shim_thread_marker) {
+                Header->SignalState--;
+                return true;
+            }
+
+            return false;
+        }
+
+        default:
+            shim_bugcheck("wait on a unknown object");
+    }
+}
+
+static LONG shim_signal(DISPATCHER_HEADER* Header, LONG State) {
+    std::lock_guard<std::mutex> guard(shim().lock);
+
+    const LONG previous = Header->SignalState;
+    Header->SignalState = State;
+
+    shim().signal.notify_all();
+
+    return previous;
+}
+
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout) {
+    UNREFERENCED_PARAMETER(WaitReason);
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+
+    // only a poll is allowed at dispatch level
+    if (shim_irql > APC_LEVEL && (!Timeout || Timeout->QuadPart)) {
+        shim_bugcheck("wait at dispatch level");
+    }
+
+    DISPATCHER_HEADER* header = static_cast<DISPATCHER_HEADER*>(Object);
+    const LONGLONG deadline = Timeout ? shim_due_time(Timeout->QuadPart) : 0;
+
+    std::unique_lock<std::mutex> guard(shim().lock);
+
+    while (!shim_try_acquire(header)) {
+        if (!Timeout) {
+            shim().signal.wait(guard);
+            continue;
+        }
+
+        if (shim().signal.wait_until(guard, shim_time_point(deadline)) == std::cv_status::timeout) {
+            return shim_try_acquire(header) ? STATUS_SUCCESS : STATUS_TIMEOUT;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+void KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State) {
+    Event->Header.Type = (Type == NotificationEvent) ? ShimNotificationEvent : ShimSynchronizationEvent;
+    Event->Header.SignalState = State ? 1 : 0;
+}
+
+LONG KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait) {
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    return shim_signal(&Event->Header, 1);
+}
+
+void KeClearEvent(PRKEVENT Event) {
+    shim_signal(&Event->Header, 0);
+}
+
+LONG KeResetEvent(PRKEVENT Event) {
+    return shim_signal(&Event->Header, 0);
+}
+
+LONG KeReadStateEvent(PRKEVENT Event) {
+    std::lock_guard<std::mutex> guard(shim().lock);
+
+    return Event->Header.SignalState;
+}
+
+void KeInitializeSemaphore(PRKSEMAPHORE Semaphore, LONG Count, LONG Limit) {
+    Semaphore->Header.Type = ShimSemaphore;
+    Semaphore->Header.SignalState = Count;
+    Semaphore->Limit = Limit;
+}
+
+LONG KeReleaseSemaphore(PRKSEMAPHORE Semaphore, KPRIORITY Increment, LONG Adjustment, BOOLEAN Wait) {
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    std::lock_guard<std::mutex> guard(shim().lock);
+
+    const LONG previous = Semaphore->Header.SignalState;
+
+    if (previous + Adjustment > Semaphore->Limit) {
+        shim_bugcheck("semaphore limit exceeded");
+    }
+
+    Semaphore->Header.SignalState = previous + Adjustment;
+    shim().signal.notify_all();
+
+    return previous;
+}
+
+void KeInitializeMutex(PKMUTEX Mutex, ULONG Level) {
+    UNREFERENCED_PARAMETER(Level);
+
+    Mutex->Header.Type = ShimMutex;
+    Mutex->Header.SignalState = 1;
+    Mutex->OwnerThread = nullptr;
+}
+
+LONG KeReleaseMutex(PKMUTEX Mutex, BOOLEAN Wait) {
+    UNREFERENCED_PARAMETER(Wait);
+
+    std::lock_guard<std::mutex> guard(shim().lock);
+
+    if (Mutex->OwnerThread != &shim_thread_marker) {
+        shim_bugcheck("mutex released by a thread that does not own it");
+    }
+
+    const LONG previous = Mutex->Header.SignalState++;
+
+    if (Mutex->Header.SignalState == 1) {
+        Mutex->OwnerThread = nullptr;
+        shim().signal.notify_all();
+    }
+
+    return previous;
+}
+
+void ExInitializeFastMutex(PFAST_MUTEX Mutex) {
+    Mutex->Header.Type = ShimSynchronizationEvent;
+    Mutex->Header.SignalState = 1;
+}
+
+void ExAcquireFastMutex(PFAST_MUTEX Mutex) {
+    KeWaitForSingleObject(&Mutex->Header, Executive, KernelMode, FALSE, nullptr);
+
+    Mutex->OldIrql = shim_set_irql(APC_LEVEL);
+}
+
+void ExReleaseFastMutex(PFAST_MUTEX Mutex) {
+    shim_set_irql(Mutex->OldIrql);
+    shim_signal(&Mutex->Header, 1);
+}
+
+/* spin locks */
+void KeInitializeSpinLock(PKSPIN_LOCK Lock) {
+    *Lock = 0;
+}
+
+void KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK Lock) {
+    while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE)) {
+        // the owner can be a preempted thread on the host
+        while (__atomic_load_n(Lock, __ATOMIC_RELAXED)) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK Lock) {
+    __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+}
+
+void KeAcquireSpinLock(PKSPIN_LOCK Lock, PKIRQL OldIrql) {
+    *OldIrql = shim_set_irql(DISPATCH_LEVEL);
+    KeAcquireSpinLockAtDpcLevel(Lock);
+}
+
+void KeReleaseSpinLock(PKSPIN_LOCK Lock, KIRQL NewIrql) {
+    KeReleaseSpinLockFromDpcLevel(Lock);
+    shim_set_irql(NewIrql);
+}
+
+void IoAcquireCancelSpinLock(PKIRQL Irql) {
+    KeAcquireSpinLock(&shim_cancel_lock, Irql);
+}
+
+void IoReleaseCancelSpinLock(KIRQL Irql) {
+    KeReleaseSpinLock(&shim_cancel_lock, Irql);
+}
+
+/* dpcs */
+void KeInitializeDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE Routine, PVOID Context) {
+    memset(Dpc, 0, sizeof(*Dpc));
+
+    Dpc->DeferredRoutine = Routine;
+    Dpc->DeferredContext = Context;
+}
+
+static BOOLEAN shim_queue_dpc(PRKDPC Dpc, PVOID SystemArgument1, PVOID SystemArgument2) {
+    // called with the lock held
+    if (Dpc->Inserted) {
+        return FALSE;
+    }
+
+    Dpc->Inserted = 1;
+    Dpc->SystemArgument1 = SystemArgument1;
+    Dpc->SystemArgument2 = SystemArgument2;
+
+    InsertTailList(&shim().dpcs, &Dpc->DpcListEntry);
+    shim().signal.notify_all();
+
+    return TRUE;
+}
+
+BOOLEAN KeInsertQueueDpc(PRKDPC Dpc, PVOID SystemArgument1, PVOID SystemArgument2) {
+    std::lock_guard<std::mutex> guard(shim().lock);
+
+    return shim_queue_dpc(Dpc, SystemArgument1, SystemArgument2);
+}
+
+void KeFlushQueuedDpcs() {
+    std::unique_lock<std::mutex> guard(shim().lock);
+
+    shim().signal.wait(guard, [] {
+        return IsListEmpty(&shim().dpcs) && !shim().dpcs_running;
+    });
+}
+
+static void shim_dpc_thread() {
+    shim_irql = DISPATCH_LEVEL;
+
+    std::unique_lock<std::mutex> guard(shim().lock);
+
+    while (true) {
+        shim().signal.wait(guard, [] {
+            return !IsListEmpty(&shim().dpcs);
+        });
+
+        PKDPC dpc = CONTAINING_RECORD(RemoveHeadList(&shim().dpcs), KDPC, DpcListEntry);
+
+        // the dpc can be queued again or freed by its routine
+        dpc->Inserted = 0;
+
+        PKDEFERRED_ROUTINE routine = dpc->DeferredRoutine;
+        PVOID context = dpc->DeferredContext;
+        PVOID argument1 = dpc->SystemArgument1;
+        PVOID argument2 = dpc->SystemArgument2;
+
+        shim().dpcs_running++;
+        guard.unlock();
+
+        routine(dpc, context, argument1, argument2);
+
+        if (shim_irql != DISPATCH_LEVEL) {
+            shim_bugcheck("dpc returned at a other irql");
+        }
+
+        guard.lock();
+        shim().dpcs_running--;
+        shim().signal.notify_all();
+    }
+}
+
+/* timers */
+void KeInitializeTimerEx(PKTIMER Timer, TIMER_TYPE Type) {
+    memset(Timer, 0, sizeof(*Timer));
+
+    Timer->Header.Type = (Type == NotificationTimer) ? ShimNotificationTimer : ShimSynchronizationTimer;
+}
+
+void KeInitializeTimer(PKTIMER Timer) {
+    KeInitializeTimerEx(Timer, NotificationTimer);
+}
+
+BOOLEAN KeSetTimerEx(PKTIMER Timer, LARGE_INTEGER DueTime, LONG Period, PKDPC Dpc) {
+    std::lock_guard<std::mutex> guard(shim().lock);
+
+    const BOOLEAN inserted = Timer->Inserted;
+
+    if (inserted) {
+        RemoveEntryList(&Timer->TimerListEntry);
+    }
+
+    Timer->DueTime = static_cast<ULONGLONG>(shim_due_time(DueTime.QuadPart));
+    Timer->Period = Period;
+    Timer->Dpc = Dpc;
+    Timer->Header.SignalState = 0;
+    Timer->Inserted = TRUE;
+
+    InsertTailList(&shim().timers, &Timer->TimerListEntry);
+    shim().signal.notify_all();
+
+    return inserted;
+}
+
+BOOLEAN KeSetTimer(PKTIMER Timer, LARGE_INTEGER DueTime, PKDPC Dpc) {
+    return KeSetTimerEx(Timer, DueTime, 0, Dpc);
+}
+
+BOOLEAN KeCancelTimer(PKTIMER Timer) {
+    std::lock_guard<std::mutex> guard(shim().lock);
+
+    const BOOLEAN inserted = Timer->Inserted;
+
+    if (inserted) {
+        RemoveEntryList(&Timer->TimerListEntry);
+        Timer->Inserted = FALSE;
+    }
+
+    return inserted;
+}
+
+static void shim_timer_thread() {
+    std::unique_lock<std::mutex> guard(shim().lock);
+
+    while (true) {
+        if (IsListEmpty(&shim().timers)) {
+            shim().signal.wait(guard);
+            continue;
+        }
+
+        // find the timer that expires first
+        PKTIMER first = nullptr;
+
+        for (PLIST_ENTRY entry = shim().timers.Flink; entry != &shim().timers; entry = entry->Flink) {
+            PKTIMER timer = CONTAINING_RECORD(entry, KTIMER, TimerListEntry);
+
+            if (!first || timer->DueTime < first->DueTime) {
+                first = timer;
+            }
+        }
+
+        if (static_cast<LONGLONG>(first->DueTime) > shim_interrupt_time()) {
+            shim().signal.wait_until(guard, shim_time_point(static_cast<LONGLONG>(first->DueTime)));
+            continue;
+        }
+
+        RemoveEntryList(&first->TimerListEntry);
+        first->Inserted = FALSE;
+        first->Header.SignalState = 1;
+
+        if (first->Period) {
+            first->DueTime += static_cast<ULONGLONG>(first->Period) * 10000;
+            first->Inserted = TRUE;
+
+            InsertTailList(&shim().timers, &first->TimerListEntry);
+        }
+
+        if (first->Dpc) {
+            shim_queue_dpc(first->Dpc, nullptr, nullptr);
+        }
+
+        shim().signal.notify_all();
+    }
+}
+
+/* pool */
+PVOID ExAllocatePoolWithTag(POOL_TYPE Type, SIZE_T Size, ULONG Tag) {
+    UNREFERENCED_PARAMETER(Type);
+    UNREFERENCED_PARAMETER(Tag);
+
+    return shim_allocate(Size);
+}
+
+void ExFreePool(PVOID Pointer) {
+    shim_free(Pointer);
+}
+
+void ExFreePoolWithTag(PVOID Pointer, ULONG Tag) {
+    UNREFERENCED_PARAMETER(Tag);
+
+    shim_free(Pointer);
+}
+
+void ExInitializeNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List, PVOID Allocate, PVOID Free, ULONG Flags, SIZE_T Size, ULONG Tag, USHORT Depth) {
+    UNREFERENCED_PARAMETER(Allocate);
+    UNREFERENCED_PARAMETER(Free);
+    UNREFERENCED_PARAMETER(Flags);
+    UNREFERENCED_PARAMETER(Depth);
+
+    List->Size = Size;
+    List->Tag = Tag;
+}
+
+void ExDeleteNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List) {
+    UNREFERENCED_PARAMETER(List);
+}
+
+PVOID ExAllocateFromNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List) {
+    return shim_allocate(List->Size);
+}
+
+void ExFreeToNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List, PVOID Entry) {
+    UNREFERENCED_PARAMETER(List);
+
+    shim_free(Entry);
+}
+
+LONG shim_pool_outstanding() {
+    return shim_allocations;
+}
+
+ULONGLONG shim_pool_allocations() {
+    return shim_allocations_total;
+}
+
+/* devices */
+PDRIVER_OBJECT shim_create_driver() {
+    PDRIVER_OBJECT driver = static_cast<PDRIVER_OBJECT>(calloc(1, sizeof(DRIVER_OBJECT) + sizeof(DRIVER_EXTENSION)));
+
+    driver->DriverExtension = reinterpret_cast<DRIVER_EXTENSION*>(driver + 1);
+
+    return driver;
+}
+
+void shim_free_driver(PDRIVER_OBJECT DriverObject) {
+    free(DriverObject);
+}
+
+NTSTATUS IoCreateDevice(PDRIVER_OBJECT DriverObject, ULONG ExtensionSize, PUNICODE_STRING Name, ULONG Type, ULONG Characteristics, BOOLEAN Exclusive, PDEVICE_OBJECT* DeviceObject) {
+    UNREFERENCED_PARAMETER(Name);
+    UNREFERENCED_PARAMETER(Type);
+    UNREFERENCED_PARAMETER(Characteristics);
+    UNREFERENCED_PARAMETER(Exclusive);
+
+    // the extension follows the object with the pool alignment
+    constexpr size_t object_size = (sizeof(DEVICE_OBJECT) + 15) & ~static_cast<size_t>(15);
+
+    PDEVICE_OBJECT device = static_cast<PDEVICE_OBJECT>(shim_allocate(object_size + ExtensionSize));
+
+    if (!device) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    device->DriverObject = DriverObject;
+    device->DeviceExtension = reinterpret_cast<char*>(device) + object_size;
+    device->Flags = DO_DEVICE_INITIALIZING;
+    device->StackSize = 1;
+
+    *DeviceObject = device;
+
+    return STATUS_SUCCESS;
+}
+
+void IoDeleteDevice(PDEVICE_OBJECT DeviceObject) {
+    shim_free(DeviceObject);
+}
+
+NTSTATUS IoCreateSymbolicLink(PUNICODE_STRING Link, PUNICODE_STRING Name) {
+    UNREFERENCED_PARAMETER(Link);
+    UNREFERENCED_PARAMETER(Name);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS IoDeleteSymbolicLink(PUNICODE_STRING Link) {
+    UNREFERENCED_PARAMETER(Link);
+
+    return STATUS_SUCCESS;
+}
+
+PDEVICE_OBJECT IoAttachDeviceToDeviceStack(PDEVICE_OBJECT Source, PDEVICE_OBJECT Target) {
+    PDEVICE_OBJECT top = Target;
+
+    while (top->AttachedDevice) {
+        top = top->AttachedDevice;
+    }
+
+    top->AttachedDevice = Source;
+    Source->StackSize = static_cast<CHAR>(top->StackSize + 1);
+
+    return top;
+}
+
+void IoDetachDevice(PDEVICE_OBJECT Target) {
+    Target->AttachedDevice = nullptr;
+}
+
+void RtlInitUnicodeString(PUNICODE_STRING String, PCWSTR Source) {
+    const size_t length = Source ? wcslen(Source) * sizeof(WCHAR) : 0;
+
+    String->Length = static_cast<USHORT>(length);
+    String->MaximumLength = static_cast<USHORT>(Source ? length + sizeof(WCHAR) : 0);
+    String->Buffer = const_cast<PWSTR>(Source);
+}
+
+BOOLEAN RtlEqualUnicodeString(const UNICODE_STRING* String1, const UNICODE_STRING* String2, BOOLEAN CaseInsensitive) {
+    if (String1->Length != String2->Length) {
+        return FALSE;
+    }
+
+    for (USHORT i = 0; i < String1->Length / sizeof(WCHAR); i++) {
+        WCHAR first = String1->Buffer[i];
+        WCHAR second = String2->Buffer[i];
+
+        if (CaseInsensitive) {
+            first = static_cast<WCHAR>(towupper(first));
+            second = static_cast<WCHAR>(towupper(second));
+        }
+
+        if (first != second) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+NTSTATUS RtlQueryRegistryValues(ULONG RelativeTo, PCWSTR Path, PRTL_QUERY_REGISTRY_TABLE Table, PVOID Context, PVOID Environment) {
+    UNREFERENCED_PARAMETER(RelativeTo);
+    UNREFERENCED_PARAMETER(Path);
+    UNREFERENCED_PARAMETER(Table);
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Environment);
+
+    // the host has no registry, like a service without a Parameters key
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+PEPROCESS IoGetCurrentProcess() {
+    // the tests all run in one process
+    static char process;
+
+    return reinterpret_cast<PEPROCESS>(&process);
+}
+
+/* irps */
+static USHORT shim_irp_size(CHAR StackSize) {
+    return static_cast<USHORT>(sizeof(IRP) + StackSize * sizeof(IO_STACK_LOCATION));
+}
+
+void IoInitializeIrp(PIRP Irp, USHORT Size, CHAR StackSize) {
+    memset(Irp, 0, Size);
+
+    // the current location starts one past the last stack location
+    Irp->StackCount = StackSize;
+    Irp->CurrentLocation = static_cast<CHAR>(StackSize + 1);
+    Irp->Tail.Overlay.CurrentStackLocation = reinterpret_cast<PIO_STACK_LOCATION>(Irp + 1) + StackSize;
+}
+
+PIRP IoAllocateIrp(CHAR StackSize, BOOLEAN ChargeQuota) {
+    UNREFERENCED_PARAMETER(ChargeQuota);
+
+    PIRP irp = static_cast<PIRP>(shim_allocate(shim_irp_size(StackSize)));
+
+    if (irp) {
+        IoInitializeIrp(irp, shim_irp_size(StackSize), StackSize);
+    }
+
+    return irp;
+}
+
+void IoFreeIrp(PIRP Irp) {
+    shim_free(Irp);
+}
+
+void IoReuseIrp(PIRP Irp, NTSTATUS Status) {
+    if (Irp->CancelRoutine) {
+        shim_bugcheck("reuse of a irp with a cancel routine");
+    }
+
+    IoInitializeIrp(Irp, shim_irp_size(Irp->StackCount), Irp->StackCount);
+    Irp->IoStatus.Status = Status;
+}
+
+NTSTATUS IofCallDriver(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+    IoSetNextIrpStackLocation(Irp);
+
+    if (Irp->CurrentLocation <= 0) {
+        shim_bugcheck("no more irp stack locations");
+    }
+
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+    stack->DeviceObject = DeviceObject;
+
+    return DeviceObject->DriverObject->MajorFunction[stack->MajorFunction](DeviceObject, Irp);
+}
+
+void IofCompleteRequest(PIRP Irp, CHAR PriorityBoost) {
+    UNREFERENCED_PARAMETER(PriorityBoost);
+
+    if (Irp->IoStatus.Status == STATUS_PENDING) {
+        shim_bugcheck("irp completed with STATUS_PENDING");
+    }
+
+    if (Irp->CancelRoutine) {
+        shim_bugcheck("irp completed with a cancel routine");
+    }
+
+    // walk up the stack and call the completion routines
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+    IoSkipCurrentIrpStackLocation(Irp);
+
+    for (; Irp->CurrentLocation <= Irp->StackCount + 1; stack++, IoSkipCurrentIrpStackLocation(Irp)) {
+        Irp->PendingReturned = (stack->Control & SL_PENDING_RETURNED) != 0;
+
+        const NTSTATUS status = Irp->IoStatus.Status;
+        const bool invoke = stack->CompletionRoutine && (
+            (NT_SUCCESS(status) && (stack->Control & SL_INVOKE_ON_SUCCESS)) ||
+            (!NT_SUCCESS(status) && (stack->Control & SL_INVOKE_ON_ERROR)) ||
+            (Irp->Cancel && (stack->Control & SL_INVOKE_ON_CANCEL))
+        );
+
+        PIO_COMPLETION_ROUTINE routine = stack->CompletionRoutine;
+        PVOID context = stack->Context;
+
+        stack->CompletionRoutine = nullptr;
+        stack->Control = 0;
+
+        if (invoke) {
+            // the routine gets the device of the driver that set it
+            PDEVICE_OBJECT device = (Irp->CurrentLocation <= Irp->StackCount) ?
+                IoGetCurrentIrpStackLocation(Irp)->DeviceObject : nullptr;
+
+            if (routine(device, Irp, context) == STATUS_MORE_PROCESSING_REQUIRED) {
+                return;
+            }
+        }
+        else if (Irp->PendingReturned && Irp->CurrentLocation <= Irp->StackCount) {
+            IoMarkIrpPending(Irp);
+        }
+    }
+
+    // the irp reached the top. Tell the test that sent it
+    if (Irp->UserIosb) {
+        *Irp->UserIosb = Irp->IoStatus;
+    }
+
+    if (Irp->UserEvent) {
+        KeSetEvent(Irp->UserEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
+BOOLEAN IoCancelIrp(PIRP Irp) {
+    KIRQL irql;
+    IoAcquireCancelSpinLock(&irql);
+
+    Irp->Cancel = TRUE;
+
+    PDRIVER_CANCEL routine = IoSetCancelRoutine(Irp, nullptr);
+
+    if (!routine) {
+        IoReleaseCancelSpinLock(irql);
+        return FALSE;
+    }
+
+    // the cancel routine releases the cancel spinlock
+    Irp->CancelIrql = irql;
+    routine(IoGetCurrentIrpStackLocation(Irp)->DeviceObject, Irp);
+
+    return TRUE;
+}
+
+NTSTATUS PoCallDriver(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+    return IofCallDriver(DeviceObject, Irp);
+}
+
+void PoStartNextPowerIrp(PIRP Irp) {
+    UNREFERENCED_PARAMETER(Irp);
+}
+
+struct shim_power_request {
+    PDEVICE_OBJECT device;
+    UCHAR minor_function;
+    POWER_STATE state;
+    PREQUEST_POWER_COMPLETE complete;
+    PVOID context;
+};
+
+static NTSTATUS shim_power_complete(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context) {
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    shim_power_request* request = static_cast<shim_power_request*>(Context);
+
+    if (request->complete) {
+        request->complete(request->device, request->minor_function, request->state, request->context, &Irp->IoStatus);
+    }
+
+    shim_free(request);
+    IoFreeIrp(Irp);
+
+    return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+NTSTATUS PoRequestPowerIrp(PDEVICE_OBJECT DeviceObject, UCHAR MinorFunction, POWER_STATE State, PREQUEST_POWER_COMPLETE Complete, PVOID Context, PIRP* Irp) {
+    // the power manager sends the irp to the top of the stack
+    PDEVICE_OBJECT top = DeviceObject;
+
+    while (top->AttachedDevice) {
+        top = top->AttachedDevice;
+    }
+
+    shim_power_request* request = static_cast<shim_power_request*>(shim_allocate(sizeof(shim_power_request)));
+    PIRP irp = IoAllocateIrp(top->StackSize, FALSE);
+
+    if (!request || !irp) {
+        if (request) {
+            shim_free(request);
+        }
+
+        if (irp) {
+            IoFreeIrp(irp);
+        }
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    request->device = DeviceObject;
+    request->minor_function = MinorFunction;
+    request->state = State;
+    request->complete = Complete;
+    request->context = Context;
+
+    PIO_STACK_LOCATION stack = IoGetNextIrpStackLocation(irp);
+    stack->MajorFunction = IRP_MJ_POWER;
+    stack->MinorFunction = MinorFunction;
+    stack->Parameters.Power.Type = DevicePowerState;
+    stack->Parameters.Power.State = State;
+
+    irp->IoStatus.Status = STATUS_NOT_SUPPORTED;
+
+    IoSetCompletionRoutine(irp, shim_power_complete, request, TRUE, TRUE, TRUE);
+
+    if (Irp) {
+        *Irp = irp;
+    }
+
+    PoCallDriver(top, irp);
+
+    return STATUS_PENDING;
+}
+
+/* cancel safe queue. The type tells a csq from a irp context in the
+   driver context of a queued irp */
+constexpr static ULONG shim_csq_type = 1;
+constexpr static ULONG shim_csq_context_type = 2;
+
+static void shim_csq_cancel(PDEVICE_OBJECT DeviceObject, PIRP Irp) {
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    IoReleaseCancelSpinLock(Irp->CancelIrql);
+
+    PVOID owner = Irp->Tail.Overlay.DriverContext[3];
+    PIO_CSQ_IRP_CONTEXT context = nullptr;
+    PIO_CSQ csq = static_cast<PIO_CSQ>(owner);
+
+    if (*static_cast<ULONG*>(owner) == shim_csq_context_type) {
+        context = static_cast<PIO_CSQ_IRP_CONTEXT>(owner);
+        csq = context->Csq;
+    }
+
+    KIRQL irql;
+    csq->CsqAcquireLock(csq, &irql);
+
+    csq->CsqRemoveIrp(csq, Irp);
+    Irp->Tail.Overlay.DriverContext[3] = nullptr;
+
+    if (context) {
+        context->Irp = nullptr;
+    }
+
+    csq->CsqReleaseLock(csq, irql);
+    csq->CsqCompleteCanceledIrp(csq, Irp);
+}
+
+NTSTATUS IoCsqInitialize(PIO_CSQ Csq, IO_CSQ_INSERT_IRP* Insert, IO_CSQ_REMOVE_IRP* Remove, IO_CSQ_PEEK_NEXT_IRP* Peek, IO_CSQ_ACQUIRE_LOCK* Acquire, IO_CSQ_RELEASE_LOCK* Release, IO_CSQ_COMPLETE_CANCELED_IRP* Complete) {
+    Csq->Type = shim_csq_type;
+    Csq->CsqInsertIrp = Insert;
+    Csq->CsqRemoveIrp = Remove;
+    Csq->CsqPeekNextIrp = Peek;
+    Csq->CsqAcquireLock = Acquire;
+    Csq->CsqReleaseLock = Release;
+    Csq->CsqCompleteCanceledIrp = Complete;
+    Csq->ReservePointer = nullptr;
+
+    return STATUS_SUCCESS;
+}
+
+void IoCsqInsertIrp(PIO_CSQ Csq, PIRP Irp, PIO_CSQ_IRP_CONTEXT Context) {
+    KIRQL irql;
+    Csq->CsqAcquireLock(Csq, &irql);
+
+    if (Context) {
+        Context->Type = shim_csq_context_type;
+        Context->Irp = Irp;
+        Context->Csq = Csq;
+        Irp->Tail.Overlay.DriverContext[3] = Context;
+    }
+    else {
+        Irp->Tail.Overlay.DriverContext[3] = Csq;
+    }
+
+    IoMarkIrpPending(Irp);
+    Csq->CsqInsertIrp(Csq, Irp);
+    IoSetCancelRoutine(Irp, shim_csq_cancel);
+
+    // the irp could be cancelled before the cancel routine was set
+    if (Irp->Cancel && IoSetCancelRoutine(Irp, nullptr)) {
+        Csq->CsqRemoveIrp(Csq, Irp);
+        Irp->Tail.Overlay.DriverContext[3] = nullptr;
+
+        if (Context) {
+            Context->Irp = nullptr;
+        }
+
+        Csq->CsqReleaseLock(Csq, irql);
+        Csq->CsqCompleteCanceledIrp(Csq, Irp);
+
+        return;
+    }
+
+    Csq->CsqReleaseLock(Csq, irql);
+}
+
+PIRP IoCsqRemoveNextIrp(PIO_CSQ Csq, PVOID PeekContext) {
+    KIRQL irql;
+    Csq->CsqAcquireLock(Csq, &irql);
+
+    PIRP irp = Csq->CsqPeekNextIrp(Csq, nullptr, PeekContext);
+
+    while (irp) {
+        // skip the irps that are being cancelled
+        if (!IoSetCancelRoutine(irp, nullptr)) {
+            irp = Csq->CsqPeekNextIrp(Csq, irp, PeekContext);
+            continue;
+        }
+
+        Csq->CsqRemoveIrp(Csq, irp);
+
+        PVOID owner = irp->Tail.Overlay.DriverContext[3];
+
+        if (owner && *static_cast<ULONG*>(owner) == shim_csq_context_type) {
+            static_cast<PIO_CSQ_IRP_CONTEXT>(owner)->Irp = nullptr;
+        }
+
+        irp->Tail.Overlay.DriverContext[3] = nullptr;
+        break;
+    }
+
+    Csq->CsqReleaseLock(Csq, irql);
+
+    return irp;
+}
+
+PIRP IoCsqRemoveIrp(PIO_CSQ Csq, PIO_CSQ_IRP_CONTEXT Context) {
+    KIRQL irql;
+    Csq->CsqAcquireLock(Csq, &irql);
+
+    PIRP irp = Context->Irp;
+
+    if (irp) {
+        // the cancel routine owns the irp when it already ran
+        if (IoSetCancelRoutine(irp, nullptr)) {
+            Csq->CsqRemoveIrp(Csq, irp);
+
+            irp->Tail.Overlay.DriverContext[3] = nullptr;
+            Context->Irp = nullptr;
+        }
+        else {
+            irp = nullptr;
+        }
+    }
+
+    Csq->CsqReleaseLock(Csq, irql);
+
+    return irp;
+}
+
+/* work items */
+struct _IO_WORKITEM {
+    PDEVICE_OBJECT device;
+};
+
+PIO_WORKITEM IoAllocateWorkItem(PDEVICE_OBJECT DeviceObject) {
+    PIO_WORKITEM item = static_cast<PIO_WORKITEM>(shim_allocate(sizeof(_IO_WORKITEM)));
+
+    if (item) {
+        item->device = DeviceObject;
+    }
+
+    return item;
+}
+
+void IoFreeWorkItem(PIO_WORKITEM WorkItem) {
+    shim_free(WorkItem);
+}
+
+void IoQueueWorkItem(PIO_WORKITEM WorkItem, PIO_WORKITEM_ROUTINE Routine, WORK_QUEUE_TYPE Queue, PVOID Context) {
+    UNREFERENCED_PARAMETER(Queue);
+
+    {
+        std::lock_guard<std::mutex> guard(shim().lock);
+        shim().work_items++;
+    }
+
+    // the routine can free the work item
+    PDEVICE_OBJECT device = WorkItem->device;
+
+    std::thread([device, Routine, Context] {
+        Routine(device, Context);
+
+        if (shim_irql != PASSIVE_LEVEL) {
+            shim_bugcheck("work item returned at a raised irql");
+        }
+
+        std::lock_guard<std::mutex> guard(shim().lock);
+        shim().work_items--;
+        shim().signal.notify_all();
+    }).detach();
+}
+
+void shim_wait_idle() {
+    std::unique_lock<std::mutex> guard(shim().lock);
+
+    shim().signal.wait(guard, [] {
+        return IsListEmpty(&shim().dpcs) && !shim().dpcs_running && !shim().work_items;
+    });
+}
+
+/* mdls. There are no physical pages, locking does nothing */
+static void shim_describe(PMDL Mdl, PVOID VirtualAddress, ULONG Length) {
+    const ULONG_PTR address = reinterpret_cast<ULONG_PTR>(VirtualAddress);
+
+    Mdl->StartVa = reinterpret_cast<PVOID>(address & ~static_cast<ULONG_PTR>(PAGE_SIZE - 1));
+    Mdl->ByteOffset = static_cast<ULONG>(address & (PAGE_SIZE - 1));
+    Mdl->ByteCount = Length;
+    Mdl->MappedSystemVa = VirtualAddress;
+}
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PIRP Irp) {
+    UNREFERENCED_PARAMETER(ChargeQuota);
+
+    PMDL mdl = static_cast<PMDL>(shim_allocate(sizeof(MDL)));
+
+    if (!mdl) {
+        return nullptr;
+    }
+
+    mdl->Size = sizeof(MDL);
+    shim_describe(mdl, VirtualAddress, Length);
+
+    if (Irp) {
+        if (!SecondaryBuffer) {
+            Irp->MdlAddress = mdl;
+        }
+        else {
+            PMDL last = Irp->MdlAddress;
+
+            while (last->Next) {
+                last = last->Next;
+            }
+
+            last->Next = mdl;
+        }
+    }
+
+    return mdl;
+}
+
+void IoFreeMdl(PMDL Mdl) {
+    shim_free(Mdl);
+}
+
+void IoBuildPartialMdl(PMDL Source, PMDL Target, PVOID VirtualAddress, ULONG Length) {
+    // a length of zero maps the rest of the source
+    if (!Length) {
+        Length = static_cast<ULONG>(
+            static_cast<char*>(MmGetMdlVirtualAddress(Source)) + MmGetMdlByteCount(Source) - static_cast<char*>(VirtualAddress)
+        );
+    }
+
+    shim_describe(Target, VirtualAddress, Length);
+}
+
+void MmProbeAndLockPages(PMDL Mdl, KPROCESSOR_MODE Mode, LOCK_OPERATION Operation) {
+    UNREFERENCED_PARAMETER(Mdl);
+    UNREFERENCED_PARAMETER(Mode);
+    UNREFERENCED_PARAMETER(Operation);
+}
+
+void MmUnlockPages(PMDL Mdl) {
+    UNREFERENCED_PARAMETER(Mdl);
+}
+
+void MmPrepareMdlForReuse(PMDL Mdl) {
+    UNREFERENCED_PARAMETER(Mdl);
+}
+
+void ProbeForRead(const volatile void* Address, SIZE_T Length, ULONG Alignment) {
+    UNREFERENCED_PARAMETER(Address);
+    UNREFERENCED_PARAMETER(Length);
+    UNREFERENCED_PARAMETER(Alignment);
+}
+
+void ProbeForWrite(volatile void* Address, SIZE_T Length, ULONG Alignment) {
+    UNREFERENCED_PARAMETER(Address);
+    UNREFERENCED_PARAMETER(Length);
+    UNREFERENCED_PARAMETER(Alignment);
+}
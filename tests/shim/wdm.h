@@ -0,0 +1,834 @@
+#pragma once
+
+/*
+ * Host version of the parts of wdm.h the driver uses, for the host
+ * tests. The types only match the WDK as far as the driver depends on
+ * them. The interlocked functions and the irp stack helpers are inline
+ * below, the rest is implemented in wdm.cpp on top of the standard
+ * library. Dispatch level is emulated per thread, nothing ever runs
+ * with interrupts disabled
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* annotations and compiler extensions */
+#define __in
+#define __out
+#define __inout
+#define _In_
+#define _Out_
+#define FORCEINLINE inline
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+#define UNREFERENCED_PARAMETER(x) (void)(x)
+#define CONTAINING_RECORD(address, type, field) ((type *)((char *)(address) - offsetof(type, field)))
+
+/* structured exception handling. The host never raises, only the
+   __try block runs. This replaces the __try of the standard library,
+   tests include the standard headers before this one */
+#undef __try
+#define __try if (1)
+#define __except(x) else if (0)
+#define GetExceptionCode() 0
+#define EXCEPTION_EXECUTE_HANDLER 1
+
+#define TRUE 1
+#define FALSE 0
+#define MAXUSHORT 0xffff
+#define MAXULONG 0xffffffffUL
+#define PAGE_SIZE 4096
+
+/* basic types. LONG and ULONG are 32 bit like on windows */
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONG64;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uint64_t ULONG64;
+typedef uint16_t USHORT;
+typedef unsigned char UCHAR;
+typedef char CHAR;
+typedef void* PVOID;
+typedef void VOID;
+typedef LONG* PLONG;
+typedef ULONG* PULONG;
+typedef UCHAR* PUCHAR;
+typedef USHORT* PUSHORT;
+typedef LONG64* PLONG64;
+typedef unsigned char BOOLEAN;
+typedef BOOLEAN* PBOOLEAN;
+typedef uintptr_t ULONG_PTR;
+typedef intptr_t LONG_PTR;
+typedef ULONG_PTR SIZE_T;
+typedef wchar_t WCHAR;
+typedef WCHAR* PWSTR;
+typedef const WCHAR* PCWSTR;
+typedef LONG NTSTATUS;
+typedef UCHAR KIRQL;
+typedef KIRQL* PKIRQL;
+typedef ULONG_PTR KSPIN_LOCK;
+typedef KSPIN_LOCK* PKSPIN_LOCK;
+typedef ULONG ACCESS_MASK;
+typedef LONG KPRIORITY;
+typedef CHAR KPROCESSOR_MODE;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+/* status codes */
+#define NT_SUCCESS(s) (((NTSTATUS)(s)) >= 0)
+#define STATUS_SUCCESS ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW ((NTSTATUS)0x80000005L)
+#define STATUS_DEVICE_BUSY ((NTSTATUS)0x80000011L)
+#define STATUS_NO_MORE_ENTRIES ((NTSTATUS)0x8000001AL)
+#define STATUS_NO_DATA_DETECTED ((NTSTATUS)0x80000022L)
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED ((NTSTATUS)0xC0000002L)
+#define STATUS_ACCESS_VIOLATION ((NTSTATUS)0xC0000005L)
+#define STATUS_INVALID_HANDLE ((NTSTATUS)0xC0000008L)
+#define STATUS_INVALID_PARAMETER ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_SUCH_DEVICE ((NTSTATUS)0xC000000EL)
+#define STATUS_INVALID_DEVICE_REQUEST ((NTSTATUS)0xC0000010L)
+#define STATUS_MORE_PROCESSING_REQUIRED ((NTSTATUS)0xC0000016L)
+#define STATUS_BUFFER_TOO_SMALL ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND ((NTSTATUS)0xC0000034L)
+#define STATUS_SHARING_VIOLATION ((NTSTATUS)0xC0000043L)
+#define STATUS_DELETE_PENDING ((NTSTATUS)0xC0000056L)
+#define STATUS_INTEGER_OVERFLOW ((NTSTATUS)0xC0000095L)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009AL)
+#define STATUS_DEVICE_DATA_ERROR ((NTSTATUS)0xC000009CL)
+#define STATUS_DEVICE_NOT_CONNECTED ((NTSTATUS)0xC000009DL)
+#define STATUS_DEVICE_NOT_READY ((NTSTATUS)0xC00000A3L)
+#define STATUS_IO_TIMEOUT ((NTSTATUS)0xC00000B5L)
+#define STATUS_NOT_SUPPORTED ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED ((NTSTATUS)0xC0000120L)
+#define STATUS_INVALID_DEVICE_STATE ((NTSTATUS)0xC0000184L)
+#define STATUS_INVALID_BUFFER_SIZE ((NTSTATUS)0xC0000206L)
+#define STATUS_NOT_FOUND ((NTSTATUS)0xC0000225L)
+#define STATUS_ALREADY_REGISTERED ((NTSTATUS)0xC0000718L)
+
+#define PASSIVE_LEVEL 0
+#define APC_LEVEL 1
+#define DISPATCH_LEVEL 2
+
+#define IO_NO_INCREMENT 0
+#define EVENT_INCREMENT 1
+
+/* strings and lists */
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWSTR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _SINGLE_LIST_ENTRY {
+    struct _SINGLE_LIST_ENTRY* Next;
+} SINGLE_LIST_ENTRY;
+
+inline void InitializeListHead(PLIST_ENTRY Head) {
+    Head->Flink = Head->Blink = Head;
+}
+
+inline BOOLEAN IsListEmpty(const LIST_ENTRY* Head) {
+    return Head->Flink == Head;
+}
+
+inline void InsertTailList(PLIST_ENTRY Head, PLIST_ENTRY Entry) {
+    Entry->Flink = Head;
+    Entry->Blink = Head->Blink;
+    Head->Blink->Flink = Entry;
+    Head->Blink = Entry;
+}
+
+inline void InsertHeadList(PLIST_ENTRY Head, PLIST_ENTRY Entry) {
+    Entry->Blink = Head;
+    Entry->Flink = Head->Flink;
+    Head->Flink->Blink = Entry;
+    Head->Flink = Entry;
+}
+
+inline BOOLEAN RemoveEntryList(PLIST_ENTRY Entry) {
+    PLIST_ENTRY next = Entry->Flink;
+    PLIST_ENTRY previous = Entry->Blink;
+
+    previous->Flink = next;
+    next->Blink = previous;
+
+    return next == previous;
+}
+
+inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY Head) {
+    PLIST_ENTRY entry = Head->Flink;
+    RemoveEntryList(entry);
+
+    return entry;
+}
+
+/* dispatcher objects. Every object that can be waited on starts with
+   the header */
+typedef enum _SHIM_OBJECT_TYPE {
+    ShimNotificationEvent,
+    ShimSynchronizationEvent,
+    ShimSemaphore,
+    ShimMutex,
+    ShimNotificationTimer,
+    ShimSynchronizationTimer
+} SHIM_OBJECT_TYPE;
+
+typedef struct _DISPATCHER_HEADER {
+    LONG Type;
+    volatile LONG SignalState;
+} DISPATCHER_HEADER;
+
+typedef struct _KEVENT {
+    DISPATCHER_HEADER Header;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+typedef struct _KSEMAPHORE {
+    DISPATCHER_HEADER Header;
+    LONG Limit;
+} KSEMAPHORE, *PKSEMAPHORE, *PRKSEMAPHORE;
+
+typedef struct _KMUTEX {
+    DISPATCHER_HEADER Header;
+    PVOID OwnerThread;
+} KMUTEX, *PKMUTEX;
+
+typedef struct _FAST_MUTEX {
+    DISPATCHER_HEADER Header;
+    KIRQL OldIrql;
+} FAST_MUTEX, *PFAST_MUTEX;
+
+struct _KDPC;
+
+typedef void KDEFERRED_ROUTINE(struct _KDPC* Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+typedef KDEFERRED_ROUTINE* PKDEFERRED_ROUTINE;
+
+typedef struct _KDPC {
+    PKDEFERRED_ROUTINE DeferredRoutine;
+    PVOID DeferredContext;
+    PVOID SystemArgument1;
+    PVOID SystemArgument2;
+    LIST_ENTRY DpcListEntry;
+    volatile LONG Inserted;
+} KDPC, *PKDPC, *PRKDPC;
+
+typedef struct _KTIMER {
+    DISPATCHER_HEADER Header;
+    ULONGLONG DueTime;
+    LONG Period;
+    PKDPC Dpc;
+    LIST_ENTRY TimerListEntry;
+    BOOLEAN Inserted;
+} KTIMER, *PKTIMER;
+
+typedef struct _KFLOATING_SAVE {
+    ULONG Reserved;
+} KFLOATING_SAVE, *PKFLOATING_SAVE;
+
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _TIMER_TYPE {
+    NotificationTimer,
+    SynchronizationTimer
+} TIMER_TYPE;
+
+typedef enum _KWAIT_REASON {
+    Executive,
+    Suspended,
+    UserRequest
+} KWAIT_REASON;
+
+typedef enum _MODE {
+    KernelMode,
+    UserMode
+} MODE;
+
+typedef enum _POOL_TYPE {
+    NonPagedPool,
+    PagedPool
+} POOL_TYPE;
+
+typedef enum _LOCK_OPERATION {
+    IoReadAccess,
+    IoWriteAccess,
+    IoModifyAccess
+} LOCK_OPERATION;
+
+typedef enum _MM_PAGE_PRIORITY {
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+/* power */
+typedef enum _SYSTEM_POWER_STATE {
+    PowerSystemUnspecified,
+    PowerSystemWorking,
+    PowerSystemSleeping1,
+    PowerSystemSleeping2,
+    PowerSystemSleeping3,
+    PowerSystemHibernate,
+    PowerSystemShutdown,
+    PowerSystemMaximum
+} SYSTEM_POWER_STATE;
+
+#define POWER_SYSTEM_MAXIMUM 7
+
+typedef enum _DEVICE_POWER_STATE {
+    PowerDeviceUnspecified,
+    PowerDeviceD0,
+    PowerDeviceD1,
+    PowerDeviceD2,
+    PowerDeviceD3,
+    PowerDeviceMaximum
+} DEVICE_POWER_STATE;
+
+typedef union _POWER_STATE {
+    SYSTEM_POWER_STATE SystemState;
+    DEVICE_POWER_STATE DeviceState;
+} POWER_STATE;
+
+typedef enum _POWER_STATE_TYPE {
+    SystemPowerState,
+    DevicePowerState
+} POWER_STATE_TYPE;
+
+typedef struct _DEVICE_CAPABILITIES {
+    USHORT Size;
+    USHORT Version;
+    ULONG Flags;
+    ULONG Address;
+    ULONG UINumber;
+    DEVICE_POWER_STATE DeviceState[POWER_SYSTEM_MAXIMUM];
+    SYSTEM_POWER_STATE SystemWake;
+    DEVICE_POWER_STATE DeviceWake;
+    ULONG D1Latency;
+    ULONG D2Latency;
+    ULONG D3Latency;
+} DEVICE_CAPABILITIES, *PDEVICE_CAPABILITIES;
+
+/* io */
+typedef struct _IO_STATUS_BLOCK {
+    union {
+        NTSTATUS Status;
+        PVOID Pointer;
+    };
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+/* a mdl of the host only describes a virtual range, there are no
+   physical pages */
+typedef struct _MDL {
+    struct _MDL* Next;
+    USHORT Size;
+    USHORT MdlFlags;
+    PVOID Process;
+    PVOID MappedSystemVa;
+    PVOID StartVa;
+    ULONG ByteCount;
+    ULONG ByteOffset;
+} MDL, *PMDL;
+
+struct _DEVICE_OBJECT;
+struct _IRP;
+struct _DRIVER_OBJECT;
+
+typedef NTSTATUS IO_COMPLETION_ROUTINE(struct _DEVICE_OBJECT*, struct _IRP*, PVOID);
+typedef IO_COMPLETION_ROUTINE* PIO_COMPLETION_ROUTINE;
+typedef NTSTATUS DRIVER_DISPATCH(struct _DEVICE_OBJECT*, struct _IRP*);
+typedef DRIVER_DISPATCH* PDRIVER_DISPATCH;
+typedef void DRIVER_CANCEL(struct _DEVICE_OBJECT*, struct _IRP*);
+typedef DRIVER_CANCEL* PDRIVER_CANCEL;
+typedef NTSTATUS DRIVER_ADD_DEVICE(struct _DRIVER_OBJECT*, struct _DEVICE_OBJECT*);
+typedef void DRIVER_UNLOAD(struct _DRIVER_OBJECT*);
+
+typedef struct _DRIVER_EXTENSION {
+    DRIVER_ADD_DEVICE* AddDevice;
+} DRIVER_EXTENSION;
+
+#define IRP_MJ_CREATE 0x00
+#define IRP_MJ_CLOSE 0x02
+#define IRP_MJ_READ 0x03
+#define IRP_MJ_WRITE 0x04
+#define IRP_MJ_DEVICE_CONTROL 0x0e
+#define IRP_MJ_INTERNAL_DEVICE_CONTROL 0x0f
+#define IRP_MJ_CLEANUP 0x12
+#define IRP_MJ_POWER 0x16
+#define IRP_MJ_SYSTEM_CONTROL 0x17
+#define IRP_MJ_PNP 0x1b
+#define IRP_MJ_MAXIMUM_FUNCTION 0x1b
+
+#define IRP_MN_START_DEVICE 0x00
+#define IRP_MN_QUERY_REMOVE_DEVICE 0x01
+#define IRP_MN_REMOVE_DEVICE 0x02
+#define IRP_MN_CANCEL_REMOVE_DEVICE 0x03
+#define IRP_MN_STOP_DEVICE 0x04
+#define IRP_MN_QUERY_STOP_DEVICE 0x05
+#define IRP_MN_CANCEL_STOP_DEVICE 0x06
+#define IRP_MN_QUERY_CAPABILITIES 0x09
+#define IRP_MN_SURPRISE_REMOVAL 0x17
+
+#define IRP_MN_WAIT_WAKE 0x00
+#define IRP_MN_POWER_SEQUENCE 0x01
+#define IRP_MN_SET_POWER 0x02
+#define IRP_MN_QUERY_POWER 0x03
+
+#define SL_PENDING_RETURNED 0x01
+#define SL_INVOKE_ON_CANCEL 0x20
+#define SL_INVOKE_ON_SUCCESS 0x40
+#define SL_INVOKE_ON_ERROR 0x80
+
+#define DO_DIRECT_IO 0x10
+#define DO_DEVICE_INITIALIZING 0x80
+#define DO_POWER_PAGABLE 0x2000
+
+#define FILE_DEVICE_UNKNOWN 0x22
+#define FILE_DEVICE_USB FILE_DEVICE_UNKNOWN
+
+#define METHOD_BUFFERED 0
+#define METHOD_IN_DIRECT 1
+#define METHOD_OUT_DIRECT 2
+#define METHOD_NEITHER 3
+#define FILE_ANY_ACCESS 0
+#define CTL_CODE(t, f, m, a) (((t) << 16) | ((a) << 14) | ((f) << 2) | (m))
+
+typedef struct _FILE_OBJECT {
+    USHORT Type;
+    USHORT Size;
+    struct _DEVICE_OBJECT* DeviceObject;
+    PVOID FsContext;
+    PVOID FsContext2;
+    UNICODE_STRING FileName;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _IO_STACK_LOCATION {
+    UCHAR MajorFunction;
+    UCHAR MinorFunction;
+    UCHAR Flags;
+    UCHAR Control;
+
+    union {
+        struct {
+            ULONG Length;
+            ULONG Key;
+            LARGE_INTEGER ByteOffset;
+        } Read;
+
+        struct {
+            ULONG Length;
+            ULONG Key;
+            LARGE_INTEGER ByteOffset;
+        } Write;
+
+        struct {
+            ULONG OutputBufferLength;
+            ULONG InputBufferLength;
+            ULONG IoControlCode;
+            PVOID Type3InputBuffer;
+        } DeviceIoControl;
+
+        struct {
+            PDEVICE_CAPABILITIES Capabilities;
+        } DeviceCapabilities;
+
+        struct {
+            ULONG SystemContext;
+            POWER_STATE_TYPE Type;
+            POWER_STATE State;
+            ULONG ShutdownType;
+        } Power;
+
+        struct {
+            PVOID Argument1;
+            PVOID Argument2;
+            PVOID Argument3;
+            PVOID Argument4;
+        } Others;
+    } Parameters;
+
+    struct _DEVICE_OBJECT* DeviceObject;
+    PFILE_OBJECT FileObject;
+    PIO_COMPLETION_ROUTINE CompletionRoutine;
+    PVOID Context;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+/* the stack locations follow the irp. UserEvent and UserIosb are set
+   when a irp that reached the top is completed, like for a irp of
+   IoBuildDeviceIoControlRequest */
+typedef struct _IRP {
+    PMDL MdlAddress;
+
+    union {
+        struct _IRP* MasterIrp;
+        PVOID SystemBuffer;
+    } AssociatedIrp;
+
+    IO_STATUS_BLOCK IoStatus;
+    KPROCESSOR_MODE RequestorMode;
+    BOOLEAN PendingReturned;
+    CHAR StackCount;
+    CHAR CurrentLocation;
+    volatile BOOLEAN Cancel;
+    KIRQL CancelIrql;
+    PDRIVER_CANCEL volatile CancelRoutine;
+    PVOID UserBuffer;
+    PKEVENT UserEvent;
+    PIO_STATUS_BLOCK UserIosb;
+
+    union {
+        struct {
+            PVOID DriverContext[4];
+            LIST_ENTRY ListEntry;
+            PIO_STACK_LOCATION CurrentStackLocation;
+            PFILE_OBJECT OriginalFileObject;
+        } Overlay;
+    } Tail;
+} IRP, *PIRP;
+
+typedef struct _DEVICE_OBJECT {
+    struct _DRIVER_OBJECT* DriverObject;
+    PVOID DeviceExtension;
+    ULONG Flags;
+    CHAR StackSize;
+    struct _DEVICE_OBJECT* AttachedDevice;
+} DEVICE_OBJECT, *PDEVICE_OBJECT;
+
+typedef struct _DRIVER_OBJECT {
+    DRIVER_EXTENSION* DriverExtension;
+    DRIVER_UNLOAD* DriverUnload;
+    PDRIVER_DISPATCH MajorFunction[IRP_MJ_MAXIMUM_FUNCTION + 1];
+} DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+typedef struct _IO_WORKITEM* PIO_WORKITEM;
+typedef void IO_WORKITEM_ROUTINE(PDEVICE_OBJECT, PVOID);
+typedef IO_WORKITEM_ROUTINE* PIO_WORKITEM_ROUTINE;
+
+typedef enum _WORK_QUEUE_TYPE {
+    CriticalWorkQueue,
+    DelayedWorkQueue
+} WORK_QUEUE_TYPE;
+
+typedef void REQUEST_POWER_COMPLETE(PDEVICE_OBJECT, UCHAR, POWER_STATE, PVOID, PIO_STATUS_BLOCK);
+typedef REQUEST_POWER_COMPLETE* PREQUEST_POWER_COMPLETE;
+
+/* cancel safe queue */
+struct _IO_CSQ;
+
+typedef struct _IO_CSQ_IRP_CONTEXT {
+    ULONG Type;
+    PIRP Irp;
+    struct _IO_CSQ* Csq;
+} IO_CSQ_IRP_CONTEXT, *PIO_CSQ_IRP_CONTEXT;
+
+typedef void IO_CSQ_INSERT_IRP(struct _IO_CSQ*, PIRP);
+typedef void IO_CSQ_REMOVE_IRP(struct _IO_CSQ*, PIRP);
+typedef PIRP IO_CSQ_PEEK_NEXT_IRP(struct _IO_CSQ*, PIRP, PVOID);
+typedef void IO_CSQ_ACQUIRE_LOCK(struct _IO_CSQ*, PKIRQL);
+typedef void IO_CSQ_RELEASE_LOCK(struct _IO_CSQ*, KIRQL);
+typedef void IO_CSQ_COMPLETE_CANCELED_IRP(struct _IO_CSQ*, PIRP);
+
+typedef struct _IO_CSQ {
+    ULONG Type;
+    IO_CSQ_INSERT_IRP* CsqInsertIrp;
+    IO_CSQ_REMOVE_IRP* CsqRemoveIrp;
+    IO_CSQ_PEEK_NEXT_IRP* CsqPeekNextIrp;
+    IO_CSQ_ACQUIRE_LOCK* CsqAcquireLock;
+    IO_CSQ_RELEASE_LOCK* CsqReleaseLock;
+    IO_CSQ_COMPLETE_CANCELED_IRP* CsqCompleteCanceledIrp;
+    PVOID ReservePointer;
+} IO_CSQ, *PIO_CSQ;
+
+/* registry */
+typedef NTSTATUS RTL_QUERY_REGISTRY_ROUTINE(PWSTR, ULONG, PVOID, ULONG, PVOID, PVOID);
+
+typedef struct _RTL_QUERY_REGISTRY_TABLE {
+    RTL_QUERY_REGISTRY_ROUTINE* QueryRoutine;
+    ULONG Flags;
+    PWSTR Name;
+    PVOID EntryContext;
+    ULONG DefaultType;
+    PVOID DefaultData;
+    ULONG DefaultLength;
+} RTL_QUERY_REGISTRY_TABLE, *PRTL_QUERY_REGISTRY_TABLE;
+
+#define RTL_REGISTRY_ABSOLUTE 0
+#define RTL_REGISTRY_OPTIONAL 0x80000000
+#define RTL_QUERY_REGISTRY_SUBKEY 0x00000001
+#define RTL_QUERY_REGISTRY_DIRECT 0x00000020
+#define RTL_QUERY_REGISTRY_TYPECHECK 0x00000100
+#define RTL_QUERY_REGISTRY_TYPECHECK_SHIFT 24
+#define REG_NONE 0
+#define REG_DWORD 4
+
+/* lookaside lists */
+typedef struct _NPAGED_LOOKASIDE_LIST {
+    SIZE_T Size;
+    ULONG Tag;
+} NPAGED_LOOKASIDE_LIST, *PNPAGED_LOOKASIDE_LIST;
+
+typedef struct _KPROCESS* PEPROCESS;
+typedef struct _KTHREAD* PKTHREAD;
+
+/* interlocked functions. All of them are full barriers */
+inline LONG InterlockedIncrement(volatile LONG* Target) {
+    return __atomic_add_fetch(Target, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedDecrement(volatile LONG* Target) {
+    return __atomic_sub_fetch(Target, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchange(volatile LONG* Target, LONG Value) {
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchangeAdd(volatile LONG* Target, LONG Value) {
+    return __atomic_fetch_add(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedCompareExchange(volatile LONG* Target, LONG Exchange, LONG Comparand) {
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    // the comparand holds the value that was in the target
+    return Comparand;
+}
+
+inline LONG InterlockedOr(volatile LONG* Target, LONG Value) {
+    return __atomic_fetch_or(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedAnd(volatile LONG* Target, LONG Value) {
+    return __atomic_fetch_and(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedIncrement64(volatile LONG64* Target) {
+    return __atomic_add_fetch(Target, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedExchange64(volatile LONG64* Target, LONG64 Value) {
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedExchangeAdd64(volatile LONG64* Target, LONG64 Value) {
+    return __atomic_fetch_add(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG64 InterlockedCompareExchange64(volatile LONG64* Target, LONG64 Exchange, LONG64 Comparand) {
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    return Comparand;
+}
+
+inline PVOID InterlockedExchangePointer(PVOID volatile* Target, PVOID Value) {
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+inline PVOID InterlockedCompareExchangePointer(PVOID volatile* Target, PVOID Exchange, PVOID Comparand) {
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    return Comparand;
+}
+
+inline BOOLEAN BitScanForward(ULONG* Index, ULONG Mask) {
+    if (!Mask) {
+        return FALSE;
+    }
+
+    *Index = static_cast<ULONG>(__builtin_ctz(Mask));
+
+    return TRUE;
+}
+
+#define RtlMoveMemory(d, s, l) memmove((d), (s), (l))
+
+/* irp stack locations */
+inline PIO_STACK_LOCATION IoGetCurrentIrpStackLocation(PIRP Irp) {
+    return Irp->Tail.Overlay.CurrentStackLocation;
+}
+
+inline PIO_STACK_LOCATION IoGetNextIrpStackLocation(PIRP Irp) {
+    return Irp->Tail.Overlay.CurrentStackLocation - 1;
+}
+
+inline void IoSetNextIrpStackLocation(PIRP Irp) {
+    Irp->CurrentLocation--;
+    Irp->Tail.Overlay.CurrentStackLocation--;
+}
+
+inline void IoSkipCurrentIrpStackLocation(PIRP Irp) {
+    Irp->CurrentLocation++;
+    Irp->Tail.Overlay.CurrentStackLocation++;
+}
+
+inline void IoCopyCurrentIrpStackLocationToNext(PIRP Irp) {
+    PIO_STACK_LOCATION current = IoGetCurrentIrpStackLocation(Irp);
+    PIO_STACK_LOCATION next = IoGetNextIrpStackLocation(Irp);
+
+    // everything except the completion routine
+    memcpy(next, current, offsetof(IO_STACK_LOCATION, CompletionRoutine));
+    next->Control = 0;
+}
+
+inline PDRIVER_CANCEL IoSetCancelRoutine(PIRP Irp, PDRIVER_CANCEL Routine) {
+    return __atomic_exchange_n(&Irp->CancelRoutine, Routine, __ATOMIC_SEQ_CST);
+}
+
+inline void IoMarkIrpPending(PIRP Irp) {
+    IoGetCurrentIrpStackLocation(Irp)->Control |= SL_PENDING_RETURNED;
+}
+
+inline void IoSetCompletionRoutine(PIRP Irp, PIO_COMPLETION_ROUTINE Routine, PVOID Context, BOOLEAN Success, BOOLEAN Error, BOOLEAN Cancel) {
+    PIO_STACK_LOCATION next = IoGetNextIrpStackLocation(Irp);
+
+    next->CompletionRoutine = Routine;
+    next->Context = Context;
+    next->Control = 0;
+
+    if (Success) {
+        next->Control |= SL_INVOKE_ON_SUCCESS;
+    }
+
+    if (Error) {
+        next->Control |= SL_INVOKE_ON_ERROR;
+    }
+
+    if (Cancel) {
+        next->Control |= SL_INVOKE_ON_CANCEL;
+    }
+}
+
+/* mdls */
+inline ULONG MmGetMdlByteCount(PMDL Mdl) {
+    return Mdl->ByteCount;
+}
+
+inline PVOID MmGetMdlVirtualAddress(PMDL Mdl) {
+    return static_cast<char*>(Mdl->StartVa) + Mdl->ByteOffset;
+}
+
+inline PVOID MmGetSystemAddressForMdlSafe(PMDL Mdl, ULONG Priority) {
+    (void)Priority;
+
+    return MmGetMdlVirtualAddress(Mdl);
+}
+
+/* dispatcher objects and irql */
+KIRQL KeGetCurrentIrql();
+PKTHREAD KeGetCurrentThread();
+void KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+LONG KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait);
+void KeClearEvent(PRKEVENT Event);
+LONG KeResetEvent(PRKEVENT Event);
+LONG KeReadStateEvent(PRKEVENT Event);
+void KeInitializeSemaphore(PRKSEMAPHORE Semaphore, LONG Count, LONG Limit);
+LONG KeReleaseSemaphore(PRKSEMAPHORE Semaphore, KPRIORITY Increment, LONG Adjustment, BOOLEAN Wait);
+void KeInitializeMutex(PKMUTEX Mutex, ULONG Level);
+LONG KeReleaseMutex(PKMUTEX Mutex, BOOLEAN Wait);
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Timeout);
+void ExInitializeFastMutex(PFAST_MUTEX Mutex);
+void ExAcquireFastMutex(PFAST_MUTEX Mutex);
+void ExReleaseFastMutex(PFAST_MUTEX Mutex);
+
+/* spin locks */
+void KeInitializeSpinLock(PKSPIN_LOCK Lock);
+void KeAcquireSpinLock(PKSPIN_LOCK Lock, PKIRQL OldIrql);
+void KeReleaseSpinLock(PKSPIN_LOCK Lock, KIRQL NewIrql);
+void KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK Lock);
+void KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK Lock);
+void IoAcquireCancelSpinLock(PKIRQL Irql);
+void IoReleaseCancelSpinLock(KIRQL Irql);
+
+/* timers and dpcs. The dpcs run on a thread of the shim at dispatch
+   level */
+void KeInitializeTimer(PKTIMER Timer);
+void KeInitializeTimerEx(PKTIMER Timer, TIMER_TYPE Type);
+BOOLEAN KeSetTimer(PKTIMER Timer, LARGE_INTEGER DueTime, PKDPC Dpc);
+BOOLEAN KeSetTimerEx(PKTIMER Timer, LARGE_INTEGER DueTime, LONG Period, PKDPC Dpc);
+BOOLEAN KeCancelTimer(PKTIMER Timer);
+void KeInitializeDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE Routine, PVOID Context);
+BOOLEAN KeInsertQueueDpc(PRKDPC Dpc, PVOID SystemArgument1, PVOID SystemArgument2);
+void KeFlushQueuedDpcs();
+
+/* time */
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER Frequency);
+void KeQuerySystemTime(PLARGE_INTEGER Time);
+ULONGLONG KeQueryInterruptTime();
+
+NTSTATUS KeSaveFloatingPointState(PKFLOATING_SAVE State);
+NTSTATUS KeRestoreFloatingPointState(PKFLOATING_SAVE State);
+
+/* pool */
+PVOID ExAllocatePoolWithTag(POOL_TYPE Type, SIZE_T Size, ULONG Tag);
+void ExFreePool(PVOID Pointer);
+void ExFreePoolWithTag(PVOID Pointer, ULONG Tag);
+void ExInitializeNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List, PVOID Allocate, PVOID Free, ULONG Flags, SIZE_T Size, ULONG Tag, USHORT Depth);
+void ExDeleteNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List);
+PVOID ExAllocateFromNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List);
+void ExFreeToNPagedLookasideList(PNPAGED_LOOKASIDE_LIST List, PVOID Entry);
+
+/* devices */
+NTSTATUS IoCreateDevice(PDRIVER_OBJECT DriverObject, ULONG ExtensionSize, PUNICODE_STRING Name, ULONG Type, ULONG Characteristics, BOOLEAN Exclusive, PDEVICE_OBJECT* DeviceObject);
+void IoDeleteDevice(PDEVICE_OBJECT DeviceObject);
+NTSTATUS IoCreateSymbolicLink(PUNICODE_STRING Link, PUNICODE_STRING Name);
+NTSTATUS IoDeleteSymbolicLink(PUNICODE_STRING Link);
+PDEVICE_OBJECT IoAttachDeviceToDeviceStack(PDEVICE_OBJECT Source, PDEVICE_OBJECT Target);
+void IoDetachDevice(PDEVICE_OBJECT Target);
+void RtlInitUnicodeString(PUNICODE_STRING String, PCWSTR Source);
+BOOLEAN RtlEqualUnicodeString(const UNICODE_STRING* String1, const UNICODE_STRING* String2, BOOLEAN CaseInsensitive);
+NTSTATUS RtlQueryRegistryValues(ULONG RelativeTo, PCWSTR Path, PRTL_QUERY_REGISTRY_TABLE Table, PVOID Context, PVOID Environment);
+PEPROCESS IoGetCurrentProcess();
+
+#define PsGetCurrentProcess IoGetCurrentProcess
+#define ExGetPreviousMode() ((KPROCESSOR_MODE)UserMode)
+
+/* irps */
+PIRP IoAllocateIrp(CHAR StackSize, BOOLEAN ChargeQuota);
+void IoFreeIrp(PIRP Irp);
+void IoReuseIrp(PIRP Irp, NTSTATUS Status);
+void IoInitializeIrp(PIRP Irp, USHORT Size, CHAR StackSize);
+BOOLEAN IoCancelIrp(PIRP Irp);
+NTSTATUS IofCallDriver(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+void IofCompleteRequest(PIRP Irp, CHAR PriorityBoost);
+NTSTATUS PoCallDriver(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+void PoStartNextPowerIrp(PIRP Irp);
+NTSTATUS PoRequestPowerIrp(PDEVICE_OBJECT DeviceObject, UCHAR MinorFunction, POWER_STATE State, PREQUEST_POWER_COMPLETE Complete, PVOID Context, PIRP* Irp);
+
+#define IoCallDriver IofCallDriver
+#define IoCompleteRequest IofCompleteRequest
+
+NTSTATUS IoCsqInitialize(PIO_CSQ Csq, IO_CSQ_INSERT_IRP* Insert, IO_CSQ_REMOVE_IRP* Remove, IO_CSQ_PEEK_NEXT_IRP* Peek, IO_CSQ_ACQUIRE_LOCK* Acquire, IO_CSQ_RELEASE_LOCK* Release, IO_CSQ_COMPLETE_CANCELED_IRP* Complete);
+void IoCsqInsertIrp(PIO_CSQ Csq, PIRP Irp, PIO_CSQ_IRP_CONTEXT Context);
+PIRP IoCsqRemoveNextIrp(PIO_CSQ Csq, PVOID PeekContext);
+PIRP IoCsqRemoveIrp(PIO_CSQ Csq, PIO_CSQ_IRP_CONTEXT Context);
+
+/* work items. Every work item runs on its own thread */
+PIO_WORKITEM IoAllocateWorkItem(PDEVICE_OBJECT DeviceObject);
+void IoFreeWorkItem(PIO_WORKITEM WorkItem);
+void IoQueueWorkItem(PIO_WORKITEM WorkItem, PIO_WORKITEM_ROUTINE Routine, WORK_QUEUE_TYPE Queue, PVOID Context);
+
+/* mdls */
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PIRP Irp);
+void IoFreeMdl(PMDL Mdl);
+void IoBuildPartialMdl(PMDL Source, PMDL Target, PVOID VirtualAddress, ULONG Length);
+void MmProbeAndLockPages(PMDL Mdl, KPROCESSOR_MODE Mode, LOCK_OPERATION Operation);
+void MmUnlockPages(PMDL Mdl);
+void MmPrepareMdlForReuse(PMDL Mdl);
+void ProbeForRead(const volatile void* Address, SIZE_T Length, ULONG Alignment);
+void ProbeForWrite(volatile void* Address, SIZE_T Length, ULONG Alignment);
@@ -0,0 +1,96 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "fake_usb_device.hpp"
+
+/**
+ * @brief Time from plug in to the first read. Adds the driver to the
+ * fake, starts it and reads from the bulk in pipe like a application
+ * that waits for the device. Reports the time the pnp thread is held
+ * by the start irp and the time until the read is done, for a few
+ * urb latencies. The start reads the device descriptor, the
+ * configuration descriptor twice and selects the configuration
+ *
+ * usage: start_device_bench [rounds per latency]
+ *
+ */
+
+// the urbs of a start that take the latency
+constexpr static ULONG bench_start_urbs = 4;
+
+/**
+ * @brief The result of the rounds with a latency
+ *
+ */
+struct start_result {
+    double dispatch = 0;
+    double ready = 0;
+};
+
+static double microseconds_since(std::chrono::steady_clock::time_point Start) {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - Start).count();
+}
+
+/**
+ * @brief Plug in a device, start it and read from it
+ *
+ * @param Latency the time every urb takes in microseconds
+ * @param Rounds
+ * @return start_result the averages in microseconds
+ */
+static start_result run(ULONG Latency, ULONG Rounds) {
+    start_result result;
+
+    for (ULONG i = 0; i < Rounds; i++) {
+        fake_usb_device fake;
+        fake.latency = Latency;
+
+        UCHAR buffer[512];
+        fake_usb_handle pipe;
+
+        const auto start = std::chrono::steady_clock::now();
+
+        fake.add();
+
+        // the pnp thread is free again when the dispatch returns
+        fake_usb_request* request = fake.begin_pnp(IRP_MN_START_DEVICE);
+        result.dispatch += microseconds_since(start);
+
+        if (fake.wait(request) != STATUS_SUCCESS ||
+            fake.open(pipe, L"\\PIPE00") != STATUS_SUCCESS ||
+            fake.read(pipe, buffer, sizeof(buffer)) != STATUS_SUCCESS) {
+            printf("the device did not start\n");
+            exit(1);
+        }
+
+        result.ready += microseconds_since(start);
+
+        fake.close(pipe);
+    }
+
+    result.dispatch /= Rounds;
+    result.ready /= Rounds;
+
+    return result;
+}
+
+int main(int argc, char** argv) {
+    const unsigned long count = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 100;
+    const ULONG rounds = count ? count : 1;
+
+    printf("%u rounds, %u urbs in the start and 1 read\n", rounds, bench_start_urbs);
+    printf("latency us   pnp thread us   first read us   urbs x latency us\n");
+
+    // a idle bus, a frame of high speed, a frame of full speed and a
+    // slow device
+    const ULONG latencies[] = { 0, 125, 1000, 10000 };
+
+    for (ULONG latency : latencies) {
+        const start_result result = run(latency, rounds);
+
+        printf("%-12u %13.1f %15.1f %19u\n", latency, result.dispatch, result.ready, (bench_start_urbs + 1) * latency);
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <chrono>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+#include "chief/device_state.hpp"
+
+// the time every urb takes in the tests in microseconds
+constexpr static ULONG test_latency = 20000;
+
+static double milliseconds_since(std::chrono::steady_clock::time_point Start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - Start).count();
+}
+
+TEST(start_is_pended_until_the_device_is_configured) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.add(), STATUS_SUCCESS);
+
+    fake.latency = test_latency;
+
+    // the pnp thread gets the start irp back before the first urb is
+    // done
+    const auto start = std::chrono::steady_clock::now();
+    fake_usb_request* request = fake.begin_pnp(IRP_MN_START_DEVICE);
+
+    CHECK(milliseconds_since(start) < test_latency / 2000.0);
+    CHECK(!fake_usb_device::done(request));
+    CHECK(get_device_state(fake.device) == device_state::starting);
+
+    CHECK_EQUAL(fake.wait(request), STATUS_SUCCESS);
+    CHECK(get_device_state(fake.device) == device_state::started);
+
+    // the configuration of the fake does not fit in the first request
+    // so it is read twice. The urbs run one after the other
+    CHECK_EQUAL(fake.descriptor_requests, 3u);
+    CHECK_EQUAL(fake.select_configurations, 1u);
+    CHECK(milliseconds_since(start) >= 4 * (test_latency / 1000.0));
+}
+
+TEST(requests_wait_for_the_start) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.add(), STATUS_SUCCESS);
+
+    // the device does not answer the descriptor requests
+    fake.stalled = true;
+
+    fake_usb_request* request = fake.begin_pnp(IRP_MN_START_DEVICE);
+    CHECK(fake_usb_device::wait_until([&] { return fake.held_count(true) == 1; }));
+
+    // nothing is accepted before the device is configured
+    fake_usb_handle handle;
+    CHECK_EQUAL(fake.open(handle, L""), STATUS_DELETE_PENDING);
+    CHECK(!fake_usb_device::done(request));
+
+    fake.stalled = false;
+    fake.release(true);
+
+    CHECK_EQUAL(fake.wait(request), STATUS_SUCCESS);
+    CHECK_EQUAL(fake.open(handle, L""), STATUS_SUCCESS);
+
+    fake.close(handle);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
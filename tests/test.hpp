@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+/**
+ * @brief Minimal test runner for the host tests. Every test file is a
+ * executable with its own main that calls test_run. A failed check
+ * marks the test as failed and continues with the next check
+ *
+ */
+
+using test_function = void (*)();
+
+struct test_case {
+    const char* name;
+    test_function function;
+};
+
+inline std::vector<test_case>& test_cases() {
+    static std::vector<test_case> cases;
+    return cases;
+}
+
+inline bool& test_failed() {
+    static bool failed = false;
+    return failed;
+}
+
+struct test_registration {
+    test_registration(const char* Name, test_function Function) {
+        test_cases().push_back({ Name, Function });
+    }
+};
+
+inline void test_fail(const char* File, int Line, const char* Expression) {
+    printf("  %s:%d: check failed: %s\n", File, Line, Expression);
+    test_failed() = true;
+}
+
+/**
+ * @brief Run all the tests or only the test with the name in the
+ * first argument. Returns the exit code of the executable
+ *
+ * @param argc
+ * @param argv
+ * @return int
+ */
+inline int test_run(int argc, char** argv) {
+    unsigned long failures = 0;
+    unsigned long count = 0;
+
+    for (const test_case& current : test_cases()) {
+        if (argc > 1 && strcmp(argv[1], current.name)) {
+            continue;
+        }
+
+        test_failed() = false;
+        current.function();
+        count++;
+
+        printf("%s %s\n", test_failed() ? "FAIL" : "ok  ", current.name);
+
+        if (test_failed()) {
+            failures++;
+        }
+    }
+
+    printf("%lu of %lu tests passed\n", count - failures, count);
+
+    return (failures || !count) ? 1 : 0;
+}
+
+#define TEST(name) \
+    static void name(); \
+    static test_registration name##_registration(#name, name); \
+    static void name()
+
+#define CHECK(expression) \
+    do { \
+        if (!(expression)) { \
+            test_fail(__FILE__, __LINE__, #expression); \
+        } \
+    } while (0)
+
+#define CHECK_EQUAL(a, b) CHECK((a) == (b))
+
+// stop the test when the check fails. For checks the rest of the
+// test depends on
+#define REQUIRE(expression) \
+    do { \
+        if (!(expression)) { \
+            test_fail(__FILE__, __LINE__, #expression); \
+            return; \
+        } \
+    } while (0)
@@ -0,0 +1,116 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "shim.hpp"
+#include "chief/trigger.hpp"
+
+/**
+ * @brief Search throughput of the trigger filter against the line rate
+ * of the bus. Filters completed buffers without a match, so every byte
+ * is searched and nothing is moved. Random data only has a anchor
+ * candidate every 256 bytes, data that is full of the anchor byte
+ * checks the full pattern at every position. Runs the vector search
+ * and the scalar search the driver uses when the floating point state
+ * cannot be saved
+ *
+ * usage: trigger_bench [megabytes per run]
+ *
+ */
+
+// the buffer of a bulk in read
+constexpr static ULONG bench_buffer_size = 64 * 1024;
+
+// the line rates in bytes per second. High speed bulk has 13 packets
+// of 512 bytes every 125 us, super speed has 5 Gbit/s with 8b/10b
+constexpr static double bench_high_speed = 13.0 * 512 * 8000;
+constexpr static double bench_super_speed = 500e6;
+
+/**
+ * @brief Filter the buffer until the bytes are searched
+ *
+ * @return double bytes per second
+ */
+static double run(trigger_filter& Filter, std::vector<UCHAR>& Buffer, ULONGLONG Bytes) {
+    const ULONGLONG buffers = (Bytes + Buffer.size() - 1) / Buffer.size();
+    ULONG returned = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (ULONGLONG i = 0; i < buffers; i++) {
+        trigger_window window = {};
+        returned += trigger_filter_buffer(Filter, window, Buffer.data(), static_cast<ULONG>(Buffer.size()));
+    }
+
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // a buffer without a match returns nothing
+    if (returned) {
+        printf("the data had a match\n");
+        exit(1);
+    }
+
+    return (buffers * Buffer.size()) / elapsed;
+}
+
+int main(int argc, char** argv) {
+    const unsigned long megabytes = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 1024;
+    const ULONGLONG bytes = static_cast<ULONGLONG>(megabytes ? megabytes : 1) * 1024 * 1024;
+
+    std::vector<UCHAR> random(bench_buffer_size);
+    std::vector<UCHAR> anchors(bench_buffer_size, 0x5a);
+
+    srand(1);
+
+    for (UCHAR& byte : random) {
+        byte = static_cast<UCHAR>(rand());
+    }
+
+    // patterns of 8 bytes that start with the anchor byte and never
+    // match the data. The random data has no 0xa5
+    for (UCHAR& byte : random) {
+        byte = (byte == 0xa5) ? 0x00 : byte;
+    }
+
+    usb_chief_trigger_config config = {};
+
+    for (ULONG i = 0; i < chief_max_trigger_patterns; i++) {
+        usb_chief_trigger_pattern& pattern = config.patterns[i];
+        pattern.length = 8;
+
+        for (ULONG j = 0; j < pattern.length; j++) {
+            pattern.pattern[j] = static_cast<UCHAR>((j == 0) ? 0x5a : ((j == 1) ? 0xa5 : i + j));
+            pattern.mask[j] = 0xff;
+        }
+    }
+
+    trigger_filter filter;
+    trigger_init(filter);
+
+    printf("%lu MB per run in %lu KB buffers\n", megabytes ? megabytes : 1, static_cast<unsigned long>(bench_buffer_size / 1024));
+    printf("search  data     patterns     MB/s   x high speed   x super speed\n");
+
+    const ULONG counts[] = { 1, chief_max_trigger_patterns };
+
+    for (int vector = 1; vector >= 0; vector--) {
+        shim_fail_floating_save(!vector);
+
+        for (ULONG count : counts) {
+            config.count = count;
+            trigger_configure(filter, config);
+
+            const double random_rate = run(filter, random, bytes);
+            const double anchor_rate = run(filter, anchors, bytes / 16);
+
+            printf("%-7s random   %8lu %8.0f %14.1f %15.2f\n", vector ? "sse2" : "scalar",
+                static_cast<unsigned long>(count), random_rate / 1e6, random_rate / bench_high_speed, random_rate / bench_super_speed);
+            printf("%-7s anchors  %8lu %8.0f %14.1f %15.2f\n", vector ? "sse2" : "scalar",
+                static_cast<unsigned long>(count), anchor_rate / 1e6, anchor_rate / bench_high_speed, anchor_rate / bench_super_speed);
+        }
+    }
+
+    shim_fail_floating_save(false);
+
+    return 0;
+}
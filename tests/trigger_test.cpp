@@ -0,0 +1,334 @@
+#include <cstdlib>
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+#include "chief/trigger.hpp"
+
+// the buffer lengths the search is checked with. Covers the buffers
+// that are shorter than a block and the positions after the last one
+constexpr static ULONG test_max_length = 80;
+constexpr static ULONG test_rounds = 5000;
+
+static usb_chief_trigger_pattern make_pattern(std::initializer_list<UCHAR> Bytes, UCHAR Mask = 0xff) {
+    usb_chief_trigger_pattern pattern = {};
+
+    for (UCHAR byte : Bytes) {
+        pattern.pattern[pattern.length] = byte;
+        pattern.mask[pattern.length] = Mask;
+        pattern.length++;
+    }
+
+    return pattern;
+}
+
+static usb_chief_trigger_config make_config(ULONG PreWindow, ULONG PostWindow, std::initializer_list<usb_chief_trigger_pattern> Patterns) {
+    usb_chief_trigger_config config = {};
+    config.pre_window = PreWindow;
+    config.post_window = PostWindow;
+
+    for (const usb_chief_trigger_pattern& pattern : Patterns) {
+        config.patterns[config.count++] = pattern;
+    }
+
+    return config;
+}
+
+/**
+ * @brief The first match of any pattern the simple way
+ *
+ * @return ULONG Length when nothing matched
+ */
+static ULONG reference_match(const usb_chief_trigger_config& Config, const UCHAR* Data, ULONG Length, ULONG& OutLength) {
+    for (ULONG offset = 0; offset < Length; offset++) {
+        for (ULONG i = 0; i < Config.count; i++) {
+            const usb_chief_trigger_pattern& pattern = Config.patterns[i];
+            bool match = (offset + pattern.length) <= Length;
+
+            for (ULONG j = 0; match && j < pattern.length; j++) {
+                match = (Data[offset + j] & pattern.mask[j]) == (pattern.pattern[j] & pattern.mask[j]);
+            }
+
+            if (match) {
+                OutLength = pattern.length;
+                return offset;
+            }
+        }
+    }
+
+    return Length;
+}
+
+TEST(configure_checks_the_patterns) {
+    trigger_filter filter;
+    trigger_init(filter);
+    CHECK(!trigger_is_enabled(filter));
+
+    usb_chief_trigger_config config = make_config(0, 0, { make_pattern({ 1, 2 }) });
+    config.count = chief_max_trigger_patterns + 1;
+    CHECK_EQUAL(trigger_configure(filter, config), STATUS_INVALID_PARAMETER);
+
+    // a empty pattern, a pattern that is too long and a pattern
+    // without a mask
+    config = make_config(0, 0, { make_pattern({}) });
+    CHECK_EQUAL(trigger_configure(filter, config), STATUS_INVALID_PARAMETER);
+
+    config = make_config(0, 0, { make_pattern({ 1 }) });
+    config.patterns[0].length = chief_max_trigger_length + 1;
+    CHECK_EQUAL(trigger_configure(filter, config), STATUS_INVALID_PARAMETER);
+
+    config = make_config(0, 0, { make_pattern({ 1, 2 }, 0) });
+    CHECK_EQUAL(trigger_configure(filter, config), STATUS_INVALID_PARAMETER);
+    CHECK(!trigger_is_enabled(filter));
+
+    config = make_config(0, 0, { make_pattern({ 1, 2 }) });
+    CHECK_EQUAL(trigger_configure(filter, config), STATUS_SUCCESS);
+    CHECK(trigger_is_enabled(filter));
+
+    // no patterns disables it again
+    config.count = 0;
+    CHECK_EQUAL(trigger_configure(filter, config), STATUS_SUCCESS);
+    CHECK(!trigger_is_enabled(filter));
+
+    // a disabled filter returns everything
+    UCHAR data[32] = {};
+    trigger_window window = {};
+    CHECK_EQUAL(trigger_filter_buffer(filter, window, data, sizeof(data)), sizeof(data));
+}
+
+TEST(window_around_a_match) {
+    trigger_filter filter;
+    trigger_init(filter);
+
+    UCHAR data[256];
+
+    for (ULONG i = 0; i < sizeof(data); i++) {
+        data[i] = static_cast<UCHAR>(i);
+    }
+
+    CHECK_EQUAL(trigger_configure(filter, make_config(10, 20, { make_pattern({ 100, 101, 102 }) })), STATUS_SUCCESS);
+
+    trigger_window window = {};
+    CHECK_EQUAL(trigger_filter_buffer(filter, window, data, sizeof(data)), 10u + 3 + 20);
+    CHECK_EQUAL(window.post_remaining, 0u);
+
+    // the window was moved to the start of the buffer
+    CHECK_EQUAL(data[0], 90);
+    CHECK_EQUAL(data[32], 122);
+}
+
+TEST(post_window_continues_in_the_next_buffer) {
+    trigger_filter filter;
+    trigger_init(filter);
+
+    // the match is 2 bytes from the start, the pre window is cut off
+    CHECK_EQUAL(trigger_configure(filter, make_config(8, 40, { make_pattern({ 0xaa, 0xbb }) })), STATUS_SUCCESS);
+
+    UCHAR data[32] = {};
+    data[2] = 0xaa;
+    data[3] = 0xbb;
+
+    trigger_window window = {};
+    CHECK_EQUAL(trigger_filter_buffer(filter, window, data, sizeof(data)), 32u);
+    CHECK_EQUAL(window.post_remaining, 2u + 2 + 40 - 32);
+
+    // the rest of the window starts the next buffer
+    UCHAR next[32] = {};
+    CHECK_EQUAL(trigger_filter_buffer(filter, window, next, sizeof(next)), 12u);
+    CHECK_EQUAL(window.post_remaining, 0u);
+
+    // and the buffer after that has nothing
+    CHECK_EQUAL(trigger_filter_buffer(filter, window, next, sizeof(next)), 0u);
+}
+
+TEST(first_match_of_any_pattern) {
+    trigger_filter filter;
+    trigger_init(filter);
+
+    // the second pattern only checks the high nibble of its first byte
+    usb_chief_trigger_pattern masked = make_pattern({ 0x50, 0x06 });
+    masked.mask[0] = 0xf0;
+
+    CHECK_EQUAL(trigger_configure(filter, make_config(0, 0, { make_pattern({ 0x01, 0x02 }), masked })), STATUS_SUCCESS);
+
+    UCHAR data[64] = {};
+    data[40] = 0x01;
+    data[41] = 0x02;
+    data[20] = 0x5f;
+    data[21] = 0x06;
+
+    trigger_window window = {};
+    CHECK_EQUAL(trigger_filter_buffer(filter, window, data, sizeof(data)), 2u);
+    CHECK_EQUAL(data[0], 0x5f);
+
+    // a match in the last bytes of the buffer
+    UCHAR tail[64] = {};
+    tail[62] = 0x01;
+    tail[63] = 0x02;
+
+    CHECK_EQUAL(trigger_filter_buffer(filter, window, tail, sizeof(tail)), 2u);
+
+    // a pattern cut off by the end of the buffer does not match. The
+    // filter moved the last match to the start
+    memset(tail, 0x00, sizeof(tail));
+    tail[63] = 0x01;
+
+    CHECK_EQUAL(trigger_filter_buffer(filter, window, tail, sizeof(tail)), 0u);
+}
+
+TEST(match_at_the_end_of_every_length) {
+    trigger_filter filter;
+    trigger_init(filter);
+
+    ULONG wrong = 0;
+
+    for (ULONG length = 1; length <= test_max_length; length++) {
+        for (ULONG pattern_length = 1; pattern_length <= 4 && pattern_length <= length; pattern_length++) {
+            const usb_chief_trigger_pattern pattern = make_pattern({ 0x11, 0x22, 0x33, 0x44 });
+            usb_chief_trigger_config config = make_config(0, 0, { pattern });
+            config.patterns[0].length = pattern_length;
+
+            trigger_configure(filter, config);
+
+            // the data after the buffer would complete the pattern
+            UCHAR data[test_max_length + 16] = {};
+            memcpy(data + length - pattern_length + 1, pattern.pattern, pattern_length);
+
+            trigger_window window = {};
+            wrong += (trigger_filter_buffer(filter, window, data, length) != 0) ? 1 : 0;
+
+            // and one byte earlier it is in the buffer
+            memset(data, 0x00, sizeof(data));
+            memcpy(data + length - pattern_length, pattern.pattern, pattern_length);
+
+            wrong += (trigger_filter_buffer(filter, window, data, length) != pattern_length) ? 1 : 0;
+        }
+    }
+
+    CHECK_EQUAL(wrong, 0u);
+}
+
+/**
+ * @brief Check the windows of the filter against the reference search
+ * on random data with the vector search or the scalar search
+ *
+ * @param Vector false lets the floating point save fail
+ * @return ULONG the amount of buffers that were different
+ */
+static ULONG compare_with_reference(bool Vector) {
+    trigger_filter filter;
+    trigger_init(filter);
+
+    shim_fail_floating_save(!Vector);
+    srand(Vector ? 1 : 2);
+
+    ULONG different = 0;
+
+    for (ULONG round = 0; round < test_rounds; round++) {
+        usb_chief_trigger_config config = {};
+        config.count = 1 + (rand() % chief_max_trigger_patterns);
+        config.pre_window = rand() % 8;
+        config.post_window = rand() % 8;
+
+        // short patterns of a small alphabet so they match often
+        for (ULONG i = 0; i < config.count; i++) {
+            usb_chief_trigger_pattern& pattern = config.patterns[i];
+            pattern.length = 1 + (rand() % 4);
+
+            for (ULONG j = 0; j < pattern.length; j++) {
+                pattern.pattern[j] = static_cast<UCHAR>(rand() % 4);
+                pattern.mask[j] = (rand() % 4) ? 0xff : 0x00;
+            }
+
+            pattern.mask[rand() % pattern.length] = 0x03;
+        }
+
+        trigger_configure(filter, config);
+
+        const ULONG length = 1 + (rand() % test_max_length);
+        UCHAR data[test_max_length];
+
+        for (ULONG i = 0; i < length; i++) {
+            data[i] = static_cast<UCHAR>(rand() % (round % 2 ? 4 : 64));
+        }
+
+        // the window we expect
+        ULONG match_length = 0;
+        const ULONG match = reference_match(config, data, length, match_length);
+
+        ULONG expected = 0;
+        UCHAR first = 0;
+
+        if (match < length) {
+            const ULONG start = (match > config.pre_window) ? match - config.pre_window : 0;
+            const ULONG end = match + match_length + config.post_window;
+
+            expected = ((end < length) ? end : length) - start;
+            first = data[start];
+        }
+
+        trigger_window window = {};
+        const ULONG returned = trigger_filter_buffer(filter, window, data, length);
+
+        if (returned != expected || (expected && data[0] != first)) {
+            different++;
+        }
+    }
+
+    shim_fail_floating_save(false);
+
+    return different;
+}
+
+TEST(vector_search_matches_the_reference) {
+    CHECK_EQUAL(compare_with_reference(true), 0u);
+
+    // every saved state was restored
+    CHECK_EQUAL(shim_floating_saved(), 0);
+}
+
+TEST(scalar_search_without_the_floating_point_state) {
+    CHECK_EQUAL(compare_with_reference(false), 0u);
+    CHECK_EQUAL(shim_floating_saved(), 0);
+}
+
+TEST(filtered_read_keeps_the_window) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    fake_usb_handle pipe;
+    CHECK_EQUAL(fake.open(pipe, L"\\PIPE00"), STATUS_SUCCESS);
+
+    // every transfer has the bytes 0 to 127, the match is at the end
+    fake.bulk_in_length = 128;
+
+    usb_chief_trigger_config config = make_config(6, 10, { make_pattern({ 126, 127 }) });
+    CHECK_EQUAL(fake.ioctl(&pipe, ioctl_set_trigger, &config, sizeof(config), 0), STATUS_SUCCESS);
+
+    // the first transfer keeps the pre window and the match. The post
+    // window continues in the second transfer, that one matches again
+    // and fills the rest of the buffer
+    UCHAR buffer[136] = {};
+    ULONG_PTR information = 0;
+
+    CHECK_EQUAL(fake.read(pipe, buffer, sizeof(buffer), &information), STATUS_SUCCESS);
+    CHECK_EQUAL(information, sizeof(buffer));
+    CHECK_EQUAL(fake.bulk_transfers, 2u);
+
+    CHECK_EQUAL(buffer[0], 120);
+    CHECK_EQUAL(buffer[7], 127);
+    CHECK_EQUAL(buffer[8], 0);
+    CHECK_EQUAL(buffer[135], 127);
+
+    // the trigger is only for pipe handles
+    fake_usb_handle handle;
+    CHECK_EQUAL(fake.open(handle, L""), STATUS_SUCCESS);
+    CHECK_EQUAL(fake.ioctl(&handle, ioctl_set_trigger, &config, sizeof(config), 0), STATUS_INVALID_HANDLE);
+
+    fake.close(handle);
+    fake.close(pipe);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
@@ -0,0 +1,157 @@
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+
+static NTSTATUS get(fake_usb_device& Fake, fake_usb_handle& Handle, usb_chief_tunables& OutTunables) {
+    return Fake.ioctl(&Handle, ioctl_get_tunables, &OutTunables, 0, sizeof(OutTunables));
+}
+
+static NTSTATUS set(fake_usb_device& Fake, fake_usb_handle& Handle, usb_chief_tunables Tunables) {
+    return Fake.ioctl(&Handle, ioctl_set_tunables, &Tunables, sizeof(Tunables), 0);
+}
+
+static LONG bulk_budget(fake_usb_device& Fake) {
+    return Fake.extension()->scheduler.classes[chief_transfer_bulk].budget;
+}
+
+TEST(defaults) {
+    fake_usb_device fake;
+    fake.start();
+
+    fake_usb_handle control;
+    fake.open(control, L"");
+
+    usb_chief_tunables tunables = {};
+    CHECK_EQUAL(get(fake, control, tunables), STATUS_SUCCESS);
+
+    // the registry of the shim has no Parameters key
+    CHECK_EQUAL(tunables.max_transfer_size, 64000u);
+    CHECK_EQUAL(tunables.interrupt_budget, static_cast<ULONG>(scheduler_interrupt_budget));
+    CHECK_EQUAL(tunables.bulk_budget, static_cast<ULONG>(scheduler_bulk_budget));
+    CHECK_EQUAL(tunables.trace_mask, 0u);
+    CHECK_EQUAL(tunables.watchdog_interval, 1000u);
+
+    // the output and input should fit the tunables
+    ULONG small = 0;
+    CHECK_EQUAL(fake.ioctl(&control, ioctl_get_tunables, &small, 0, sizeof(small)), STATUS_BUFFER_TOO_SMALL);
+    CHECK_EQUAL(fake.ioctl(&control, ioctl_set_tunables, &tunables, sizeof(tunables) - 1, 0), STATUS_BUFFER_TOO_SMALL);
+
+    fake.close(control);
+}
+
+TEST(values_out_of_range) {
+    fake_usb_device fake;
+    fake.start();
+
+    fake_usb_handle control;
+    fake.open(control, L"");
+
+    usb_chief_tunables defaults = {};
+    get(fake, control, defaults);
+
+    // a value on both sides of the range of a few tunables
+    struct {
+        unsigned long usb_chief_tunables::*field;
+        unsigned long below;
+        unsigned long above;
+    } ranges[] = {
+        { &usb_chief_tunables::max_transfer_size, 0, (1024 * 1024) + 1 },
+        { &usb_chief_tunables::max_adaptive_size, 511, (1024 * 1024) + 1 },
+        { &usb_chief_tunables::interrupt_budget, 0, 65 },
+        { &usb_chief_tunables::bulk_budget, 0, 257 },
+        { &usb_chief_tunables::fanout_depth, 0, chief_max_fanout_depth + 1 },
+        { &usb_chief_tunables::control_deadline, 99, 60001 },
+    };
+
+    for (const auto& range : ranges) {
+        for (unsigned long value : { range.below, range.above }) {
+            usb_chief_tunables tunables = defaults;
+
+            // a valid change in the same request is not applied either
+            tunables.*range.field = value;
+            tunables.bulk_budget = (range.field == &usb_chief_tunables::bulk_budget) ? value : 4;
+
+            CHECK_EQUAL(set(fake, control, tunables), STATUS_INVALID_PARAMETER);
+        }
+    }
+
+    // the trace mask has no unknown bits
+    usb_chief_tunables tunables = defaults;
+    tunables.trace_mask = (chief_trace_mask_tap | chief_trace_mask_requests) + 1;
+    CHECK_EQUAL(set(fake, control, tunables), STATUS_INVALID_PARAMETER);
+
+    usb_chief_tunables current = {};
+    get(fake, control, current);
+    CHECK(memcmp(&current, &defaults, sizeof(current)) == 0);
+    CHECK_EQUAL(bulk_budget(fake), scheduler_bulk_budget);
+
+    // the bounds themselves are valid
+    tunables = defaults;
+    tunables.bulk_budget = 256;
+    tunables.control_deadline = 100;
+    tunables.max_transfer_size = 1;
+
+    CHECK_EQUAL(set(fake, control, tunables), STATUS_SUCCESS);
+    get(fake, control, current);
+    CHECK(memcmp(&current, &tunables, sizeof(current)) == 0);
+    CHECK_EQUAL(bulk_budget(fake), 256);
+
+    // and a read over the new maximum is rejected
+    UCHAR data[2] = {};
+    fake_usb_handle pipe;
+    fake.open(pipe, L"\\PIPE00");
+
+    CHECK_EQUAL(fake.read(pipe, data, sizeof(data)), STATUS_INVALID_BUFFER_SIZE);
+
+    fake.close(pipe);
+    fake.close(control);
+}
+
+TEST(applied_to_every_device) {
+    fake_usb_device first;
+    fake_usb_device second;
+
+    // two devices of the same driver
+    CHECK_EQUAL(first.start(), STATUS_SUCCESS);
+    CHECK_EQUAL(second.add(first), STATUS_SUCCESS);
+    CHECK_EQUAL(second.pnp(IRP_MN_START_DEVICE), STATUS_SUCCESS);
+
+    fake_usb_handle control;
+    first.open(control, L"");
+
+    usb_chief_tunables tunables = {};
+    get(first, control, tunables);
+
+    // a change on one device changes the budgets and tracing of both
+    tunables.bulk_budget = 4;
+    tunables.trace_mask = chief_trace_mask_requests;
+
+    CHECK_EQUAL(set(first, control, tunables), STATUS_SUCCESS);
+    CHECK_EQUAL(bulk_budget(first), 4);
+    CHECK_EQUAL(bulk_budget(second), 4);
+    CHECK(first.extension()->trace_enabled);
+    CHECK(second.extension()->trace_enabled);
+
+    // a device that is added later starts with the changed values
+    fake_usb_device third;
+    CHECK_EQUAL(third.add(first), STATUS_SUCCESS);
+    CHECK_EQUAL(third.pnp(IRP_MN_START_DEVICE), STATUS_SUCCESS);
+    CHECK_EQUAL(bulk_budget(third), 4);
+    CHECK(third.extension()->trace_enabled);
+
+    // a removed device is not changed anymore
+    third.remove();
+    second.remove();
+
+    tunables.bulk_budget = 8;
+    tunables.trace_mask = 0;
+
+    CHECK_EQUAL(set(first, control, tunables), STATUS_SUCCESS);
+    CHECK_EQUAL(bulk_budget(first), 8);
+    CHECK(!first.extension()->trace_enabled);
+
+    first.close(control);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
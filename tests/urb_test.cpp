@@ -0,0 +1,200 @@
+#include <type_traits>
+
+#include "test.hpp"
+#include "chief/urb.hpp"
+
+// true when the urb function has a structure in urb_function_traits
+template <USHORT Function, typename = void>
+struct has_urb_traits : std::false_type {};
+
+template <USHORT Function>
+struct has_urb_traits<Function, std::void_t<typename urb_function_traits<Function>::type>> : std::true_type {};
+
+static_assert(std::is_same<urb_type<URB_FUNCTION_SELECT_CONFIGURATION>, _URB_SELECT_CONFIGURATION>::value, "select configuration");
+static_assert(std::is_same<urb_type<URB_FUNCTION_ABORT_PIPE>, _URB_PIPE_REQUEST>::value, "abort pipe");
+static_assert(std::is_same<urb_type<URB_FUNCTION_RESET_PIPE>, _URB_PIPE_REQUEST>::value, "reset pipe");
+static_assert(std::is_same<urb_type<URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER>, _URB_BULK_OR_INTERRUPT_TRANSFER>::value, "bulk");
+static_assert(std::is_same<urb_type<URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE>, _URB_CONTROL_DESCRIPTOR_REQUEST>::value, "descriptor");
+static_assert(std::is_same<urb_type<URB_FUNCTION_VENDOR_DEVICE>, _URB_CONTROL_VENDOR_OR_CLASS_REQUEST>::value, "vendor");
+
+// functions the driver does not send have no structure
+static_assert(!has_urb_traits<URB_FUNCTION_CONTROL_TRANSFER>::value, "control transfer");
+
+template <typename T>
+static void fill(T& Urb) {
+    // garbage from a previous user of the memory
+    memset(&Urb, 0xcc, sizeof(Urb));
+}
+
+template <typename T>
+static bool is_zero(const T& Value) {
+    const UCHAR* bytes = reinterpret_cast<const UCHAR*>(&Value);
+
+    for (size_t i = 0; i < sizeof(Value); i++) {
+        if (bytes[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename T>
+static bool header_is(const T& Urb, USHORT Function) {
+    return Urb.Hdr.Length == sizeof(T) && Urb.Hdr.Function == Function && Urb.Hdr.Status == 0 &&
+        Urb.Hdr.UsbdDeviceHandle == nullptr && Urb.Hdr.UsbdFlags == 0;
+}
+
+TEST(header_length) {
+    _URB_BULK_OR_INTERRUPT_TRANSFER bulk;
+    fill(bulk);
+    urb_set_header<URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER>(bulk);
+    CHECK(header_is(bulk, URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER));
+
+    _URB_PIPE_REQUEST pipe;
+    fill(pipe);
+    urb_set_header<URB_FUNCTION_RESET_PIPE>(pipe);
+    CHECK(header_is(pipe, URB_FUNCTION_RESET_PIPE));
+
+    // the pipe requests share the structure and only differ in the function
+    urb_set_header<URB_FUNCTION_ABORT_PIPE>(pipe);
+    CHECK(header_is(pipe, URB_FUNCTION_ABORT_PIPE));
+}
+
+TEST(urb_cast_is_the_same_memory) {
+    _URB_CONTROL_VENDOR_OR_CLASS_REQUEST vendor;
+    PURB urb = urb_cast(vendor);
+
+    CHECK(static_cast<void*>(urb) == static_cast<void*>(&vendor));
+    CHECK(&urb->UrbControlVendorClassRequest == &vendor);
+}
+
+TEST(bulk_clears_hca) {
+    _URB_BULK_OR_INTERRUPT_TRANSFER urb;
+    fill(urb);
+
+    int buffer;
+    MDL mdl = {};
+
+    urb_build_bulk_or_interrupt(
+        urb, reinterpret_cast<USBD_PIPE_HANDLE>(0x1234), USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK,
+        &buffer, &mdl, 512
+    );
+
+    CHECK(header_is(urb, URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER));
+    CHECK(urb.PipeHandle == reinterpret_cast<USBD_PIPE_HANDLE>(0x1234));
+    CHECK_EQUAL(urb.TransferFlags, static_cast<ULONG>(USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK));
+    CHECK_EQUAL(urb.TransferBufferLength, 512u);
+    CHECK(urb.TransferBuffer == &buffer);
+    CHECK(urb.TransferBufferMDL == &mdl);
+    CHECK(urb.UrbLink == nullptr);
+    CHECK(is_zero(urb.hca));
+}
+
+TEST(bulk_reuse) {
+    // a urb in a transfer context is built again for the next transfer
+    _URB_BULK_OR_INTERRUPT_TRANSFER urb;
+    fill(urb);
+
+    MDL mdl = {};
+    urb_build_bulk_or_interrupt(urb, nullptr, USBD_TRANSFER_DIRECTION_IN, nullptr, &mdl, 64);
+
+    // the usb stack writes the status and its own area
+    urb.Hdr.Status = USBD_STATUS_STALL_PID;
+    memset(&urb.hca, 0x55, sizeof(urb.hca));
+
+    urb_build_bulk_or_interrupt(urb, nullptr, USBD_TRANSFER_DIRECTION_OUT, nullptr, &mdl, 32);
+
+    CHECK(header_is(urb, URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER));
+    CHECK_EQUAL(urb.TransferFlags, static_cast<ULONG>(USBD_TRANSFER_DIRECTION_OUT));
+    CHECK_EQUAL(urb.TransferBufferLength, 32u);
+    CHECK(is_zero(urb.hca));
+}
+
+TEST(vendor_request) {
+    _URB_CONTROL_VENDOR_OR_CLASS_REQUEST urb;
+    UCHAR buffer[16];
+
+    fill(urb);
+    urb_build_vendor_request(urb, true, 0x42, 0x1234, 0x5678, buffer, sizeof(buffer));
+
+    CHECK(header_is(urb, URB_FUNCTION_VENDOR_DEVICE));
+    CHECK_EQUAL(urb.TransferFlags, static_cast<ULONG>(USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK));
+    CHECK_EQUAL(urb.TransferBufferLength, sizeof(buffer));
+    CHECK(urb.TransferBuffer == buffer);
+    CHECK(urb.TransferBufferMDL == nullptr);
+    CHECK(urb.UrbLink == nullptr);
+    CHECK(urb.Reserved == nullptr);
+    CHECK_EQUAL(urb.Reserved1, 0);
+    CHECK(is_zero(urb.hca));
+
+    // device to host, vendor, device
+    CHECK_EQUAL(urb.RequestTypeReservedBits, 0xc0);
+    CHECK_EQUAL(urb.Request, 0x42);
+    CHECK_EQUAL(urb.Value, 0x1234);
+    CHECK_EQUAL(urb.Index, 0x5678);
+
+    fill(urb);
+    urb_build_vendor_request(urb, false, 0x43, 1, 2, buffer, 4);
+
+    CHECK(header_is(urb, URB_FUNCTION_VENDOR_DEVICE));
+    CHECK_EQUAL(urb.TransferFlags, static_cast<ULONG>(USBD_TRANSFER_DIRECTION_OUT));
+    CHECK_EQUAL(urb.RequestTypeReservedBits, 0x40);
+    CHECK(is_zero(urb.hca));
+}
+
+TEST(get_descriptor) {
+    _URB_CONTROL_DESCRIPTOR_REQUEST urb;
+    USB_DEVICE_DESCRIPTOR descriptor;
+
+    fill(urb);
+    urb_build_get_descriptor(urb, USB_DEVICE_DESCRIPTOR_TYPE, 0, 0x0409, &descriptor, sizeof(descriptor));
+
+    CHECK(header_is(urb, URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE));
+    CHECK_EQUAL(urb.DescriptorType, USB_DEVICE_DESCRIPTOR_TYPE);
+    CHECK_EQUAL(urb.Index, 0);
+    CHECK_EQUAL(urb.LanguageId, 0x0409);
+    CHECK(urb.TransferBuffer == &descriptor);
+    CHECK_EQUAL(urb.TransferBufferLength, sizeof(descriptor));
+    CHECK(urb.TransferBufferMDL == nullptr);
+    CHECK(urb.Reserved == nullptr);
+    CHECK_EQUAL(urb.Reserved0, 0u);
+    CHECK_EQUAL(urb.Reserved1, 0);
+    CHECK_EQUAL(urb.Reserved2, 0);
+    CHECK(is_zero(urb.hca));
+}
+
+TEST(pipe_request) {
+    _URB_PIPE_REQUEST urb;
+
+    fill(urb);
+    urb_build_pipe_request<URB_FUNCTION_RESET_PIPE>(urb, reinterpret_cast<USBD_PIPE_HANDLE>(0x10));
+
+    CHECK(header_is(urb, URB_FUNCTION_RESET_PIPE));
+    CHECK(urb.PipeHandle == reinterpret_cast<USBD_PIPE_HANDLE>(0x10));
+    CHECK_EQUAL(urb.Reserved, 0u);
+
+    fill(urb);
+    urb_build_pipe_request<URB_FUNCTION_ABORT_PIPE>(urb, reinterpret_cast<USBD_PIPE_HANDLE>(0x20));
+
+    CHECK(header_is(urb, URB_FUNCTION_ABORT_PIPE));
+    CHECK(urb.PipeHandle == reinterpret_cast<USBD_PIPE_HANDLE>(0x20));
+    CHECK_EQUAL(urb.Reserved, 0u);
+}
+
+TEST(select_configuration) {
+    _URB_SELECT_CONFIGURATION urb;
+
+    // deselecting the configuration
+    fill(urb);
+    urb_build_select_configuration(urb, nullptr);
+
+    CHECK(header_is(urb, URB_FUNCTION_SELECT_CONFIGURATION));
+    CHECK(urb.ConfigurationDescriptor == nullptr);
+    CHECK(urb.ConfigurationHandle == nullptr);
+    CHECK(is_zero(urb.Interface));
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
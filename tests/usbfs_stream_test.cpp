@@ -0,0 +1,123 @@
+#include "test.hpp"
+#include "loopback_device.hpp"
+
+TEST(stream_in_order) {
+    loopback_device device;
+    loopback_checker checker;
+    usbfs_stream_stats stats;
+
+    // stop after 1MB in 4k urbs
+    const int result = usbfs_stream(device, 1, 8, 4096, 0, [&checker](const usbdevfs_urb& urb) {
+        CHECK_EQUAL(urb.endpoint, 0x81);
+        checker.check(static_cast<const uint8_t*>(urb.buffer), static_cast<size_t>(urb.actual_length));
+
+        return checker.bytes < 1024 * 1024;
+    }, stats);
+
+    CHECK_EQUAL(result, 0);
+    CHECK(checker.valid);
+    CHECK_EQUAL(checker.bytes, 1024 * 1024u);
+    CHECK_EQUAL(stats.bytes, 1024 * 1024u);
+    CHECK_EQUAL(stats.transfers, 256u);
+    CHECK_EQUAL(stats.errors, 0u);
+
+    // every urb came back from the device
+    CHECK(device.pending.empty());
+    CHECK(device.discarded.empty());
+    CHECK_EQUAL(device.submits, device.reaps);
+}
+
+TEST(stream_short_transfers) {
+    loopback_device device;
+    device.short_every = 4;
+
+    loopback_checker checker;
+    usbfs_stream_stats stats;
+
+    const int result = usbfs_stream(device, 2, 4, 1024, 0, [&](const usbdevfs_urb& urb) {
+        checker.check(static_cast<const uint8_t*>(urb.buffer), static_cast<size_t>(urb.actual_length));
+
+        return stats.transfers < 100;
+    }, stats);
+
+    CHECK_EQUAL(result, 0);
+    CHECK(checker.valid);
+    CHECK_EQUAL(stats.transfers, 100u);
+    CHECK_EQUAL(stats.short_transfers, 25u);
+    CHECK_EQUAL(stats.bytes, (75 * 1024u) + (25 * 512u));
+}
+
+TEST(stream_counts_errors) {
+    loopback_device device;
+    device.error_urb = 3;
+
+    usbfs_stream_stats stats;
+    unsigned long calls = 0;
+
+    const int result = usbfs_stream(device, 1, 4, 512, 0, [&calls](const usbdevfs_urb&) {
+        return ++calls < 10;
+    }, stats);
+
+    // the failed urb is counted and sent again
+    CHECK_EQUAL(result, 0);
+    CHECK_EQUAL(stats.errors, 1u);
+    CHECK_EQUAL(stats.transfers, 10u);
+    CHECK_EQUAL(device.submits, device.reaps);
+}
+
+TEST(stream_stops_on_submit_error) {
+    loopback_device device;
+
+    // the first resubmit fails
+    device.fail_submit = 5;
+
+    usbfs_stream_stats stats;
+
+    const int result = usbfs_stream(device, 1, 4, 512, 0, [](const usbdevfs_urb&) {
+        return true;
+    }, stats);
+
+    CHECK_EQUAL(result, -ENODEV);
+    CHECK_EQUAL(stats.transfers, 1u);
+
+    // the other urbs are discarded and reaped before we return
+    CHECK(device.pending.empty());
+    CHECK(device.discarded.empty());
+}
+
+TEST(stream_initial_submit_error) {
+    loopback_device device;
+    device.fail_submit = 3;
+
+    usbfs_stream_stats stats;
+    unsigned long calls = 0;
+
+    const int result = usbfs_stream(device, 1, 4, 512, 0, [&calls](const usbdevfs_urb&) {
+        calls++;
+        return true;
+    }, stats);
+
+    // the two urbs that were submitted are discarded
+    CHECK_EQUAL(result, -ENODEV);
+    CHECK_EQUAL(calls, 0u);
+    CHECK_EQUAL(device.reaps, 2u);
+    CHECK(device.pending.empty());
+}
+
+TEST(stream_stops_on_reap_error) {
+    loopback_device device;
+    device.fail_reap = 6;
+
+    usbfs_stream_stats stats;
+
+    const int result = usbfs_stream(device, 1, 4, 512, 0, [](const usbdevfs_urb&) {
+        return true;
+    }, stats);
+
+    CHECK_EQUAL(result, -ENODEV);
+    CHECK_EQUAL(stats.transfers, 5u);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
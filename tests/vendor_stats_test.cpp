@@ -0,0 +1,188 @@
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+
+// the performance counter ticks in a microsecond on the shim
+constexpr static LONGLONG test_ticks_per_us = 10;
+
+/**
+ * @brief A started fake with a handle on the device to read the
+ * statistics of the vendor requests
+ *
+ */
+struct vendor_device {
+    fake_usb_device fake;
+    fake_usb_handle control;
+
+    // the statistics are too big for the stack
+    std::unique_ptr<usb_chief_vendor_stats> stats = std::make_unique<usb_chief_vendor_stats>();
+
+    vendor_device() {
+        fake.start();
+        fake.open(control, L"");
+    }
+
+    ~vendor_device() {
+        fake.close(control);
+    }
+
+    void add(UCHAR Request, ULONGLONG Latency, NTSTATUS Status = STATUS_SUCCESS, ULONG Bytes = 8) {
+        vendor_stats_add(fake.device, Request, Bytes, Status, static_cast<LONGLONG>(Latency) * test_ticks_per_us);
+    }
+
+    NTSTATUS get(ULONG Flags = 0) {
+        memset(stats.get(), 0xff, sizeof(usb_chief_vendor_stats));
+        stats->flags = Flags;
+
+        return fake.ioctl(&control, ioctl_get_vendor_stats, stats.get(), sizeof(stats->flags), sizeof(usb_chief_vendor_stats));
+    }
+
+    const usb_chief_vendor_code_stats& code(UCHAR Request) {
+        return stats->codes[Request];
+    }
+};
+
+TEST(nothing_sent) {
+    vendor_device test;
+
+    CHECK_EQUAL(test.get(), STATUS_SUCCESS);
+
+    ULONGLONG requests = 0;
+
+    for (const usb_chief_vendor_code_stats& code : test.stats->codes) {
+        requests += code.requests;
+    }
+
+    CHECK_EQUAL(requests, 0u);
+
+    // only the reset flag is known
+    CHECK_EQUAL(test.get(0x2), STATUS_INVALID_PARAMETER);
+}
+
+TEST(vendor_requests_are_counted) {
+    vendor_device test;
+
+    // a send and receive of the application
+    std::vector<UCHAR> data(64);
+
+    usb_chief_vendor_request send = { 0x30, 0, 0, 8, data.data() };
+    usb_chief_vendor_request receive = { 0x31, 0, 0, 64, data.data() };
+
+    CHECK_EQUAL(test.fake.ioctl(&test.control, ioctl_vendor_send, &send, sizeof(send), sizeof(send)), STATUS_SUCCESS);
+    CHECK_EQUAL(test.fake.ioctl(&test.control, ioctl_vendor_receive, &receive, sizeof(receive), sizeof(receive)), STATUS_SUCCESS);
+    CHECK_EQUAL(test.fake.ioctl(&test.control, ioctl_vendor_receive, &receive, sizeof(receive), sizeof(receive)), STATUS_SUCCESS);
+
+    // a failed request counts as a error without bytes
+    test.add(0x31, 10, STATUS_UNSUCCESSFUL, 64);
+
+    CHECK_EQUAL(test.get(), STATUS_SUCCESS);
+    CHECK_EQUAL(test.code(0x30).requests, 1u);
+    CHECK_EQUAL(test.code(0x30).bytes, 8u);
+    CHECK_EQUAL(test.code(0x31).requests, 3u);
+    CHECK_EQUAL(test.code(0x31).bytes, 128u);
+    CHECK_EQUAL(test.code(0x31).errors, 1u);
+    CHECK_EQUAL(test.code(0x32).requests, 0u);
+}
+
+TEST(latency_buckets) {
+    vendor_device test;
+
+    // the first bucket ends at the base, every next one doubles it
+    const ULONGLONG base = chief_vendor_latency_base;
+
+    test.add(1, 0);
+    test.add(1, base - 1);
+    test.add(1, base);
+    test.add(1, (2 * base) - 1);
+    test.add(1, 2 * base);
+    test.add(1, (base << 13) - 1);
+    test.add(1, base << 14);
+    test.add(1, base << 20);
+
+    CHECK_EQUAL(test.get(), STATUS_SUCCESS);
+
+    const usb_chief_vendor_code_stats& code = test.code(1);
+    CHECK_EQUAL(code.latency[0], 2u);
+    CHECK_EQUAL(code.latency[1], 2u);
+    CHECK_EQUAL(code.latency[2], 1u);
+    CHECK_EQUAL(code.latency[13], 1u);
+    CHECK_EQUAL(code.latency[3], 0u);
+
+    // the last bucket has everything above
+    CHECK_EQUAL(code.latency[chief_vendor_latency_buckets - 1], 2u);
+
+    CHECK_EQUAL(code.max_latency, base << 20);
+    CHECK_EQUAL(code.total_latency, 0 + (base - 1) + base + ((2 * base) - 1) + (2 * base) + ((base << 13) - 1) + (base << 14) + (base << 20));
+}
+
+TEST(max_latency_from_many_threads) {
+    vendor_device test;
+
+    constexpr ULONG threads = 8;
+    constexpr ULONG requests = 20000;
+
+    // the threads race on the maximum with lower latencies. The
+    // highest comes from one request in the middle of one thread
+    std::vector<std::thread> workers;
+
+    for (ULONG t = 0; t < threads; t++) {
+        workers.emplace_back([&test, t] {
+            for (ULONG i = 0; i < requests; i++) {
+                const bool highest = (t == 3) && (i == requests / 2);
+                test.add(7, highest ? 1000000 : (i % 5000));
+            }
+        });
+    }
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    CHECK_EQUAL(test.get(), STATUS_SUCCESS);
+
+    const usb_chief_vendor_code_stats& code = test.code(7);
+    CHECK_EQUAL(code.requests, static_cast<ULONGLONG>(threads) * requests);
+    CHECK_EQUAL(code.max_latency, 1000000u);
+
+    // every request is in a bucket
+    ULONGLONG bucketed = 0;
+
+    for (ULONG bucket = 0; bucket < chief_vendor_latency_buckets; bucket++) {
+        bucketed += code.latency[bucket];
+    }
+
+    CHECK_EQUAL(bucketed, code.requests);
+}
+
+TEST(reset) {
+    vendor_device test;
+
+    test.add(2, 100);
+    test.add(2, 300);
+
+    // the reset returns the counters before they are cleared
+    CHECK_EQUAL(test.get(chief_vendor_stats_reset), STATUS_SUCCESS);
+    CHECK_EQUAL(test.code(2).requests, 2u);
+    CHECK_EQUAL(test.code(2).max_latency, 300u);
+    CHECK_EQUAL(test.code(2).latency[1] + test.code(2).latency[3], 2u);
+
+    CHECK_EQUAL(test.get(), STATUS_SUCCESS);
+    CHECK_EQUAL(test.code(2).requests, 0u);
+    CHECK_EQUAL(test.code(2).total_latency, 0u);
+    CHECK_EQUAL(test.code(2).max_latency, 0u);
+    CHECK_EQUAL(test.code(2).latency[1], 0u);
+
+    // a lower latency is the new maximum after the reset
+    test.add(2, 50);
+
+    CHECK_EQUAL(test.get(), STATUS_SUCCESS);
+    CHECK_EQUAL(test.code(2).requests, 1u);
+    CHECK_EQUAL(test.code(2).max_latency, 50u);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
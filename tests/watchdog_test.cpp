@@ -0,0 +1,175 @@
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "fake_usb_device.hpp"
+#include "chief/tunables.hpp"
+#include "chief/usb.hpp"
+#include "chief/watchdog.hpp"
+
+// the interval of the watchdog in the tests in milliseconds. Shorter
+// than the time a recovery request takes so the next check is due
+// while a recovery is still running
+constexpr static ULONG test_interval = 5;
+constexpr static ULONG test_latency = 20000;
+
+/**
+ * @brief Start the watchdog of the started devices with a interval.
+ * The control requests wait for the device, only the watchdog does
+ * something about a hang
+ *
+ */
+static void set_watchdog_interval(ULONG Interval) {
+    usb_chief_tunables tunables = get_tunables();
+    tunables.watchdog_interval = Interval;
+    tunables.control_deadline = 100;
+    tunables.control_timeout = 0;
+
+    tunables_set(tunables);
+}
+
+static usb_chief_watchdog_stats get_stats(fake_usb_device& Fake) {
+    usb_chief_watchdog_stats stats = {};
+    watchdog_get_stats(Fake.device, stats);
+
+    return stats;
+}
+
+static std::vector<fake_usb_recovery> get_recoveries(fake_usb_device& Fake) {
+    std::lock_guard<std::mutex> guard(Fake.lock);
+
+    return Fake.recoveries;
+}
+
+/**
+ * @brief A vendor request the stalled fake keeps. The watchdog sees
+ * it past the deadline on every check
+ *
+ */
+struct wedged_request {
+    fake_usb_device& fake;
+    UCHAR data[8] = {};
+    NTSTATUS status = STATUS_PENDING;
+    std::thread thread;
+
+    wedged_request(fake_usb_device& Fake) : fake(Fake) {
+        fake.stalled = true;
+
+        thread = std::thread([this] {
+            usb_chief_vendor_request request = { 0x10, 0, 0, sizeof(data), data };
+            status = usb_send_receive_vendor_request(fake.device, &request, true);
+        });
+
+        fake_usb_device::wait_until([this] { return fake.held_count(true) == 1; });
+    }
+
+    NTSTATUS finish() {
+        fake.stalled = false;
+        fake.release(true);
+        thread.join();
+
+        return status;
+    }
+};
+
+TEST(recovery_escalates_one_check_at_a_time) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    // every recovery request takes a few intervals
+    fake.latency = test_latency;
+    fake.recoveries.clear();
+
+    wedged_request wedged(fake);
+    set_watchdog_interval(test_interval);
+
+    CHECK(fake_usb_device::wait_until([&] { return get_stats(fake).exhausted != 0; }));
+
+    // stop the watchdog and wait for the last check
+    set_watchdog_interval(0);
+
+    // every check did the next action. Abort the pipes, reset them,
+    // reset the port and select the configuration again
+    const std::vector<fake_usb_recovery> expected = {
+        fake_usb_recovery::abort_pipe, fake_usb_recovery::abort_pipe, fake_usb_recovery::abort_pipe,
+        fake_usb_recovery::abort_pipe, fake_usb_recovery::reset_pipe,
+        fake_usb_recovery::abort_pipe, fake_usb_recovery::reset_pipe,
+        fake_usb_recovery::abort_pipe, fake_usb_recovery::reset_pipe,
+        fake_usb_recovery::reset_port,
+        fake_usb_recovery::select_configuration
+    };
+
+    CHECK(get_recoveries(fake) == expected);
+
+    // the next check waited for the recovery of the last one
+    {
+        std::lock_guard<std::mutex> guard(fake.lock);
+        CHECK_EQUAL(fake.max_recovering, 1u);
+    }
+
+    const usb_chief_watchdog_stats stats = get_stats(fake);
+    CHECK_EQUAL(stats.level, chief_watchdog_action_count);
+    CHECK_EQUAL(stats.skipped, 0u);
+    CHECK_EQUAL(stats.failed, 0u);
+
+    for (ULONG i = 0; i < chief_watchdog_action_count; i++) {
+        CHECK_EQUAL(stats.actions[i], 1u);
+    }
+
+    CHECK_EQUAL(wedged.finish(), STATUS_SUCCESS);
+}
+
+TEST(responding_device_starts_over) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    {
+        wedged_request wedged(fake);
+        set_watchdog_interval(test_interval);
+
+        CHECK(fake_usb_device::wait_until([&] { return get_stats(fake).level != 0; }));
+        CHECK_EQUAL(wedged.finish(), STATUS_SUCCESS);
+    }
+
+    // the checks after the answer find a healthy device
+    const ULONGLONG checks = get_stats(fake).checks;
+
+    CHECK(fake_usb_device::wait_until([&] { return get_stats(fake).checks > checks + 2; }));
+    set_watchdog_interval(0);
+
+    CHECK_EQUAL(get_stats(fake).level, 0u);
+}
+
+TEST(open_handles_skip_the_reselect) {
+    fake_usb_device fake;
+    CHECK_EQUAL(fake.start(), STATUS_SUCCESS);
+
+    fake_usb_handle pipe;
+    CHECK_EQUAL(fake.open(pipe, L"\\PIPE00"), STATUS_SUCCESS);
+
+    fake.recoveries.clear();
+
+    wedged_request wedged(fake);
+    set_watchdog_interval(test_interval);
+
+    CHECK(fake_usb_device::wait_until([&] { return get_stats(fake).exhausted != 0; }));
+    set_watchdog_interval(0);
+
+    CHECK_EQUAL(wedged.finish(), STATUS_SUCCESS);
+
+    // the handle points at the pipes of the configuration. They are
+    // not replaced while it is open
+    const usb_chief_watchdog_stats stats = get_stats(fake);
+    CHECK_EQUAL(stats.skipped, 1u);
+    CHECK(get_recoveries(fake).back() == fake_usb_recovery::reset_port);
+
+    UCHAR data[512] = {};
+    CHECK_EQUAL(fake.read(pipe, data, sizeof(data)), STATUS_SUCCESS);
+    CHECK_EQUAL(data[100], 100);
+
+    fake.close(pipe);
+}
+
+int main(int argc, char** argv) {
+    return test_run(argc, argv);
+}
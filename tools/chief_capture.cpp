@@ -0,0 +1,410 @@
+#include <windows.h>
+#include <conio.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cwchar>
+#include <vector>
+#include <algorithm>
+
+#include "chief/ioctl.hpp"
+#include "chunk_compressor.hpp"
+
+/**
+ * @brief Records the data of a pipe to a compressed capture file. The
+ * data is split in chunks that are compressed independently on a pool
+ * of threads, so any chunk can be decompressed on its own
+ *
+ * usage:
+ *  chief_capture record <pipe> <capture file> [threads] [seconds]
+ *  chief_capture unpack <capture file> <output> [first chunk] [count]
+ *  chief_capture bench <input file> [max threads]
+ *
+ */
+
+// magic and version at the start of a capture file
+constexpr static uint32_t capture_file_magic = 0x5a434843; // "CHCZ"
+constexpr static uint32_t capture_file_version = 1;
+
+// the size of the uncompressed chunks
+constexpr static uint32_t capture_chunk_size = 1024 * 1024;
+
+// the size of a single read from the pipe
+constexpr static uint32_t capture_read_size = 64 * 1024;
+
+// chunk flags
+enum capture_chunk_flags : uint32_t {
+    // the chunk is stored uncompressed
+    capture_chunk_stored = 1,
+};
+
+/**
+ * @brief Header at the start of a capture file
+ *
+ */
+struct capture_file_header {
+    uint32_t magic;
+    uint32_t version;
+
+    // the size of the uncompressed chunks
+    uint32_t chunk_size;
+    uint32_t reserved;
+};
+
+/**
+ * @brief Header before the data of every chunk
+ *
+ */
+struct capture_chunk_header {
+    uint32_t raw_size;
+    uint32_t size;
+    uint32_t flags;
+};
+
+/**
+ * @brief Trailer at the end of a capture file. Follows the index
+ * with the file offset of every chunk. Missing when the recording
+ * did not finish, the chunks can then still be read in order
+ *
+ */
+struct capture_file_trailer {
+    uint64_t index_offset;
+    uint32_t count;
+    uint32_t magic;
+};
+
+/**
+ * @brief Writes the compressed chunks and keeps the index
+ *
+ */
+class capture_writer {
+protected:
+    FILE* file;
+
+    // the offset of every chunk
+    std::vector<uint64_t> index;
+    uint64_t offset;
+
+    // totals for the report
+    uint64_t raw_bytes = 0;
+
+public:
+    capture_writer(FILE* output):
+        file(output), offset(sizeof(capture_file_header))
+    {
+        const capture_file_header header = { capture_file_magic, capture_file_version, capture_chunk_size, 0 };
+        fwrite(&header, sizeof(header), 1, file);
+    }
+
+    bool write(const compressed_chunk& chunk) {
+        const capture_chunk_header header = {
+            chunk.raw_size, chunk.size, chunk.stored ? static_cast<uint32_t>(capture_chunk_stored) : 0u
+        };
+
+        if (fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(chunk.data, 1, chunk.size, file) != chunk.size) {
+            return false;
+        }
+
+        index.push_back(offset);
+        offset += sizeof(header) + chunk.size;
+        raw_bytes += chunk.raw_size;
+
+        return true;
+    }
+
+    bool finish() {
+        const capture_file_trailer trailer = { offset, static_cast<uint32_t>(index.size()), capture_file_magic };
+
+        // write the index after the last chunk
+        if (fwrite(index.data(), sizeof(uint64_t), index.size(), file) != index.size()) {
+            return false;
+        }
+
+        return fwrite(&trailer, sizeof(trailer), 1, file) == 1;
+    }
+
+    uint64_t raw_size() const {
+        return raw_bytes;
+    }
+
+    uint64_t size() const {
+        return offset;
+    }
+};
+
+static double seconds_since(const LARGE_INTEGER& start) {
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+
+    return static_cast<double>(now.QuadPart - start.QuadPart) / frequency.QuadPart;
+}
+
+static int record(unsigned long pipe, const char* path, unsigned long threads, unsigned long seconds) {
+    // open the pipe
+    wchar_t name[64];
+    swprintf(name, 64, L"\\\\.\\ChiefUSB\\PIPE%02lu", pipe);
+
+    HANDLE device = CreateFileW(
+        name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr
+    );
+
+    if (device == INVALID_HANDLE_VALUE) {
+        printf("could not open pipe %lu (%lu)\n", pipe, GetLastError());
+        return 1;
+    }
+
+    FILE* output = fopen(path, "wb");
+
+    if (!output) {
+        printf("could not open %s\n", path);
+        CloseHandle(device);
+        return 1;
+    }
+
+    capture_writer writer(output);
+
+    // the compressor writes the chunks in order
+    chunk_compressor compressor(threads, [&writer](const compressed_chunk& chunk) {
+        return writer.write(chunk);
+    });
+
+    std::vector<uint8_t> chunk(capture_chunk_size);
+    uint32_t used = 0;
+    bool success = true;
+
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    printf("recording with %lu threads, press a key to stop\n", threads);
+
+    while (!_kbhit() && (!seconds || seconds_since(start) < seconds)) {
+        DWORD returned = 0;
+
+        if (!ReadFile(device, chunk.data() + used, capture_read_size, &returned, nullptr)) {
+            printf("could not read the pipe (%lu)\n", GetLastError());
+            break;
+        }
+
+        used += returned;
+
+        // queue the chunk when the next read does not fit
+        if ((capture_chunk_size - used) < capture_read_size) {
+            success = compressor.submit(chunk.data(), used);
+            used = 0;
+
+            if (!success) {
+                break;
+            }
+        }
+    }
+
+    // queue the last partial chunk
+    if (success && used) {
+        success = compressor.submit(chunk.data(), used);
+    }
+
+    success = compressor.finish() && success && writer.finish();
+
+    const double elapsed = seconds_since(start);
+
+    if (!success) {
+        printf("could not write %s\n", path);
+    }
+
+    printf("recorded %.3f MB in %.3f s, stored %.3f MB (ratio %.2f)\n",
+        writer.raw_size() / (1024.0 * 1024.0), elapsed, writer.size() / (1024.0 * 1024.0),
+        writer.size() ? static_cast<double>(writer.raw_size()) / writer.size() : 0.0
+    );
+
+    fclose(output);
+    CloseHandle(device);
+
+    return success ? 0 : 1;
+}
+
+static bool read_index(FILE* input, std::vector<uint64_t>& index) {
+    // try the index at the end of the file first
+    capture_file_trailer trailer = {};
+
+    if (!_fseeki64(input, -static_cast<int64_t>(sizeof(trailer)), SEEK_END) &&
+        fread(&trailer, sizeof(trailer), 1, input) == 1 && trailer.magic == capture_file_magic) {
+        index.resize(trailer.count);
+
+        return !_fseeki64(input, static_cast<int64_t>(trailer.index_offset), SEEK_SET) &&
+            fread(index.data(), sizeof(uint64_t), index.size(), input) == index.size();
+    }
+
+    // the recording did not finish. Walk over the chunks
+    uint64_t offset = sizeof(capture_file_header);
+    capture_chunk_header header;
+
+    _fseeki64(input, static_cast<int64_t>(offset), SEEK_SET);
+
+    while (fread(&header, sizeof(header), 1, input) == 1 && !_fseeki64(input, header.size, SEEK_CUR)) {
+        index.push_back(offset);
+        offset += sizeof(header) + header.size;
+    }
+
+    return true;
+}
+
+static int unpack(const char* path, const char* output_path, unsigned long first, unsigned long count) {
+    FILE* input = fopen(path, "rb");
+
+    if (!input) {
+        printf("could not open %s\n", path);
+        return 1;
+    }
+
+    // read and check the header
+    capture_file_header header = {};
+
+    if (fread(&header, sizeof(header), 1, input) != 1 || header.magic != capture_file_magic || header.version != capture_file_version) {
+        printf("%s is not a capture file\n", path);
+        fclose(input);
+        return 1;
+    }
+
+    std::vector<uint64_t> index;
+
+    if (!read_index(input, index)) {
+        printf("could not read the index of %s\n", path);
+        fclose(input);
+        return 1;
+    }
+
+    FILE* output = fopen(output_path, "wb");
+
+    if (!output) {
+        printf("could not open %s\n", output_path);
+        fclose(input);
+        return 1;
+    }
+
+    std::vector<uint8_t> packed;
+    std::vector<uint8_t> raw(header.chunk_size);
+
+    // every chunk is independent so we can start at any chunk
+    const uint64_t last = count ? std::min<uint64_t>(index.size(), static_cast<uint64_t>(first) + count) : index.size();
+    int result = 0;
+
+    for (uint64_t i = first; i < last; i++) {
+        capture_chunk_header chunk;
+
+        if (_fseeki64(input, static_cast<int64_t>(index[i]), SEEK_SET) || fread(&chunk, sizeof(chunk), 1, input) != 1 || chunk.raw_size > header.chunk_size) {
+            printf("chunk %llu is invalid\n", static_cast<unsigned long long>(i));
+            result = 1;
+            break;
+        }
+
+        packed.resize(chunk.size);
+
+        if (fread(packed.data(), 1, chunk.size, input) != chunk.size) {
+            printf("chunk %llu is truncated\n", static_cast<unsigned long long>(i));
+            result = 1;
+            break;
+        }
+
+        // stored chunks are copied as is
+        const size_t size = (chunk.flags & capture_chunk_stored) ?
+            ((chunk.size == chunk.raw_size) ? chunk.size : SIZE_MAX) :
+            lz4::decompress(packed.data(), packed.size(), raw.data(), raw.size());
+
+        if (size != chunk.raw_size) {
+            printf("chunk %llu does not decompress\n", static_cast<unsigned long long>(i));
+            result = 1;
+            break;
+        }
+
+        fwrite((chunk.flags & capture_chunk_stored) ? packed.data() : raw.data(), 1, size, output);
+    }
+
+    printf("unpacked %llu of %zu chunks\n", static_cast<unsigned long long>((last > first) ? last - first : 0), index.size());
+
+    fclose(output);
+    fclose(input);
+
+    return result;
+}
+
+static int bench(const char* path, unsigned long max_threads) {
+    FILE* input = fopen(path, "rb");
+
+    if (!input) {
+        printf("could not open %s\n", path);
+        return 1;
+    }
+
+    // read the whole file in memory so the disk is not measured
+    std::vector<uint8_t> data;
+    uint8_t buffer[64 * 1024];
+    size_t size;
+
+    while ((size = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+        data.insert(data.end(), buffer, buffer + size);
+    }
+
+    fclose(input);
+
+    if (data.empty()) {
+        printf("%s is empty\n", path);
+        return 1;
+    }
+
+    printf("threads  MB/s      ratio\n");
+
+    for (unsigned long threads = 1; threads <= max_threads; threads *= 2) {
+        uint64_t stored = 0;
+
+        LARGE_INTEGER start;
+        QueryPerformanceCounter(&start);
+
+        chunk_compressor compressor(threads, [&stored](const compressed_chunk& chunk) {
+            stored += sizeof(capture_chunk_header) + chunk.size;
+            return true;
+        });
+
+        for (size_t offset = 0; offset < data.size(); offset += capture_chunk_size) {
+            compressor.submit(data.data() + offset, std::min<size_t>(capture_chunk_size, data.size() - offset));
+        }
+
+        compressor.finish();
+
+        const double elapsed = seconds_since(start);
+
+        printf("%-8lu %-9.1f %.2f\n", threads, data.size() / elapsed / (1024.0 * 1024.0), static_cast<double>(data.size()) / stored);
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 4 && !strcmp(argv[1], "record")) {
+        return record(
+            strtoul(argv[2], nullptr, 0), argv[3],
+            (argc > 4) ? strtoul(argv[4], nullptr, 0) : 4,
+            (argc > 5) ? strtoul(argv[5], nullptr, 0) : 0
+        );
+    }
+
+    if (argc >= 4 && !strcmp(argv[1], "unpack")) {
+        return unpack(
+            argv[2], argv[3],
+            (argc > 4) ? strtoul(argv[4], nullptr, 0) : 0,
+            (argc > 5) ? strtoul(argv[5], nullptr, 0) : 0
+        );
+    }
+
+    if (argc >= 3 && !strcmp(argv[1], "bench")) {
+        return bench(argv[2], (argc > 3) ? strtoul(argv[3], nullptr, 0) : 8);
+    }
+
+    printf("usage: %s record <pipe> <capture file> [threads] [seconds]\n", argv[0]);
+    printf("       %s unpack <capture file> <output> [first chunk] [count]\n", argv[0]);
+    printf("       %s bench <input file> [max threads]\n", argv[0]);
+
+    return 1;
+}
@@ -0,0 +1,249 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "chunk_compressor.hpp"
+
+/**
+ * @brief Benchmark of the compression stage of chief_capture on
+ * linux. Reports the compression throughput and ratio for 1 to N
+ * threads, and the throughput of decompressing the chunks in a
+ * random order. Runs on generated data that looks like a capture or
+ * on a recorded pipe (the output of chief_capture unpack or
+ * chief_usbfs stream)
+ *
+ * usage:
+ *  chief_compress_bench synthetic [megabytes] [max threads] [seed]
+ *  chief_compress_bench file <input file> [max threads]
+ *
+ */
+
+// the size of the uncompressed chunks. Same as chief_capture
+constexpr static uint32_t bench_chunk_size = 1024 * 1024;
+
+/**
+ * @brief Generator for data that looks like the traffic of a capture:
+ * timestamped packet records with a few packet types, long runs of
+ * idle frames and payloads that are partly counters and partly noise
+ *
+ */
+class capture_generator {
+protected:
+    uint64_t state;
+    uint64_t timestamp = 0;
+    uint32_t frame = 0;
+
+    uint32_t next() {
+        // xorshift64*. Fast and the same on every platform
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+
+        return static_cast<uint32_t>((state * 2685821657736338717ull) >> 32);
+    }
+
+    void write(std::vector<uint8_t>& Output, const void* Data, size_t Size) {
+        const uint8_t* data = static_cast<const uint8_t*>(Data);
+        Output.insert(Output.end(), data, data + Size);
+    }
+
+    void record(std::vector<uint8_t>& Output, uint8_t Pid, size_t Length) {
+        // the packets are a few microseconds apart
+        timestamp += 60 + (next() & 0xff);
+
+        write(Output, &timestamp, sizeof(timestamp));
+        write(Output, &Pid, sizeof(Pid));
+
+        const uint16_t length = static_cast<uint16_t>(Length);
+        write(Output, &length, sizeof(length));
+    }
+
+public:
+    capture_generator(uint64_t Seed):
+        state(Seed ? Seed : 1)
+    {}
+
+    void generate(std::vector<uint8_t>& Output, size_t Size) {
+        Output.clear();
+        Output.reserve(Size + 1024);
+
+        while (Output.size() < Size) {
+            const uint32_t kind = next() % 100;
+
+            if (kind < 40) {
+                // start of frame packets with the frame number
+                frame = (frame + 1) & 0x7ff;
+                record(Output, 0xa5, sizeof(frame));
+                write(Output, &frame, sizeof(frame));
+            }
+            else if (kind < 70) {
+                // in/out tokens and handshakes
+                record(Output, (kind & 1) ? 0x69 : 0xd2, 0);
+            }
+            else {
+                // data packets. The device sends counters and samples
+                // with a bit of noise in the low bits
+                const size_t length = 64 + (next() % 448);
+                record(Output, 0xc3, length);
+
+                uint8_t payload[512];
+                const uint32_t base = next();
+
+                for (size_t i = 0; i < length; i++) {
+                    payload[i] = static_cast<uint8_t>((i < 8) ? (base >> (i * 4)) : ((i / 16) + (next() & 0x3)));
+                }
+
+                write(Output, payload, length);
+            }
+        }
+
+        Output.resize(Size);
+    }
+};
+
+static double seconds_since(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>& data) {
+    FILE* input = fopen(path, "rb");
+
+    if (!input) {
+        return false;
+    }
+
+    uint8_t buffer[64 * 1024];
+    size_t size;
+
+    while ((size = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+        data.insert(data.end(), buffer, buffer + size);
+    }
+
+    fclose(input);
+
+    return true;
+}
+
+static int bench(const std::vector<uint8_t>& data, unsigned long max_threads) {
+    const size_t chunks = (data.size() + bench_chunk_size - 1) / bench_chunk_size;
+
+    // the compressed chunks of the last run for the decompression
+    std::vector<std::vector<uint8_t>> packed(chunks);
+    std::vector<bool> stored(chunks);
+
+    printf("%zu MB in %zu chunks\n", data.size() / (1024 * 1024), chunks);
+    printf("threads  MB/s      ratio\n");
+
+    for (unsigned long threads = 1; threads <= max_threads; threads *= 2) {
+        uint64_t size = 0;
+        uint64_t expected = 0;
+        bool ordered = true;
+
+        const auto start = std::chrono::steady_clock::now();
+
+        chunk_compressor compressor(threads, [&](const compressed_chunk& chunk) {
+            // the chunks should arrive in the order they were submitted
+            ordered = ordered && chunk.sequence == expected++;
+            size += chunk.size;
+
+            packed[chunk.sequence].assign(chunk.data, chunk.data + chunk.size);
+            stored[chunk.sequence] = chunk.stored;
+
+            return true;
+        });
+
+        for (size_t offset = 0; offset < data.size(); offset += bench_chunk_size) {
+            compressor.submit(data.data() + offset, std::min<size_t>(bench_chunk_size, data.size() - offset));
+        }
+
+        compressor.finish();
+
+        const double elapsed = seconds_since(start);
+
+        if (!ordered) {
+            printf("the chunks are out of order with %lu threads\n", threads);
+            return 1;
+        }
+
+        printf("%-8lu %-9.1f %.2f\n", threads, data.size() / elapsed / (1024.0 * 1024.0), static_cast<double>(data.size()) / size);
+    }
+
+    // every chunk is independent. Decompress them in a random order
+    // and check them against the input
+    std::vector<size_t> order(chunks);
+
+    for (size_t i = 0; i < chunks; i++) {
+        order[i] = i;
+    }
+
+    std::srand(1);
+
+    for (size_t i = chunks; i > 1; i--) {
+        std::swap(order[i - 1], order[static_cast<size_t>(std::rand()) % i]);
+    }
+
+    std::vector<uint8_t> raw(bench_chunk_size);
+    const auto start = std::chrono::steady_clock::now();
+
+    for (size_t i : order) {
+        const size_t offset = i * bench_chunk_size;
+        const size_t raw_size = std::min<size_t>(bench_chunk_size, data.size() - offset);
+
+        const size_t size = stored[i] ? packed[i].size() :
+            lz4::decompress(packed[i].data(), packed[i].size(), raw.data(), raw.size());
+
+        const uint8_t* output = stored[i] ? packed[i].data() : raw.data();
+
+        if (size != raw_size || memcmp(output, data.data() + offset, raw_size)) {
+            printf("chunk %zu does not decompress\n", i);
+            return 1;
+        }
+    }
+
+    printf("random access decompression: %.1f MB/s\n", data.size() / seconds_since(start) / (1024.0 * 1024.0));
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    std::vector<uint8_t> data;
+
+    if (argc >= 2 && !strcmp(argv[1], "synthetic")) {
+        const unsigned long megabytes = (argc > 2) ? strtoul(argv[2], nullptr, 0) : 256;
+        const unsigned long max_threads = (argc > 3) ? strtoul(argv[3], nullptr, 0) : 8;
+        const unsigned long long seed = (argc > 4) ? strtoull(argv[4], nullptr, 0) : 1;
+
+        if (!megabytes) {
+            printf("the size should be at least 1 MB\n");
+            return 1;
+        }
+
+        capture_generator generator(seed);
+        generator.generate(data, static_cast<size_t>(megabytes) * 1024 * 1024);
+
+        return bench(data, max_threads);
+    }
+
+    if (argc >= 3 && !strcmp(argv[1], "file")) {
+        if (!read_file(argv[2], data)) {
+            printf("could not open %s\n", argv[2]);
+            return 1;
+        }
+
+        if (data.empty()) {
+            printf("%s is empty\n", argv[2]);
+            return 1;
+        }
+
+        return bench(data, (argc > 3) ? strtoul(argv[3], nullptr, 0) : 8);
+    }
+
+    printf("usage: %s synthetic [megabytes] [max threads] [seed]\n", argv[0]);
+    printf("       %s file <input file> [max threads]\n", argv[0]);
+
+    return 1;
+}
@@ -0,0 +1,226 @@
+#include <windows.h>
+#include <conio.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cwchar>
+#include <vector>
+
+#include "chief/ioctl.hpp"
+#include "tools/trace_replay.hpp"
+
+/**
+ * @brief Records the requests the application sends to the driver
+ * and replays them to measure the throughput and latency
+ *
+ * usage:
+ *  chief_replay record <trace file> [seconds]
+ *  chief_replay replay <trace file> [max]
+ *
+ * With max the requests are sent back to back instead of with the
+ * original timing. Requests are replayed one at a time
+ *
+ */
+
+static bool device_control(HANDLE device, unsigned long code, void* input, DWORD input_length, void* output, DWORD output_length, DWORD& returned) {
+    returned = 0;
+
+    return DeviceIoControl(device, code, input, input_length, output, output_length, &returned, nullptr) != FALSE;
+}
+
+static HANDLE open_device(const wchar_t* name) {
+    return CreateFileW(
+        name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr
+    );
+}
+
+static int record(HANDLE device, const char* path, unsigned long seconds) {
+    FILE* output = fopen(path, "wb");
+
+    if (!output) {
+        printf("could not open %s\n", path);
+        return 1;
+    }
+
+    DWORD returned;
+
+    // get the frequency of the timestamps
+    usb_chief_clock_info info = {};
+
+    if (!device_control(device, ioctl_get_clock_info, nullptr, 0, &info, sizeof(info), returned)) {
+        printf("could not get the clock info (%lu)\n", GetLastError());
+        fclose(output);
+        return 1;
+    }
+
+    const trace_file_header header = { trace_file_magic, trace_file_version, info.frequency };
+    fwrite(&header, sizeof(header), 1, output);
+
+    // enable the recorder
+    usb_chief_trace_config config = { 1 };
+
+    if (!device_control(device, ioctl_configure_trace, &config, sizeof(config), nullptr, 0, returned)) {
+        printf("could not enable the recorder (%lu)\n", GetLastError());
+        fclose(output);
+        return 1;
+    }
+
+    // buffer for the drained records
+    std::vector<uint8_t> buffer(sizeof(usb_chief_trace_drain) + 512 * sizeof(usb_chief_trace_record));
+
+    const ULONGLONG start = GetTickCount64();
+    unsigned long long total = 0;
+    unsigned long long dropped = 0;
+
+    printf("recording, press a key to stop\n");
+
+    while (true) {
+        // check if we need to stop. We do one more drain after stopping
+        const bool stop = _kbhit() || (seconds && (GetTickCount64() - start) >= seconds * 1000ull);
+
+        if (stop) {
+            config.enable = 0;
+            device_control(device, ioctl_configure_trace, &config, sizeof(config), nullptr, 0, returned);
+        }
+
+        // move the records out of the driver until the ring is empty
+        while (true) {
+            if (!device_control(device, ioctl_drain_trace, nullptr, 0, buffer.data(), static_cast<DWORD>(buffer.size()), returned)) {
+                printf("could not drain the recorder (%lu)\n", GetLastError());
+                break;
+            }
+
+            const usb_chief_trace_drain* drain = reinterpret_cast<const usb_chief_trace_drain*>(buffer.data());
+
+            fwrite(drain + 1, sizeof(usb_chief_trace_record), drain->count, output);
+
+            total += drain->count;
+            dropped += drain->dropped;
+
+            if (!drain->count) {
+                break;
+            }
+        }
+
+        if (stop) {
+            break;
+        }
+
+        Sleep(50);
+    }
+
+    printf("recorded %llu requests, dropped %llu\n", total, dropped);
+
+    fclose(output);
+
+    return 0;
+}
+
+/**
+ * @brief The installed driver as the target of a replay. The pipes
+ * are opened when they are first used
+ *
+ */
+struct driver_target {
+    HANDLE device;
+    HANDLE pipes[256];
+
+    driver_target(HANDLE Device) : device(Device) {
+        std::fill(pipes, pipes + 256, INVALID_HANDLE_VALUE);
+    }
+
+    ~driver_target() {
+        for (HANDLE pipe : pipes) {
+            if (pipe != INVALID_HANDLE_VALUE) {
+                CloseHandle(pipe);
+            }
+        }
+    }
+
+    bool vendor(unsigned long Code, usb_chief_vendor_request& Request) {
+        DWORD returned = 0;
+
+        return device_control(device, Code, &Request, sizeof(Request), &Request, sizeof(Request), returned);
+    }
+
+    bool transfer(unsigned char Major, unsigned char Pipe, uint8_t* Buffer, unsigned long Length, unsigned long& Returned) {
+        // open the pipe the first time we need it
+        if (pipes[Pipe] == INVALID_HANDLE_VALUE) {
+            wchar_t name[64];
+            swprintf(name, 64, L"\\\\.\\ChiefUSB\\PIPE%02u", static_cast<unsigned int>(Pipe));
+
+            pipes[Pipe] = open_device(name);
+        }
+
+        if (pipes[Pipe] == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        DWORD returned = 0;
+        bool success;
+
+        if (Major == chief_trace_read) {
+            success = ReadFile(pipes[Pipe], Buffer, Length, &returned, nullptr) != FALSE;
+        }
+        else {
+            success = WriteFile(pipes[Pipe], Buffer, Length, &returned, nullptr) != FALSE;
+        }
+
+        Returned = returned;
+
+        return success;
+    }
+};
+
+static int replay(HANDLE device, const char* path, bool max_speed) {
+    uint64_t frequency = 0;
+    std::vector<usb_chief_trace_record> records;
+
+    if (!trace_file_read(path, frequency, records)) {
+        printf("%s is not a trace file\n", path);
+        return 1;
+    }
+
+    if (records.empty()) {
+        printf("the trace is empty\n");
+        return 0;
+    }
+
+    driver_target target(device);
+
+    const trace_replay_result result = trace_replay(target, frequency, records, max_speed);
+    trace_replay_print(result);
+
+    return result.failed ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3 || (strcmp(argv[1], "record") && strcmp(argv[1], "replay"))) {
+        printf("usage: %s record <trace file> [seconds]\n", argv[0]);
+        printf("       %s replay <trace file> [max]\n", argv[0]);
+        return 1;
+    }
+
+    // open the device
+    HANDLE device = open_device(L"\\\\.\\ChiefUSB");
+
+    if (device == INVALID_HANDLE_VALUE) {
+        printf("could not open the device (%lu)\n", GetLastError());
+        return 1;
+    }
+
+    int result;
+
+    if (!strcmp(argv[1], "record")) {
+        result = record(device, argv[2], (argc > 3) ? strtoul(argv[3], nullptr, 0) : 0);
+    }
+    else {
+        result = replay(device, argv[2], (argc > 3) && !strcmp(argv[3], "max"));
+    }
+
+    CloseHandle(device);
+
+    return result;
+}
@@ -0,0 +1,347 @@
+#include <windows.h>
+#include <conio.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+#include "chief/ioctl.hpp"
+
+/**
+ * @brief Records the urbs of the driver with the urb tap and writes
+ * them to a pcapng file with the USBPcap link type so they can be
+ * opened in Wireshark
+ *
+ * usage: chief_tap <output.pcapng> [snapshot length] [seconds]
+ *
+ */
+
+// the link type of USBPcap captures
+constexpr static uint16_t linktype_usbpcap = 249;
+
+// the difference between 1601 and 1970 in 100ns units
+constexpr static int64_t filetime_unix_epoch = 116444736000000000ll;
+
+// the control stages of USBPcap
+enum usbpcap_stage : uint8_t {
+    usbpcap_stage_setup = 0,
+    usbpcap_stage_data = 1,
+    usbpcap_stage_complete = 3,
+};
+
+#pragma pack(push, 1)
+/**
+ * @brief Packet header of USBPcap
+ *
+ */
+struct usbpcap_header {
+    uint16_t header_length;
+    uint64_t irp_id;
+    int32_t status;
+    uint16_t function;
+    uint8_t info;
+    uint16_t bus;
+    uint16_t device;
+    uint8_t endpoint;
+    uint8_t transfer;
+    uint32_t data_length;
+};
+
+/**
+ * @brief Packet header of USBPcap for control transfers
+ *
+ */
+struct usbpcap_control_header {
+    usbpcap_header header;
+    uint8_t stage;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(usbpcap_header) == 27, "Invalid USBPcap header size");
+static_assert(sizeof(usbpcap_control_header) == 28, "Invalid USBPcap control header size");
+
+/**
+ * @brief Writer for the pcapng blocks we need
+ *
+ */
+class pcapng_writer {
+protected:
+    // the output file
+    FILE* file;
+
+    void write_u32(uint32_t value) {
+        fwrite(&value, sizeof(value), 1, file);
+    }
+
+    void write_u16(uint16_t value) {
+        fwrite(&value, sizeof(value), 1, file);
+    }
+
+public:
+    pcapng_writer(FILE* output):
+        file(output)
+    {}
+
+    /**
+     * @brief Write the section header and the interface description
+     *
+     */
+    void write_header() {
+        // section header block
+        write_u32(0x0a0d0d0a);
+        write_u32(28);
+        write_u32(0x1a2b3c4d);
+        write_u16(1);
+        write_u16(0);
+
+        // unknown section length
+        write_u32(0xffffffff);
+        write_u32(0xffffffff);
+        write_u32(28);
+
+        // interface description block. Without options the
+        // timestamps are in microseconds
+        write_u32(0x00000001);
+        write_u32(20);
+        write_u16(linktype_usbpcap);
+        write_u16(0);
+        write_u32(0);
+        write_u32(20);
+    }
+
+    /**
+     * @brief Write a enhanced packet block
+     *
+     * @param timestamp in microseconds since 1970
+     * @param data
+     * @param length
+     * @param original_length
+     */
+    void write_packet(uint64_t timestamp, const void* data, uint32_t length, uint32_t original_length) {
+        // the packet data is padded to 32 bits
+        const uint32_t padding = (4 - (length & 3)) & 3;
+        const uint32_t block_length = 32 + length + padding;
+
+        write_u32(0x00000006);
+        write_u32(block_length);
+        write_u32(0);
+        write_u32(static_cast<uint32_t>(timestamp >> 32));
+        write_u32(static_cast<uint32_t>(timestamp & 0xffffffff));
+        write_u32(length);
+        write_u32(original_length);
+
+        fwrite(data, 1, length, file);
+
+        const uint8_t zeros[4] = {};
+        fwrite(zeros, 1, padding, file);
+
+        write_u32(block_length);
+    }
+};
+
+/**
+ * @brief Converts performance counter values of the driver to
+ * microseconds since 1970
+ *
+ */
+struct clock_converter {
+    int64_t frequency;
+    int64_t counter;
+    int64_t unix_time;
+
+    uint64_t to_unix_us(uint64_t timestamp) const {
+        // split the conversion so the multiplication does not overflow
+        const int64_t delta = static_cast<int64_t>(timestamp) - counter;
+        const int64_t us = (delta / frequency) * 1000000 + ((delta % frequency) * 1000000) / frequency;
+
+        return static_cast<uint64_t>(unix_time + us);
+    }
+};
+
+static void write_record(pcapng_writer& writer, const clock_converter& clock, const usb_chief_tap_record& record) {
+    const bool completion = (record.info & chief_tap_info_completion) != 0;
+    const uint64_t timestamp = clock.to_unix_us(record.timestamp);
+
+    // out data is sent with the submit and in data with the completion
+    const bool has_data = (completion == ((record.endpoint & 0x80) != 0));
+    const uint32_t data_length = has_data ? record.length : 0;
+
+    // the packet with the largest header and payload
+    uint8_t packet[sizeof(usbpcap_control_header) + 8 + chief_max_tap_snapshot];
+
+    usbpcap_control_header header = {};
+    header.header.irp_id = record.irp_id;
+    header.header.status = record.status;
+    header.header.function = record.function;
+    header.header.info = record.info;
+    header.header.endpoint = record.endpoint;
+    header.header.transfer = record.transfer;
+
+    if (record.transfer != chief_tap_transfer_control) {
+        // bulk, interrupt and urbs without data use the short header
+        header.header.header_length = sizeof(usbpcap_header);
+        header.header.data_length = record.captured;
+
+        memcpy(packet, &header.header, sizeof(usbpcap_header));
+        memcpy(packet + sizeof(usbpcap_header), record.data, record.captured);
+
+        writer.write_packet(
+            timestamp, packet, sizeof(usbpcap_header) + record.captured, sizeof(usbpcap_header) + data_length
+        );
+
+        return;
+    }
+
+    header.header.header_length = sizeof(usbpcap_control_header);
+
+    if (!completion) {
+        // the setup stage with the setup packet
+        header.stage = usbpcap_stage_setup;
+        header.header.data_length = 8;
+
+        memcpy(packet, &header, sizeof(header));
+        memcpy(packet + sizeof(header), record.setup, 8);
+
+        writer.write_packet(timestamp, packet, sizeof(header) + 8, sizeof(header) + 8);
+
+        // check if we have out data
+        if (!record.captured) {
+            return;
+        }
+
+        header.stage = usbpcap_stage_data;
+    }
+    else {
+        header.stage = usbpcap_stage_complete;
+    }
+
+    // the data stage on the submit or the completion with the in data
+    header.header.data_length = record.captured;
+
+    memcpy(packet, &header, sizeof(header));
+    memcpy(packet + sizeof(header), record.data, record.captured);
+
+    writer.write_packet(timestamp, packet, sizeof(header) + record.captured, sizeof(header) + data_length);
+}
+
+static bool device_control(HANDLE device, unsigned long code, void* input, DWORD input_length, void* output, DWORD output_length, DWORD& returned) {
+    returned = 0;
+
+    return DeviceIoControl(device, code, input, input_length, output, output_length, &returned, nullptr) != FALSE;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("usage: %s <output.pcapng> [snapshot length] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    // get the optional arguments
+    const unsigned long snapshot_length = (argc > 2) ? strtoul(argv[2], nullptr, 0) : chief_max_tap_snapshot;
+    const unsigned long seconds = (argc > 3) ? strtoul(argv[3], nullptr, 0) : 0;
+
+    // open the device
+    HANDLE device = CreateFileW(
+        L"\\\\.\\ChiefUSB", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr
+    );
+
+    if (device == INVALID_HANDLE_VALUE) {
+        printf("could not open the device (%lu)\n", GetLastError());
+        return 1;
+    }
+
+    FILE* output = fopen(argv[1], "wb");
+
+    if (!output) {
+        printf("could not open %s\n", argv[1]);
+        CloseHandle(device);
+        return 1;
+    }
+
+    DWORD returned;
+
+    // get the clocks of the driver so we can convert the timestamps
+    usb_chief_clock_info info = {};
+
+    if (!device_control(device, ioctl_get_clock_info, nullptr, 0, &info, sizeof(info), returned)) {
+        printf("could not get the clock info (%lu)\n", GetLastError());
+        fclose(output);
+        CloseHandle(device);
+        return 1;
+    }
+
+    const clock_converter clock = {
+        static_cast<int64_t>(info.frequency),
+        static_cast<int64_t>(info.counter),
+        (static_cast<int64_t>(info.system_time) - filetime_unix_epoch) / 10
+    };
+
+    // enable the tap
+    usb_chief_tap_config config = { 1, snapshot_length };
+
+    if (!device_control(device, ioctl_configure_tap, &config, sizeof(config), nullptr, 0, returned)) {
+        printf("could not enable the tap (%lu)\n", GetLastError());
+        fclose(output);
+        CloseHandle(device);
+        return 1;
+    }
+
+    pcapng_writer writer(output);
+    writer.write_header();
+
+    // buffer for the drained records
+    std::vector<uint8_t> buffer(sizeof(usb_chief_tap_drain) + 256 * sizeof(usb_chief_tap_record));
+
+    const ULONGLONG start = GetTickCount64();
+    unsigned long long total = 0;
+    unsigned long long dropped = 0;
+
+    printf("recording, press a key to stop\n");
+
+    while (true) {
+        // check if we need to stop. We do one more drain after stopping
+        const bool stop = _kbhit() || (seconds && (GetTickCount64() - start) >= seconds * 1000ull);
+
+        if (stop) {
+            config.enable = 0;
+            device_control(device, ioctl_configure_tap, &config, sizeof(config), nullptr, 0, returned);
+        }
+
+        // move the records out of the driver until the ring is empty
+        while (true) {
+            if (!device_control(device, ioctl_drain_tap, nullptr, 0, buffer.data(), static_cast<DWORD>(buffer.size()), returned)) {
+                printf("could not drain the tap (%lu)\n", GetLastError());
+                break;
+            }
+
+            const usb_chief_tap_drain* header = reinterpret_cast<const usb_chief_tap_drain*>(buffer.data());
+            const usb_chief_tap_record* records = reinterpret_cast<const usb_chief_tap_record*>(header + 1);
+
+            for (unsigned long i = 0; i < header->count; i++) {
+                write_record(writer, clock, records[i]);
+            }
+
+            total += header->count;
+            dropped += header->dropped;
+
+            if (!header->count) {
+                break;
+            }
+        }
+
+        if (stop) {
+            break;
+        }
+
+        Sleep(50);
+    }
+
+    printf("recorded %llu urbs, dropped %llu\n", total, dropped);
+
+    fclose(output);
+    CloseHandle(device);
+
+    return 0;
+}
@@ -0,0 +1,404 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+#include "chief/protocol.hpp"
+#include "usbfs_stream.hpp"
+
+/**
+ * @brief Linux backend for the Chief protocol. Talks to the device
+ * with usbfs instead of the driver, so the analyzer can be used on
+ * the capture servers. The vendor requests and the image download
+ * use the same protocol core as the driver
+ *
+ * usage:
+ *  chief_usbfs vendor <device> <in|out> <request> <value> <index> [length | bytes...]
+ *  chief_usbfs alt <device> <setting>
+ *  chief_usbfs download <device> <image file> <request> <value> <index> [chunk length] [address]
+ *  chief_usbfs stream <device> <endpoint> [seconds] [urbs] [urb size] [output]
+ *
+ * <device> is the usbfs node of the device (/dev/bus/usb/BBB/DDD)
+ *
+ */
+
+// the timeout of a control request in ms. Same as the default of the
+// ControlTimeout tunable of the driver
+constexpr static unsigned int usbfs_control_timeout = 10000;
+
+/**
+ * @brief Transport of the protocol core on usbfs. Images are in the
+ * memory of the tool
+ *
+ */
+struct usbfs_transport {
+    int fd;
+
+    long read_image(const void* Image, unsigned long Offset, void* Buffer, unsigned long Length) {
+        memcpy(Buffer, static_cast<const uint8_t*>(Image) + Offset, Length);
+
+        return 0;
+    }
+
+    long control(const chief_setup_packet& Setup, void* Buffer, unsigned long& OutLength) {
+        usbdevfs_ctrltransfer transfer = {};
+        transfer.bRequestType = Setup.request_type;
+        transfer.bRequest = Setup.request;
+        transfer.wValue = Setup.value;
+        transfer.wIndex = Setup.index;
+        transfer.wLength = Setup.length;
+        transfer.timeout = usbfs_control_timeout;
+        transfer.data = Buffer;
+
+        // usbfs returns the amount of bytes that are transferred
+        const int result = ioctl(fd, USBDEVFS_CONTROL, &transfer);
+
+        if (result < 0) {
+            return -errno;
+        }
+
+        OutLength = static_cast<unsigned long>(result);
+
+        return 0;
+    }
+
+    long select_setting(const void* Interface, const chief_interface_setting& Setting) {
+        // usbfs finds the interface descriptor itself
+        static_cast<void>(Interface);
+
+        usbdevfs_setinterface request = {};
+        request.interface = Setting.interface_number;
+        request.altsetting = Setting.alternate_setting;
+
+        return (ioctl(fd, USBDEVFS_SETINTERFACE, &request) < 0) ? -errno : 0;
+    }
+};
+
+/**
+ * @brief The asynchronous urbs of usbfs for usbfs_stream
+ *
+ */
+struct usbfs_device {
+    int fd;
+
+    int submit(usbdevfs_urb* Urb) {
+        return (ioctl(fd, USBDEVFS_SUBMITURB, Urb) < 0) ? -errno : 0;
+    }
+
+    int reap(usbdevfs_urb*& Urb) {
+        return (ioctl(fd, USBDEVFS_REAPURB, &Urb) < 0) ? -errno : 0;
+    }
+
+    void discard(usbdevfs_urb* Urb) {
+        ioctl(fd, USBDEVFS_DISCARDURB, Urb);
+    }
+};
+
+static int open_device(const char* path) {
+    const int fd = open(path, O_RDWR);
+
+    if (fd < 0) {
+        printf("could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // claim the interface so the kernel does not give the pipes to
+    // another driver while we use them
+    unsigned int interface = chief_interface_number;
+
+    if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface) < 0) {
+        printf("could not claim interface %u of %s: %s\n", interface, path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void close_device(int fd) {
+    unsigned int interface = chief_interface_number;
+    ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface);
+
+    close(fd);
+}
+
+static double seconds_since(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int vendor(const char* path, bool in, unsigned long request, unsigned long value, unsigned long index, int argc, char** argv) {
+    std::vector<uint8_t> data;
+
+    if (in) {
+        // the amount of bytes we want from the device
+        data.resize((argc > 0) ? strtoul(argv[0], nullptr, 0) : 0);
+    }
+    else {
+        // the bytes we send to the device
+        for (int i = 0; i < argc; i++) {
+            data.push_back(static_cast<uint8_t>(strtoul(argv[i], nullptr, 0)));
+        }
+    }
+
+    if (data.size() > 0xffff) {
+        printf("a vendor request can not have more than 65535 bytes\n");
+        return 1;
+    }
+
+    const int fd = open_device(path);
+
+    if (fd < 0) {
+        return 1;
+    }
+
+    usbfs_transport transport = { fd };
+    unsigned long length = 0;
+
+    const long status = transport.control(
+        protocol_vendor_setup(in, static_cast<unsigned char>(request & 0xff), static_cast<unsigned short>(value),
+            static_cast<unsigned short>(index), static_cast<unsigned short>(data.size())),
+        data.data(), length
+    );
+
+    close_device(fd);
+
+    if (status < 0) {
+        printf("request 0x%02lx failed: %s\n", request & 0xff, strerror(static_cast<int>(-status)));
+        return 1;
+    }
+
+    printf("request 0x%02lx transferred %lu bytes\n", request & 0xff, length);
+
+    // print the data we got
+    for (unsigned long i = 0; in && i < length; i++) {
+        printf("%02x%s", data[i], ((i % 16) == 15 || i + 1 == length) ? "\n" : " ");
+    }
+
+    return 0;
+}
+
+static bool read_configuration(int fd, std::vector<uint8_t>& configuration) {
+    // the node has the device descriptor followed by the descriptors
+    // of every configuration. The device only has one
+    uint8_t buffer[64 * 1024];
+
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return false;
+    }
+
+    const ssize_t size = read(fd, buffer, sizeof(buffer));
+
+    if (size < 2 || buffer[0] >= size) {
+        return false;
+    }
+
+    configuration.assign(buffer + buffer[0], buffer + size);
+
+    return true;
+}
+
+static int alternate_setting(const char* path, unsigned long setting) {
+    const int fd = open_device(path);
+
+    if (fd < 0) {
+        return 1;
+    }
+
+    // the same checks of the setting as the driver
+    std::vector<uint8_t> configuration;
+    chief_interface_setting found;
+
+    if (!read_configuration(fd, configuration) ||
+        !protocol_find_setting(configuration.data(), static_cast<unsigned long>(configuration.size()), setting, found)) {
+        printf("the device has no alternate setting %lu we support\n", setting);
+        close_device(fd);
+        return 1;
+    }
+
+    usbfs_transport transport = { fd };
+    const long status = protocol_select_setting(transport, configuration.data(), found);
+
+    close_device(fd);
+
+    if (status < 0) {
+        printf("could not select alternate setting %lu: %s\n", setting, strerror(static_cast<int>(-status)));
+        return 1;
+    }
+
+    // the pipes of the setting in the order the driver numbers them
+    for (unsigned long i = 0; i < found.endpoint_count; i++) {
+        const chief_endpoint_info& endpoint = found.endpoints[i];
+
+        printf("pipe %02lu: endpoint 0x%02x, max packet %u%s\n", i, endpoint.address, endpoint.max_packet_size,
+            protocol_endpoint_is_bulk_in(endpoint) ? ", bulk in" : "");
+    }
+
+    return 0;
+}
+
+static int download(const char* path, const char* image_path, unsigned long request, unsigned long value, unsigned long index, unsigned long chunk_length, bool address) {
+    FILE* input = fopen(image_path, "rb");
+
+    if (!input) {
+        printf("could not open %s\n", image_path);
+        return 1;
+    }
+
+    // read the whole image in memory
+    std::vector<uint8_t> image;
+    uint8_t buffer[64 * 1024];
+    size_t size;
+
+    while ((size = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+        image.insert(image.end(), buffer, buffer + size);
+    }
+
+    fclose(input);
+
+    usb_chief_image_download download = {};
+    download.request = static_cast<unsigned short>(request);
+    download.value = static_cast<unsigned short>(value);
+    download.index = static_cast<unsigned short>(index);
+    download.chunk_length = static_cast<unsigned short>(chunk_length);
+    download.flags = address ? chief_image_flag_address : 0;
+    download.length = static_cast<unsigned long>(image.size());
+    download.data = image.data();
+
+    // the same checks as the driver
+    if (chunk_length > chief_max_image_chunk_length || !protocol_image_download_valid(download)) {
+        printf("invalid chunk length %lu (1 - %lu)\n", chunk_length, chief_max_image_chunk_length);
+        return 1;
+    }
+
+    const int fd = open_device(path);
+
+    if (fd < 0) {
+        return 1;
+    }
+
+    usbfs_transport transport = { fd };
+    std::vector<uint8_t> bounce(download.chunk_length);
+    unsigned long transferred = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    const long status = protocol_download_image(transport, download, bounce.data(), transferred);
+    const double elapsed = seconds_since(start);
+
+    close_device(fd);
+
+    if (status < 0) {
+        printf("download failed at offset %lu: %s\n", transferred, strerror(static_cast<int>(-status)));
+        return 1;
+    }
+
+    printf("sent %lu bytes in %.3f s (%.1f KB/s)\n", transferred, elapsed, (elapsed > 0) ? (transferred / elapsed / 1024.0) : 0.0);
+
+    return 0;
+}
+
+static int stream(const char* path, unsigned long endpoint, unsigned long seconds, unsigned long count, unsigned long urb_size, const char* output_path) {
+    if (!count || !urb_size) {
+        printf("the amount of urbs and the urb size should not be 0\n");
+        return 1;
+    }
+
+    FILE* output = nullptr;
+
+    if (output_path) {
+        output = fopen(output_path, "wb");
+
+        if (!output) {
+            printf("could not open %s\n", output_path);
+            return 1;
+        }
+    }
+
+    const int fd = open_device(path);
+
+    if (fd < 0) {
+        if (output) {
+            fclose(output);
+        }
+
+        return 1;
+    }
+
+    usbfs_device device = { fd };
+    usbfs_stream_stats stats;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    usbfs_stream(device, endpoint, count, urb_size, seconds, [output](const usbdevfs_urb& urb) {
+        if (output) {
+            fwrite(urb.buffer, 1, static_cast<size_t>(urb.actual_length), output);
+        }
+
+        return true;
+    }, stats);
+
+    const double elapsed = seconds_since(start);
+
+    close_device(fd);
+
+    if (output) {
+        fclose(output);
+    }
+
+    printf("transfers: %llu, short: %llu, errors: %llu\n",
+        static_cast<unsigned long long>(stats.transfers), static_cast<unsigned long long>(stats.short_transfers),
+        static_cast<unsigned long long>(stats.errors)
+    );
+    printf("%llu bytes in %.3f s (%.1f MB/s)\n",
+        static_cast<unsigned long long>(stats.bytes), elapsed, (elapsed > 0) ? (stats.bytes / elapsed / (1024.0 * 1024.0)) : 0.0
+    );
+
+    return stats.errors ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 7 && !strcmp(argv[1], "vendor") && (!strcmp(argv[3], "in") || !strcmp(argv[3], "out"))) {
+        return vendor(
+            argv[2], !strcmp(argv[3], "in"),
+            strtoul(argv[4], nullptr, 0), strtoul(argv[5], nullptr, 0), strtoul(argv[6], nullptr, 0),
+            argc - 7, argv + 7
+        );
+    }
+
+    if (argc >= 4 && !strcmp(argv[1], "alt")) {
+        return alternate_setting(argv[2], strtoul(argv[3], nullptr, 0));
+    }
+
+    if (argc >= 7 && !strcmp(argv[1], "download")) {
+        return download(
+            argv[2], argv[3],
+            strtoul(argv[4], nullptr, 0), strtoul(argv[5], nullptr, 0), strtoul(argv[6], nullptr, 0),
+            (argc > 7) ? strtoul(argv[7], nullptr, 0) : chief_max_image_chunk_length,
+            (argc > 8) && !strcmp(argv[8], "address")
+        );
+    }
+
+    if (argc >= 4 && !strcmp(argv[1], "stream")) {
+        return stream(
+            argv[2], strtoul(argv[3], nullptr, 0),
+            (argc > 4) ? strtoul(argv[4], nullptr, 0) : 10,
+            (argc > 5) ? strtoul(argv[5], nullptr, 0) : 8,
+            (argc > 6) ? strtoul(argv[6], nullptr, 0) : 64 * 1024,
+            (argc > 7) ? argv[7] : nullptr
+        );
+    }
+
+    printf("usage: %s vendor <device> <in|out> <request> <value> <index> [length | bytes...]\n", argv[0]);
+    printf("       %s alt <device> <setting>\n", argv[0]);
+    printf("       %s download <device> <image file> <request> <value> <index> [chunk length] [address]\n", argv[0]);
+    printf("       %s stream <device> <endpoint> [seconds] [urbs] [urb size] [output]\n", argv[0]);
+
+    return 1;
+}
@@ -0,0 +1,147 @@
+#include <windows.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "chief/ioctl.hpp"
+
+/**
+ * @brief Ranks the vendor request codes by the time the device spends
+ * on them. Without seconds the totals since the driver started (or the
+ * last reset) are shown, with seconds only the requests in that window
+ *
+ * usage: chief_vendor [seconds] [top] [reset]
+ *
+ */
+
+static bool get_stats(HANDLE device, usb_chief_vendor_stats& stats, bool reset) {
+    memset(&stats, 0x00, sizeof(stats));
+    stats.flags = reset ? static_cast<unsigned long>(chief_vendor_stats_reset) : 0;
+
+    DWORD returned = 0;
+
+    if (!DeviceIoControl(device, ioctl_get_vendor_stats, &stats, sizeof(stats), &stats, sizeof(stats), &returned, nullptr)) {
+        return false;
+    }
+
+    return returned >= sizeof(stats);
+}
+
+static double bucket_bound(unsigned long bucket) {
+    // the upper bound of a latency bucket in microseconds
+    return static_cast<double>(chief_vendor_latency_base) * static_cast<double>(1ull << bucket);
+}
+
+static double percentile(const usb_chief_vendor_code_stats& code, double fraction) {
+    unsigned long long total = 0;
+
+    for (unsigned long bucket = 0; bucket < chief_vendor_latency_buckets; bucket++) {
+        total += code.latency[bucket];
+    }
+
+    if (!total) {
+        return 0.0;
+    }
+
+    // the upper bound of the bucket with the nearest rank. The last
+    // bucket has no bound, use the maximum instead
+    const unsigned long long rank = static_cast<unsigned long long>(fraction * (total - 1) + 0.5) + 1;
+    unsigned long long count = 0;
+
+    for (unsigned long bucket = 0; bucket < chief_vendor_latency_buckets - 1; bucket++) {
+        count += code.latency[bucket];
+
+        if (count >= rank) {
+            return std::min(bucket_bound(bucket), static_cast<double>(code.max_latency));
+        }
+    }
+
+    return static_cast<double>(code.max_latency);
+}
+
+static void report(const usb_chief_vendor_stats& stats, unsigned long top) {
+    std::vector<unsigned long> codes;
+    unsigned long long total_latency = 0;
+
+    for (unsigned long i = 0; i < 256; i++) {
+        if (stats.codes[i].requests) {
+            codes.push_back(i);
+            total_latency += stats.codes[i].total_latency;
+        }
+    }
+
+    if (codes.empty()) {
+        printf("no vendor requests\n");
+        return;
+    }
+
+    // the codes that took the most time first
+    std::sort(codes.begin(), codes.end(), [&stats](unsigned long a, unsigned long b) {
+        return stats.codes[a].total_latency > stats.codes[b].total_latency;
+    });
+
+    printf("code  requests    bytes         errors   time%%   avg us    p50 us    p99 us    max us\n");
+
+    for (size_t i = 0; i < codes.size() && (!top || i < top); i++) {
+        const usb_chief_vendor_code_stats& code = stats.codes[codes[i]];
+
+        printf("0x%02lx  %-11llu %-13llu %-8llu %-7.1f %-9.1f %-9.0f %-9.0f %llu\n",
+            codes[i], code.requests, code.bytes, code.errors,
+            total_latency ? (100.0 * code.total_latency / total_latency) : 0.0,
+            static_cast<double>(code.total_latency) / code.requests,
+            percentile(code, 0.50), percentile(code, 0.99), code.max_latency
+        );
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))) {
+        printf("usage: %s [seconds] [top] [reset]\n", argv[0]);
+        return 1;
+    }
+
+    const unsigned long seconds = (argc > 1) ? strtoul(argv[1], nullptr, 0) : 0;
+    const unsigned long top = (argc > 2) ? strtoul(argv[2], nullptr, 0) : 16;
+    const bool reset = (argc > 3) && !strcmp(argv[3], "reset");
+
+    // open the device
+    HANDLE device = CreateFileW(
+        L"\\\\.\\ChiefUSB", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr
+    );
+
+    if (device == INVALID_HANDLE_VALUE) {
+        printf("could not open the device (%lu)\n", GetLastError());
+        return 1;
+    }
+
+    // the stats are large, keep them off the stack
+    std::vector<usb_chief_vendor_stats> stats(1);
+
+    // clear the counters so only the requests in the window are left
+    if (seconds && !get_stats(device, stats[0], true)) {
+        printf("could not get the vendor statistics (%lu)\n", GetLastError());
+        CloseHandle(device);
+        return 1;
+    }
+
+    if (seconds) {
+        printf("recording the vendor requests for %lu seconds\n", seconds);
+        Sleep(seconds * 1000);
+    }
+
+    if (!get_stats(device, stats[0], seconds || reset)) {
+        printf("could not get the vendor statistics (%lu)\n", GetLastError());
+        CloseHandle(device);
+        return 1;
+    }
+
+    CloseHandle(device);
+
+    report(stats[0], top);
+
+    return 0;
+}
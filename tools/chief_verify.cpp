@@ -0,0 +1,223 @@
+#include <windows.h>
+#include <conio.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cwchar>
+#include <vector>
+
+#include "chief/ioctl.hpp"
+#include "crc32c.hpp"
+
+/**
+ * @brief Reads a pipe in the crc read mode and checks the crc of
+ * every frame. The frames can be stored so the file can be checked
+ * again later, after it was copied to the archive
+ *
+ * usage:
+ *  chief_verify read <pipe> [frame file] [seconds]
+ *  chief_verify check <frame file>
+ *
+ */
+
+// the size of the data in a single read
+constexpr static uint32_t verify_read_size = 64 * 1024;
+
+/**
+ * @brief Counters of the checked frames
+ *
+ */
+struct verify_result {
+    unsigned long long frames = 0;
+    unsigned long long bytes = 0;
+
+    // frames without a crc. The driver could not map the data
+    unsigned long long unchecked = 0;
+
+    // frames where the crc did not match
+    unsigned long long mismatches = 0;
+};
+
+static void verify_frame(const crc32c_table& table, const chief_read_frame_header& header, const uint8_t* data, verify_result& result) {
+    result.frames++;
+    result.bytes += header.length;
+
+    if (!(header.flags & chief_frame_crc)) {
+        result.unchecked++;
+        return;
+    }
+
+    if (table.calculate(data, header.length) != header.crc) {
+        printf("frame %llu (timestamp %llu, %lu bytes) has a invalid crc\n", result.frames - 1, header.timestamp, header.length);
+        result.mismatches++;
+    }
+}
+
+static void print_result(const verify_result& result) {
+    printf("frames: %llu, bytes: %llu, without crc: %llu, invalid crc: %llu\n",
+        result.frames, result.bytes, result.unchecked, result.mismatches
+    );
+}
+
+static bool device_control(HANDLE device, unsigned long code, void* input, DWORD input_length, void* output, DWORD output_length, DWORD& returned) {
+    returned = 0;
+
+    return DeviceIoControl(device, code, input, input_length, output, output_length, &returned, nullptr) != FALSE;
+}
+
+static int read_pipe(unsigned long pipe, const char* path, unsigned long seconds) {
+    // open the pipe
+    wchar_t name[64];
+    swprintf(name, 64, L"\\\\.\\ChiefUSB\\PIPE%02lu", pipe);
+
+    HANDLE device = CreateFileW(
+        name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr
+    );
+
+    if (device == INVALID_HANDLE_VALUE) {
+        printf("could not open pipe %lu (%lu)\n", pipe, GetLastError());
+        return 1;
+    }
+
+    DWORD returned;
+
+    // get a frame header with a crc in front of every read
+    usb_chief_read_mode mode = { chief_read_mode_framed | chief_read_mode_crc };
+
+    if (!device_control(device, ioctl_set_read_mode, &mode, sizeof(mode), nullptr, 0, returned)) {
+        printf("could not set the crc read mode (%lu)\n", GetLastError());
+        CloseHandle(device);
+        return 1;
+    }
+
+    FILE* output = path ? fopen(path, "wb") : nullptr;
+
+    if (path && !output) {
+        printf("could not open %s\n", path);
+        CloseHandle(device);
+        return 1;
+    }
+
+    // get the counters of the pipe so we only report this run
+    usb_chief_pipe_stats before = {};
+    before.pipe = pipe;
+
+    device_control(device, ioctl_get_pipe_stats, &before, sizeof(before), &before, sizeof(before), returned);
+
+    const crc32c_table table;
+    std::vector<uint8_t> buffer(sizeof(chief_read_frame_header) + verify_read_size);
+    verify_result result;
+
+    const ULONGLONG start = GetTickCount64();
+
+    printf("reading, press a key to stop\n");
+
+    while (!_kbhit() && (!seconds || (GetTickCount64() - start) < seconds * 1000ull)) {
+        if (!ReadFile(device, buffer.data(), static_cast<DWORD>(buffer.size()), &returned, nullptr)) {
+            printf("could not read the pipe (%lu)\n", GetLastError());
+            break;
+        }
+
+        const chief_read_frame_header* header = reinterpret_cast<const chief_read_frame_header*>(buffer.data());
+
+        if (returned < sizeof(chief_read_frame_header) || (returned - sizeof(chief_read_frame_header)) != header->length) {
+            printf("read %lu returned a invalid frame\n", static_cast<unsigned long>(result.frames));
+            break;
+        }
+
+        verify_frame(table, *header, buffer.data() + sizeof(chief_read_frame_header), result);
+
+        // store the frame as we got it
+        if (output) {
+            fwrite(buffer.data(), 1, returned, output);
+        }
+    }
+
+    print_result(result);
+
+    // report what the crc cost in the driver
+    usb_chief_pipe_stats after = {};
+    after.pipe = pipe;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    if (device_control(device, ioctl_get_pipe_stats, &after, sizeof(after), &after, sizeof(after), returned) && after.crc_bytes > before.crc_bytes) {
+        const double seconds_per_byte = static_cast<double>(after.crc_ticks - before.crc_ticks) / frequency.QuadPart / (after.crc_bytes - before.crc_bytes);
+
+        printf("driver crc cost: %.3f ms per GB (%.0f MB/s)\n",
+            seconds_per_byte * 1024.0 * 1024.0 * 1024.0 * 1000.0, 1.0 / seconds_per_byte / (1024.0 * 1024.0)
+        );
+    }
+
+    if (output) {
+        fclose(output);
+    }
+
+    CloseHandle(device);
+
+    return result.mismatches ? 1 : 0;
+}
+
+static int check_file(const char* path) {
+    FILE* input = fopen(path, "rb");
+
+    if (!input) {
+        printf("could not open %s\n", path);
+        return 1;
+    }
+
+    const crc32c_table table;
+    std::vector<uint8_t> data;
+    verify_result result;
+
+    chief_read_frame_header header;
+
+    // walk over the stored frames
+    while (fread(&header, sizeof(header), 1, input) == 1) {
+        // a read never returns more than verify_read_size bytes. A larger
+        // length is a corrupt header and we can not find the next frame
+        if (header.length > verify_read_size) {
+            printf("frame %llu has a corrupt length (%lu bytes)\n", result.frames, header.length);
+            result.mismatches++;
+            break;
+        }
+
+        data.resize(header.length);
+
+        if (fread(data.data(), 1, header.length, input) != header.length) {
+            printf("frame %llu is truncated\n", result.frames);
+            result.mismatches++;
+            break;
+        }
+
+        verify_frame(table, header, data.data(), result);
+    }
+
+    fclose(input);
+
+    print_result(result);
+
+    return result.mismatches ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 3 && !strcmp(argv[1], "read")) {
+        return read_pipe(
+            strtoul(argv[2], nullptr, 0),
+            (argc > 3) ? argv[3] : nullptr,
+            (argc > 4) ? strtoul(argv[4], nullptr, 0) : 0
+        );
+    }
+
+    if (argc >= 3 && !strcmp(argv[1], "check")) {
+        return check_file(argv[2]);
+    }
+
+    printf("usage: %s read <pipe> [frame file] [seconds]\n", argv[0]);
+    printf("       %s check <frame file>\n", argv[0]);
+
+    return 1;
+}
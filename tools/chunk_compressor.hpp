@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "lz4_block.hpp"
+
+/**
+ * @brief A compressed chunk as it is given to the sink. Chunks that
+ * do not get smaller are stored uncompressed
+ *
+ */
+struct compressed_chunk {
+    // the position of the chunk in the input
+    uint64_t sequence;
+
+    // the stored data and its size
+    const uint8_t* data;
+    uint32_t size;
+
+    // the size of the uncompressed chunk
+    uint32_t raw_size;
+
+    // true when data is the uncompressed chunk
+    bool stored;
+};
+
+/**
+ * @brief Compresses chunks on a pool of worker threads. The chunks
+ * are given to the sink in the order they were submitted, from one
+ * thread at a time. Submit blocks when every slot is in use so a
+ * slow disk slows down the reader instead of using more memory
+ *
+ */
+class chunk_compressor {
+public:
+    // called for every chunk in order. Returns false on a error
+    using sink_function = std::function<bool(const compressed_chunk&)>;
+
+protected:
+    // a chunk that is compressed or waiting to be written
+    struct slot {
+        std::vector<uint8_t> raw;
+        std::vector<uint8_t> packed;
+
+        // size of the compressed data. 0 when it is stored
+        size_t packed_size;
+
+        // true when the chunk is compressed and can be written
+        bool ready;
+    };
+
+    sink_function sink;
+
+    // protects everything below
+    std::mutex lock;
+    std::condition_variable work_ready;
+    std::condition_variable slot_free;
+
+    // a slot for every chunk that can be in flight
+    std::vector<slot> slots;
+
+    // sequences of the chunks that still need to be compressed
+    std::deque<uint64_t> pending;
+
+    // amount of submitted and written chunks
+    uint64_t submitted = 0;
+    uint64_t written = 0;
+
+    // true while a thread is calling the sink
+    bool writing = false;
+
+    // true when the sink failed
+    bool failed = false;
+
+    // true when the workers should stop
+    bool stopping = false;
+
+    std::vector<std::thread> workers;
+
+    void worker() {
+        lz4::block_compressor compressor;
+
+        std::unique_lock<std::mutex> guard(lock);
+
+        while (true) {
+            work_ready.wait(guard, [this] { return !pending.empty() || stopping; });
+
+            if (pending.empty()) {
+                return;
+            }
+
+            const uint64_t sequence = pending.front();
+            pending.pop_front();
+
+            slot& current = slots[sequence % slots.size()];
+
+            // compress without the lock. The slot is only ours
+            guard.unlock();
+
+            current.packed.resize(lz4::compress_bound(current.raw.size()));
+
+            const size_t size = compressor.compress(
+                current.raw.data(), current.raw.size(), current.packed.data(), current.packed.size()
+            );
+
+            // store the chunk when it does not get smaller
+            current.packed_size = (size < current.raw.size()) ? size : 0;
+
+            guard.lock();
+            current.ready = true;
+
+            // only one thread writes. It also writes the chunks
+            // that other threads complete while it is writing
+            if (writing) {
+                continue;
+            }
+
+            writing = true;
+
+            while (written < submitted && slots[written % slots.size()].ready) {
+                slot& output = slots[written % slots.size()];
+
+                const compressed_chunk chunk = {
+                    written,
+                    output.packed_size ? output.packed.data() : output.raw.data(),
+                    static_cast<uint32_t>(output.packed_size ? output.packed_size : output.raw.size()),
+                    static_cast<uint32_t>(output.raw.size()),
+                    !output.packed_size
+                };
+
+                // write without the lock so the other workers continue
+                guard.unlock();
+                const bool success = !failed && sink(chunk);
+                guard.lock();
+
+                failed = !success;
+                output.ready = false;
+                written++;
+
+                slot_free.notify_all();
+            }
+
+            writing = false;
+        }
+    }
+
+public:
+    /**
+     * @brief Start the workers
+     *
+     * @param threads amount of worker threads
+     * @param output called for every chunk in order
+     */
+    chunk_compressor(size_t threads, sink_function output):
+        sink(std::move(output)), slots((threads ? threads : 1) * 2)
+    {
+        for (size_t i = 0; i < (threads ? threads : 1); i++) {
+            workers.emplace_back(&chunk_compressor::worker, this);
+        }
+    }
+
+    ~chunk_compressor() {
+        finish();
+    }
+
+    chunk_compressor(const chunk_compressor&) = delete;
+    chunk_compressor& operator=(const chunk_compressor&) = delete;
+
+    /**
+     * @brief Queue a chunk. Blocks until a slot is free. Returns
+     * false when the sink failed
+     *
+     * @param data
+     * @param size should be smaller than 4GB
+     * @return true
+     * @return false
+     */
+    bool submit(const uint8_t* data, size_t size) {
+        std::unique_lock<std::mutex> guard(lock);
+
+        slot_free.wait(guard, [this] { return (submitted - written) < slots.size() || failed; });
+
+        if (failed) {
+            return false;
+        }
+
+        // the slot is free. Nobody else uses it until we queue it
+        slot& current = slots[submitted % slots.size()];
+        current.raw.assign(data, data + size);
+        current.ready = false;
+
+        pending.push_back(submitted++);
+        work_ready.notify_one();
+
+        return true;
+    }
+
+    /**
+     * @brief Wait until every chunk is written and stop the workers.
+     * Returns false when the sink failed
+     *
+     * @return true
+     * @return false
+     */
+    bool finish() {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+
+            slot_free.wait(guard, [this] { return written == submitted; });
+
+            stopping = true;
+            work_ready.notify_all();
+        }
+
+        for (std::thread& current : workers) {
+            current.join();
+        }
+
+        workers.clear();
+
+        return !failed;
+    }
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Portable crc32c (castagnoli) with the same result as the
+ * crc the driver puts in the frame header
+ *
+ */
+class crc32c_table {
+protected:
+    uint32_t table[256];
+
+public:
+    crc32c_table() {
+        // the reversed castagnoli polynomial
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t value = i;
+
+            for (uint32_t bit = 0; bit < 8; bit++) {
+                value = (value >> 1) ^ ((value & 1) ? 0x82F63B78u : 0);
+            }
+
+            table[i] = value;
+        }
+    }
+
+    uint32_t calculate(const uint8_t* data, size_t length) const {
+        uint32_t crc = 0xffffffffu;
+
+        for (size_t i = 0; i < length; i++) {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+
+        return ~crc;
+    }
+};
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief Compressor and decompressor for the lz4 block format. Every
+ * block is independent so it can be decompressed without the blocks
+ * before it. Only uses the standard library so it can be used on any
+ * platform
+ *
+ */
+namespace lz4 {
+    // the smallest match the format can encode
+    constexpr static size_t min_match = 4;
+
+    // the last bytes of a block are always literals
+    constexpr static size_t last_literals = 5;
+
+    // a match can not start in the last bytes of a block
+    constexpr static size_t match_limit = 12;
+
+    // the largest distance of a match
+    constexpr static size_t max_offset = 65535;
+
+    // amount of bits in the hash of the match finder
+    constexpr static size_t hash_bits = 12;
+
+    /**
+     * @brief Get the largest size a compressed block can have
+     *
+     * @param size size of the uncompressed data
+     * @return size_t
+     */
+    inline size_t compress_bound(size_t size) {
+        return size + (size / 255) + 16;
+    }
+
+    inline uint32_t read_u32(const uint8_t* data) {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+
+        return value;
+    }
+
+    inline size_t hash(uint32_t value) {
+        return static_cast<size_t>((value * 2654435761u) >> (32 - hash_bits));
+    }
+
+    inline uint8_t* write_length(uint8_t* output, size_t length) {
+        // lengths of 15 or more continue with bytes of 255
+        while (length >= 255) {
+            *output++ = 255;
+            length -= 255;
+        }
+
+        *output++ = static_cast<uint8_t>(length);
+
+        return output;
+    }
+
+    inline uint8_t* write_sequence(uint8_t* output, const uint8_t* literals, size_t literal_length, size_t offset, size_t match_length) {
+        uint8_t* token = output++;
+
+        // the literal length is in the high nibble of the token
+        *token = static_cast<uint8_t>(((literal_length >= 15) ? 15 : literal_length) << 4);
+
+        if (literal_length >= 15) {
+            output = write_length(output, literal_length - 15);
+        }
+
+        memcpy(output, literals, literal_length);
+        output += literal_length;
+
+        // the last sequence has no match
+        if (!match_length) {
+            return output;
+        }
+
+        *output++ = static_cast<uint8_t>(offset & 0xff);
+        *output++ = static_cast<uint8_t>(offset >> 8);
+
+        // the match length is in the low nibble of the token
+        const size_t length = match_length - min_match;
+        *token |= static_cast<uint8_t>((length >= 15) ? 15 : length);
+
+        if (length >= 15) {
+            output = write_length(output, length - 15);
+        }
+
+        return output;
+    }
+
+    /**
+     * @brief Compressor with the table of the match finder. A
+     * compressor can be reused but not shared between threads
+     *
+     */
+    class block_compressor {
+    protected:
+        // the last position of every hashed sequence
+        uint32_t table[1 << hash_bits];
+
+    public:
+        /**
+         * @brief Compress a block. Returns the size of the compressed
+         * block or 0 when the output is smaller than compress_bound
+         *
+         * @param input
+         * @param size should be smaller than 4GB
+         * @param output
+         * @param capacity
+         * @return size_t
+         */
+        size_t compress(const uint8_t* input, size_t size, uint8_t* output, size_t capacity) {
+            if (capacity < compress_bound(size)) {
+                return 0;
+            }
+
+            uint8_t* current = output;
+            size_t anchor = 0;
+
+            if (size > match_limit) {
+                // the blocks are independent. Forget the earlier block
+                memset(table, 0x00, sizeof(table));
+
+                const size_t limit = size - match_limit;
+                const size_t match_end = size - last_literals;
+
+                size_t position = 0;
+                size_t misses = 0;
+
+                while (position <= limit) {
+                    const uint32_t sequence = read_u32(input + position);
+                    const size_t index = hash(sequence);
+                    const size_t candidate = table[index];
+
+                    table[index] = static_cast<uint32_t>(position);
+
+                    // check if the position in the table is a real match
+                    if (candidate >= position || (position - candidate) > max_offset || read_u32(input + candidate) != sequence) {
+                        // skip faster through data that does not compress
+                        position += 1 + (misses++ >> 6);
+                        continue;
+                    }
+
+                    size_t length = min_match;
+
+                    while ((position + length) < match_end && input[candidate + length] == input[position + length]) {
+                        length++;
+                    }
+
+                    current = write_sequence(
+                        current, input + anchor, position - anchor, position - candidate, length
+                    );
+
+                    position += length;
+                    anchor = position;
+                    misses = 0;
+                }
+            }
+
+            // the rest of the block are literals
+            current = write_sequence(current, input + anchor, size - anchor, 0, 0);
+
+            return static_cast<size_t>(current - output);
+        }
+    };
+
+    /**
+     * @brief Decompress a block. Returns the size of the decompressed
+     * data or SIZE_MAX when the block is invalid or does not fit in
+     * the output
+     *
+     * @param input
+     * @param size
+     * @param output
+     * @param capacity
+     * @return size_t
+     */
+    inline size_t decompress(const uint8_t* input, size_t size, uint8_t* output, size_t capacity) {
+        const uint8_t* end = input + size;
+        size_t written = 0;
+
+        while (input < end) {
+            const uint8_t token = *input++;
+
+            // get the literal length
+            size_t literal_length = token >> 4;
+
+            if (literal_length == 15) {
+                uint8_t value;
+
+                do {
+                    if (input >= end) {
+                        return SIZE_MAX;
+                    }
+
+                    value = *input++;
+                    literal_length += value;
+                } while (value == 255);
+            }
+
+            if (literal_length > static_cast<size_t>(end - input) || literal_length > (capacity - written)) {
+                return SIZE_MAX;
+            }
+
+            memcpy(output + written, input, literal_length);
+            input += literal_length;
+            written += literal_length;
+
+            // the last sequence ends after the literals
+            if (input == end) {
+                break;
+            }
+
+            if ((end - input) < 2) {
+                return SIZE_MAX;
+            }
+
+            const size_t offset = input[0] | (static_cast<size_t>(input[1]) << 8);
+            input += 2;
+
+            if (!offset || offset > written) {
+                return SIZE_MAX;
+            }
+
+            // get the match length
+            size_t match_length = token & 0x0f;
+
+            if (match_length == 15) {
+                uint8_t value;
+
+                do {
+                    if (input >= end) {
+                        return SIZE_MAX;
+                    }
+
+                    value = *input++;
+                    match_length += value;
+                } while (value == 255);
+            }
+
+            match_length += min_match;
+
+            if (match_length > (capacity - written)) {
+                return SIZE_MAX;
+            }
+
+            // the match can overlap the output. Copy byte by byte
+            const uint8_t* source = output + written - offset;
+
+            for (size_t i = 0; i < match_length; i++) {
+                output[written + i] = source[i];
+            }
+
+            written += match_length;
+        }
+
+        return written;
+    }
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "chief/ioctl.hpp"
+
+// magic and version at the start of a trace file
+constexpr static uint32_t trace_file_magic = 0x52544843; // "CHTR"
+constexpr static uint32_t trace_file_version = 1;
+
+/**
+ * @brief Header of a trace file. Followed by the records
+ *
+ */
+struct trace_file_header {
+    uint32_t magic;
+    uint32_t version;
+
+    // the performance counter frequency of the recording machine
+    uint64_t frequency;
+};
+
+/**
+ * @brief Write a trace file
+ *
+ * @param Path
+ * @param Frequency of the timestamps in the records
+ * @param Records
+ * @return true when the whole file was written
+ */
+static bool trace_file_write(const char* Path, uint64_t Frequency, const std::vector<usb_chief_trace_record>& Records) {
+    FILE* output = fopen(Path, "wb");
+
+    if (!output) {
+        return false;
+    }
+
+    const trace_file_header header = { trace_file_magic, trace_file_version, Frequency };
+
+    bool written = fwrite(&header, sizeof(header), 1, output) == 1;
+    written = written && fwrite(Records.data(), sizeof(usb_chief_trace_record), Records.size(), output) == Records.size();
+
+    return (fclose(output) == 0) && written;
+}
+
+/**
+ * @brief Read the requests of a trace file. The recoveries of the
+ * watchdog are not requests that can be replayed, they are skipped
+ *
+ * @param Path
+ * @param OutFrequency of the timestamps in the records
+ * @param OutRecords
+ * @return true when the file is a trace file
+ */
+static bool trace_file_read(const char* Path, uint64_t& OutFrequency, std::vector<usb_chief_trace_record>& OutRecords) {
+    FILE* input = fopen(Path, "rb");
+
+    if (!input) {
+        return false;
+    }
+
+    // read and check the header
+    trace_file_header header = {};
+
+    if (fread(&header, sizeof(header), 1, input) != 1 || header.magic != trace_file_magic || header.version != trace_file_version || !header.frequency) {
+        fclose(input);
+        return false;
+    }
+
+    OutFrequency = header.frequency;
+    OutRecords.clear();
+
+    usb_chief_trace_record current;
+
+    while (fread(&current, sizeof(current), 1, input) == 1) {
+        if (current.major == chief_trace_recovery) {
+            continue;
+        }
+
+        OutRecords.push_back(current);
+    }
+
+    fclose(input);
+
+    return true;
+}
+
+/**
+ * @brief The result of a replay
+ *
+ */
+struct trace_replay_result {
+    uint64_t requests;
+    uint64_t failed;
+    uint64_t bytes;
+    double elapsed;
+
+    // the latency of every request in microseconds, sorted
+    std::vector<double> latencies;
+};
+
+/**
+ * @brief Nearest rank percentile of sorted values
+ *
+ */
+static double trace_percentile(const std::vector<double>& Sorted, double Fraction) {
+    if (Sorted.empty()) {
+        return 0.0;
+    }
+
+    const size_t index = static_cast<size_t>(Fraction * (Sorted.size() - 1) + 0.5);
+
+    return Sorted[std::min(index, Sorted.size() - 1)];
+}
+
+/**
+ * @brief Send the requests of a trace to a target one at a time. A
+ * target is a class with these members, they return false when the
+ * request failed:
+ *
+ *  // a vendor request ioctl like ioctl_vendor_send
+ *  bool vendor(unsigned long Code, usb_chief_vendor_request& Request);
+ *
+ *  // a read or write of a pipe. Returned gets the transferred bytes
+ *  bool transfer(unsigned char Major, unsigned char Pipe, uint8_t* Buffer, unsigned long Length, unsigned long& Returned);
+ *
+ * @tparam Target
+ * @param Device
+ * @param Frequency of the timestamps in the records
+ * @param Records
+ * @param MaxSpeed send the requests back to back instead of with the
+ * original timing
+ * @return trace_replay_result
+ */
+template <typename Target>
+static trace_replay_result trace_replay(Target& Device, uint64_t Frequency, const std::vector<usb_chief_trace_record>& Records, bool MaxSpeed) {
+    using clock = std::chrono::steady_clock;
+
+    trace_replay_result result = {};
+    result.latencies.reserve(Records.size());
+
+    // buffer for the data of the requests
+    std::vector<uint8_t> buffer(64 * 1024);
+
+    const clock::time_point start = clock::now();
+
+    for (const usb_chief_trace_record& record : Records) {
+        if (!MaxSpeed) {
+            // wait until the request was sent in the recording
+            const double offset = static_cast<double>(record.timestamp - Records[0].timestamp) / Frequency;
+
+            while (true) {
+                const double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+                if (elapsed >= offset) {
+                    break;
+                }
+
+                // sleep when we have to wait long
+                if ((offset - elapsed) > 0.002) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+        }
+
+        const unsigned long length = std::min<unsigned long>(record.length, static_cast<unsigned long>(buffer.size()));
+        unsigned long returned = 0;
+        bool success;
+
+        const clock::time_point begin = clock::now();
+
+        if (record.major == chief_trace_device_control) {
+            usb_chief_vendor_request request = {};
+            request.request = record.request;
+            request.value = record.value;
+            request.index = record.index;
+            request.length = static_cast<unsigned short>(length);
+            request.data = buffer.data();
+
+            // send the data we recorded. The rest is zero
+            if (record.code == ioctl_vendor_send) {
+                memset(buffer.data(), 0x00, length);
+                memcpy(buffer.data(), record.data, std::min<unsigned long>(record.captured, length));
+            }
+
+            success = Device.vendor(record.code, request);
+        }
+        else {
+            if (record.major == chief_trace_write) {
+                memset(buffer.data(), 0x00, length);
+            }
+
+            success = Device.transfer(record.major, record.pipe, buffer.data(), length, returned);
+            result.bytes += returned;
+        }
+
+        result.latencies.push_back(std::chrono::duration<double, std::micro>(clock::now() - begin).count());
+        result.failed += success ? 0 : 1;
+    }
+
+    result.requests = Records.size();
+    result.elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::sort(result.latencies.begin(), result.latencies.end());
+
+    return result;
+}
+
+/**
+ * @brief Print the throughput and the latency percentiles of a replay
+ *
+ */
+static void trace_replay_print(const trace_replay_result& Result) {
+    const double elapsed = (Result.elapsed > 0) ? Result.elapsed : 1e-9;
+
+    printf("requests:   %llu (%llu failed)\n",
+        static_cast<unsigned long long>(Result.requests), static_cast<unsigned long long>(Result.failed));
+    printf("elapsed:    %.3f s\n", Result.elapsed);
+    printf("throughput: %.1f requests/s, %.3f MB/s\n", Result.requests / elapsed, Result.bytes / elapsed / (1024.0 * 1024.0));
+
+    if (Result.latencies.empty()) {
+        return;
+    }
+
+    printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+        trace_percentile(Result.latencies, 0.50), trace_percentile(Result.latencies, 0.90),
+        trace_percentile(Result.latencies, 0.99), trace_percentile(Result.latencies, 0.999),
+        Result.latencies.back()
+    );
+}
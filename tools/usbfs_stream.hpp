@@ -0,0 +1,152 @@
+#pragma once
+
+#include <linux/usbdevice_fs.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * @brief Totals of a stream
+ *
+ */
+struct usbfs_stream_stats {
+    uint64_t bytes;
+    uint64_t transfers;
+    uint64_t short_transfers;
+    uint64_t errors;
+};
+
+/**
+ * @brief Stream a bulk in endpoint with a ring of asynchronous urbs.
+ * All the urbs are kept with the device so it never waits for a
+ * transfer, they are reaped in the order they complete. A device is
+ * a class with these members, a negative result is a -errno:
+ *
+ *  int submit(usbdevfs_urb* Urb);     // USBDEVFS_SUBMITURB
+ *  int reap(usbdevfs_urb*& Urb);      // USBDEVFS_REAPURB, blocking
+ *  void discard(usbdevfs_urb* Urb);   // USBDEVFS_DISCARDURB
+ *
+ * @tparam Device
+ * @tparam Sink bool(const usbdevfs_urb&). Gets every urb with data in
+ * the order it is reaped. Returns false to stop the stream
+ * @param Link
+ * @param Endpoint the endpoint number. The direction bit is added
+ * @param Count the amount of urbs
+ * @param UrbSize the size of the buffer of every urb
+ * @param Seconds stop after this time. 0 to only stop from the sink
+ * @param Output
+ * @param Stats
+ * @return int 0 or the -errno of the submit or reap that failed
+ */
+template <typename Device, typename Sink>
+int usbfs_stream(Device& Link, unsigned long Endpoint, unsigned long Count, unsigned long UrbSize, unsigned long Seconds, Sink&& Output, usbfs_stream_stats& Stats) {
+    Stats = {};
+
+    std::vector<usbdevfs_urb> urbs(Count);
+    std::vector<std::vector<uint8_t>> buffers(Count, std::vector<uint8_t>(UrbSize));
+
+    unsigned long submitted = 0;
+    int result = 0;
+
+    for (unsigned long i = 0; i < Count; i++) {
+        usbdevfs_urb& urb = urbs[i];
+        urb.type = USBDEVFS_URB_TYPE_BULK;
+        urb.endpoint = static_cast<unsigned char>(Endpoint | 0x80);
+        urb.buffer = buffers[i].data();
+        urb.buffer_length = static_cast<int>(UrbSize);
+        urb.usercontext = &buffers[i];
+
+        result = Link.submit(&urb);
+
+        if (result < 0) {
+            printf("could not submit a urb on endpoint 0x%02lx: %s\n", Endpoint | 0x80, strerror(-result));
+            break;
+        }
+
+        submitted++;
+    }
+
+    // cancel the urbs that are still with the device. These are
+    // reaped with a -ENOENT status. Discarding a urb that is not with
+    // the device fails without doing anything
+    bool stopping = false;
+
+    auto stop = [&]() {
+        stopping = true;
+
+        for (unsigned long i = 0; i < Count; i++) {
+            Link.discard(&urbs[i]);
+        }
+    };
+
+    if (submitted != Count) {
+        stop();
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    // reap the urbs and send them again until we stop
+    while (submitted) {
+        usbdevfs_urb* urb = nullptr;
+        const int reaped = Link.reap(urb);
+
+        if (reaped < 0) {
+            if (reaped == -EINTR) {
+                continue;
+            }
+
+            // the urbs that are still with the device are cancelled
+            // when the device is closed
+            printf("could not reap a urb: %s\n", strerror(-reaped));
+            result = reaped;
+            break;
+        }
+
+        submitted--;
+
+        if (urb->status && urb->status != -ENOENT && urb->status != -ECONNRESET) {
+            Stats.errors++;
+        }
+        else if (urb->actual_length > 0) {
+            Stats.bytes += static_cast<uint64_t>(urb->actual_length);
+            Stats.transfers++;
+
+            if (urb->actual_length < urb->buffer_length) {
+                Stats.short_transfers++;
+            }
+
+            if (!Output(*urb) && !stopping) {
+                stop();
+            }
+        }
+
+        if (!stopping && Seconds && std::chrono::steady_clock::now() - start >= std::chrono::seconds(Seconds)) {
+            stop();
+        }
+
+        if (stopping) {
+            continue;
+        }
+
+        // send the urb again
+        urb->status = 0;
+        urb->actual_length = 0;
+
+        const int status = Link.submit(urb);
+
+        if (status < 0) {
+            printf("could not submit a urb: %s\n", strerror(-status));
+            result = status;
+            stop();
+            continue;
+        }
+
+        submitted++;
+    }
+
+    return result;
+}